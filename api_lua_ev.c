@@ -0,0 +1,80 @@
+/* native watcher flags, see lua_ev_native. */
+#define NATIVE_FLAG_IS_DAEMON 1
+
+/**
+ * check_loop_and_init() for lua_ev_api.
+ */
+static struct ev_loop* api_check_loop(lua_State *L, int idx) {
+    return *check_loop_and_init(L, idx);
+}
+
+/**
+ * Implements lua_ev_api.native_started(), loop_start_watcher() for
+ * watchers which have no userdata: holds a reference to the loop
+ * object instead of the watcher.
+ *
+ * [-0, +0, e]
+ */
+static void api_native_started(lua_State *L, int loop_i, lua_ev_native* native, int is_daemon) {
+    struct ev_loop* loop = *check_loop_and_init(L, loop_i);
+    int current_is_daemon = ( native->flags & NATIVE_FLAG_IS_DAEMON ) != 0;
+
+    if ( is_daemon == -1 ) is_daemon = current_is_daemon;
+
+    if ( native->loop_ref == LUA_NOREF ) {
+        lua_pushvalue(L, loop_i);
+        native->loop_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        current_is_daemon = 0;
+    }
+    if ( current_is_daemon ^ ( is_daemon != 0 ) ) {
+        if ( is_daemon ) {
+            /* unref() so that we are a "daemon" */
+            ev_unref(loop);
+            native->flags |= NATIVE_FLAG_IS_DAEMON;
+        } else {
+            ev_ref(loop);
+            native->flags &= ~NATIVE_FLAG_IS_DAEMON;
+        }
+    }
+}
+
+/**
+ * Implements lua_ev_api.native_stopped(), see loop_stop_watcher().
+ *
+ * [-0, +0, -]
+ */
+static void api_native_stopped(lua_State *L, lua_ev_native* native) {
+    lua_ev_loop* loop;
+
+    if ( native->loop_ref == LUA_NOREF ) return;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, native->loop_ref);
+    loop = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if ( ( native->flags & NATIVE_FLAG_IS_DAEMON ) && NULL != loop ) {
+        ev_ref(loop->loop);
+    }
+    luaL_unref(L, LUA_REGISTRYINDEX, native->loop_ref);
+    native->loop_ref = LUA_NOREF;
+    native->flags &= ~NATIVE_FLAG_IS_DAEMON;
+}
+
+static const lua_ev_api api = {
+    LUA_EV_API_VERSION,
+    api_check_loop,
+    push_default_loop,
+    api_native_started,
+    api_native_stopped
+};
+
+/**
+ * Publish the lua_ev_api in the registry, see lua_ev_api.h.
+ *
+ * [-0, +0, m]
+ */
+static void api_register(lua_State *L) {
+    lua_pushlightuserdata(L, (void*)&api);
+    lua_setfield(L, LUA_REGISTRYINDEX, LUA_EV_API_KEY);
+}
+
+/* vi:set expandtab ts=4: */
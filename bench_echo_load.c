@@ -0,0 +1,369 @@
+/**
+ * Closed loop TCP echo load generator for benchmarking lua-ev as a
+ * network server.  Each connection sends a message, waits for the
+ * whole echo and immediately sends the next one.  For every
+ * connection count and message size it reports requests per second,
+ * p50/p99/p999 latency and the server CPU time per request.
+ *
+ * Usage:
+ *     bench_echo_load [options] [-- server command ...]
+ *
+ * If a server command is given, it is started with stdin and stdout
+ * connected to pipes, must print "port <n>" on stdout and is expected
+ * to exit once stdin is closed (see bench_echo_server.lua).
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <ev.h>
+
+#define MAX_LIST 32
+
+typedef struct conn {
+    ev_io   io;
+    size_t  sent;
+    size_t  received;
+    double  started;
+} conn;
+
+typedef struct run {
+    struct ev_loop* loop;
+    conn*           conns;
+    int             num_conns;
+    char*           message;
+    char*           buffer;
+    size_t          size;
+    int             recording;
+    double*         latencies;
+    size_t          num_latencies;
+    size_t          max_latencies;
+    unsigned long   errors;
+} run;
+
+static const char* host = "127.0.0.1";
+static int    port       = 0;
+static pid_t  server_pid = 0;
+static int    server_in  = -1;
+static double duration   = 2;
+static double warmup     = 0.5;
+static int    json       = 0;
+static int    conn_counts[MAX_LIST] = { 1, 10, 100, 1000 };
+static int    num_conn_counts       = 4;
+static int    sizes[MAX_LIST]       = { 64, 1024, 16384 };
+static int    num_sizes             = 3;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void die(const char* what) {
+    perror(what);
+    exit(1);
+}
+
+static int parse_list(const char* str, int* list) {
+    int n = 0;
+    while ( *str && n < MAX_LIST ) {
+        list[n++] = atoi(str);
+        str = strchr(str, ',');
+        if ( ! str ) break;
+        str++;
+    }
+    return n;
+}
+
+/**
+ * Server CPU seconds (user + system) from /proc, -1 if unknown.
+ */
+static double server_cpu(void) {
+    char   path[64], buf[1024];
+    char*  p;
+    FILE*  f;
+    unsigned long utime, stime;
+
+    if ( server_pid <= 0 ) return -1;
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)server_pid);
+    f = fopen(path, "r");
+    if ( ! f ) return -1;
+    p = fgets(buf, sizeof(buf), f);
+    fclose(f);
+    /* skip "pid (comm)", comm may contain spaces. */
+    if ( ! p || ! (p = strrchr(buf, ')')) ) return -1;
+    if ( sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                &utime, &stime) != 2 ) return -1;
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+/**
+ * Start the server command and read the port it listens on.
+ */
+static void start_server(char** argv) {
+    int   in[2], out[2];
+    char  line[128];
+    FILE* f;
+
+    if ( pipe(in) || pipe(out) ) die("pipe");
+    server_pid = fork();
+    if ( server_pid < 0 ) die("fork");
+    if ( 0 == server_pid ) {
+        dup2(in[0], 0);
+        dup2(out[1], 1);
+        close(in[0]); close(in[1]);
+        close(out[0]); close(out[1]);
+        execvp(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    server_in = in[1];
+
+    f = fdopen(out[0], "r");
+    while ( fgets(line, sizeof(line), f) ) {
+        if ( sscanf(line, "port %d", &port) == 1 ) break;
+    }
+    fclose(f);
+    if ( port <= 0 ) {
+        fprintf(stderr, "server did not report its port\n");
+        exit(1);
+    }
+}
+
+static void stop_server(void) {
+    if ( server_pid <= 0 ) return;
+    close(server_in);
+    kill(server_pid, SIGTERM);
+    waitpid(server_pid, NULL, 0);
+}
+
+static void add_latency(run* r, double latency) {
+    if ( r->num_latencies == r->max_latencies ) {
+        r->max_latencies = r->max_latencies ? r->max_latencies * 2 : 65536;
+        r->latencies = realloc(r->latencies, r->max_latencies * sizeof(double));
+        if ( ! r->latencies ) die("realloc");
+    }
+    r->latencies[r->num_latencies++] = latency;
+}
+
+static void conn_cb(struct ev_loop* loop, ev_io* io, int revents) {
+    conn*   c = (conn*)io;
+    run*    r = ev_userdata(loop);
+    ssize_t len;
+
+    if ( c->sent < r->size ) {
+        len = write(io->fd, r->message + c->sent, r->size - c->sent);
+        if ( len < 0 ) {
+            if ( errno == EAGAIN || errno == EINTR ) return;
+            r->errors++;
+            ev_io_stop(loop, io);
+            return;
+        }
+        c->sent += len;
+        if ( c->sent == r->size ) {
+            ev_io_stop(loop, io);
+            ev_io_set(io, io->fd, EV_READ);
+            ev_io_start(loop, io);
+        }
+        return;
+    }
+
+    len = read(io->fd, r->buffer, r->size);
+    if ( len <= 0 ) {
+        if ( len < 0 && (errno == EAGAIN || errno == EINTR) ) return;
+        r->errors++;
+        ev_io_stop(loop, io);
+        return;
+    }
+    c->received += len;
+    if ( c->received < r->size ) return;
+
+    if ( r->recording ) add_latency(r, now() - c->started);
+
+    /* next request. */
+    c->sent     = 0;
+    c->received = 0;
+    c->started  = now();
+    ev_io_stop(loop, io);
+    ev_io_set(io, io->fd, EV_WRITE);
+    ev_io_start(loop, io);
+}
+
+static void phase_cb(struct ev_loop* loop, ev_timer* timer, int revents) {
+    ev_break(loop, EVBREAK_ONE);
+}
+
+static int cmp_double(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(run* r, double rank) {
+    size_t idx;
+    if ( 0 == r->num_latencies ) return 0;
+    idx = (size_t)(rank * r->num_latencies + 0.999999);
+    if ( idx > 0 ) idx--;
+    return r->latencies[idx];
+}
+
+static int connect_one(void) {
+    struct sockaddr_in addr;
+    int fd, one = 1;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if ( fd < 0 ) die("socket");
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port   = htons(port);
+    inet_pton(AF_INET, host, &addr.sin_addr);
+    if ( connect(fd, (struct sockaddr*)&addr, sizeof(addr)) ) die("connect");
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+static void bench(struct ev_loop* loop, int num_conns, int size, int first) {
+    run      r;
+    ev_timer phase;
+    double   start, elapsed, cpu_start, cpu;
+    int      i;
+
+    memset(&r, 0, sizeof(r));
+    r.loop      = loop;
+    r.num_conns = num_conns;
+    r.size      = size;
+    r.conns     = calloc(num_conns, sizeof(conn));
+    r.message   = malloc(size);
+    r.buffer    = malloc(size);
+    if ( ! r.conns || ! r.message || ! r.buffer ) die("malloc");
+    memset(r.message, 'x', size);
+    ev_set_userdata(loop, &r);
+
+    for ( i = 0; i < num_conns; i++ ) {
+        conn* c = &r.conns[i];
+        ev_io_init(&c->io, conn_cb, connect_one(), EV_WRITE);
+        c->started = now();
+        ev_io_start(loop, &c->io);
+    }
+
+    /* warm up, then measure. */
+    ev_timer_init(&phase, phase_cb, warmup, 0.);
+    ev_timer_start(loop, &phase);
+    ev_run(loop, 0);
+
+    r.recording = 1;
+    cpu_start = server_cpu();
+    start     = now();
+    ev_timer_set(&phase, duration, 0.);
+    ev_timer_start(loop, &phase);
+    ev_run(loop, 0);
+    elapsed = now() - start;
+    cpu     = server_cpu();
+    cpu     = ( cpu < 0 || cpu_start < 0 ) ? -1 : cpu - cpu_start;
+
+    for ( i = 0; i < num_conns; i++ ) {
+        ev_io_stop(loop, &r.conns[i].io);
+        close(r.conns[i].io.fd);
+    }
+
+    qsort(r.latencies, r.num_latencies, sizeof(double), cmp_double);
+    if ( json ) {
+        printf("%s\n  {\"connections\": %d, \"size\": %d, \"requests\": %lu, "
+               "\"rps\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, "
+               "\"server_cpu_us_per_req\": %.3f, \"errors\": %lu}",
+               first ? "" : ",", num_conns, size, (unsigned long)r.num_latencies,
+               r.num_latencies / elapsed,
+               percentile(&r, 0.5) * 1e6, percentile(&r, 0.99) * 1e6, percentile(&r, 0.999) * 1e6,
+               ( cpu >= 0 && r.num_latencies ) ? cpu * 1e6 / r.num_latencies : -1,
+               r.errors);
+    } else {
+        printf("%6d %7d %12.1f %10.1f %10.1f %10.1f %12.3f %7lu\n",
+               num_conns, size, r.num_latencies / elapsed,
+               percentile(&r, 0.5) * 1e6, percentile(&r, 0.99) * 1e6, percentile(&r, 0.999) * 1e6,
+               ( cpu >= 0 && r.num_latencies ) ? cpu * 1e6 / r.num_latencies : -1,
+               r.errors);
+    }
+    fflush(stdout);
+
+    free(r.latencies);
+    free(r.conns);
+    free(r.message);
+    free(r.buffer);
+}
+
+static void usage(void) {
+    fprintf(stderr,
+        "usage: bench_echo_load [options] [-- server command ...]\n"
+        "  -c list   connection counts (default 1,10,100,1000)\n"
+        "  -s list   message sizes in bytes (default 64,1024,16384)\n"
+        "  -d secs   measured seconds per run (default 2)\n"
+        "  -w secs   warm up seconds per run (default 0.5)\n"
+        "  -p port   connect to an already running server\n"
+        "  -P pid    pid of that server, for CPU accounting\n"
+        "  -j        print JSON\n");
+    exit(2);
+}
+
+int main(int argc, char** argv) {
+    struct ev_loop* loop;
+    int i, j, first = 1;
+
+    for ( i = 1; i < argc; i++ ) {
+        if ( 0 == strcmp(argv[i], "--") ) {
+            i++;
+            break;
+        }
+        if ( 0 == strcmp(argv[i], "-j") ) {
+            json = 1;
+            continue;
+        }
+        if ( i + 1 >= argc || argv[i][0] != '-' ) usage();
+        switch ( argv[i][1] ) {
+        case 'c': num_conn_counts = parse_list(argv[++i], conn_counts); break;
+        case 's': num_sizes       = parse_list(argv[++i], sizes);       break;
+        case 'd': duration        = atof(argv[++i]);                    break;
+        case 'w': warmup          = atof(argv[++i]);                    break;
+        case 'p': port            = atoi(argv[++i]);                    break;
+        case 'P': server_pid      = atoi(argv[++i]);                    break;
+        default:  usage();
+        }
+    }
+    if ( i < argc ) {
+        start_server(argv + i);
+    } else if ( port <= 0 ) {
+        usage();
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    loop = ev_default_loop(0);
+    if ( json ) {
+        printf("[");
+    } else {
+        printf("%6s %7s %12s %10s %10s %10s %12s %7s\n",
+               "conns", "bytes", "req/s", "p50(us)", "p99(us)", "p999(us)", "cpu(us)/req", "errors");
+    }
+    for ( i = 0; i < num_conn_counts; i++ ) {
+        for ( j = 0; j < num_sizes; j++ ) {
+            bench(loop, conn_counts[i], sizes[j], first);
+            first = 0;
+        }
+    }
+    if ( json ) printf("\n]\n");
+
+    stop_server();
+    return 0;
+}
+
+/* vi:set expandtab ts=4: */
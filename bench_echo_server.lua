@@ -0,0 +1,105 @@
+#!/usr/bin/env lua
+--[[
+TCP echo server on ev.IO watchers, used by bench_echo_load.
+
+Binds to 127.0.0.1 (port 0 picks a free one), prints "port <n>" on
+stdout and echoes everything it receives.  Exits when stdin is closed
+so it never outlives the load generator that started it.
+
+Usage: lua bench_echo_server.lua [-port n] [-cpath dir]
+]]
+
+local port = 0
+
+local i=1
+while i <= #arg do
+	local p=arg[i]
+	i = i + 1
+	if p == '-port' then
+		port = tonumber(arg[i])
+	elseif p == '-cpath' then
+		package.cpath = arg[i] .. "?.so;" .. package.cpath
+	else
+		io.stderr:write("unknown option: ", p, "\n")
+		os.exit(2)
+	end
+	i = i + 1
+end
+
+local socket = require"socket"
+local ev = require"ev"
+local loop = ev.Loop.default
+
+local READ_SIZE = 65536
+
+local function new_client(sock)
+	local pending  -- data not yet written back.
+	local reader, writer
+
+	sock:settimeout(0)
+	sock:setoption("tcp-nodelay", true)
+
+	local function close()
+		reader:stop(loop)
+		writer:stop(loop)
+		sock:close()
+	end
+
+	-- returns false if the connection is gone.
+	local function flush()
+		local last, err, partial = sock:send(pending)
+		last = last or partial
+		if err and err ~= "timeout" then
+			close()
+			return false
+		end
+		if last == #pending then
+			pending = nil
+			writer:stop(loop)
+			reader:start(loop)
+		else
+			-- wait until the client reads, stop reading meanwhile.
+			pending = pending:sub(last + 1)
+			reader:stop(loop)
+			writer:start(loop)
+		end
+		return true
+	end
+
+	reader = ev.IO.new(function()
+		local data, err, partial = sock:receive(READ_SIZE)
+		data = data or partial
+		if data and #data > 0 then
+			pending = data
+			if not flush() then return end
+		end
+		if err == "closed" then close() end
+	end, sock:getfd(), ev.READ)
+
+	writer = ev.IO.new(function()
+		flush()
+	end, sock:getfd(), ev.WRITE)
+
+	reader:start(loop)
+end
+
+local server = assert(socket.bind("127.0.0.1", port))
+server:settimeout(0)
+
+ev.IO.new(function()
+	local sock = server:accept()
+	while sock do
+		new_client(sock)
+		sock = server:accept()
+	end
+end, server:getfd(), ev.READ):start(loop)
+
+-- stdin is a pipe from the load generator, readable once it is closed.
+ev.IO.new(function(loop)
+	loop:unloop()
+end, 0, ev.READ):start(loop, true)
+
+print("port " .. select(2, server:getsockname()))
+io.stdout:flush()
+
+loop:loop()
@@ -0,0 +1,82 @@
+#!/usr/bin/env lua
+--[[
+Measure timer wakeup latency of the default loop with loop:probe_latency(),
+optionally while other callbacks keep the loop busy.
+
+Usage: lua bench_latency.lua [options]
+	-interval s     seconds between probe ticks (default 0.001)
+	-duration s     seconds to probe (default 5)
+	-load ms        busy-loop this many milliseconds in a competing timer
+	-load_every s   how often the competing timer fires (default 0.01)
+	-max_p99 ms     exit with status 1 if the p99 latency is above this
+	-cpath dir      directory that contains ev.so
+]]
+
+local interval = 0.001
+local duration = 5
+local load_ms = 0
+local load_every = 0.01
+local max_p99
+
+local i=1
+while i <= #arg do
+	local p=arg[i]
+	i = i + 1
+	if p == '-interval' then
+		interval = tonumber(arg[i])
+	elseif p == '-duration' then
+		duration = tonumber(arg[i])
+	elseif p == '-load' then
+		load_ms = tonumber(arg[i])
+	elseif p == '-load_every' then
+		load_every = tonumber(arg[i])
+	elseif p == '-max_p99' then
+		max_p99 = tonumber(arg[i])
+	elseif p == '-cpath' then
+		package.cpath = arg[i] .. "?.so;" .. package.cpath
+	else
+		io.stderr:write("unknown option: ", p, "\n")
+		os.exit(2)
+	end
+	i = i + 1
+end
+
+local ev = require"ev"
+local loop = ev.Loop.default
+
+local load
+if load_ms > 0 then
+	load = ev.Timer.new(function()
+		local start = os.clock()
+		while (os.clock() - start) * 1000 < load_ms do end
+	end, load_every, load_every)
+	load:start(loop, true)
+end
+
+print(string.format("interval=%gms duration=%gs load=%gms every %gms",
+	interval * 1000, duration, load_ms, load_every * 1000))
+
+local report
+loop:probe_latency{
+	interval  = interval,
+	duration  = duration,
+	on_report = function(loop, probe, revents, r)
+		report = r
+	end,
+}
+loop:loop()
+if load then load:stop(loop) end
+
+print(string.format("ticks=%d missed=%d", report.ticks, report.missed))
+print(string.format("%-6s %10s %10s %10s %10s %10s %10s",
+	"(us)", "mean", "p50", "p90", "p99", "p999", "max"))
+for _, name in ipairs{ "total", "poll", "queue" } do
+	local s = report[name]
+	print(string.format("%-6s %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f", name,
+		s.mean * 1e6, s.p50 * 1e6, s.p90 * 1e6, s.p99 * 1e6, s.p999 * 1e6, s.max * 1e6))
+end
+
+if max_p99 and report.total.p99 * 1000 > max_p99 then
+	print(string.format("p99 latency %.3fms is above %gms", report.total.p99 * 1000, max_p99))
+	os.exit(1)
+end
@@ -1,41 +1,92 @@
 #!/usr/bin/env lua
+--[[
+Benchmark lua-ev watchers.
 
-local ev = require"ev"
-local loop = ev.Loop.default
+For each watcher type this measures callback dispatch rate, start/stop
+rate, bytes per watcher and GC time, plus start rate, dispatch rate and
+memory with 1k, 10k, 100k and 1M active watchers.
 
-local socket = require"socket"
-local time = socket.gettime
-local clock = os.clock
-local quiet = false
+Usage: lua bench_watcher.lua [options]
+	-N n            number of callbacks/start-stops per run (default 1000000)
+	-scale list     comma separated watcher counts for the scaling runs
+	-only list      comma separated watcher types (io,timer,signal,child,stat,idle)
+	-gc             keep the garbage collector running during timed runs
+	-json file      write the results as JSON to file ("-" for stdout)
+	-compare file   compare against a baseline JSON file, exits with status 1
+	                if any result regressed by more than the threshold
+	-threshold pct  regression threshold in percent (default 10)
+	-cpath dir      directory that contains ev.so
+	-quiet          only print the comparison
+]]
+
+local N = 1000000
+local scale = { 1000, 10000, 100000, 1000000 }
+local only
 local disable_gc = true
+local json_file
+local compare_file
+local threshold = 10
+local quiet = false
 
-local N=10000000
+local function split_list(str)
+	local list = {}
+	for item in string.gmatch(str, "[^,]+") do
+		list[#list + 1] = tonumber(item) or item
+	end
+	return list
+end
 
 local i=1
-while i < #arg do
+while i <= #arg do
 	local p=arg[i]
 	if p == '-gc' then
 		disable_gc = false
+	elseif p == '-quiet' then
+		quiet = true
 	elseif p == '-N' then
 		i = i + 1
 		N=tonumber(arg[i])
+	elseif p == '-scale' then
+		i = i + 1
+		scale = split_list(arg[i])
+	elseif p == '-only' then
+		i = i + 1
+		only = {}
+		for _, name in ipairs(split_list(arg[i])) do only[name] = true end
+	elseif p == '-json' then
+		i = i + 1
+		json_file = arg[i]
+	elseif p == '-compare' then
+		i = i + 1
+		compare_file = arg[i]
+	elseif p == '-threshold' then
+		i = i + 1
+		threshold = tonumber(arg[i])
+	elseif p == '-cpath' then
+		i = i + 1
+		package.cpath = arg[i] .. "?.so;" .. package.cpath
+	else
+		io.stderr:write("unknown option: ", p, "\n")
+		os.exit(2)
 	end
 	i = i + 1
 end
-print("N=",N)
-if disable_gc then
-	print"GC is disabled so we can track memory usage better"
-	print""
+
+local ev = require"ev"
+local loop = ev.Loop.default
+
+local clock = os.clock
+local function time()
+	return loop:update_now()
 end
 
+local SIGALRM = 14
+
 local function printf(fmt, ...)
-	local res
 	if not quiet then
-		fmt = fmt or ''
-		res = print(string.format(fmt, ...))
+		print(string.format(fmt or '', ...))
 		io.stdout:flush()
 	end
-	return res
 end
 
 local function full_gc()
@@ -45,16 +96,8 @@ local function full_gc()
 	collectgarbage"collect"
 end
 
-local function bench(name, N, func, ...)
-	local start1,start2
-	printf('run bench: %s', name)
-	start1 = clock()
-	start2 = time()
-	func(N, ...)
-	local diff1 = (clock() - start1)
-	local diff2 = (time() - start2)
-	printf("total time: %10.6f (%10.6f) seconds", diff1, diff2)
-	return diff1, diff2
+local function mem()
+	return collectgarbage"count" * 1024
 end
 
 local function mper(mem, N)
@@ -63,145 +106,455 @@ local function mper(mem, N)
 	return per
 end
 
-local function run_watcher_speedtest(N, name, create)
-	local start_mem, end_mem
+-- name => { value=, unit=, better="higher"|"lower" }
+local results = {}
 
-	local pending = 0
-	local function cb()
-		pending = pending - 1
-		if pending <= 0 then loop:unloop() end
-	end
-
-	local watcher = create(cb)
-	watcher:start(loop)
-
-	local function run(N)
-		pending = N
-		loop:loop()
-	end
+local function record(name, value, unit, better)
+	results[name] = { value = value, unit = unit, better = better }
+	printf("%-32s %16.3f %s", name, value, unit)
+end
 
+-- Time func(), returns the elapsed cpu and wall clock seconds.
+local function bench(func, ...)
 	full_gc()
-	start_mem = (collectgarbage"count" * 1024)
-	--print(name, 'start memory size: ', start_mem)
 	if disable_gc then collectgarbage"stop" end
-	local diff1, diff2 = bench(name, N, run)
-	end_mem = (collectgarbage"count" * 1024)
-	local total = N
-	printf("units/sec: %10.6f (%10.6f) units/sec", total/diff1, total/diff2)
-	--print(name, 'end   memory size: ', end_mem)
-	local mem = (end_mem - start_mem)
-	print(name.. ': total memory used: '.. mem.. ' bytes,  used per loop: '..
-		mper(mem,total).. ' bytes')
-	print()
-
-	watcher:stop(loop)
+	local start1 = clock()
+	local start2 = time()
+	func(...)
+	local diff1 = (clock() - start1)
+	local diff2 = (time() - start2)
 	collectgarbage"restart"
-	full_gc()
+	return diff1, diff2
+end
+
+local function rate(n, secs)
+	if secs <= 0 then return 0 end
+	return n / secs
 end
 
-local function run_watcher_stop_start_speedtest(N, name, create)
-	local start_mem, end_mem
+local function null_cb()
+end
 
-	local watcher1, watcher2
-	local pending = 0
-	local function cb()
-		pending = pending - 1
-		if pending <= 0 then loop:unloop() end
+--
+-- Watcher types.  create(cb) returns a new (stopped) watcher, trigger()
+-- is called once per dispatch to cause the next event, max caps the
+-- number of dispatches and max_scale the number of watchers for
+-- types that are expensive to run.
+--
+local tmp_path
+local stat_toggle = false
+local write_fd, io_chans, io_proc
+
+local types = {
+{
+	name = "io",
+	setup = function()
+		-- an empty socket is always writable.
+		if ev.FdChannel then
+			local fd1, fd2 = ev.FdChannel.socketpair()
+			io_chans = { ev.FdChannel.new(null_cb, fd1), ev.FdChannel.new(null_cb, fd2) }
+			write_fd = fd1
+			return
+		end
+		-- elsewhere the write end of an empty pipe into cat.
+		io_proc = ev.spawn_process{
+			argv = { "cat" }, stdin = "pipe", stdout = "null",
+			on_exit = function() io_proc = nil end,
+		}
+		write_fd = io_proc.stdin
+	end,
+	teardown = function()
+		if io_chans then
+			io_chans[1]:close()
+			io_chans[2]:close()
+			io_chans = nil
+		end
+		if io_proc then
+			os.execute("kill " .. io_proc.pid)
+			while io_proc do loop:loop(ev.ONCE) end
+		end
+	end,
+	create = function(cb)
+		return ev.IO.new(cb, write_fd, ev.WRITE)
+	end,
+},
+{
+	name = "timer",
+	create = function(cb)
+		-- expires on every loop iteration without blocking the backend.
+		return ev.Timer.new(cb, 1e-9, 1e-9)
+	end,
+},
+{
+	name = "signal",
+	create = function(cb)
+		return ev.Signal.new(cb, SIGALRM)
+	end,
+	trigger = function()
+		loop:feed_signal_event(SIGALRM)
+	end,
+},
+{
+	name = "child",
+	max = 1000,
+	create = function(cb)
+		return ev.Child.new(cb, 0, false)
+	end,
+	trigger = function()
+		ev.spawn_process{ argv = { "true" } }
+	end,
+	no_scale_dispatch = true,
+},
+{
+	name = "stat",
+	max = 10000,
+	max_scale = 10000,
+	setup = function()
+		tmp_path = os.tmpname()
+	end,
+	teardown = function()
+		os.remove(tmp_path)
+	end,
+	create = function(cb)
+		return ev.Stat.new(cb, tmp_path, 0)
+	end,
+	trigger = function()
+		-- alternate the size so every write is seen as a change.
+		local f = io.open(tmp_path, "w")
+		stat_toggle = not stat_toggle
+		f:write(stat_toggle and "xx" or "x")
+		f:close()
+	end,
+	no_scale_dispatch = true,
+},
+{
+	name = "idle",
+	create = function(cb)
+		return ev.Idle.new(cb)
+	end,
+},
+}
+
+
+-- bytes per stopped watcher and GC time per watcher.
+local function bench_overhead(t, n)
+	local watchers = {}
+	for i=1,n do
+		watchers[i] = true -- pre-grow table.
+	end
+	full_gc()
+	local start_mem = mem()
+	for i=1,n do
+		watchers[i] = t.create(null_cb)
 	end
+	full_gc()
+	record(t.name .. ".bytes", mper(mem() - start_mem, n), "bytes", "lower")
 
-	-- create watcher 1
-	watcher1 = create(function()
-		watcher1:stop(loop)
-		watcher2:start(loop)
-		cb()
+	local _, secs = bench(function()
+		watchers = nil
+		full_gc()
 	end)
+	record(t.name .. ".gc", secs * 1e6 / n, "us/watcher", "lower")
+end
 
-	-- create watcher 2
-	watcher2 = create(function()
-		watcher2:stop(loop)
-		watcher1:start(loop)
-		cb()
+-- callbacks per second with a single active watcher.
+local function bench_dispatch(t, n)
+	local trigger = t.trigger
+	local pending = n
+	local watcher = t.create(function()
+		pending = pending - 1
+		if pending <= 0 then
+			loop:unloop()
+		elseif trigger then
+			trigger()
+		end
 	end)
+	watcher:start(loop)
+	local _, secs = bench(function()
+		if trigger then
+			-- fed events don't wake up a blocked loop, so trigger the
+			-- first one from an idle watcher.
+			ev.Idle.new(function(loop, idle)
+				idle:stop(loop)
+				trigger()
+			end):start(loop)
+		end
+		loop:loop()
+	end)
+	watcher:stop(loop)
+	record(t.name .. ".dispatch", rate(n, secs), "calls/s", "higher")
+end
 
-	-- start only watcher 1
-	watcher1:start(loop)
+-- start/stop pairs per second.
+local function bench_start_stop(t, n)
+	local watcher = t.create(null_cb)
+	local _, secs = bench(function()
+		for i=1,n do
+			watcher:start(loop)
+			watcher:stop(loop)
+		end
+	end)
+	record(t.name .. ".start_stop", rate(n, secs), "ops/s", "higher")
+end
 
-	local function run(N)
-		pending = N
-		loop:loop()
+-- start rate, memory and one non-blocking loop iteration with count
+-- active watchers.
+local function bench_scale(t, count)
+	local prefix = t.name .. ".scale." .. count
+	local watchers = {}
+	local fired = 0
+	local function cb()
+		fired = fired + 1
+	end
+	for i=1,count do
+		watchers[i] = t.create(cb)
 	end
 
 	full_gc()
-	start_mem = (collectgarbage"count" * 1024)
-	--print(name, 'start memory size: ', start_mem)
-	if disable_gc then collectgarbage"stop" end
-	local diff1, diff2 = bench(name, N, run)
-	end_mem = (collectgarbage"count" * 1024)
-	local total = N
-	printf("units/sec: %10.6f (%10.6f) units/sec", total/diff1, total/diff2)
-	--print(name, 'end   memory size: ', end_mem)
-	local mem = (end_mem - start_mem)
-	print(name.. ': total memory used: '.. mem.. ' bytes,  used per loop: '..
-		mper(mem,total).. ' bytes')
-	print()
-
-	watcher1:stop(loop)
-	watcher2:stop(loop)
-	collectgarbage"restart"
+	local start_mem = mem()
+	local _, secs = bench(function()
+		for i=1,count do
+			watchers[i]:start(loop)
+		end
+	end)
+	record(prefix .. ".start", rate(count, secs), "ops/s", "higher")
 	full_gc()
-end
+	record(prefix .. ".bytes", mper(mem() - start_mem, count), "bytes", "lower")
 
-local function per_watcher_overhead(N, name, create, cb)
-	local start_mem, end_mem
-	local watchers = {}
- 
-	-- pre-grow table
-	for i=1,N do
-		watchers[i] = true -- add place-holder values.
+	if not t.no_scale_dispatch then
+		_, secs = bench(function()
+			if t.trigger then t.trigger() end
+			loop:loop(ev.NOWAIT)
+		end)
+		record(prefix .. ".dispatch", rate(fired, secs), "calls/s", "higher")
 	end
-	full_gc()
-	start_mem = (collectgarbage"count" * 1024)
-	--print('overhead: start memory size: ', start_mem)
-	for i=1,N do
-		watchers[i] = create(cb)
+
+	for i=1,count do
+		watchers[i]:stop(loop)
 	end
-	full_gc()
-	end_mem = (collectgarbage"count" * 1024)
-	--print('overhead: end   memory size: ', end_mem)
-	print(name.. ': total memory used: '.. mper((end_mem - start_mem), N).. ' bytes per watcher')
-	print()
-   
 	watchers = nil
 	full_gc()
 end
 
-local tests = {
-idle = {
-	create = function(cb)
-		return ev.Idle.new(cb, 0, ev.READ)
-	end,
-},
-}
+--
+-- Minimal JSON support, enough for our own result files.
+--
+local json_encode
+function json_encode(value, indent)
+	indent = indent or ""
+	local vtype = type(value)
+	if vtype == "table" then
+		local keys = {}
+		for k in pairs(value) do keys[#keys + 1] = tostring(k) end
+		table.sort(keys)
+		local inner = indent .. "  "
+		local parts = {}
+		for _, k in ipairs(keys) do
+			parts[#parts + 1] = inner .. json_encode(k) .. ": " ..
+				json_encode(value[k], inner)
+		end
+		return "{\n" .. table.concat(parts, ",\n") .. "\n" .. indent .. "}"
+	elseif vtype == "string" then
+		return '"' .. value:gsub('[%c"\\]', function(c)
+			return string.format("\\u%04x", c:byte())
+		end) .. '"'
+	elseif vtype == "number" then
+		if value ~= value or value == math.huge or value == -math.huge then
+			return "null"
+		end
+		return string.format("%.17g", value)
+	elseif vtype == "boolean" then
+		return tostring(value)
+	end
+	return "null"
+end
 
-local function null_cb()
+local function json_decode(str)
+	local pos = 1
+	local value
+
+	local function fail(what)
+		error(string.format("invalid JSON at offset %d: %s", pos, what), 0)
+	end
+	local function skip()
+		pos = string.find(str, "[^ \t\r\n]", pos) or (#str + 1)
+	end
+	local function parse_string()
+		local buf = {}
+		pos = pos + 1
+		while true do
+			local c = str:sub(pos, pos)
+			if c == "" then fail("unterminated string") end
+			if c == '"' then break end
+			if c == "\\" then
+				local esc = str:sub(pos + 1, pos + 1)
+				if esc == "u" then
+					local code = tonumber(str:sub(pos + 2, pos + 5), 16)
+					buf[#buf + 1] = code and code < 256 and string.char(code) or "?"
+					pos = pos + 4
+				else
+					buf[#buf + 1] = ({ n = "\n", t = "\t", r = "\r", b = "\b", f = "\f" })[esc] or esc
+				end
+				pos = pos + 2
+			else
+				buf[#buf + 1] = c
+				pos = pos + 1
+			end
+		end
+		pos = pos + 1
+		return table.concat(buf)
+	end
+	function value()
+		skip()
+		local c = str:sub(pos, pos)
+		if c == "{" then
+			local obj = {}
+			pos = pos + 1
+			skip()
+			if str:sub(pos, pos) == "}" then pos = pos + 1 return obj end
+			while true do
+				skip()
+				if str:sub(pos, pos) ~= '"' then fail("expected key") end
+				local k = parse_string()
+				skip()
+				if str:sub(pos, pos) ~= ":" then fail("expected ':'") end
+				pos = pos + 1
+				obj[k] = value()
+				skip()
+				c = str:sub(pos, pos)
+				pos = pos + 1
+				if c == "}" then return obj end
+				if c ~= "," then fail("expected ',' or '}'") end
+			end
+		elseif c == "[" then
+			local arr, n = {}, 0
+			pos = pos + 1
+			skip()
+			if str:sub(pos, pos) == "]" then pos = pos + 1 return arr end
+			while true do
+				n = n + 1
+				arr[n] = value()
+				skip()
+				c = str:sub(pos, pos)
+				pos = pos + 1
+				if c == "]" then return arr end
+				if c ~= "," then fail("expected ',' or ']'") end
+			end
+		elseif c == '"' then
+			return parse_string()
+		end
+		if str:sub(pos, pos + 3) == "true" then
+			pos = pos + 4
+			return true
+		elseif str:sub(pos, pos + 4) == "false" then
+			pos = pos + 5
+			return false
+		elseif str:sub(pos, pos + 3) == "null" then
+			pos = pos + 4
+			return nil
+		end
+		local num = string.match(str, "^-?%d+%.?%d*[eE]?[-+]?%d*", pos)
+		if not num or num == "" then fail("unexpected character") end
+		pos = pos + #num
+		return tonumber(num)
+	end
+	return value()
 end
 
-print('overhead test')
-for name,test in pairs(tests) do
-	per_watcher_overhead(N/100, name, test.create, null_cb)
+local function read_file(path)
+	local f = assert(io.open(path, "r"))
+	local data = f:read("*a")
+	f:close()
+	return data
 end
 
----[[
-print()
-print('speed test watcher callback overhead')
-for name,test in pairs(tests) do
-	run_watcher_speedtest(N, name, test.create)
+local function write_json(path, data)
+	local out = json_encode(data) .. "\n"
+	if path == "-" then
+		io.stdout:write(out)
+	else
+		local f = assert(io.open(path, "w"))
+		f:write(out)
+		f:close()
+	end
 end
---]]
 
-print()
-print('speed test watcher start/stop overhead')
-for name,test in pairs(tests) do
-	run_watcher_stop_start_speedtest(N, name, test.create)
+-- returns the number of regressions.
+local function compare(baseline, current)
+	local names = {}
+	for name in pairs(current) do
+		if baseline[name] then names[#names + 1] = name end
+	end
+	table.sort(names)
+
+	local regressions = 0
+	print(string.format("%-32s %16s %16s %8s", "benchmark", "baseline", "current", "change"))
+	for _, name in ipairs(names) do
+		local base, cur = baseline[name], current[name]
+		local change = 0
+		if base.value and base.value ~= 0 then
+			change = (cur.value - base.value) * 100 / base.value
+		end
+		-- positive is worse.
+		local worse = (cur.better == "lower") and change or -change
+		local flag = ""
+		if worse > threshold then
+			flag = "REGRESSION"
+			regressions = regressions + 1
+		elseif worse < -threshold then
+			flag = "improved"
+		end
+		print(string.format("%-32s %16.3f %16.3f %+7.1f%% %s",
+			name, base.value or 0, cur.value, change, flag))
+	end
+	print(string.format("%d regression(s) above %g%%", regressions, threshold))
+	return regressions
+end
+
+--
+-- Run the benchmarks.
+--
+printf("%s, N=%d", _VERSION, N)
+if disable_gc then
+	printf"GC is disabled during timed runs so we can track memory usage better"
 end
+printf""
 
+for _, t in ipairs(types) do
+	if not only or only[t.name] then
+		local n = math.min(N, t.max or N)
+		if t.setup then t.setup() end
+		printf("== %s", t.name)
+		bench_overhead(t, math.max(1, math.floor(n / 100)))
+		bench_dispatch(t, n)
+		bench_start_stop(t, n)
+		for _, count in ipairs(scale) do
+			if count <= (t.max_scale or count) then
+				bench_scale(t, count)
+			end
+		end
+		if t.teardown then t.teardown() end
+		printf""
+	end
+end
+
+local major, minor = ev.version()
+local report = {
+	format = 1,
+	libev = major .. "." .. minor,
+	lua = _VERSION,
+	N = N,
+	gc_disabled = disable_gc,
+	results = results,
+}
+
+if json_file then
+	write_json(json_file, report)
+end
+
+if compare_file then
+	local baseline = json_decode(read_file(compare_file))
+	if compare(baseline.results or {}, results) > 0 then
+		os.exit(1)
+	end
+end
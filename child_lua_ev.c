@@ -33,6 +33,7 @@ static int create_child_mt(lua_State *L) {
         { "getpid" ,       child_getpid },
         { "getrpid" ,      child_getrpid },
         { "getstatus" ,    child_getstatus },
+        { "set",           child_set },
         { NULL, NULL }
     };
     return add_watcher_mt(L, methods, CHILD_MT);
@@ -45,6 +46,7 @@ static int create_child_mt(lua_State *L) {
  *   3 - trace (either false - only activate the watcher when the process
  *       terminates or true - additionally activate the watcher when the
  *       process is stopped or continued).
+ *   4 - optional context, see watcher:context()
  *
  * @see watcher_new()
  *
@@ -56,6 +58,7 @@ static int child_new(lua_State* L) {
     ev_child*   child;
 
     child = (ev_child*)watcher_new(L, sizeof(ev_child), CHILD_MT);
+    watcher_new_context(L, 4);
     ev_child_init(child, &child_cb, pid, trace);
     return 1;
 }
@@ -106,6 +109,28 @@ static int child_start(lua_State *L) {
     return 0;
 }
 
+/**
+ * Changes the pid and trace flag, restarting the child if it is
+ * active.
+ *
+ * Usage:
+ *     child:set(pid, trace)
+ *
+ * [+0, -0, e]
+ */
+static int child_set(lua_State *L) {
+    ev_child*       child = check_child(L, 1);
+    int             pid   = luaL_checkint(L, 2);
+    int             trace = luaL_checkbool(L, 3);
+    struct ev_loop* loop  = watcher_active_loop(child);
+
+    if ( loop ) ev_child_stop(loop, child);
+    ev_child_set(child, pid, trace);
+    if ( loop ) ev_child_start(loop, child);
+
+    return 0;
+}
+
 /**
  * Returns the child pid (the process id this watcher watches out for, or 0,
  * meaning any process id).
@@ -137,15 +162,15 @@ static int child_getrpid(lua_State *L) {
     return 1;
 }
 
-static void populate_child_status_table(ev_child *child, lua_State *L) {
+static void populate_child_status_table(int rstatus, lua_State *L) {
     int             exited, stopped, signaled;
 
-    exited = WIFEXITED(child->rstatus);
-    stopped = WIFSTOPPED(child->rstatus);
-    signaled = WIFSIGNALED(child->rstatus);
+    exited = WIFEXITED(rstatus);
+    stopped = WIFSTOPPED(rstatus);
+    signaled = WIFSIGNALED(rstatus);
 
     lua_pushstring(L, "status");
-    lua_pushinteger(L, child->rstatus);
+    lua_pushinteger(L, rstatus);
     lua_settable(L, -3);
 
     lua_pushstring(L, "exited");
@@ -162,19 +187,19 @@ static void populate_child_status_table(ev_child *child, lua_State *L) {
 
     if (exited) {
         lua_pushstring(L, "exit_status");
-        lua_pushinteger(L, WEXITSTATUS(child->rstatus));
+        lua_pushinteger(L, WEXITSTATUS(rstatus));
         lua_settable(L, -3);
     }
 
     if (stopped) {
         lua_pushstring(L, "stop_signal");
-        lua_pushinteger(L, WSTOPSIG(child->rstatus));
+        lua_pushinteger(L, WSTOPSIG(rstatus));
         lua_settable(L, -3);
     }
 
     if (signaled) {
         lua_pushstring(L, "term_signal");
-        lua_pushinteger(L, WTERMSIG(child->rstatus));
+        lua_pushinteger(L, WTERMSIG(rstatus));
         lua_settable(L, -3);
     }
 }
@@ -207,7 +232,7 @@ static int child_getstatus(lua_State *L) {
 
     lua_newtable(L);
 #ifndef _WIN32
-    populate_child_status_table(child, L);
+    populate_child_status_table(child->rstatus, L);
 #endif
 
     return 1;
@@ -0,0 +1,262 @@
+#ifdef __linux__
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+
+/**
+ * A child watcher built on a pidfd (Linux 5.4+): the pidfd becomes
+ * readable when the process exits, and waitid(P_PIDFD) reaps exactly
+ * that process.  Unlike ev_child this needs no SIGCHLD handler, so it
+ * works on any loop and only wakes the loop watching the process.
+ *
+ * The io watcher must be the first member, since that is what
+ * watcher_cb() and GET_WATCHER_DATA() operate on.
+ */
+struct lua_ev_childfd {
+    ev_io            io;
+    int              pid;
+    int              rpid;
+    int              rstatus;
+    /* extra callback arguments, used by ev.spawn_process(). */
+    lua_ev_push_args push_args;
+};
+
+/**
+ * Create a table for ev.ChildFD that gives access to the constructor
+ * for childfd objects.
+ *
+ * [-0, +1, ?]
+ */
+static int luaopen_ev_childfd(lua_State *L) {
+    lua_pop(L, create_childfd_mt(L));
+
+    lua_createtable(L, 0, 1);
+
+    lua_pushcfunction(L, childfd_new);
+    lua_setfield(L, -2, "new");
+
+    return 1;
+}
+
+/**
+ * Create the childfd metatable in the registry.
+ *
+ * [-0, +1, ?]
+ */
+static int create_childfd_mt(lua_State *L) {
+
+    static luaL_reg methods[] = {
+        { "stop",          childfd_stop },
+        { "start",         childfd_start },
+        { "getpid",        childfd_getpid },
+        { "getrpid",       childfd_getrpid },
+        { "getstatus",     childfd_getstatus },
+        { "getfd",         childfd_getfd },
+        { NULL, NULL }
+    };
+    add_watcher_mt(L, methods, CHILDFD_MT);
+
+    /* close the pidfd. */
+    lua_pushcfunction(L, childfd_gc);
+    lua_setfield(L, -2, "__gc");
+    return 1;
+}
+
+/**
+ * Create a new childfd object.  Arguments:
+ *   1 - callback function.
+ *   2 - pid of the process to watch (must be > 0).
+ *   3 - optional context, see watcher:context()
+ *
+ * @see watcher_new()
+ *
+ * [+1, -0, ?]
+ */
+static int childfd_new(lua_State* L) {
+    int              pid = luaL_checkint(L, 2);
+    lua_ev_childfd*  cfd;
+    int              fd;
+
+    if ( pid <= 0 ) luaL_argerror(L, 2, "pid must be greater than 0");
+
+    cfd = (lua_ev_childfd*)watcher_new(L, sizeof(lua_ev_childfd), CHILDFD_MT);
+    watcher_new_context(L, 3);
+    memset(cfd, 0, sizeof(lua_ev_childfd));
+    ev_io_init(&cfd->io, &childfd_cb, -1, EV_READ);
+    cfd->pid = pid;
+
+    /* the pidfd is always close-on-exec. */
+    fd = syscall(SYS_pidfd_open, pid, 0);
+    if ( fd < 0 ) {
+        return luaL_error(L, "pidfd_open: %s", strerror(errno));
+    }
+    ev_io_set(&cfd->io, fd, EV_READ);
+    return 1;
+}
+
+/**
+ * The process exited: reap it and call the lua callback.  The watcher
+ * is stopped first since a pidfd reports the exit only once.
+ *
+ * [+0, -0, m]
+ */
+static void childfd_cb(struct ev_loop* loop, ev_io* io, int revents) {
+    lua_ev_childfd* cfd = (lua_ev_childfd*)io;
+    siginfo_t       info;
+
+    memset(&info, 0, sizeof(info));
+    if ( waitid((idtype_t)P_PIDFD, io->fd, &info, WEXITED | WNOHANG) != 0 ) {
+        /* not our child, or reaped by someone else: status unknown. */
+        info.si_pid  = cfd->pid;
+        info.si_code = 0;
+    } else if ( 0 == info.si_pid ) {
+        return;
+    }
+
+    cfd->rpid = info.si_pid;
+    switch ( info.si_code ) {
+    case CLD_EXITED:
+        cfd->rstatus = ( info.si_status & 0xff ) << 8;
+        break;
+    case CLD_KILLED:
+        cfd->rstatus = info.si_status & 0x7f;
+        break;
+    case CLD_DUMPED:
+        cfd->rstatus = ( info.si_status & 0x7f ) | 0x80;
+        break;
+    default:
+        cfd->rstatus = -1;
+    }
+
+    ev_io_stop(loop, io);
+    watcher_cb_args(loop, io, EV_CHILD, cfd->push_args);
+}
+
+/**
+ * Stops the childfd so it won't be called by the specified event loop.
+ *
+ * Usage:
+ *     childfd:stop(loop)
+ *
+ * [+0, -0, e]
+ */
+static int childfd_stop(lua_State *L) {
+    lua_ev_childfd* cfd  = check_childfd(L, 1);
+    struct ev_loop* loop = *check_loop_and_init(L, 2);
+
+    loop_stop_watcher(L, loop, GET_WATCHER_DATA(cfd), 1);
+    ev_io_stop(loop, &cfd->io);
+
+    return 0;
+}
+
+/**
+ * Starts the childfd so it will be called by the specified event loop
+ * (which need not be the default loop).
+ *
+ * Usage:
+ *     childfd:start(loop [, is_daemon])
+ *
+ * [+0, -0, e]
+ */
+static int childfd_start(lua_State *L) {
+    lua_ev_childfd* cfd  = check_childfd(L, 1);
+    struct ev_loop* loop = *check_loop_and_init(L, 2);
+    int is_daemon        = lua_toboolean(L, 3);
+
+    if ( cfd->io.fd < 0 ) return luaL_error(L, "childfd is closed");
+
+    ev_io_start(loop, &cfd->io);
+    loop_start_watcher(L, loop, GET_WATCHER_DATA(cfd), 2, 1, is_daemon);
+
+    return 0;
+}
+
+/**
+ * Returns the pid this watcher watches.
+ *
+ * Usage:
+ *     pid = childfd:getpid()
+ *
+ * [+1, -0, e]
+ */
+static int childfd_getpid(lua_State *L) {
+    lua_ev_childfd* cfd = check_childfd(L, 1);
+
+    lua_pushinteger(L, cfd->pid);
+    return 1;
+}
+
+/**
+ * Returns the pid of the process that exited, 0 before that.
+ *
+ * Usage:
+ *     rpid = childfd:getrpid()
+ *
+ * [+1, -0, e]
+ */
+static int childfd_getrpid(lua_State *L) {
+    lua_ev_childfd* cfd = check_childfd(L, 1);
+
+    lua_pushinteger(L, cfd->rpid);
+    return 1;
+}
+
+/**
+ * Returns the exit status table, see child:getstatus().
+ *
+ * Usage:
+ *     status = childfd:getstatus()
+ *
+ * [+1, -0, e]
+ */
+static int childfd_getstatus(lua_State *L) {
+    lua_ev_childfd* cfd = check_childfd(L, 1);
+
+    lua_newtable(L);
+    populate_child_status_table(cfd->rstatus, L);
+    return 1;
+}
+
+/**
+ * Returns the pidfd.
+ *
+ * Usage:
+ *     fd = childfd:getfd()
+ *
+ * [+1, -0, e]
+ */
+static int childfd_getfd(lua_State *L) {
+    lua_ev_childfd* cfd = check_childfd(L, 1);
+
+    lua_pushinteger(L, cfd->io.fd);
+    return 1;
+}
+
+/**
+ * Close the pidfd.
+ *
+ * [+0, -0, -]
+ */
+static int childfd_gc(lua_State *L) {
+    lua_ev_childfd* cfd = check_childfd(L, 1);
+
+    if ( cfd->io.fd >= 0 ) close(cfd->io.fd);
+    cfd->io.fd = -1;
+    return 0;
+}
+
+#endif /* __linux__ */
+
+/* vi:set expandtab ts=4: */
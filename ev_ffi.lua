@@ -0,0 +1,124 @@
+--[[
+Fast path for the hot watcher operations on LuaJIT.
+
+The methods of the watcher objects are classic C functions, which
+LuaJIT can't compile into its traces.  The functions of this module do
+the same as the methods, but call into ev.so through the FFI, so code
+which starts and stops watchers in a loop stays compiled:
+
+   local ev     = require("ev")
+   local ev_ffi = require("ev_ffi")
+
+   ev_ffi.start(io, loop)       -- io:start(loop)
+   ev_ffi.stop(io, loop)        -- io:stop(loop)
+   ev_ffi.again(timer, loop)    -- timer:again(loop)
+   ev_ffi.is_active(io)         -- io:is_active()
+   ev_ffi.is_pending(io)        -- io:is_pending()
+   ev_ffi.now(loop)             -- loop:now()
+   ev_ffi.timer_set(timer, after, repeat)
+   ev_ffi.io_set(io, fd, events)
+
+The first start of a watcher, daemon watchers and watcher types other
+than io, timer, idle and signal take the regular methods.  Without the
+FFI (plain lua) every function is the regular method, and
+ev_ffi.enabled is false.
+]]
+
+local ev = require("ev")
+
+local M = { enabled = false }
+
+local function regular()
+   function M.start(watcher, loop, is_daemon) return watcher:start(loop, is_daemon) end
+   function M.stop(watcher, loop) return watcher:stop(loop) end
+   function M.again(timer, loop, repeat_seconds) return timer:again(loop, repeat_seconds) end
+   function M.is_active(watcher) return watcher:is_active() end
+   function M.is_pending(watcher) return watcher:is_pending() end
+   function M.now(loop) return loop:now() end
+   function M.timer_set(timer, after, repeat_seconds) return timer:set(after, repeat_seconds) end
+   function M.io_set(io, fd, events) return io:set(fd, events) end
+   return M
+end
+
+local has_ffi, ffi = pcall(require, "ffi")
+if not has_ffi then return regular() end
+
+-- find the ev.so which require("ev") loaded:
+local function find_library()
+   if package.searchpath then
+      return package.searchpath("ev", package.cpath)
+   end
+   for template in package.cpath:gmatch("[^;]+") do
+      local path = template:gsub("%?", "ev")
+      local file = io.open(path)
+      if file then
+         file:close()
+         return path
+      end
+   end
+end
+
+ffi.cdef[[
+double lua_ev_ffi_now(void* loop);
+int    lua_ev_ffi_is_active(void* watcher);
+int    lua_ev_ffi_is_pending(void* watcher);
+int    lua_ev_ffi_start(void* loop, void* watcher);
+int    lua_ev_ffi_stop(void* loop, void* watcher);
+int    lua_ev_ffi_again(void* loop, void* watcher);
+int    lua_ev_ffi_timer_set(void* timer, double after, double repeat);
+int    lua_ev_ffi_io_set(void* io, int fd, int events);
+]]
+
+local path = find_library()
+local loaded, C = pcall(ffi.load, path or "ev")
+if not loaded or not pcall(function() return C.lua_ev_ffi_now end) then
+   return regular()
+end
+
+M.enabled = true
+
+function M.start(watcher, loop, is_daemon)
+   if is_daemon ~= nil or C.lua_ev_ffi_start(loop, watcher) == 0 then
+      return watcher:start(loop, is_daemon)
+   end
+end
+
+function M.stop(watcher, loop)
+   if C.lua_ev_ffi_stop(loop, watcher) == 0 then
+      return watcher:stop(loop)
+   end
+end
+
+function M.again(timer, loop, repeat_seconds)
+   if repeat_seconds ~= nil or C.lua_ev_ffi_again(loop, timer) == 0 then
+      return timer:again(loop, repeat_seconds)
+   end
+end
+
+function M.is_active(watcher)
+   return C.lua_ev_ffi_is_active(watcher) ~= 0
+end
+
+function M.is_pending(watcher)
+   return C.lua_ev_ffi_is_pending(watcher) ~= 0
+end
+
+function M.now(loop)
+   local now = C.lua_ev_ffi_now(loop)
+   if now < 0 then return loop:now() end
+   return now
+end
+
+function M.timer_set(timer, after, repeat_seconds)
+   if C.lua_ev_ffi_timer_set(timer, after, repeat_seconds or 0) == 0 then
+      error("ev_ffi.timer_set() expects a timer and non-negative after and repeat", 2)
+   end
+end
+
+function M.io_set(io, fd, events)
+   if C.lua_ev_ffi_io_set(io, fd, events) == 0 then
+      error("ev_ffi.io_set() expects an io watcher and a valid fd", 2)
+   end
+end
+
+return M
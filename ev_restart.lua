@@ -0,0 +1,218 @@
+--[[
+Zero downtime restarts (Linux only).
+
+The running process starts the new one with restart.exec() and hands
+it its listening sockets, optionally live connections and a state
+string, over an ev.FdChannel which the new process inherits.  Both
+processes share the listening sockets, so no connection is refused
+meanwhile.  Once the new process called handoff:ready(), the old one
+stops accepting and drains until a deadline:
+
+   local restart = require("ev_restart")
+
+   restart.exec{
+      argv        = { "lua", "server.lua" },
+      listeners   = { http = http_io },   -- name => ev.IO watcher or fd
+      conns       = { fd, ... },          -- optional fds handed over as is
+      state       = "...",                -- optional string of any size
+      deadline    = 10,                   -- seconds to drain (default 10)
+      loop        = loop,                 -- default ev.Loop.default
+      on_ready    = function(loop, proc) end,  -- listeners are stopped
+      on_deadline = function(loop) end,        -- default loop:unloop()
+      on_fail     = function(loop, err) end,   -- still serving
+   }
+
+And in the new process, before it starts serving:
+
+   local handoff = restart.inherit()   -- nil unless started by exec()
+   if handoff then
+      -- handoff.listeners (name => fd), handoff.conns (array of fds)
+      -- and handoff.state, all fds non-blocking: start ev.IO
+      -- watchers on them, then let the old process drain:
+      handoff:ready()
+   end
+
+The new process is exec()ed, so it starts with fresh loops; only a
+process which fork()s without exec() needs loop:fork().
+]]
+
+local ev = require("ev")
+
+local unpack = unpack or table.unpack
+
+local M = {}
+
+-- the new process finds the channel at this fd, named by this variable:
+local ENV        = "LUA_EV_RESTART_FD"
+local CHANNEL_FD = 3
+
+-- stay below the 65535 byte payload limit of ev.FdChannel.
+local CHUNK    = 60000
+local MAX_FDS  = 253
+
+--[[
+Message payloads start with a kind: "Ls" and "Ln" a listener with a
+string or number name and its fd, "S" a chunk of the state, "C" a batch
+of connections and "E" the end.  The new process answers "R" once it
+is ready.
+]]
+local function handoff_messages(opts)
+   local messages = {}
+   for name, listener in pairs(opts.listeners or {}) do
+      local fd = type(listener) == "number" and listener or listener:getfd()
+      local kind = type(name) == "number" and "Ln" or "Ls"
+      messages[#messages + 1] = { kind .. name, { fd } }
+   end
+   local state = opts.state or ""
+   for i = 1, #state, CHUNK do
+      messages[#messages + 1] = { "S" .. state:sub(i, i + CHUNK - 1) }
+   end
+   local conns = opts.conns or {}
+   for i = 1, #conns, MAX_FDS do
+      messages[#messages + 1] = { "C", { unpack(conns, i, math.min(i + MAX_FDS - 1, #conns)) } }
+   end
+   messages[#messages + 1] = { "E" }
+   return messages
+end
+
+function M.exec(opts)
+   local loop = opts.loop or ev.Loop.default
+   local deadline = opts.deadline or 10
+   local fd1, fd2 = ev.FdChannel.socketpair()
+   local messages = handoff_messages(opts)
+   local sent = 0
+   local done = false
+   local chan, writable, proc
+
+   local function finish()
+      done = true
+      writable:stop(loop)
+      chan:stop(loop)
+      chan:close()
+   end
+
+   local function fail(err)
+      if done then return end
+      finish()
+      if opts.on_fail then
+         opts.on_fail(loop, err)
+      else
+         io.stderr:write("ev_restart: new process failed: ", err, "\n")
+      end
+   end
+
+   local function ready()
+      if done then return end
+      finish()
+      for _, listener in pairs(opts.listeners or {}) do
+         if type(listener) ~= "number" then listener:stop(loop) end
+      end
+      -- the new process is on its own now.
+      proc.child:stop(loop)
+      if opts.on_ready then opts.on_ready(loop, proc) end
+      ev.Timer.new(function(loop)
+         if opts.on_deadline then
+            opts.on_deadline(loop)
+         else
+            loop:unloop()
+         end
+      end, deadline):start(loop, true)
+   end
+
+   -- send what fits in the socket buffer, the rest once it is writable.
+   local function flush()
+      while sent < #messages do
+         local msg = messages[sent + 1]
+         if not chan:send(msg[1], msg[2]) then
+            writable:start(loop)
+            return
+         end
+         sent = sent + 1
+      end
+      writable:stop(loop)
+   end
+
+   chan = ev.FdChannel.new(function(loop, chan, revents, received)
+      for _, msg in ipairs(received) do
+         if msg.payload == "R" then return ready() end
+      end
+      if received.closed then fail("closed the handoff channel") end
+   end, fd1)
+   writable = ev.IO.new(flush, fd1, ev.WRITE)
+
+   local setenv = { [ENV] = CHANNEL_FD }
+   if opts.setenv then
+      for name, value in pairs(opts.setenv) do setenv[name] = value end
+   end
+   local ok, err = pcall(function()
+      proc = ev.spawn_process{
+         argv    = opts.argv,
+         env     = opts.env,
+         setenv  = setenv,
+         cwd     = opts.cwd,
+         fds     = { [CHANNEL_FD] = fd2 },
+         loop    = loop,
+         on_exit = function(loop, child, revents, exit_status, term_signal)
+            fail("exited with " .. (exit_status and ("status " .. exit_status)
+                                     or ("signal " .. tostring(term_signal))))
+         end,
+      }
+   end)
+   -- the new process has its end, close ours.
+   ev.FdChannel.new(function() end, fd2):close()
+   if not ok then error(err, 2) end
+
+   chan:start(loop)
+   flush()
+   return proc
+end
+
+function M.inherit(timeout)
+   local fd = tonumber(os.getenv(ENV))
+   if not fd then return nil end
+
+   local loop = ev.Loop.new()
+   local handoff = { listeners = {}, conns = {} }
+   local state = {}
+   local complete, err
+
+   local chan = ev.FdChannel.new(function(loop, chan, revents, messages)
+      for _, msg in ipairs(messages) do
+         local payload = msg.payload
+         local kind = payload:sub(1, 1)
+         if kind == "L" then
+            local name = payload:sub(3)
+            if payload:sub(2, 2) == "n" then name = tonumber(name) end
+            handoff.listeners[name] = msg.fds[1]
+         elseif kind == "S" then
+            state[#state + 1] = payload:sub(2)
+         elseif kind == "C" then
+            for _, conn in ipairs(msg.fds) do handoff.conns[#handoff.conns + 1] = conn end
+         elseif kind == "E" then
+            complete = true
+         end
+      end
+      if messages.closed and not complete then err = "the old process closed the handoff channel" end
+      if complete or err then chan:stop(loop) end
+   end, fd)
+   chan:start(loop)
+
+   local timer = ev.Timer.new(function(loop, timer)
+      err = "timed out waiting for the handoff"
+      chan:stop(loop)
+   end, timeout or 10)
+   timer:start(loop, true)
+   loop:loop()
+   timer:stop(loop)
+   if err then error("ev_restart: " .. err, 2) end
+
+   handoff.state = table.concat(state)
+   handoff.channel = chan
+   function handoff:ready()
+      -- keep the channel open until the old process got this.
+      return self.channel:send("R")
+   end
+   return handoff
+end
+
+return M
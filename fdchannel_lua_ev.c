@@ -0,0 +1,436 @@
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/* the kernel limit (SCM_MAX_FD) on fds per message. */
+#define FDCHANNEL_MAX_FDS     253
+#define FDCHANNEL_MAX_PAYLOAD 65535
+/* messages received per callback, the rest wait for the next one. */
+#define FDCHANNEL_MAX_BATCH   64
+
+/* every message starts with this byte, so that a message with an
+ * empty payload and no fds can not be mistaken for the end of file. */
+#define FDCHANNEL_TAG 'F'
+
+/**
+ * A received message.  buf points to FDCHANNEL_MAX_PAYLOAD + 1 bytes.
+ */
+typedef struct fdchannel_msg {
+    char*   buf;
+    ssize_t len;
+    int     fds[FDCHANNEL_MAX_FDS];
+    int     num_fds;
+    /* fds were lost, see fdchannel_recv(). */
+    int     truncated;
+} fdchannel_msg;
+
+/**
+ * The io watcher must be the first member, since that is what
+ * watcher_cb() and GET_WATCHER_DATA() operate on.
+ */
+struct lua_ev_fdchannel {
+    ev_io          io;
+    /* the message fdchannel_cb() received, for fdchannel_push_messages(). */
+    fdchannel_msg* first;
+};
+
+/**
+ * Create a table for ev.FdChannel that gives access to the
+ * constructor for fdchannel objects.
+ *
+ * [-0, +1, ?]
+ */
+static int luaopen_ev_fdchannel(lua_State *L) {
+    lua_pop(L, create_fdchannel_mt(L));
+
+    lua_createtable(L, 0, 2);
+
+    lua_pushcfunction(L, fdchannel_new);
+    lua_setfield(L, -2, "new");
+
+    lua_pushcfunction(L, fdchannel_socketpair);
+    lua_setfield(L, -2, "socketpair");
+
+    return 1;
+}
+
+/**
+ * Create the fdchannel metatable in the registry.
+ *
+ * [-0, +1, ?]
+ */
+static int create_fdchannel_mt(lua_State *L) {
+
+    static luaL_reg methods[] = {
+        { "stop",          fdchannel_stop },
+        { "start",         fdchannel_start },
+        { "send",          fdchannel_send },
+        { "getfd",         fdchannel_getfd },
+        { "close",         fdchannel_close },
+        { NULL, NULL }
+    };
+    add_watcher_mt(L, methods, FDCHANNEL_MT);
+
+    /* close the socket. */
+    lua_pushcfunction(L, fdchannel_gc);
+    lua_setfield(L, -2, "__gc");
+    return 1;
+}
+
+/**
+ * Create a connected pair of unix sockets for ev.FdChannel.new().
+ * Both are close-on-exec, pass one to another process through
+ * ev.spawn_process() (which dup2()s it) or fork().
+ *
+ * Usage:
+ *     fd1, fd2 = ev.FdChannel.socketpair()
+ *
+ * [+2, -0, e]
+ */
+static int fdchannel_socketpair(lua_State *L) {
+    int fds[2];
+
+    if ( socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) != 0 ) {
+        return luaL_error(L, "socketpair: %s", strerror(errno));
+    }
+    lua_pushinteger(L, fds[0]);
+    lua_pushinteger(L, fds[1]);
+    return 2;
+}
+
+/**
+ * Create a new fdchannel object.  Arguments:
+ *   1 - callback function.
+ *   2 - a connected unix SOCK_SEQPACKET socket, see
+ *       ev.FdChannel.socketpair().  The fdchannel owns it from now on
+ *       and makes it non-blocking.
+ *   3 - optional context, see watcher:context()
+ *
+ * @see watcher_new()
+ *
+ * [+1, -0, ?]
+ */
+static int fdchannel_new(lua_State* L) {
+    int               fd = luaL_checkint(L, 2);
+    lua_ev_fdchannel* chan;
+    int               flags;
+
+    if ( fd < 0 ) luaL_argerror(L, 2, "fd must be non-negative");
+
+    chan = (lua_ev_fdchannel*)watcher_new(L, sizeof(lua_ev_fdchannel), FDCHANNEL_MT);
+    watcher_new_context(L, 3);
+    memset(chan, 0, sizeof(lua_ev_fdchannel));
+    ev_io_init(&chan->io, &fdchannel_cb, fd, EV_READ);
+
+    flags = fcntl(fd, F_GETFL);
+    if ( flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0 ) {
+        chan->io.fd = -1;
+        return luaL_error(L, "fcntl: %s", strerror(errno));
+    }
+    return 1;
+}
+
+/**
+ * Receive one message, with its fds non-blocking and close-on-exec.
+ * Returns 1 if a message was received, 0 if the peer closed the
+ * socket (or it failed) and -1 if there is nothing to receive.  The
+ * message is marked truncated if the kernel dropped some of its fds
+ * (MSG_CTRUNC, for example at RLIMIT_NOFILE) or it had more than
+ * FDCHANNEL_MAX_FDS, the extra ones are closed.
+ */
+static int fdchannel_recv(int fd, fdchannel_msg* msg) {
+    union {
+        struct cmsghdr hdr;
+        char           buf[CMSG_SPACE(FDCHANNEL_MAX_FDS * sizeof(int))];
+    } control;
+    struct msghdr   mh;
+    struct iovec    iov;
+    struct cmsghdr* cmsg;
+    ssize_t         len;
+    int             i;
+
+    iov.iov_base = msg->buf;
+    iov.iov_len  = FDCHANNEL_MAX_PAYLOAD + 1;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov        = &iov;
+    mh.msg_iovlen     = 1;
+    mh.msg_control    = control.buf;
+    mh.msg_controllen = sizeof(control.buf);
+
+    do {
+        len = recvmsg(fd, &mh, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    } while ( len < 0 && errno == EINTR );
+    if ( len < 0 ) return errno == EAGAIN || errno == EWOULDBLOCK ? -1 : 0;
+    if ( len == 0 ) return 0;
+
+    msg->num_fds   = 0;
+    msg->truncated = 0 != ( mh.msg_flags & MSG_CTRUNC );
+    for ( cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg) ) {
+        int* fds;
+        int  n;
+
+        if ( cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ) continue;
+        fds = (int*)CMSG_DATA(cmsg);
+        n   = ( cmsg->cmsg_len - CMSG_LEN(0) ) / sizeof(int);
+        for ( i = 0; i < n; i++ ) {
+            int flags;
+
+            if ( msg->num_fds == FDCHANNEL_MAX_FDS ) {
+                close(fds[i]);
+                msg->truncated = 1;
+                continue;
+            }
+            flags = fcntl(fds[i], F_GETFL);
+            if ( flags >= 0 ) fcntl(fds[i], F_SETFL, flags | O_NONBLOCK);
+            msg->fds[msg->num_fds++] = fds[i];
+        }
+    }
+    /* skip the tag. */
+    msg->len = len - 1;
+    memmove(msg->buf, msg->buf + 1, msg->len);
+    return 1;
+}
+
+/**
+ * The socket is readable: receive the first message, and call the lua
+ * callback which receives the rest of the batch.  If the peer closed
+ * the socket, the watcher is stopped and the callback is called with
+ * an empty batch marked closed.
+ *
+ * [+0, -0, m]
+ */
+static void fdchannel_cb(struct ev_loop* loop, ev_io* io, int revents) {
+    lua_ev_fdchannel* chan = (lua_ev_fdchannel*)io;
+    char              buf[FDCHANNEL_MAX_PAYLOAD + 1];
+    fdchannel_msg     msg;
+    int               result;
+
+    msg.buf = buf;
+    result  = fdchannel_recv(io->fd, &msg);
+    if ( result < 0 ) return;
+
+    if ( 0 == result ) {
+        ev_io_stop(loop, io);
+        chan->first = NULL;
+    } else {
+        chan->first = &msg;
+    }
+    watcher_cb_args(loop, io, revents, &fdchannel_push_messages);
+    chan->first = NULL;
+}
+
+/**
+ * Push the batch of messages as an array of tables with payload and
+ * fds (and truncated = true if fds were lost), receiving more
+ * messages first.  The array has closed = true if
+ * the peer closed the socket.
+ *
+ * @see watcher_cb_args()
+ *
+ * [-0, +1, m]
+ */
+static int fdchannel_push_messages(lua_State *L, void *watcher) {
+    lua_ev_fdchannel* chan = (lua_ev_fdchannel*)watcher;
+    fdchannel_msg*    msg  = chan->first;
+    int               n    = 0;
+    int               i;
+
+    lua_newtable(L);
+    if ( NULL == msg ) {
+        lua_pushboolean(L, 1);
+        lua_setfield(L, -2, "closed");
+        return 1;
+    }
+    do {
+        lua_createtable(L, 0, 2);
+        lua_pushlstring(L, msg->buf, msg->len);
+        lua_setfield(L, -2, "payload");
+        lua_createtable(L, msg->num_fds, 0);
+        for ( i = 0; i < msg->num_fds; i++ ) {
+            lua_pushinteger(L, msg->fds[i]);
+            lua_rawseti(L, -2, i + 1);
+        }
+        lua_setfield(L, -2, "fds");
+        if ( msg->truncated ) {
+            lua_pushboolean(L, 1);
+            lua_setfield(L, -2, "truncated");
+        }
+        lua_rawseti(L, -2, ++n);
+    /* the end of file is left for the next callback. */
+    } while ( n < FDCHANNEL_MAX_BATCH && fdchannel_recv(chan->io.fd, msg) > 0 );
+    return 1;
+}
+
+/**
+ * Send a message with a payload and a batch of fds to the peer.  The
+ * fds are duplicated by the kernel, if close is true they are closed
+ * here once sent.  Returns false and the error message if the message
+ * could not be sent, for example because the socket buffer is full.
+ *
+ * Usage:
+ *     ok, err = fdchannel:send(payload [, fds [, close]])
+ *
+ * [+1..2, -0, e]
+ */
+static int fdchannel_send(lua_State *L) {
+    lua_ev_fdchannel* chan  = check_fdchannel(L, 1);
+    size_t            len;
+    const char*       payload = luaL_optlstring(L, 2, "", &len);
+    int               close_fds = lua_toboolean(L, 4);
+    int               fds[FDCHANNEL_MAX_FDS];
+    int               num_fds = 0;
+    union {
+        struct cmsghdr hdr;
+        char           buf[CMSG_SPACE(FDCHANNEL_MAX_FDS * sizeof(int))];
+    } control;
+    char              tag = FDCHANNEL_TAG;
+    struct msghdr     mh;
+    struct iovec      iov[2];
+    ssize_t           result;
+    int               i;
+
+    if ( len > FDCHANNEL_MAX_PAYLOAD )
+        luaL_argerror(L, 2, "payload must be at most 65535 bytes");
+    if ( ! lua_isnoneornil(L, 3) ) {
+        luaL_checktype(L, 3, LUA_TTABLE);
+        num_fds = lua_objlen(L, 3);
+        if ( num_fds > FDCHANNEL_MAX_FDS )
+            luaL_argerror(L, 3, "at most 253 fds per message");
+        for ( i = 0; i < num_fds; i++ ) {
+            lua_rawgeti(L, 3, i + 1);
+            fds[i] = lua_tointeger(L, -1);
+            if ( ! lua_isnumber(L, -1) || fds[i] < 0 )
+                luaL_argerror(L, 3, "fds must be an array of fds");
+            lua_pop(L, 1);
+        }
+    }
+    if ( chan->io.fd < 0 ) return luaL_error(L, "fdchannel is closed");
+
+    iov[0].iov_base = &tag;
+    iov[0].iov_len  = 1;
+    iov[1].iov_base = (void*)payload;
+    iov[1].iov_len  = len;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov    = iov;
+    mh.msg_iovlen = 2;
+    if ( num_fds ) {
+        struct cmsghdr* cmsg;
+
+        memset(&control, 0, sizeof(control));
+        mh.msg_control    = control.buf;
+        mh.msg_controllen = CMSG_SPACE(num_fds * sizeof(int));
+        cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type  = SCM_RIGHTS;
+        cmsg->cmsg_len   = CMSG_LEN(num_fds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, num_fds * sizeof(int));
+    }
+
+    do {
+        result = sendmsg(chan->io.fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+    } while ( result < 0 && errno == EINTR );
+    if ( result < 0 ) {
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, strerror(errno));
+        return 2;
+    }
+
+    if ( close_fds ) {
+        for ( i = 0; i < num_fds; i++ ) close(fds[i]);
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/**
+ * Stops the fdchannel so it won't be called by the specified event
+ * loop.  Messages stay in the socket buffer meanwhile.
+ *
+ * Usage:
+ *     fdchannel:stop(loop)
+ *
+ * [+0, -0, e]
+ */
+static int fdchannel_stop(lua_State *L) {
+    lua_ev_fdchannel* chan = check_fdchannel(L, 1);
+    struct ev_loop*   loop = *check_loop_and_init(L, 2);
+
+    loop_stop_watcher(L, loop, GET_WATCHER_DATA(chan), 1);
+    ev_io_stop(loop, &chan->io);
+
+    return 0;
+}
+
+/**
+ * Starts the fdchannel so it will be called by the specified event
+ * loop for received messages.  Sending does not need it started.
+ *
+ * Usage:
+ *     fdchannel:start(loop [, is_daemon])
+ *
+ * [+0, -0, e]
+ */
+static int fdchannel_start(lua_State *L) {
+    lua_ev_fdchannel* chan = check_fdchannel(L, 1);
+    struct ev_loop*   loop = *check_loop_and_init(L, 2);
+    int is_daemon          = lua_toboolean(L, 3);
+
+    if ( chan->io.fd < 0 ) return luaL_error(L, "fdchannel is closed");
+
+    ev_io_start(loop, &chan->io);
+    loop_start_watcher(L, loop, GET_WATCHER_DATA(chan), 2, 1, is_daemon);
+
+    return 0;
+}
+
+/**
+ * Returns the socket.
+ *
+ * Usage:
+ *     fd = fdchannel:getfd()
+ *
+ * [+1, -0, e]
+ */
+static int fdchannel_getfd(lua_State *L) {
+    lua_ev_fdchannel* chan = check_fdchannel(L, 1);
+
+    lua_pushinteger(L, chan->io.fd);
+    return 1;
+}
+
+/**
+ * Close the socket now rather than when the fdchannel is garbage
+ * collected.  The fdchannel must be stopped.
+ *
+ * Usage:
+ *     fdchannel:close()
+ *
+ * [+0, -0, e]
+ */
+static int fdchannel_close(lua_State *L) {
+    lua_ev_fdchannel* chan = check_fdchannel(L, 1);
+
+    if ( ev_is_active(&chan->io) ) return luaL_error(L, "fdchannel is started");
+    return fdchannel_gc(L);
+}
+
+/**
+ * Close the socket.
+ *
+ * [+0, -0, -]
+ */
+static int fdchannel_gc(lua_State *L) {
+    lua_ev_fdchannel* chan = check_fdchannel(L, 1);
+
+    if ( chan->io.fd >= 0 ) close(chan->io.fd);
+    chan->io.fd = -1;
+    return 0;
+}
+
+#endif /* __linux__ */
+
+/* vi:set expandtab ts=4: */
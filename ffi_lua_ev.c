@@ -0,0 +1,255 @@
+#include <stdlib.h>
+
+/* release parked watchers at least this often... */
+#define FFI_SWEEP_INTERVAL 1.0
+/* ...or once this many are waiting. */
+#define FFI_SWEEP_MAX      256
+
+/**
+ * Functions exported for the LuaJIT FFI (see ev_ffi.lua).  They take
+ * the userdata of the loop and of the watcher (which the FFI passes
+ * as a pointer to the payload) and never call into lua, so JIT
+ * compiled code stays compiled.  Anything needing the lua API (the
+ * first start of a watcher, daemon watchers, watcher types without a
+ * fast path) makes them return 0, and ev_ffi.lua then calls the
+ * regular method instead.
+ *
+ * Stopping a watcher normally releases the registry reference which
+ * keeps it from being collected, which can't be done here.  So
+ * lua_ev_ffi_stop() "parks" the watcher instead: it stays registered
+ * with the loop, and a restart is just a call into libev.  A prepare
+ * watcher releases parked watchers which are still stopped every
+ * FFI_SWEEP_INTERVAL seconds.
+ */
+typedef struct ffi_parked {
+    void* ud;
+    int   ref;
+} ffi_parked;
+
+struct lua_ev_ffi {
+    ev_prepare  sweep;
+    ffi_parked* parked;
+    int         num_parked;
+    int         max_parked;
+    ev_tstamp   last_sweep;
+};
+
+typedef void (*ffi_cb)(struct ev_loop*, ev_watcher*, int);
+
+static ev_watcher* ffi_watcher(void* ud) {
+    return (ev_watcher*)((char*)ud + WATCHER_DATA_SIZE);
+}
+
+/**
+ * Returns 1 if the watcher is started in this loop through the lua
+ * API, so only libev needs to be told.
+ */
+static int ffi_registered(lua_ev_loop* loop, lua_ev_watcher_data* wdata) {
+    return wdata->loop == loop && ! ( wdata->flags & WATCHER_FLAG_IS_DAEMON );
+}
+
+/**
+ * loop:now(), or -1 if the default loop is not initialized yet.
+ */
+LUALIB_API double lua_ev_ffi_now(lua_ev_loop* loop) {
+    if ( UNINITIALIZED_DEFAULT_LOOP == loop->loop ) return -1;
+    return ev_now(loop->loop);
+}
+
+LUALIB_API int lua_ev_ffi_is_active(void* ud) {
+    return ev_is_active(ffi_watcher(ud));
+}
+
+LUALIB_API int lua_ev_ffi_is_pending(void* ud) {
+    return ev_is_pending(ffi_watcher(ud));
+}
+
+/**
+ * Start or stop the watcher in libev, returns 0 if the watcher type
+ * has no fast path.
+ */
+static int ffi_start_stop(struct ev_loop* loop, ev_watcher* w, int start) {
+    if ( ev_cb(w) == (ffi_cb)&io_cb ) {
+        if ( start ) ev_io_start(loop, (ev_io*)w);
+        else         ev_io_stop(loop, (ev_io*)w);
+    } else if ( ev_cb(w) == (ffi_cb)&timer_cb ) {
+        if ( start ) ev_timer_start(loop, (ev_timer*)w);
+        else         ev_timer_stop(loop, (ev_timer*)w);
+    } else if ( ev_cb(w) == (ffi_cb)&idle_cb ) {
+        if ( start ) ev_idle_start(loop, (ev_idle*)w);
+        else         ev_idle_stop(loop, (ev_idle*)w);
+    } else if ( ev_cb(w) == (ffi_cb)&signal_cb ) {
+        if ( start ) ev_signal_start(loop, (ev_signal*)w);
+        else         ev_signal_stop(loop, (ev_signal*)w);
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * watcher:start(loop) for a watcher which was already started in
+ * this loop with watcher:start() and later stopped with
+ * lua_ev_ffi_stop().
+ */
+LUALIB_API int lua_ev_ffi_start(lua_ev_loop* loop, void* ud) {
+    lua_ev_watcher_data* wdata = ud;
+
+    if ( ! ffi_registered(loop, wdata) ) return 0;
+    if ( NULL != loop->mem ) mem_owner = loop->mem;
+    if ( ! ffi_start_stop(loop->loop, ffi_watcher(ud), 1) ) return 0;
+    wdata->flags &= ~WATCHER_FLAG_PARKED;
+    return 1;
+}
+
+/**
+ * watcher:stop(loop), but the watcher is parked instead of released.
+ */
+LUALIB_API int lua_ev_ffi_stop(lua_ev_loop* loop, void* ud) {
+    lua_ev_watcher_data* wdata = ud;
+    ev_watcher*          w     = ffi_watcher(ud);
+
+    if ( ! ffi_registered(loop, wdata) ) return 0;
+    if ( ev_cb(w) != (ffi_cb)&io_cb    && ev_cb(w) != (ffi_cb)&timer_cb &&
+         ev_cb(w) != (ffi_cb)&idle_cb  && ev_cb(w) != (ffi_cb)&signal_cb ) return 0;
+    if ( ffi_park(loop, wdata) ) return 0;
+    ffi_start_stop(loop->loop, w, 0);
+    wdata->flags |= WATCHER_FLAG_PARKED;
+    return 1;
+}
+
+/**
+ * timer:again(loop) for a timer started in this loop.
+ */
+LUALIB_API int lua_ev_ffi_again(lua_ev_loop* loop, void* ud) {
+    lua_ev_watcher_data* wdata = ud;
+    ev_timer*            timer = (ev_timer*)ffi_watcher(ud);
+
+    if ( ev_cb(ffi_watcher(ud)) != (ffi_cb)&timer_cb || ! ffi_registered(loop, wdata) ) return 0;
+    if ( ! timer->repeat ) return lua_ev_ffi_stop(loop, ud);
+
+    if ( NULL != loop->mem ) mem_owner = loop->mem;
+    ev_timer_again(loop->loop, timer);
+    wdata->flags &= ~WATCHER_FLAG_PARKED;
+    return 1;
+}
+
+/**
+ * Changes after and repeat of a timer, restarting it if it is
+ * active.
+ */
+LUALIB_API int lua_ev_ffi_timer_set(void* ud, double after, double repeat) {
+    ev_timer*       timer = (ev_timer*)ffi_watcher(ud);
+    struct ev_loop* loop;
+
+    if ( ev_cb(ffi_watcher(ud)) != (ffi_cb)&timer_cb || after < 0 || repeat < 0 ) return 0;
+    /* active watchers are always registered. */
+    loop = watcher_active_loop(timer);
+    if ( loop ) ev_timer_stop(loop, timer);
+    ev_timer_set(timer, after, repeat);
+    if ( loop ) ev_timer_start(loop, timer);
+    return 1;
+}
+
+/**
+ * Changes fd and events of an io watcher, restarting it if it is
+ * active.
+ */
+LUALIB_API int lua_ev_ffi_io_set(void* ud, int fd, int events) {
+    ev_io*          io = (ev_io*)ffi_watcher(ud);
+    struct ev_loop* loop;
+
+    if ( ev_cb(ffi_watcher(ud)) != (ffi_cb)&io_cb || fd < 0 ) return 0;
+    loop = watcher_active_loop(io);
+    if ( loop ) ev_io_stop(loop, io);
+    ev_io_set(io, fd, events);
+    if ( loop ) ev_io_start(loop, io);
+    return 1;
+}
+
+/**
+ * Remember a watcher which is about to be parked so the sweep can
+ * release it, returns non-zero if that is not possible.
+ */
+static int ffi_park(lua_ev_loop* loop, lua_ev_watcher_data* wdata) {
+    lua_ev_ffi* ffi = loop->ffi;
+
+    if ( wdata->flags & WATCHER_FLAG_PARK_LISTED ) return 0;
+
+    if ( NULL == ffi ) {
+        ffi = calloc(1, sizeof(lua_ev_ffi));
+        if ( NULL == ffi ) return -1;
+        ev_prepare_init(&ffi->sweep, &ffi_sweep_cb);
+        ev_prepare_start(loop->loop, &ffi->sweep);
+        ev_unref(loop->loop);
+        ffi->last_sweep = ev_now(loop->loop);
+        loop->ffi = ffi;
+    }
+    if ( ffi->num_parked == ffi->max_parked ) {
+        int         max    = ffi->max_parked ? ffi->max_parked * 2 : 16;
+        ffi_parked* parked = realloc(ffi->parked, max * sizeof(ffi_parked));
+        if ( NULL == parked ) return -1;
+        ffi->parked     = parked;
+        ffi->max_parked = max;
+    }
+    ffi->parked[ffi->num_parked].ud  = wdata;
+    ffi->parked[ffi->num_parked].ref = wdata->watcher_ref;
+    ffi->num_parked++;
+    wdata->flags |= WATCHER_FLAG_PARK_LISTED;
+    return 0;
+}
+
+/**
+ * Release the parked watchers which were not started again, as
+ * watcher:stop() would have done.
+ *
+ * [+0, -0, m]
+ */
+static void ffi_sweep_cb(struct ev_loop* loop, ev_prepare* prepare, int revents) {
+    lua_ev_ffi* ffi = (lua_ev_ffi*)prepare;
+    lua_State*  L   = ev_userdata(loop);
+    int         i;
+
+    if ( ffi->num_parked < FFI_SWEEP_MAX &&
+         ev_now(loop) - ffi->last_sweep < FFI_SWEEP_INTERVAL ) return;
+    ffi->last_sweep = ev_now(loop);
+    if ( NULL == L || ! lua_checkstack(L, 4) ) return;
+
+    for ( i = 0; i < ffi->num_parked; i++ ) {
+        lua_ev_watcher_data* wdata = ffi->parked[i].ud;
+
+        /* the reference may have been released and reused since, or
+         * the watcher moved to another loop. */
+        lua_rawgeti(L, LUA_REGISTRYINDEX, ffi->parked[i].ref);
+        if ( lua_touserdata(L, -1) == wdata &&
+             NULL != wdata->loop && wdata->loop->loop == loop )
+        {
+            wdata->flags &= ~WATCHER_FLAG_PARK_LISTED;
+            if ( ( wdata->flags & WATCHER_FLAG_PARKED ) &&
+                 ! ev_is_active(ffi_watcher(wdata)) )
+            {
+                loop_stop_watcher(L, loop, wdata, lua_gettop(L));
+            }
+        }
+        lua_pop(L, 1);
+    }
+    ffi->num_parked = 0;
+}
+
+/**
+ * Called by the loop __gc.
+ *
+ * [+0, -0, -]
+ */
+static void ffi_free(struct ev_loop* loop, lua_ev_loop* lloop) {
+    lua_ev_ffi* ffi = lloop->ffi;
+
+    if ( NULL == ffi ) return;
+    lloop->ffi = NULL;
+    ev_ref(loop);
+    ev_prepare_stop(loop, &ffi->sweep);
+    free(ffi->parked);
+    free(ffi);
+}
+
+/* vi:set expandtab ts=4: */
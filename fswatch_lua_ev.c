@@ -0,0 +1,500 @@
+#ifdef __linux__
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+/**
+ * Events we ask inotify for on every directory in the tree.
+ */
+#define FSWATCH_MASK (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | \
+                      IN_CREATE | IN_DELETE | IN_DELETE_SELF | \
+                      IN_MOVED_FROM | IN_MOVED_TO | IN_MOVE_SELF)
+
+typedef struct fswatch_event {
+    char*    path;
+    uint32_t mask;
+} fswatch_event;
+
+/**
+ * The io watcher must be the first member, since that is what
+ * watcher_cb() and GET_WATCHER_DATA() operate on.
+ */
+struct lua_ev_fswatch {
+    ev_io          io;
+    ev_timer       debounce;
+    ev_tstamp      delay;
+    char*          root;
+    /* wd -> directory path */
+    char**         dirs;
+    int            max_dirs;
+    /* coalesced events waiting to be delivered to lua. */
+    fswatch_event* events;
+    int            num_events;
+    int            max_events;
+    /* open addressed index into events, keyed by path. */
+    int*           index;
+    int            index_size;
+};
+
+/**
+ * Create a table for ev.FSWatch that gives access to the constructor
+ * for fswatch objects and the inotify mask constants.
+ *
+ * [-0, +1, ?]
+ */
+static int luaopen_ev_fswatch(lua_State *L) {
+    lua_pop(L, create_fswatch_mt(L));
+
+    lua_createtable(L, 0, 12);
+
+    lua_pushcfunction(L, fswatch_new);
+    lua_setfield(L, -2, "new");
+
+#define CONSTANT(def, name) do { \
+    lua_pushinteger(L, def); \
+    lua_setfield(L, -2, name); \
+} while(0);
+
+    CONSTANT(IN_MODIFY,      "MODIFY");
+    CONSTANT(IN_ATTRIB,      "ATTRIB");
+    CONSTANT(IN_CLOSE_WRITE, "CLOSE_WRITE");
+    CONSTANT(IN_CREATE,      "CREATE");
+    CONSTANT(IN_DELETE,      "DELETE");
+    CONSTANT(IN_DELETE_SELF, "DELETE_SELF");
+    CONSTANT(IN_MOVED_FROM,  "MOVED_FROM");
+    CONSTANT(IN_MOVED_TO,    "MOVED_TO");
+    CONSTANT(IN_MOVE_SELF,   "MOVE_SELF");
+    CONSTANT(IN_ISDIR,       "ISDIR");
+    CONSTANT(IN_Q_OVERFLOW,  "OVERFLOW");
+#undef CONSTANT
+
+    return 1;
+}
+
+/**
+ * Create the fswatch metatable in the registry.
+ *
+ * [-0, +1, ?]
+ */
+static int create_fswatch_mt(lua_State *L) {
+
+    static luaL_reg methods[] = {
+        { "stop",          fswatch_stop },
+        { "start",         fswatch_start },
+        { "getpath",       fswatch_getpath },
+        { NULL, NULL }
+    };
+    add_watcher_mt(L, methods, FSWATCH_MT);
+
+    /* release the inotify fd and buffers. */
+    lua_pushcfunction(L, fswatch_gc);
+    lua_setfield(L, -2, "__gc");
+    return 1;
+}
+
+/**
+ * FNV-1a, used to coalesce events on the same path.
+ */
+static unsigned int fswatch_hash(const char* str) {
+    unsigned int hash = 2166136261u;
+    while ( *str ) {
+        hash ^= (unsigned char)*str++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Rebuild the path index so that it is at most half full.
+ */
+static int fswatch_reindex(lua_ev_fswatch* fs, int size) {
+    int* index = malloc(size * sizeof(int));
+    int  i;
+
+    if ( NULL == index ) return -1;
+    for ( i = 0; i < size; i++ ) index[i] = -1;
+    for ( i = 0; i < fs->num_events; i++ ) {
+        unsigned int slot = fswatch_hash(fs->events[i].path) & (size - 1);
+        while ( index[slot] != -1 ) slot = (slot + 1) & (size - 1);
+        index[slot] = i;
+    }
+    free(fs->index);
+    fs->index      = index;
+    fs->index_size = size;
+    return 0;
+}
+
+/**
+ * Record an event for path, or-ing mask into any event already
+ * recorded for that path since the last delivery.  Takes ownership
+ * of path.
+ */
+static void fswatch_record(lua_ev_fswatch* fs, char* path, uint32_t mask) {
+    unsigned int slot;
+
+    if ( NULL == path ) return;
+
+    if ( fs->num_events * 2 >= fs->index_size &&
+         fswatch_reindex(fs, fs->index_size ? fs->index_size * 2 : 64) != 0 )
+    {
+        free(path);
+        return;
+    }
+
+    slot = fswatch_hash(path) & (fs->index_size - 1);
+    while ( fs->index[slot] != -1 ) {
+        fswatch_event* event = &fs->events[fs->index[slot]];
+        if ( strcmp(event->path, path) == 0 ) {
+            event->mask |= mask;
+            free(path);
+            return;
+        }
+        slot = (slot + 1) & (fs->index_size - 1);
+    }
+
+    if ( fs->num_events == fs->max_events ) {
+        int            max    = fs->max_events ? fs->max_events * 2 : 32;
+        fswatch_event* events = realloc(fs->events, max * sizeof(fswatch_event));
+        if ( NULL == events ) {
+            free(path);
+            return;
+        }
+        fs->events     = events;
+        fs->max_events = max;
+    }
+    fs->events[fs->num_events].path = path;
+    fs->events[fs->num_events].mask = mask;
+    fs->index[slot] = fs->num_events++;
+}
+
+static char* fswatch_join(const char* dir, const char* name) {
+    size_t dir_len  = strlen(dir);
+    size_t name_len = strlen(name);
+    char*  path     = malloc(dir_len + name_len + 2);
+
+    if ( NULL == path ) return NULL;
+    memcpy(path, dir, dir_len);
+    if ( name_len ) {
+        path[dir_len++] = '/';
+        memcpy(path + dir_len, name, name_len);
+    }
+    path[dir_len + name_len] = '\0';
+    return path;
+}
+
+/**
+ * Register inotify watches on dir and every directory beneath it.
+ * If report is true, every entry found is recorded as IN_CREATE (used
+ * for directories created after the watcher so that files created
+ * before the watch was in place are not lost).
+ *
+ * Returns 0 on success, otherwise -1 with errno set.
+ */
+static int fswatch_add_tree(lua_ev_fswatch* fs, const char* dir, int report) {
+    int            wd;
+    DIR*           dh;
+    struct dirent* ent;
+
+    wd = inotify_add_watch(fs->io.fd, dir, FSWATCH_MASK | IN_ONLYDIR | IN_DONT_FOLLOW);
+    if ( wd < 0 ) return -1;
+
+    if ( wd >= fs->max_dirs ) {
+        int    max  = wd * 2 + 16;
+        char** dirs = realloc(fs->dirs, max * sizeof(char*));
+        if ( NULL == dirs ) {
+            inotify_rm_watch(fs->io.fd, wd);
+            errno = ENOMEM;
+            return -1;
+        }
+        memset(dirs + fs->max_dirs, 0, (max - fs->max_dirs) * sizeof(char*));
+        fs->dirs     = dirs;
+        fs->max_dirs = max;
+    }
+    free(fs->dirs[wd]);
+    fs->dirs[wd] = strdup(dir);
+
+    dh = opendir(dir);
+    if ( NULL == dh ) return 0; /* removed already, IN_IGNORED will follow. */
+
+    while ( NULL != (ent = readdir(dh)) ) {
+        char* path;
+        int   is_dir;
+
+        if ( strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0 ) continue;
+
+        path = fswatch_join(dir, ent->d_name);
+        if ( NULL == path ) continue;
+
+        is_dir = ent->d_type == DT_DIR;
+        if ( ent->d_type == DT_UNKNOWN ) {
+            struct stat st;
+            is_dir = lstat(path, &st) == 0 && S_ISDIR(st.st_mode);
+        }
+
+        if ( is_dir && fswatch_add_tree(fs, path, report) != 0 && !report ) {
+            int err = errno;
+            free(path);
+            closedir(dh);
+            errno = err;
+            return -1;
+        }
+        if ( report ) {
+            fswatch_record(fs, path, IN_CREATE | (is_dir ? IN_ISDIR : 0));
+        } else {
+            free(path);
+        }
+    }
+    closedir(dh);
+    return 0;
+}
+
+/**
+ * Create a new fswatch object.  Arguments:
+ *   1 - callback function.
+ *   2 - path of the directory tree to watch.
+ *   3 - debounce (number of seconds to coalesce events before calling
+ *       the callback, defaults to 0 which means one call per wakeup).
+ *   4 - optional context, see watcher:context()
+ *
+ * @see watcher_new()
+ *
+ * [+1, -0, ?]
+ */
+static int fswatch_new(lua_State* L) {
+    const char*      path     = luaL_checkstring(L, 2);
+    ev_tstamp        debounce = luaL_optnumber(L, 3, 0);
+    int              fd;
+    lua_ev_fswatch*  fs;
+
+    if ( debounce < 0.0 )
+        luaL_argerror(L, 3, "debounce must be greater than or equal to 0");
+
+    fs = (lua_ev_fswatch*)watcher_new(L, sizeof(lua_ev_fswatch), FSWATCH_MT);
+    watcher_new_context(L, 4);
+    memset(fs, 0, sizeof(lua_ev_fswatch));
+    ev_io_init(&fs->io, &fswatch_io_cb, -1, EV_READ);
+    ev_timer_init(&fs->debounce, &fswatch_timer_cb, debounce, 0);
+    fs->delay = debounce;
+
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if ( fd < 0 ) {
+        return luaL_error(L, "inotify_init1: %s", strerror(errno));
+    }
+    ev_io_set(&fs->io, fd, EV_READ);
+
+    fs->root = strdup(path);
+    if ( NULL == fs->root ) {
+        return luaL_error(L, "out of memory");
+    }
+    if ( fswatch_add_tree(fs, path, 0) != 0 ) {
+        return luaL_error(L, "unable to watch '%s': %s%s", path, strerror(errno),
+                          errno == ENOSPC ?
+                          " (see /proc/sys/fs/inotify/max_user_watches)" : "");
+    }
+    return 1;
+}
+
+/**
+ * Drain the inotify fd, coalescing the events by path.  If debounce
+ * is zero the batch is delivered right away, otherwise the first
+ * event starts the debounce timer and the batch is delivered when it
+ * expires.
+ *
+ * [+0, -0, m]
+ */
+static void fswatch_io_cb(struct ev_loop* loop, ev_io* io, int revents) {
+    lua_ev_fswatch* fs = (lua_ev_fswatch*)io;
+    char            buf[16384]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+    for (;;) {
+        ssize_t len = read(io->fd, buf, sizeof(buf));
+        char*   ptr;
+
+        if ( len <= 0 ) break;
+
+        for ( ptr = buf; ptr < buf + len; ) {
+            const struct inotify_event* ev = (const struct inotify_event*)ptr;
+            const char*                 dir;
+
+            ptr += sizeof(struct inotify_event) + ev->len;
+
+            if ( ev->mask & IN_Q_OVERFLOW ) {
+                fswatch_record(fs, strdup(fs->root), IN_Q_OVERFLOW);
+                continue;
+            }
+            if ( ev->wd < 0 || ev->wd >= fs->max_dirs ||
+                 NULL == (dir = fs->dirs[ev->wd]) ) continue;
+
+            if ( ev->mask & IN_IGNORED ) {
+                /* watch was removed (directory deleted or unmounted). */
+                free(fs->dirs[ev->wd]);
+                fs->dirs[ev->wd] = NULL;
+                continue;
+            }
+
+            if ( ev->len ) {
+                char* path = fswatch_join(dir, ev->name);
+
+                if ( NULL != path &&
+                     ( ev->mask & IN_ISDIR ) &&
+                     ( ev->mask & (IN_CREATE | IN_MOVED_TO) ) &&
+                     fswatch_add_tree(fs, path, 1) != 0 )
+                {
+                    /* out of watches: tell lua this sub-tree is blind. */
+                    fswatch_record(fs, strdup(path), IN_Q_OVERFLOW);
+                }
+                fswatch_record(fs, path, ev->mask & ~IN_IGNORED);
+            } else {
+                fswatch_record(fs, strdup(dir), ev->mask);
+            }
+        }
+    }
+
+    if ( 0 == fs->num_events ) return;
+
+    if ( fs->delay > 0.0 ) {
+        if ( ! ev_is_active(&fs->debounce) ) {
+            ev_timer_set(&fs->debounce, fs->delay, 0);
+            ev_timer_start(loop, &fs->debounce);
+        }
+        return;
+    }
+    watcher_cb_args(loop, io, revents, &fswatch_push_events);
+}
+
+/**
+ * The debounce window expired, deliver the batch.
+ *
+ * [+0, -0, m]
+ */
+static void fswatch_timer_cb(struct ev_loop* loop, ev_timer* timer, int revents) {
+    lua_ev_fswatch* fs = (lua_ev_fswatch*)
+        (((char*)timer) - offsetof(lua_ev_fswatch, debounce));
+
+    if ( 0 == fs->num_events ) return;
+    watcher_cb_args(loop, &fs->io, EV_READ, &fswatch_push_events);
+}
+
+/**
+ * Push the batch of events as a table of path => mask and reset the
+ * batch.
+ *
+ * @see watcher_cb_args()
+ *
+ * [-0, +1, m]
+ */
+static int fswatch_push_events(lua_State *L, void *watcher) {
+    lua_ev_fswatch* fs = (lua_ev_fswatch*)watcher;
+    int             i;
+
+    lua_createtable(L, 0, fs->num_events);
+    for ( i = 0; i < fs->num_events; i++ ) {
+        lua_pushinteger(L, fs->events[i].mask);
+        lua_setfield(L, -2, fs->events[i].path);
+        free(fs->events[i].path);
+    }
+    fs->num_events = 0;
+    for ( i = 0; i < fs->index_size; i++ ) fs->index[i] = -1;
+    return 1;
+}
+
+/**
+ * Stops the fswatch so it won't be called by the specified event
+ * loop.  Events that were already read are kept and delivered by the
+ * next start() (after the debounce delay).
+ *
+ * Usage:
+ *     fswatch:stop(loop)
+ *
+ * [+0, -0, e]
+ */
+static int fswatch_stop(lua_State *L) {
+    lua_ev_fswatch* fs   = check_fswatch(L, 1);
+    struct ev_loop* loop = *check_loop_and_init(L, 2);
+
+    loop_stop_watcher(L, loop, GET_WATCHER_DATA(fs), 1);
+    ev_io_stop(loop, &fs->io);
+    ev_timer_stop(loop, &fs->debounce);
+
+    return 0;
+}
+
+/**
+ * Starts the fswatch so it will be called by the specified event loop.
+ *
+ * Usage:
+ *     fswatch:start(loop [, is_daemon])
+ *
+ * [+0, -0, e]
+ */
+static int fswatch_start(lua_State *L) {
+    lua_ev_fswatch* fs   = check_fswatch(L, 1);
+    struct ev_loop* loop = *check_loop_and_init(L, 2);
+    int is_daemon        = lua_toboolean(L, 3);
+
+    ev_io_start(loop, &fs->io);
+    /* deliver the events kept by stop() without waiting for more. */
+    if ( fs->num_events > 0 && ! ev_is_active(&fs->debounce) ) {
+        ev_timer_set(&fs->debounce, fs->delay, 0);
+        ev_timer_start(loop, &fs->debounce);
+    }
+    loop_start_watcher(L, loop, GET_WATCHER_DATA(fs), 2, 1, is_daemon);
+
+    return 0;
+}
+
+/**
+ * Returns the root path of the watched directory tree.
+ *
+ * Usage:
+ *     path = fswatch:getpath()
+ *
+ * [+1, -0, e]
+ */
+static int fswatch_getpath(lua_State *L) {
+    lua_ev_fswatch* fs = check_fswatch(L, 1);
+
+    lua_pushstring(L, fs->root);
+    return 1;
+}
+
+/**
+ * Close the inotify fd and free the directory table and any events
+ * that were never delivered.
+ *
+ * [+0, -0, -]
+ */
+static int fswatch_gc(lua_State *L) {
+    lua_ev_fswatch* fs = check_fswatch(L, 1);
+    int             i;
+
+    if ( fs->io.fd >= 0 ) close(fs->io.fd);
+    fs->io.fd = -1;
+
+    for ( i = 0; i < fs->max_dirs; i++ ) free(fs->dirs[i]);
+    for ( i = 0; i < fs->num_events; i++ ) free(fs->events[i].path);
+    free(fs->dirs);
+    free(fs->events);
+    free(fs->index);
+    free(fs->root);
+    fs->dirs       = NULL;
+    fs->events     = NULL;
+    fs->index      = NULL;
+    fs->root       = NULL;
+    fs->max_dirs   = 0;
+    fs->num_events = 0;
+    fs->index_size = 0;
+    return 0;
+}
+
+#endif /* __linux__ */
+
+/* vi:set expandtab ts=4: */
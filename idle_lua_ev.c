@@ -33,6 +33,7 @@ static int create_idle_mt(lua_State *L) {
 /**
  * Create a new idle object.  Arguments:
  *   1 - callback function.
+ *   2 - optional context, see watcher:context()
  *
  * @see watcher_new()
  *
@@ -42,6 +43,7 @@ static int idle_new(lua_State* L) {
     ev_idle*  idle;
 
     idle = (ev_idle*)watcher_new(L, sizeof(ev_idle), IDLE_MT);
+    watcher_new_context(L, 2);
     ev_idle_init(idle, &idle_cb);
     return 1;
 }
@@ -26,6 +26,8 @@ static int create_io_mt(lua_State *L) {
         { "stop",          io_stop },
         { "start",         io_start },
         { "getfd" ,        io_getfd },
+        { "set",           io_set },
+        { "modify",        io_modify },
         { NULL, NULL }
     };
     return add_watcher_mt(L, methods, IO_MT);
@@ -36,6 +38,7 @@ static int create_io_mt(lua_State *L) {
  *   1 - callback function.
  *   2 - fd (file descriptor number)
  *   3 - READ | WRITE (what operation to watch)
+ *   4 - optional context, see watcher:context()
  *
  * @see watcher_new()
  *
@@ -47,6 +50,7 @@ static int io_new(lua_State* L) {
     ev_io*  io;
 
     io = (ev_io*)watcher_new(L, sizeof(ev_io), IO_MT);
+    watcher_new_context(L, 4);
     ev_io_init(io, &io_cb, fd, events);
     return 1;
 }
@@ -112,4 +116,53 @@ static int io_getfd(lua_State *L) {
     return 1;
 }
 
+/**
+ * Changes the fd and events, restarting the io if it is active.
+ *
+ * Usage:
+ *     io:set(fd, events)
+ *
+ * [+0, -0, e]
+ */
+static int io_set(lua_State *L) {
+    ev_io*          io     = check_io(L, 1);
+    int             fd     = luaL_checkint(L, 2);
+    int             events = luaL_checkint(L, 3);
+    struct ev_loop* loop   = watcher_active_loop(io);
+
+    if ( loop ) ev_io_stop(loop, io);
+    ev_io_set(io, fd, events);
+    if ( loop ) ev_io_start(loop, io);
+
+    return 0;
+}
+
+/**
+ * Changes only the events of the io, restarting it if it is active.
+ * Cheaper than io:set() since libev may assume the fd still refers
+ * to the same file (needs libev 4.27, otherwise the same as
+ * io:set(io:getfd(), events)).
+ *
+ * Usage:
+ *     io:modify(events)
+ *
+ * [+0, -0, e]
+ */
+static int io_modify(lua_State *L) {
+    ev_io*          io     = check_io(L, 1);
+    int             events = luaL_checkint(L, 2);
+    struct ev_loop* loop   = watcher_active_loop(io);
+
+    if ( loop ) ev_io_stop(loop, io);
+#ifdef ev_io_modify
+    /* ev_io_modify() spelled out, its macro trips -Wparentheses. */
+    io->events = ( io->events & EV__IOFDSET ) | events;
+#else
+    ev_io_set(io, io->fd, events);
+#endif
+    if ( loop ) ev_io_start(loop, io);
+
+    return 0;
+}
+
 /* vi:set expandtab ts=4: */
@@ -1,3 +1,7 @@
+#include <stdlib.h>
+
+static char default_loop_key[] = "LUA_EV_DEFAULT_LOOP_KEY";
+
 /**
  * Create a table for ev.Loop that gives access to the constructor for
  * loop objects and the "default" event loop object instance.
@@ -13,11 +17,28 @@ static int luaopen_ev_loop(lua_State *L) {
     lua_setfield(L, -2, "new");
 
     *loop_alloc(L) = UNINITIALIZED_DEFAULT_LOOP;
+
+    /* registry[<default_loop_key>] = default loop */
+    lua_pushlightuserdata(L, default_loop_key);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
     lua_setfield(L, -2, "default");
 
     return 1;
 }
 
+/**
+ * Push the ev.Loop.default object, for C functions that need a loop
+ * when none was passed in.
+ *
+ * [-0, +1, -]
+ */
+static void push_default_loop(lua_State *L) {
+    lua_pushlightuserdata(L, default_loop_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+}
+
 /**
  * Create the loop metatable in the registry.
  *
@@ -35,6 +56,21 @@ static int create_loop_mt(lua_State *L) {
         { "break",      loop_break },
         { "backend",    loop_backend },
         { "fork",       loop_fork },
+        { "pick_hot",   loop_pick_hot },
+        { "slack_stats", loop_slack_stats },
+        { "feed_signal_event", loop_feed_signal_event },
+        { "on_error",   loop_on_error },
+        { "error_counts", loop_error_counts },
+        { "probe_latency", probe_latency },
+        { "trace_start", loop_trace_start },
+        { "trace_stop", loop_trace_stop },
+        { "trace_dump", loop_trace_dump },
+        { "memory",     loop_memory },
+        { "once",       loop_once },
+#ifndef _WIN32
+        { "watchdog_start", loop_watchdog_start },
+        { "watchdog_stop", loop_watchdog_stop },
+#endif
         /* older 3.x method names. */
         { "count",      loop_iteration },
         { "loop",       loop_run },
@@ -45,7 +81,7 @@ static int create_loop_mt(lua_State *L) {
 
     /* create methods table. */
     lua_createtable(L, 0, 10);
-    luaL_register(L, NULL, methods);
+    lua_ev_setfuncs(L, methods);
 
     lua_setfield(L, -2, "__index");
 
@@ -61,18 +97,30 @@ static int create_loop_mt(lua_State *L) {
 
 /**
  * Create a table intended as the loop object, sets the metatable,
- * registers it, creates the evlua_loop struct appropriately, and sets
- * the userdata fenv to an empty table.  This table is used to store
- * references to active watchers so the garbage collector does not
- * prematurely collect the watchers.
+ * registers it, creates the lua_ev_loop struct appropriately, and
+ * creates the slots which store the error handler and error counts of
+ * the loop.
  *
  * [-0, +1, v]
  */
 static struct ev_loop** loop_alloc(lua_State *L) {
-    struct ev_loop** loop = (struct ev_loop**)
-        obj_new(L, sizeof(struct ev_loop*), LOOP_MT);
-
-    return loop;
+    lua_ev_loop* loop = (lua_ev_loop*)
+        obj_new(L, sizeof(lua_ev_loop), LOOP_MT, LOOP_SLOTS);
+
+    loop->loop         = NULL;
+    loop->max_failures = 0;
+    loop->tracer       = NULL;
+    loop->watchdog     = NULL;
+    loop->mem          = NULL;
+    loop->ffi          = NULL;
+    loop->once         = NULL;
+    loop->picked       = 0;
+    loop->slack_at     = 0;
+    loop->slack_fired  = 0;
+    loop->slack_coalesced = 0;
+    loop->slack_iteration = 0;
+
+    return &loop->loop;
 }
 
 /**
@@ -82,16 +130,20 @@ static struct ev_loop** loop_alloc(lua_State *L) {
  * the ev_loop object is returned.
  */
 static struct ev_loop** check_loop_and_init(lua_State *L, int loop_i) {
-    struct ev_loop** loop_r = check_loop(L, loop_i);
-    if ( UNINITIALIZED_DEFAULT_LOOP == *loop_r ) {
-        *loop_r = ev_default_loop(EVFLAG_AUTO);
-        if ( NULL == *loop_r ) {
+    lua_ev_loop* loop = check_loop_data(L, loop_i);
+    if ( UNINITIALIZED_DEFAULT_LOOP == loop->loop ) {
+        mem_loop_init(loop);
+        loop->loop = ev_default_loop(EVFLAG_AUTO);
+        if ( NULL == loop->loop ) {
             luaL_error(L,
                        "libev init failed, perhaps LIBEV_FLAGS environment variable "
                        " is causing it to select a bad backend?");
         }
+        loop->picked = ev_now(loop->loop);
     }
-    return loop_r;
+    /* charge whatever libev allocates next to this loop. */
+    if ( NULL != loop->mem ) mem_owner = loop->mem;
+    return &loop->loop;
 }
 
 
@@ -107,7 +159,9 @@ static int loop_new(lua_State *L) {
     unsigned int flags = lua_isnumber(L, 1) ?
         lua_tointeger(L, 1) : EVFLAG_AUTO;
 
+    mem_loop_init(check_loop_data(L, -1));
     *loop_r = ev_loop_new(flags);
+    if ( NULL != *loop_r ) check_loop_data(L, -1)->picked = ev_now(*loop_r);
 
     return 1;
 }
@@ -118,10 +172,18 @@ static int loop_new(lua_State *L) {
 static int loop_delete(lua_State *L) {
     struct ev_loop* loop = *check_loop(L, 1);
 
-    if ( UNINITIALIZED_DEFAULT_LOOP == loop ||
-         ev_is_default_loop(loop)           ) return 0;
+    if ( UNINITIALIZED_DEFAULT_LOOP == loop ) return 0;
+
+    trace_free(loop, check_loop_data(L, 1));
+    ffi_free(loop, check_loop_data(L, 1));
+    once_free(check_loop_data(L, 1));
+#ifndef _WIN32
+    watchdog_free(L, check_loop_data(L, 1));
+#endif
+    if ( ev_is_default_loop(loop) ) return 0;
 
     ev_loop_destroy(loop);
+    mem_loop_free(check_loop_data(L, 1));
     return 0;
 }
 
@@ -135,13 +197,29 @@ static int loop_delete(lua_State *L) {
  * registered in the event loop, then use the current is_daemon value,
  * otherwise set is_daemon to false.
  *
+ * A watcher still registered with another loop (parked there by
+ * lua_ev_ffi_stop()) is released from that loop first.
+ *
  * [-0, +0, m]
  */
 static void loop_start_watcher(lua_State* L, struct ev_loop *loop, lua_ev_watcher_data* wdata, int loop_i, int watcher_i, int is_daemon) {
     int current_is_daemon = -1;
 
+    if ( wdata->watcher_ref != LUA_NOREF && wdata->loop != lua_touserdata(L, loop_i) ) {
+        if ( NULL != wdata->loop && (wdata->flags & WATCHER_FLAG_IS_DAEMON) ) {
+            ev_ref(wdata->loop->loop);
+        }
+        luaL_unref(L, LUA_REGISTRYINDEX, wdata->watcher_ref);
+        wdata->watcher_ref = LUA_NOREF;
+        wdata->loop = NULL;
+        /* the sweep of the old loop skips it from now on. */
+        wdata->flags &= ~(WATCHER_FLAG_PARK_LISTED | WATCHER_FLAG_IS_DAEMON);
+        if ( is_daemon == -1 ) is_daemon = 0;
+    }
+
     /* get current is_daemon flag for watcher. */
     current_is_daemon = ((wdata->flags & WATCHER_FLAG_IS_DAEMON) == WATCHER_FLAG_IS_DAEMON);
+    wdata->flags &= ~WATCHER_FLAG_PARKED;
 
     /* re-initialize watcher using the same is_daemon from the first initialization. */
     if ( is_daemon == -1 ) {
@@ -153,9 +231,9 @@ static void loop_start_watcher(lua_State* L, struct ev_loop *loop, lua_ev_watche
         /* initialize stopped watcher. */
         lua_pushvalue(L, watcher_i);
         wdata->watcher_ref = luaL_ref(L, LUA_REGISTRYINDEX);
-        lua_getfenv(L, watcher_i);
+        wdata->loop = lua_touserdata(L, loop_i);
         lua_pushvalue(L, loop_i);
-        lua_rawseti(L, -2, WATCHER_LOOP);
+        obj_setslot(L, watcher_i, WATCHER_LOOP);
         if ( is_daemon ) {
             /* unref() so that we are a "daemon" */
             ev_unref(loop);
@@ -163,7 +241,6 @@ static void loop_start_watcher(lua_State* L, struct ev_loop *loop, lua_ev_watche
         } else {
             wdata->flags &= ~WATCHER_FLAG_IS_DAEMON;
         }
-        lua_pop(L, 1); /* pop fenv. */
         return;
     }
 
@@ -199,14 +276,14 @@ static void loop_stop_watcher(lua_State* L, struct ev_loop *loop, lua_ev_watcher
     }
     luaL_unref(L, LUA_REGISTRYINDEX, wdata->watcher_ref);
     wdata->watcher_ref = LUA_NOREF;
-    lua_getfenv(L, watcher_i);
+    wdata->loop = NULL;
+    wdata->flags &= ~(WATCHER_FLAG_PARKED | WATCHER_FLAG_PARK_LISTED);
 
     if ((wdata->flags & WATCHER_FLAG_IS_DAEMON)) {
         ev_ref(loop);
     }
     lua_pushnil(L);
-    lua_rawseti(L, -2, WATCHER_LOOP);
-    lua_pop(L, 1); /* pop fenv. */
+    obj_setslot(L, watcher_i, WATCHER_LOOP);
 }
 
 /**
@@ -261,6 +338,23 @@ static int loop_update_now(lua_State *L) {
     return 1;
 }
 
+/**
+ * Feed a signal event into the loop as if the signal had been
+ * received, without involving the kernel.
+ *
+ * Usage:
+ *     loop:feed_signal_event(signum)
+ *
+ * [+0, -0, e]
+ */
+static int loop_feed_signal_event(lua_State *L) {
+    struct ev_loop* loop = *check_loop_and_init(L, 1);
+    int signum = luaL_checkint(L, 2);
+
+    ev_feed_signal_event(loop, signum);
+    return 0;
+}
+
 /**
  * Actually do the event loop.
  */
@@ -327,4 +421,143 @@ static int loop_fork(lua_State *L) {
     return 0;
 }
 
+/**
+ * An entry of the watchers passed to loop:pick_hot().
+ */
+typedef struct {
+    int watcher_i;
+    int events;
+} loop_hot_entry;
+
+/**
+ * Pick watchers to move to a less busy loop, see watcher:migrate().
+ * Of the watchers in the array which are started in this loop, the
+ * busiest ones are picked whose callbacks add up to at most share
+ * (default 0.5) of all callbacks of these watchers since the last
+ * call, or since they were started here.  A single watcher busier than
+ * that is not picked, moving it would just move the hot spot.  Resets
+ * the counts of these watchers, which saturate at 32767.
+ *
+ * Returns the array of picked watchers, busiest first, and the number
+ * of callbacks per second of all these watchers since the last call.
+ *
+ * Usage:
+ *   hot, rate = loop:pick_hot(watchers [, share])
+ *
+ * [+2, -0, e]
+ */
+static int loop_pick_hot(lua_State *L) {
+    lua_ev_loop*    lloop  = check_loop_data(L, 1);
+    struct ev_loop* loop   = *check_loop_and_init(L, 1);
+    double          share  = luaL_optnumber(L, 3, 0.5);
+    double          budget, elapsed;
+    loop_hot_entry* entries;
+    int             n, i, count = 0, total = 0, picked = 0, sum = 0;
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 3);
+    n = lua_objlen(L, 2);
+    entries = lua_newuserdata(L, (n ? n : 1) * sizeof(loop_hot_entry));
+
+    /* keep the watchers on the stack, entries refer to them. */
+    if ( ! lua_checkstack(L, n + 2) ) return luaL_error(L, "too many watchers");
+    for ( i = 1; i <= n; i++ ) {
+        lua_ev_watcher_data* wdata;
+
+        lua_rawgeti(L, 2, i);
+        wdata = GET_WATCHER_DATA(check_watcher(L, -1));
+        if ( wdata->loop != lloop ) {
+            lua_pop(L, 1);
+            continue;
+        }
+        entries[count].watcher_i = lua_gettop(L);
+        entries[count].events    = (wdata->flags & WATCHER_EVENTS_MASK) >> WATCHER_EVENTS_SHIFT;
+        total += entries[count].events;
+        wdata->flags &= ~WATCHER_EVENTS_MASK;
+        count++;
+    }
+    qsort(entries, count, sizeof(loop_hot_entry), &loop_pick_hot_cmp);
+
+    budget = share * total;
+    lua_createtable(L, count / 2, 0);
+    for ( i = 0; i < count && entries[i].events; i++ ) {
+        if ( sum + entries[i].events > budget ) continue;
+        sum += entries[i].events;
+        lua_pushvalue(L, entries[i].watcher_i);
+        lua_rawseti(L, -2, ++picked);
+    }
+
+    elapsed = ev_now(loop) - lloop->picked;
+    lloop->picked = ev_now(loop);
+    lua_pushnumber(L, elapsed > 0 ? total / elapsed : 0);
+    return 2;
+}
+
+/**
+ * qsort() comparator of loop:pick_hot(), busiest first.
+ */
+static int loop_pick_hot_cmp(const void* a, const void* b) {
+    return ((const loop_hot_entry*)b)->events - ((const loop_hot_entry*)a)->events;
+}
+
+/**
+ * Get/set the function called when a watcher callback raises an
+ * error.  The handler is called as handler(loop, watcher, err) where
+ * err is the error message with a traceback.  If max_failures is
+ * given, a watcher whose callback fails that many times in a row is
+ * stopped (0 turns this off).  Returns the old handler.
+ *
+ * Usage:
+ *     old_handler = loop:on_error([handler [, max_failures]])
+ *
+ * [+1, -0, e]
+ */
+static int loop_on_error(lua_State *L) {
+    lua_ev_loop* loop = check_loop_data(L, 1);
+    int nargs         = lua_gettop(L);
+
+    if ( nargs > 1 && ! lua_isnil(L, 2) ) luaL_checktype(L, 2, LUA_TFUNCTION);
+    if ( nargs > 2 ) {
+        int max_failures = luaL_checkint(L, 3);
+        if ( max_failures < 0 || max_failures > 255 )
+            luaL_argerror(L, 3, "max_failures must be between 0 and 255");
+        loop->max_failures = max_failures;
+    }
+
+    obj_getslot(L, 1, LOOP_ERROR_FN); /* get current handler. */
+
+    if ( nargs > 1 ) {
+        lua_pushvalue(L, 2);
+        obj_setslot(L, 1, LOOP_ERROR_FN); /* set new handler. */
+    }
+    /* return current/old handler. */
+    return 1;
+}
+
+/**
+ * Returns a table of watcher type name (io, timer, ...) => number of
+ * callback errors in this loop.
+ *
+ * Usage:
+ *     counts = loop:error_counts()
+ *
+ * [+1, -0, e]
+ */
+static int loop_error_counts(lua_State *L) {
+    check_loop(L, 1);
+
+    lua_newtable(L);
+    obj_getslot(L, 1, LOOP_ERRORS);
+    if ( lua_istable(L, -1) ) {
+        lua_pushnil(L);
+        while ( lua_next(L, -2) ) {
+            lua_pushvalue(L, -2);
+            lua_insert(L, -2);
+            lua_rawset(L, -5);
+        }
+    }
+    lua_pop(L, 1);
+    return 1;
+}
+
 /* vi:set expandtab ts=4: */
@@ -1,8 +1,12 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#  define _GNU_SOURCE /* posix_spawn_file_actions_addchdir_np(), pipe2() */
+#endif
 #include <assert.h>
 #include <ev.h>
 #include <lauxlib.h>
 #include <lua.h>
 
+#include "lua_ev_api.h"
 #include "lua_ev.h"
 
 static char lua_ev_loop_mt[]   = "ev{loop}";
@@ -12,21 +16,54 @@ static char lua_ev_signal_mt[] = "ev{signal}";
 static char lua_ev_idle_mt[]   = "ev{idle}";
 static char lua_ev_child_mt[]  = "ev{child}";
 static char lua_ev_stat_mt[]   = "ev{stat}";
+static char lua_ev_fswatch_mt[] = "ev{fswatch}";
+static char lua_ev_signalfd_mt[] = "ev{signalfd}";
+static char lua_ev_childfd_mt[] = "ev{childfd}";
+static char lua_ev_statpoll_mt[] = "ev{statpoll}";
+static char lua_ev_shmring_mt[] = "ev{shmring}";
+static char lua_ev_fdchannel_mt[] = "ev{fdchannel}";
+static char lua_ev_probe_mt[]  = "ev{probe}";
+static char lua_ev_prefork_mt[] = "ev{prefork}";
+/* not a metatable: the type of loop:once() callbacks for the tracer
+ * and the watchdog. */
+static char lua_ev_once_name[] = "ev{once}";
+/* marks the metatables of all watcher types. */
+static char watcher_magic[]    = "ev{watcher}";
 
 /* We make everything static, so we just include all *.c files in a
  * single compilation unit. */
 #include "obj_lua_ev.c"
+#include "mem_lua_ev.c"
 #include "loop_lua_ev.c"
 #include "watcher_lua_ev.c"
 #include "io_lua_ev.c"
 #include "timer_lua_ev.c"
 #include "signal_lua_ev.c"
+#include "signalfd_lua_ev.c"
 #include "idle_lua_ev.c"
 #include "child_lua_ev.c"
+#include "childfd_lua_ev.c"
+#include "spawn_lua_ev.c"
+#include "prefork_lua_ev.c"
 #include "stat_lua_ev.c"
+#include "once_lua_ev.c"
+#include "fswatch_lua_ev.c"
+#include "statpoll_lua_ev.c"
+#include "shmring_lua_ev.c"
+#include "fdchannel_lua_ev.c"
+#include "probe_lua_ev.c"
+#include "trace_lua_ev.c"
+#include "watchdog_lua_ev.c"
+#include "ffi_lua_ev.c"
+#include "api_lua_ev.c"
 
 static const luaL_reg R[] = {
     {"version", version},
+    {"set_allocator", mem_set_allocator},
+#ifndef _WIN32
+    {"spawn_process", spawn_process},
+    {"prefork", prefork_new},
+#endif
     {NULL, NULL},
 };
 
@@ -34,23 +71,19 @@ static char *traceback_key = "LUA_EV_TRACEBACK_KEY";
 
 static void push_traceback(lua_State *L) {
     lua_pushlightuserdata(L, traceback_key);
-    lua_gettable(L, LUA_REGISTRYINDEX); /* registry[<traceback_key>] */
+    lua_rawget(L, LUA_REGISTRYINDEX); /* registry[<traceback_key>] */
 }
 
+/**
+ * Cache the traceback() C function in the registry so that watcher
+ * callbacks can use it as the lua_pcall() message handler without
+ * allocating a closure per call.  The traceback itself is only built
+ * when an error actually happens.
+ */
 static void save_traceback(lua_State *L) {
     lua_pushlightuserdata(L, traceback_key);
-    /* save reference to 'debug.traceback' */
-    lua_getfield(L, LUA_GLOBALSINDEX, "debug");
-    if ( !lua_istable(L, -1) ) {
-        luaL_error(L, "Can't get global 'debug'");
-    }
-
-    lua_getfield(L, -1, "traceback");
-    if ( !lua_isfunction(L, -1) ) {
-        luaL_error(L, "Can't get 'debug.trackeback' function");
-    }
-    lua_remove(L, -2); /* remove 'debug' table from stack. */
-    lua_settable(L, LUA_REGISTRYINDEX); /* registry[<traceback_key>] = debug.traceback */
+    lua_pushcfunction(L, traceback);
+    lua_rawset(L, LUA_REGISTRYINDEX); /* registry[<traceback_key>] = traceback */
 }
 
 /**
@@ -64,8 +97,13 @@ LUALIB_API int luaopen_ev(lua_State *L) {
            ev_version_minor() >= EV_VERSION_MINOR);
 
     save_traceback(L);
+    api_register(L);
 
+#if LUA_VERSION_NUM >= 502
+    luaL_newlib(L, R);
+#else
     luaL_register(L, "ev", R);
+#endif
 
 #define CONSTANT(def, name) do { \
     lua_pushinteger(L, def); \
@@ -100,15 +138,47 @@ LUALIB_API int luaopen_ev(lua_State *L) {
     luaopen_ev_signal(L);
     lua_setfield(L, -2, "Signal");
 
+#ifdef __linux__
+    luaopen_ev_signalfd(L);
+    lua_setfield(L, -2, "SignalFD");
+#endif
+
     luaopen_ev_idle(L);
     lua_setfield(L, -2, "Idle");
 
     luaopen_ev_child(L);
     lua_setfield(L, -2, "Child");
 
+#ifndef _WIN32
+    /* ev.prefork() returns these. */
+    lua_pop(L, create_prefork_mt(L));
+#endif
+
+#ifdef __linux__
+    luaopen_ev_childfd(L);
+    lua_setfield(L, -2, "ChildFD");
+#endif
+
     luaopen_ev_stat(L);
     lua_setfield(L, -2, "Stat");
 
+    luaopen_ev_probe(L);
+    lua_setfield(L, -2, "Probe");
+
+#ifdef __linux__
+    luaopen_ev_fswatch(L);
+    lua_setfield(L, -2, "FSWatch");
+
+    luaopen_ev_statpoll(L);
+    lua_setfield(L, -2, "StatPoll");
+
+    luaopen_ev_shmring(L);
+    lua_setfield(L, -2, "ShmRing");
+
+    luaopen_ev_fdchannel(L);
+    lua_setfield(L, -2, "FdChannel");
+#endif
+
 #define CONSTANT(name) do { \
     lua_pushinteger(L, EV_ ## name); \
     lua_setfield(L, -2, #name); \
@@ -134,8 +204,8 @@ LUALIB_API int luaopen_ev(lua_State *L) {
  * [+2, -0, -]
  */
 static int version(lua_State *L) {
-    lua_pushnumber(L, ev_version_major());
-    lua_pushnumber(L, ev_version_minor());
+    lua_pushinteger(L, ev_version_major());
+    lua_pushinteger(L, ev_version_minor());
     return 2;
 }
 
@@ -146,7 +216,7 @@ static int version(lua_State *L) {
 static int traceback(lua_State *L) {
     if ( !lua_isstring(L, 1) ) return 1;
 
-    lua_getfield(L, LUA_GLOBALSINDEX, "debug");
+    lua_getglobal(L, "debug");
     if ( !lua_istable(L, -1) ) {
         lua_pop(L, 1);
         return 1;
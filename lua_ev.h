@@ -14,6 +14,27 @@
 #  warning lua-ev requires version 3.7 or newer of libev
 #endif
 
+/**
+ * Lua 5.1 names for what changed in 5.2 and later.  Objects keep
+ * their lua references in numbered slots (see obj_getslot()) which
+ * are the fenv table in 5.1, the user value table in 5.2 and 5.3 and
+ * the user values of the userdata in 5.4.
+ */
+#if LUA_VERSION_NUM >= 502
+#  define luaL_reg               luaL_Reg
+#  define lua_objlen             lua_rawlen
+#  define lua_ev_setfuncs(L, l)  luaL_setfuncs((L), (l), 0)
+#  ifndef luaL_checkint
+#    define luaL_checkint(L, n)    ((int)luaL_checkinteger((L), (n)))
+#    define luaL_optint(L, n, d)   ((int)luaL_optinteger((L), (n), (d)))
+#    define luaL_optlong(L, n, d)  ((long)luaL_optinteger((L), (n), (d)))
+#  endif
+#else
+#  define lua_getuservalue       lua_getfenv
+#  define lua_setuservalue       lua_setfenv
+#  define lua_ev_setfuncs(L, l)  luaL_register((L), NULL, (l))
+#endif
+
 /**
  * Define the names used for the metatables.
  */
@@ -24,6 +45,14 @@
 #define IDLE_MT    lua_ev_idle_mt
 #define CHILD_MT   lua_ev_child_mt
 #define STAT_MT    lua_ev_stat_mt
+#define FSWATCH_MT lua_ev_fswatch_mt
+#define SIGNALFD_MT lua_ev_signalfd_mt
+#define CHILDFD_MT lua_ev_childfd_mt
+#define STATPOLL_MT lua_ev_statpoll_mt
+#define SHMRING_MT lua_ev_shmring_mt
+#define FDCHANNEL_MT lua_ev_fdchannel_mt
+#define PROBE_MT   lua_ev_probe_mt
+#define PREFORK_MT lua_ev_prefork_mt
 
 /**
  * Special token to represent the uninitialized default loop.  This is
@@ -32,34 +61,130 @@
  */
 #define UNINITIALIZED_DEFAULT_LOOP (struct ev_loop*)1
 
+typedef struct lua_ev_loop lua_ev_loop;
+typedef struct lua_ev_tracer lua_ev_tracer;
+typedef struct lua_ev_watchdog lua_ev_watchdog;
+typedef struct lua_ev_mem lua_ev_mem;
+typedef struct lua_ev_ffi lua_ev_ffi;
+typedef struct lua_ev_once_pool lua_ev_once_pool;
+typedef struct lua_ev_once lua_ev_once;
+
+/**
+ * The loop userdata.  The ev_loop pointer must be the first member so
+ * that check_loop() can keep returning a struct ev_loop**.
+ */
+struct lua_ev_loop {
+    struct ev_loop* loop;
+    /* stop a watcher after this many consecutive callback errors (0 = never). */
+    int             max_failures;
+    /* set while loop:trace_start() is recording. */
+    lua_ev_tracer*  tracer;
+    /* set while loop:watchdog_start() is watching. */
+    lua_ev_watchdog* watchdog;
+    /* what libev allocated for this loop, see ev.set_allocator(). */
+    lua_ev_mem*     mem;
+    /* watchers stopped through ev_ffi.lua, see ffi_lua_ev.c. */
+    lua_ev_ffi*     ffi;
+    /* nodes for loop:once(), see once_lua_ev.c. */
+    lua_ev_once_pool* once;
+    /* when loop:pick_hot() last reset the event counts. */
+    ev_tstamp       picked;
+    /* the last expiry picked for a timer with slack, see timer:slack(). */
+    ev_tstamp       slack_at;
+    /* for loop:slack_stats(). */
+    double          slack_fired;
+    double          slack_coalesced;
+    unsigned int    slack_iteration;
+};
+
+/**
+ * The slot of the loop that contains the error handler function.
+ */
+#define LOOP_ERROR_FN 1
+
+/**
+ * The slot of the loop that contains the table of error counts per
+ * watcher type.
+ */
+#define LOOP_ERRORS   2
+
+/**
+ * Number of slots of a loop.
+ */
+#define LOOP_SLOTS    2
+
 typedef struct lua_ev_watcher_data lua_ev_watcher_data;
 
 struct lua_ev_watcher_data {
     int watcher_ref;
     int flags;
+    /* the loop the watcher is registered with, NULL when stopped. */
+    lua_ev_loop* loop;
 };
 #define ALIGN_SIZE(s, n) (((s) + ((n) - 1)) & -(n))
 #define WATCHER_DATA_SIZE ALIGN_SIZE(sizeof(lua_ev_watcher_data), sizeof(void *))
 #define GET_WATCHER_DATA(watcher) (lua_ev_watcher_data*)(((char*)watcher) - WATCHER_DATA_SIZE)
 #define WATCHER_FLAG_IS_DAEMON   1
 #define WATCHER_FLAG_HAS_SHADOW  2
+/* stopped by lua_ev_ffi_stop() but still registered with the loop. */
+#define WATCHER_FLAG_PARKED      4
+/* in the list of parked watchers of the loop. */
+#define WATCHER_FLAG_PARK_LISTED 8
+/* has a context, passed as the first callback argument. */
+#define WATCHER_FLAG_HAS_CONTEXT 16
+/* bits 8-15 count consecutive callback errors. */
+#define WATCHER_FAILURES_SHIFT   8
+#define WATCHER_FAILURES_MASK    (0xff << WATCHER_FAILURES_SHIFT)
+/* bits 16-30 count callbacks since the last loop:pick_hot(), saturating. */
+#define WATCHER_EVENTS_SHIFT     16
+#define WATCHER_EVENTS_MASK      (0x7fff << WATCHER_EVENTS_SHIFT)
+
+/**
+ * Optional hook used by watcher_cb_args() to push extra callback
+ * arguments after <revents>.  Returns the number of values pushed.
+ */
+typedef int (*lua_ev_push_args)(lua_State *L, void *watcher);
 
 /**
- * The location in the fenv of the watcher that contains the callback
- * function.
+ * The slot of the watcher that contains the callback function.
  */
 #define WATCHER_FN 1
 
 /**
- * The location in the fenv of the watcher that contains the ev_loop reference.
+ * The slot of the watcher that contains the ev_loop reference.
  */
 #define WATCHER_LOOP 2
 
 /**
- * The location in the fenv of the shadow table.
+ * The slot of the watcher that contains the shadow table.
  */
 #define WATCHER_SHADOW 3
 
+/**
+ * The slot of the watcher that contains the callback context.
+ */
+#define WATCHER_CONTEXT 4
+
+/**
+ * Number of slots of a watcher.
+ */
+#define WATCHER_SLOTS  4
+
+/**
+ * The slot of a stat watcher that keeps its path string alive, libev
+ * only stores the pointer.
+ */
+#define STAT_PATH      5
+#define STAT_SLOTS     5
+
+/**
+ * The slots of an ev.Prefork object with the init and on_exit
+ * functions.
+ */
+#define PREFORK_INIT     1
+#define PREFORK_ON_EXIT  2
+#define PREFORK_SLOTS    2
+
 /**
  * Various "check" functions simply call lua_ev_checkobject() and do the
  * appropriate casting, with the exception of check_watcher which is
@@ -81,6 +206,12 @@ static ev_watcher* lua_ev_checkwatcher(lua_State *L, int idx, const char *type_m
 #define check_loop(L, narg)                                      \
     ((struct ev_loop**)    lua_ev_checkobject((L), (narg), LOOP_MT))
 
+#define check_loop_data(L, narg)                                 \
+    ((lua_ev_loop*)        lua_ev_checkobject((L), (narg), LOOP_MT))
+
+#define check_prefork(L, narg)                                   \
+    ((lua_ev_prefork*)     lua_ev_checkobject((L), (narg), PREFORK_MT))
+
 #define check_timer(L, narg)                                     \
     ((ev_timer*)    lua_ev_checkwatcher((L), (narg), TIMER_MT))
 
@@ -99,12 +230,35 @@ static ev_watcher* lua_ev_checkwatcher(lua_State *L, int idx, const char *type_m
 #define check_stat(L, narg)                                      \
     ((ev_stat*)     lua_ev_checkwatcher((L), (narg), STAT_MT))
 
+#define check_probe(L, narg)                                     \
+    ((lua_ev_probe*) lua_ev_checkwatcher((L), (narg), PROBE_MT))
+
+#define check_fswatch(L, narg)                                   \
+    ((lua_ev_fswatch*) lua_ev_checkwatcher((L), (narg), FSWATCH_MT))
+
+#define check_signalfd(L, narg)                                  \
+    ((lua_ev_signalfd*) lua_ev_checkwatcher((L), (narg), SIGNALFD_MT))
+
+#define check_childfd(L, narg)                                   \
+    ((lua_ev_childfd*) lua_ev_checkwatcher((L), (narg), CHILDFD_MT))
+
+#define check_statpoll(L, narg)                                  \
+    ((lua_ev_statpoll*) lua_ev_checkwatcher((L), (narg), STATPOLL_MT))
+
+#define check_shmring(L, narg)                                   \
+    ((lua_ev_shmring*) lua_ev_checkwatcher((L), (narg), SHMRING_MT))
+
+#define check_fdchannel(L, narg)                                 \
+    ((lua_ev_fdchannel*) lua_ev_checkwatcher((L), (narg), FDCHANNEL_MT))
+
 
 /**
  * Copied from the lua source code lauxlib.c.  It simply converts a
  * negative stack index into a positive one so that if the stack later
  * grows or shrinks, the index will not be effected.
  */
+#define abs_index(L, i)                                          \
+    ((i) > 0 || (i) <= LUA_REGISTRYINDEX ? (i) : lua_gettop(L) + (i) + 1)
 
 
 /**
@@ -112,6 +266,7 @@ static ev_watcher* lua_ev_checkwatcher(lua_State *L, int idx, const char *type_m
  */
 static int               version(lua_State *L);
 static void              push_traceback(lua_State *L);
+static int               traceback(lua_State *L);
 
 /**
  * Loop functions:
@@ -120,6 +275,7 @@ static int               luaopen_ev_loop(lua_State *L);
 static int               create_loop_mt(lua_State *L);
 static struct ev_loop**  loop_alloc(lua_State *L);
 static struct ev_loop**  check_loop_and_init(lua_State *L, int loop_i);
+static void              push_default_loop(lua_State *L);
 static int               loop_new(lua_State *L);
 static int               loop_delete(lua_State *L);
 static void              loop_start_watcher(lua_State* L, struct ev_loop *loop,
@@ -131,15 +287,31 @@ static int               loop_iteration(lua_State *L);
 static int               loop_depth(lua_State *L);
 static int               loop_now(lua_State *L);
 static int               loop_update_now(lua_State *L);
+static int               loop_feed_signal_event(lua_State *L);
 static int               loop_run(lua_State *L);
 static int               loop_break(lua_State *L);
 static int               loop_backend(lua_State *L);
 static int               loop_fork(lua_State *L);
+static int               loop_pick_hot(lua_State *L);
+static int               loop_pick_hot_cmp(const void* a, const void* b);
+static int               loop_on_error(lua_State *L);
+static int               loop_error_counts(lua_State *L);
+static int               loop_trace_start(lua_State *L);
+static int               loop_trace_stop(lua_State *L);
+static int               loop_trace_dump(lua_State *L);
+static int               loop_memory(lua_State *L);
+#ifndef _WIN32
+static int               loop_watchdog_start(lua_State *L);
+static int               loop_watchdog_stop(lua_State *L);
+#endif
 
 /**
  * Object functions:
  */
-static void*             obj_new(lua_State* L, size_t size, const char* tname);
+static void*             obj_new(lua_State* L, size_t size, const char* tname, int nslots);
+static void              obj_getslot(lua_State* L, int idx, int slot);
+static void              obj_setslot(lua_State* L, int idx, int slot);
+static int               obj_typerror(lua_State *L, int narg, const char *tname);
 
 /**
  * Watcher functions:
@@ -149,25 +321,45 @@ static int               watcher_is_active(lua_State *L);
 static int               watcher_is_pending(lua_State *L);
 static int               watcher_clear_pending(lua_State *L);
 static ev_watcher*       watcher_new(lua_State* L, size_t size, const char* lua_type);
+static ev_watcher*       watcher_new_slots(lua_State* L, size_t size, const char* lua_type,
+                                           int nslots);
+static struct ev_loop*   watcher_active_loop(void* watcher);
+static void              watcher_new_context(lua_State* L, int ctx_i);
+static int               watcher_context(lua_State *L);
+static void              watcher_set_context(lua_State *L, int watcher_i);
 static int               watcher_callback(lua_State *L);
 static int               watcher_priority(lua_State *L);
+static int               watcher_migrate(lua_State *L);
 static int               watcher_shadow(lua_State *L);
 static int               watcher_newindex(lua_State *L);
 static int               watcher_index(lua_State *L);
 static void              watcher_cb(struct ev_loop *loop, void *watcher, int revents);
+static void              watcher_cb_args(struct ev_loop *loop, void *watcher, int revents,
+                            lua_ev_push_args push_args);
 static ev_watcher*       check_watcher(lua_State *L, int watcher_i);
+static void              watcher_error(lua_State *L, lua_ev_watcher_data* wdata,
+                            int watcher_i, int loop_i);
+static const char*       watcher_type(lua_State *L, int watcher_i);
+static const char*       watcher_target(const char* name, void* watcher, int* arg);
 
 /**
  * Timer functions:
  */
+typedef struct lua_ev_timer lua_ev_timer;
 static int               luaopen_ev_timer(lua_State *L);
 static int               create_timer_mt(lua_State *L);
 static int               timer_new(lua_State* L);
 static void              timer_cb(struct ev_loop* loop, ev_timer* timer, int revents);
+static void              timer_slack_cb(struct ev_loop* loop, ev_timer* timer, int revents);
+static ev_tstamp         timer_slack_after(struct ev_loop* loop, lua_ev_loop* lloop,
+                            ev_tstamp after, ev_tstamp slack);
 static int               timer_again(lua_State *L);
 static int               timer_stop(lua_State *L);
 static int               timer_start(lua_State *L);
 static int               timer_clear_pending(lua_State *L);
+static int               timer_set(lua_State *L);
+static int               timer_slack(lua_State *L);
+static int               loop_slack_stats(lua_State *L);
 
 /**
  * IO functions:
@@ -179,6 +371,8 @@ static void              io_cb(struct ev_loop* loop, ev_io* io, int revents);
 static int               io_stop(lua_State *L);
 static int               io_start(lua_State *L);
 static int               io_getfd(lua_State *L);
+static int               io_set(lua_State *L);
+static int               io_modify(lua_State *L);
 
 /**
  * Signal functions:
@@ -189,6 +383,7 @@ static int               signal_new(lua_State* L);
 static void              signal_cb(struct ev_loop* loop, ev_signal* sig, int revents);
 static int               signal_stop(lua_State *L);
 static int               signal_start(lua_State *L);
+static int               signal_set(lua_State *L);
 
 /**
  * Idle functions:
@@ -212,6 +407,50 @@ static int               child_start(lua_State *L);
 static int               child_getpid(lua_State *L);
 static int               child_getrpid(lua_State *L);
 static int               child_getstatus(lua_State *L);
+static int               child_set(lua_State *L);
+
+/**
+ * Process spawning functions:
+ */
+#ifndef _WIN32
+static int               spawn_process(lua_State *L);
+static void              spawn_child_cb(struct ev_loop* loop, ev_child* child, int revents);
+static int               spawn_push_status(lua_State *L, void *watcher);
+static int               spawn_push_rstatus(lua_State *L, int rstatus);
+static int               spawn_is_setenv(lua_State *L, int setenv_i, int name_i);
+#ifdef __linux__
+static int               spawn_push_fd_status(lua_State *L, void *watcher);
+#endif
+static int               spawn_on_exit(lua_State *L);
+#endif
+
+/**
+ * Prefork functions (not on windows):
+ */
+#ifndef _WIN32
+typedef struct lua_ev_prefork lua_ev_prefork;
+typedef struct lua_ev_prefork_worker lua_ev_prefork_worker;
+static int               create_prefork_mt(lua_State *L);
+static int               prefork_new(lua_State *L);
+static int               prefork_opt_signal(lua_State *L, const char* name, int def);
+static lua_ev_prefork_worker* prefork_worker_new(lua_ev_prefork* prefork, int id);
+static void              prefork_worker_free(lua_ev_prefork* prefork, lua_ev_prefork_worker* worker);
+static void              prefork_spawn(lua_State *L, lua_ev_prefork_worker* worker);
+static void              prefork_worker(lua_State *L, lua_ev_prefork_worker* worker, const sigset_t* mask);
+static void              prefork_schedule(lua_ev_prefork_worker* worker);
+static void              prefork_child_cb(struct ev_loop* loop, ev_child* child, int revents);
+static void              prefork_respawn_cb(struct ev_loop* loop, ev_timer* timer, int revents);
+static void              prefork_reload_cb(struct ev_loop* loop, ev_signal* sig, int revents);
+static void              prefork_stop_cb(struct ev_loop* loop, ev_signal* sig, int revents);
+static void              prefork_reload(lua_State *L, lua_ev_prefork* prefork);
+static void              prefork_signal_all(lua_ev_prefork* prefork, int signum);
+static void              prefork_done(lua_State *L, lua_ev_prefork* prefork);
+static lua_ev_prefork*   check_prefork_master(lua_State *L, int narg);
+static int               prefork_pids(lua_State *L);
+static int               prefork_reload_method(lua_State *L);
+static int               prefork_stop(lua_State *L);
+static int               prefork_gc(lua_State *L);
+#endif
 
 /**
  * Stat functions:
@@ -219,10 +458,229 @@ static int               child_getstatus(lua_State *L);
 static int               luaopen_ev_stat(lua_State *L);
 static int               create_stat_mt(lua_State *L);
 static int               stat_new(lua_State* L);
+typedef struct lua_ev_stat lua_ev_stat;
 static void              stat_cb(struct ev_loop* loop, ev_stat* sig, int revents);
+static void              stat_nsec_cb(struct ev_loop* loop, ev_prepare* prepare, int revents);
+static void              stat_nsec_start(struct ev_loop* loop, lua_ev_stat* stat);
+static void              stat_nsec_stop(struct ev_loop* loop, lua_ev_stat* stat);
 static int               stat_stop(lua_State *L);
 static int               stat_start(lua_State *L);
-static int               stat_start(lua_State *L);
+static int               stat_set(lua_State *L);
 static int               stat_getdata(lua_State *L);
+static int               stat_push_changed(lua_State *L, void *watcher);
+static int               stat_changed(lua_State *L);
+static int               stat_dev(lua_State *L);
+static int               stat_ino(lua_State *L);
+static int               stat_mode(lua_State *L);
+static int               stat_nlink(lua_State *L);
+static int               stat_uid(lua_State *L);
+static int               stat_gid(lua_State *L);
+static int               stat_rdev(lua_State *L);
+static int               stat_size(lua_State *L);
+static int               stat_atime(lua_State *L);
+static int               stat_mtime(lua_State *L);
+static int               stat_ctime(lua_State *L);
+static int               stat_mtime_nsec(lua_State *L);
+
+/**
+ * Probe functions (timer latency measurement):
+ */
+typedef struct lua_ev_probe lua_ev_probe;
+static int               luaopen_ev_probe(lua_State *L);
+static int               create_probe_mt(lua_State *L);
+static int               probe_new(lua_State* L);
+static int               probe_latency(lua_State *L);
+static int               probe_on_report(lua_State *L);
+static void              probe_prepare_cb(struct ev_loop* loop, ev_prepare* prepare, int revents);
+static void              probe_check_cb(struct ev_loop* loop, ev_check* check, int revents);
+static void              probe_timer_cb(struct ev_loop* loop, ev_timer* timer, int revents);
+static void              probe_stop_watchers(struct ev_loop* loop, lua_ev_probe* probe);
+static int               probe_push_report(lua_State *L, void *watcher);
+static void              probe_push_table(lua_State *L, lua_ev_probe* probe);
+static int               probe_stop(lua_State *L);
+static int               probe_start(lua_State *L);
+static int               probe_report(lua_State *L);
+static int               probe_gc(lua_State *L);
+
+/**
+ * Memory accounting functions:
+ */
+static int               mem_set_allocator(lua_State *L);
+static void*             mem_alloc(void* ptr, long size);
+static void              mem_loop_init(lua_ev_loop* loop);
+static void              mem_loop_free(lua_ev_loop* loop);
+static long              mem_table_bytes(lua_State *L, int idx);
+
+/**
+ * Trace functions (chrome trace of loop activity):
+ */
+typedef void (*trace_add_fn)(void* ctx, const char* s, size_t len);
+static void              trace_free(struct ev_loop* loop, lua_ev_loop* lloop);
+static int               trace_roll(lua_ev_tracer* tracer);
+static void              trace_prepare_cb(struct ev_loop* loop, ev_prepare* prepare, int revents);
+static void              trace_check_cb(struct ev_loop* loop, ev_check* check, int revents);
+static void              trace_signal_cb(struct ev_loop* loop, ev_signal* sig, int revents);
+static void              trace_callback(lua_State *L, lua_ev_tracer* tracer, void *watcher,
+                            int watcher_i, int revents, double started, int failed);
+static int               trace_write_file(lua_ev_tracer* tracer, const char* path);
+static void              trace_write(lua_ev_tracer* tracer, trace_add_fn add, void* ctx);
+static void              trace_add_buffer(void* ctx, const char* s, size_t len);
+static double            probe_now(void);
+
+/**
+ * LuaJIT FFI functions (see ev_ffi.lua), exported so the FFI can
+ * find them:
+ */
+LUALIB_API double        lua_ev_ffi_now(lua_ev_loop* loop);
+LUALIB_API int           lua_ev_ffi_is_active(void* ud);
+LUALIB_API int           lua_ev_ffi_is_pending(void* ud);
+LUALIB_API int           lua_ev_ffi_start(lua_ev_loop* loop, void* ud);
+LUALIB_API int           lua_ev_ffi_stop(lua_ev_loop* loop, void* ud);
+LUALIB_API int           lua_ev_ffi_again(lua_ev_loop* loop, void* ud);
+LUALIB_API int           lua_ev_ffi_timer_set(void* ud, double after, double repeat);
+LUALIB_API int           lua_ev_ffi_io_set(void* ud, int fd, int events);
+static int               ffi_start_stop(struct ev_loop* loop, ev_watcher* w, int start);
+static int               ffi_park(lua_ev_loop* loop, lua_ev_watcher_data* wdata);
+static void              ffi_sweep_cb(struct ev_loop* loop, ev_prepare* prepare, int revents);
+static void              ffi_free(struct ev_loop* loop, lua_ev_loop* lloop);
+
+/**
+ * One-shot io/timeout functions (loop:once()):
+ */
+static int               loop_once(lua_State *L);
+static lua_ev_once*      once_alloc(lua_ev_loop* loop);
+static void              once_cb(int revents, void* arg);
+static void              once_free(lua_ev_loop* loop);
+
+/**
+ * Public C API functions (see lua_ev_api.h):
+ */
+static struct ev_loop*   api_check_loop(lua_State *L, int idx);
+static void              api_native_started(lua_State *L, int loop_i,
+                            lua_ev_native* native, int is_daemon);
+static void              api_native_stopped(lua_State *L, lua_ev_native* native);
+static void              api_register(lua_State *L);
+
+/**
+ * Watchdog functions (slow callback detection):
+ */
+#ifndef _WIN32
+static void              watchdog_free(lua_State *L, lua_ev_loop* lloop);
+static void              watchdog_enter(lua_ev_watchdog* wd, lua_State *L, void *watcher,
+                            int watcher_i);
+static void              watchdog_leave(lua_ev_watchdog* wd);
+static void*             watchdog_thread(void* arg);
+static void              watchdog_hook(lua_State *L, lua_Debug *ar);
+static void              watchdog_push_traceback(lua_State *L);
+#endif
+
+/**
+ * FSWatch functions (recursive inotify directory watcher, Linux only):
+ */
+#ifdef __linux__
+typedef struct lua_ev_fswatch lua_ev_fswatch;
+static int               luaopen_ev_fswatch(lua_State *L);
+static int               create_fswatch_mt(lua_State *L);
+static int               fswatch_new(lua_State* L);
+static void              fswatch_io_cb(struct ev_loop* loop, ev_io* io, int revents);
+static void              fswatch_timer_cb(struct ev_loop* loop, ev_timer* timer, int revents);
+static int               fswatch_push_events(lua_State *L, void *watcher);
+static int               fswatch_stop(lua_State *L);
+static int               fswatch_start(lua_State *L);
+static int               fswatch_getpath(lua_State *L);
+static int               fswatch_gc(lua_State *L);
+#endif
+
+/**
+ * SignalFD functions (signals delivered through signalfd, Linux only):
+ */
+#ifdef __linux__
+typedef struct lua_ev_signalfd lua_ev_signalfd;
+static int               luaopen_ev_signalfd(lua_State *L);
+static int               create_signalfd_mt(lua_State *L);
+static int               signalfd_new(lua_State* L);
+static void              signalfd_cb(struct ev_loop* loop, ev_io* io, int revents);
+static int               signalfd_push_info(lua_State *L, void *watcher);
+static int               signalfd_stop(lua_State *L);
+static int               signalfd_start(lua_State *L);
+static int               signalfd_getfd(lua_State *L);
+static int               signalfd_gc(lua_State *L);
+#endif
+
+/**
+ * ChildFD functions (child processes watched through a pidfd, Linux
+ * only):
+ */
+#ifdef __linux__
+typedef struct lua_ev_childfd lua_ev_childfd;
+static int               luaopen_ev_childfd(lua_State *L);
+static int               create_childfd_mt(lua_State *L);
+static int               childfd_new(lua_State* L);
+static void              childfd_cb(struct ev_loop* loop, ev_io* io, int revents);
+static int               childfd_stop(lua_State *L);
+static int               childfd_start(lua_State *L);
+static int               childfd_getpid(lua_State *L);
+static int               childfd_getrpid(lua_State *L);
+static int               childfd_getstatus(lua_State *L);
+static int               childfd_getfd(lua_State *L);
+static int               childfd_gc(lua_State *L);
+#endif
+
+/**
+ * StatPoll functions (shared stat polling of many paths, Linux only):
+ */
+#ifdef __linux__
+typedef struct lua_ev_statpoll lua_ev_statpoll;
+static int               luaopen_ev_statpoll(lua_State *L);
+static int               create_statpoll_mt(lua_State *L);
+static int               statpoll_new(lua_State* L);
+static void              statpoll_cb(struct ev_loop* loop, ev_timer* timer, int revents);
+static int               statpoll_push_changes(lua_State *L, void *watcher);
+static int               statpoll_add(lua_State *L);
+static int               statpoll_remove(lua_State *L);
+static int               statpoll_count(lua_State *L);
+static int               statpoll_stop(lua_State *L);
+static int               statpoll_start(lua_State *L);
+static int               statpoll_gc(lua_State *L);
+#endif
+
+/**
+ * ShmRing functions (shared memory record ring between processes,
+ * Linux only):
+ */
+#ifdef __linux__
+typedef struct lua_ev_shmring lua_ev_shmring;
+static int               luaopen_ev_shmring(lua_State *L);
+static int               create_shmring_mt(lua_State *L);
+static int               shmring_new(lua_State* L);
+static int               shmring_open(lua_State* L);
+static void              shmring_cb(struct ev_loop* loop, ev_io* io, int revents);
+static int               shmring_drain(lua_State *L, void *watcher);
+static int               shmring_push(lua_State *L);
+static int               shmring_stop(lua_State *L);
+static int               shmring_start(lua_State *L);
+static int               shmring_getfds(lua_State *L);
+static int               shmring_getsize(lua_State *L);
+static int               shmring_gc(lua_State *L);
+#endif
+
+/**
+ * FdChannel functions (fds passed over a unix socket, Linux only):
+ */
+#ifdef __linux__
+typedef struct lua_ev_fdchannel lua_ev_fdchannel;
+static int               luaopen_ev_fdchannel(lua_State *L);
+static int               create_fdchannel_mt(lua_State *L);
+static int               fdchannel_socketpair(lua_State *L);
+static int               fdchannel_new(lua_State* L);
+static void              fdchannel_cb(struct ev_loop* loop, ev_io* io, int revents);
+static int               fdchannel_push_messages(lua_State *L, void *watcher);
+static int               fdchannel_send(lua_State *L);
+static int               fdchannel_stop(lua_State *L);
+static int               fdchannel_start(lua_State *L);
+static int               fdchannel_getfd(lua_State *L);
+static int               fdchannel_close(lua_State *L);
+static int               fdchannel_gc(lua_State *L);
+#endif
 
 /* vi:set expandtab ts=4: */
@@ -0,0 +1,112 @@
+/**
+ * Public C API of lua-ev for other native modules.
+ *
+ * A C module can use the libev loop behind an ev.Loop object directly
+ * and start its own (native) watchers on it, so that its events never
+ * go through a lua callback.  Native watchers take part in the same
+ * bookkeeping as lua watchers: while started they keep the loop
+ * object from being garbage collected, and a "daemon" watcher does
+ * not keep loop:run() from returning.
+ *
+ * The functions are reached through a table which require("ev")
+ * stores in the lua registry:
+ *
+ *     const lua_ev_api* api = lua_ev_api_get(L, 1);
+ *     if ( NULL == api ) return luaL_error(L, "lua-ev is not loaded");
+ *
+ *     struct ev_loop* loop = api->check_loop(L, 1);
+ *     ev_io_init(&my->io, my_cb, fd, EV_READ);
+ *     ev_io_start(loop, &my->io);
+ *     api->native_started(L, 1, &my->native, 0);
+ *     ...
+ *     ev_io_stop(loop, &my->io);
+ *     api->native_stopped(L, &my->native);
+ *
+ * While loop:run() is running, ev_userdata(loop) is the lua_State
+ * which called it, so native callbacks can call native_stopped() and
+ * other lua functions with it.  Outside of loop:run() it may be
+ * anything.
+ *
+ * New functions are only ever added to the end of lua_ev_api and
+ * raise LUA_EV_API_VERSION, so a module built against an older
+ * version of this header keeps working.
+ */
+#ifndef LUA_EV_API_H
+#define LUA_EV_API_H
+
+#include <ev.h>
+#include <lua.h>
+
+#define LUA_EV_API_VERSION 1
+
+/* registry field holding a light userdata pointing to the lua_ev_api. */
+#define LUA_EV_API_KEY     "lua_ev.api"
+
+/**
+ * Bookkeeping of one native watcher, embed it next to the ev watcher
+ * and initialize it with LUA_EV_NATIVE_INIT or lua_ev_native_init().
+ * The members are private.
+ */
+typedef struct lua_ev_native {
+    int loop_ref;
+    int flags;
+} lua_ev_native;
+
+#define LUA_EV_NATIVE_INIT { LUA_NOREF, 0 }
+
+#define lua_ev_native_init(native) \
+    ((native)->loop_ref = LUA_NOREF, (native)->flags = 0)
+
+typedef struct lua_ev_api {
+    /* LUA_EV_API_VERSION of the loaded lua-ev. */
+    int              version;
+
+    /* Returns the libev loop of the ev.Loop at idx, initializing the
+     * default loop if needed.  Raises a lua error if idx is not a
+     * loop. */
+    struct ev_loop*  (*check_loop)(lua_State *L, int idx);
+
+    /* Push ev.Loop.default. */
+    void             (*push_default_loop)(lua_State *L);
+
+    /* Must be called after starting a native watcher in the ev.Loop
+     * at loop_i, like watcher:start(loop, is_daemon).  Calling it
+     * again for a started watcher only changes is_daemon, -1 keeps
+     * the current value. */
+    void             (*native_started)(lua_State *L, int loop_i,
+                                       lua_ev_native* native, int is_daemon);
+
+    /* Must be called after a native watcher was stopped (by the
+     * module or by libev, like a timer without repeat).  Does
+     * nothing if the watcher is not started. */
+    void             (*native_stopped)(lua_State *L, lua_ev_native* native);
+} lua_ev_api;
+
+/* inline so that modules which include this header without calling
+ * lua_ev_api_get() do not get unused function warnings. */
+#if defined(__GNUC__)
+#define LUA_EV_API_INLINE static __inline__
+#elif defined(_MSC_VER)
+#define LUA_EV_API_INLINE static __inline
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 199901L
+#define LUA_EV_API_INLINE static inline
+#else
+#define LUA_EV_API_INLINE static
+#endif
+
+/**
+ * Returns the API of the loaded lua-ev, or NULL if require("ev") was
+ * not called yet in this lua state or if its version is older than
+ * min_version.
+ */
+LUA_EV_API_INLINE const lua_ev_api* lua_ev_api_get(lua_State *L, int min_version) {
+    const lua_ev_api* api;
+
+    lua_getfield(L, LUA_REGISTRYINDEX, LUA_EV_API_KEY);
+    api = (const lua_ev_api*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if ( NULL == api || api->version < min_version ) return NULL;
+    return api;
+}
+
+#endif
@@ -0,0 +1,246 @@
+#include <stdlib.h>
+
+#if defined(__GNUC__)
+#  define MEM_THREAD_LOCAL __thread
+#elif defined(_MSC_VER)
+#  define MEM_THREAD_LOCAL __declspec(thread)
+#else
+#  define MEM_THREAD_LOCAL
+#endif
+
+/* rough size of a lua table, of one of its slots and of a user value
+ * (64 bit). */
+#define MEM_TABLE_BYTES  56
+#define MEM_SLOT_BYTES   40
+#define MEM_UVALUE_BYTES 16
+
+/**
+ * Memory allocated by libev for one loop.  Kept apart from the loop
+ * userdata since libev may free (or keep, in the case of global signal
+ * arrays) memory after the loop object is gone.  Freed once the loop
+ * is gone and none of its blocks are left.
+ */
+struct lua_ev_mem {
+    long bytes;
+    long peak;
+    long blocks;
+    int  loop_alive;
+};
+
+/**
+ * Every block handed to libev is preceded by this header, padded so
+ * the block itself stays aligned for any type.
+ */
+typedef union mem_header {
+    struct {
+        lua_ev_mem* owner;
+        long        size;
+    } h;
+    double      align_d;
+    long double align_ld;
+    void*       align_p;
+} mem_header;
+
+/* the counters are not atomic, with loops in several threads the
+ * totals are only approximate. */
+static int mem_counting = 0;
+/* number of live blocks allocated by mem_alloc(). */
+static long mem_live_blocks = 0;
+/* memory libev allocated while no loop was the owner. */
+static lua_ev_mem mem_unowned = { 0, 0, 0, 1 };
+/* loop to charge new blocks to, set whenever lua-ev enters libev. */
+static MEM_THREAD_LOCAL lua_ev_mem* mem_owner = NULL;
+/* set once libev allocated memory with its own allocator. */
+static int mem_libev_used = 0;
+
+static void mem_charge(lua_ev_mem* owner, long bytes, long blocks) {
+    owner->bytes  += bytes;
+    owner->blocks += blocks;
+    if ( owner->bytes > owner->peak ) owner->peak = owner->bytes;
+    mem_live_blocks += blocks;
+    if ( 0 == owner->blocks && ! owner->loop_alive && owner != &mem_unowned ) free(owner);
+}
+
+/**
+ * The libev allocator: realloc() which remembers the size and owner
+ * of every block.
+ */
+static void* mem_alloc(void* ptr, long size) {
+    mem_header* hdr = ptr ? ((mem_header*)ptr) - 1 : NULL;
+    mem_header* new_hdr;
+
+    if ( 0 == size ) {
+        if ( hdr ) {
+            mem_charge(hdr->h.owner, -hdr->h.size, -1);
+            free(hdr);
+        }
+        return NULL;
+    }
+    new_hdr = realloc(hdr, sizeof(mem_header) + size);
+    if ( NULL == new_hdr ) return NULL; /* libev aborts */
+
+    if ( hdr ) {
+        mem_charge(new_hdr->h.owner, size - new_hdr->h.size, 0);
+    } else {
+        new_hdr->h.owner = mem_owner ? mem_owner : &mem_unowned;
+        mem_charge(new_hdr->h.owner, size, 1);
+    }
+    new_hdr->h.size = size;
+    return new_hdr + 1;
+}
+
+/**
+ * Route all libev memory through a counting allocator, so that
+ * loop:memory() can report what libev holds for each loop.  Must be
+ * called before any loop is used, since blocks allocated by libev's
+ * own allocator can't be handed to this one.  Passing false switches
+ * back to the system allocator, which is only possible while libev
+ * holds no counted memory.
+ *
+ * Usage:
+ *     ev.set_allocator(true)
+ *
+ * [+0, -0, e]
+ */
+static int mem_set_allocator(lua_State *L) {
+    int counting = lua_toboolean(L, 1);
+
+    if ( counting == mem_counting ) return 0;
+    if ( counting && mem_libev_used ) {
+        return luaL_error(L, "ev.set_allocator() must be called before any loop is used");
+    }
+    if ( ! counting && mem_live_blocks ) {
+        return luaL_error(L, "libev still holds %d blocks from the counting allocator",
+                          (int)mem_live_blocks);
+    }
+    ev_set_allocator(counting ? &mem_alloc : NULL);
+    mem_counting = counting;
+    return 0;
+}
+
+/**
+ * Called right before libev is asked to create the loop: sets up the
+ * accounting of the loop and makes it the owner of whatever libev
+ * allocates next.
+ *
+ * [-0, +0, -]
+ */
+static void mem_loop_init(lua_ev_loop* loop) {
+    if ( ! mem_counting ) {
+        mem_libev_used = 1;
+        return;
+    }
+    if ( NULL == loop->mem ) {
+        loop->mem = calloc(1, sizeof(lua_ev_mem));
+        if ( NULL != loop->mem ) loop->mem->loop_alive = 1;
+    }
+    mem_owner = loop->mem;
+}
+
+/**
+ * Called by the loop __gc after the loop was destroyed.
+ *
+ * [-0, +0, -]
+ */
+static void mem_loop_free(lua_ev_loop* loop) {
+    lua_ev_mem* mem = loop->mem;
+
+    if ( NULL == mem ) return;
+    loop->mem = NULL;
+    if ( mem_owner == mem ) mem_owner = NULL;
+    mem->loop_alive = 0;
+    if ( 0 == mem->blocks ) free(mem);
+}
+
+/**
+ * Estimate the bytes used by the table at idx.
+ *
+ * [-0, +0, -]
+ */
+static long mem_table_bytes(lua_State *L, int idx) {
+    long n     = 0;
+    long slots = 1;
+
+    lua_pushnil(L);
+    while ( lua_next(L, idx) ) {
+        lua_pop(L, 1);
+        n++;
+    }
+    if ( 0 == n ) return MEM_TABLE_BYTES;
+    while ( slots < n ) slots <<= 1;
+    return MEM_TABLE_BYTES + slots * MEM_SLOT_BYTES;
+}
+
+/**
+ * Returns how much memory this loop uses:
+ *   libev      - bytes libev allocated for the loop (fd table, timer
+ *                heap, pending queues, ...), nil unless
+ *                ev.set_allocator(true) was called.
+ *   libev_peak - the most libev ever held for the loop.
+ *   watchers   - bytes of the userdata of the started watchers.
+ *   fenv       - estimated bytes of their slots (the fenv tables
+ *                before lua 5.4, the user values after).
+ *   shadow     - estimated bytes of their shadow tables.
+ *   count      - number of started watchers.
+ * This walks the registry, so it is not meant for the hot path.
+ *
+ * Usage:
+ *     mem = loop:memory()
+ *
+ * [+1, -0, e]
+ */
+static int loop_memory(lua_State *L) {
+    lua_ev_loop* loop     = check_loop_data(L, 1);
+    long         watchers = 0;
+    long         fenv     = 0;
+    long         shadow   = 0;
+    long         count    = 0;
+    int          top;
+
+    check_loop_and_init(L, 1);
+    lua_settop(L, 1);
+    lua_pushnil(L);
+    while ( lua_next(L, LUA_REGISTRYINDEX) ) {
+        /* STACK: <loop>, <key>, <value> */
+        top = lua_gettop(L);
+        if ( lua_type(L, top) == LUA_TUSERDATA && lua_getmetatable(L, top) ) {
+            lua_rawgeti(L, -1, WATCHER_TYPE_MAGIC_IDX);
+            if ( lua_touserdata(L, -1) == watcher_magic ) {
+                obj_getslot(L, top, WATCHER_LOOP);
+                if ( lua_rawequal(L, -1, 1) ) {
+                    count++;
+                    watchers += (long)lua_objlen(L, top);
+#if LUA_VERSION_NUM >= 504
+                    fenv     += WATCHER_SLOTS * MEM_UVALUE_BYTES;
+#else
+                    lua_getuservalue(L, top);
+                    fenv     += mem_table_bytes(L, lua_gettop(L));
+                    lua_pop(L, 1);
+#endif
+                    obj_getslot(L, top, WATCHER_SHADOW);
+                    if ( lua_istable(L, -1) ) shadow += mem_table_bytes(L, lua_gettop(L));
+                }
+            }
+        }
+        lua_settop(L, top - 1);
+    }
+
+    lua_createtable(L, 0, 6);
+    if ( NULL != loop->mem ) {
+        lua_pushinteger(L, loop->mem->bytes);
+        lua_setfield(L, -2, "libev");
+        lua_pushinteger(L, loop->mem->peak);
+        lua_setfield(L, -2, "libev_peak");
+    }
+    lua_pushinteger(L, watchers);
+    lua_setfield(L, -2, "watchers");
+    lua_pushinteger(L, fenv);
+    lua_setfield(L, -2, "fenv");
+    lua_pushinteger(L, shadow);
+    lua_setfield(L, -2, "shadow");
+    lua_pushinteger(L, count);
+    lua_setfield(L, -2, "count");
+    return 1;
+}
+
+/* vi:set expandtab ts=4: */
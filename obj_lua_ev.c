@@ -33,28 +33,80 @@ static void *lua_ev_checkobject(lua_State *L, int idx, const char *type_mt) {
         }
     }
     /* wrong type. */
-    luaL_typerror(L, idx, type_mt);
+    obj_typerror(L, idx, type_mt);
     return NULL;
 }
 
+/**
+ * luaL_typerror() from lua 5.1, which later versions dropped.
+ *
+ * [-0, +0, v]
+ */
+static int obj_typerror(lua_State *L, int narg, const char *tname) {
+    const char *msg = lua_pushfstring(L, "%s expected, got %s",
+                                      tname, luaL_typename(L, narg));
+    return luaL_argerror(L, narg, msg);
+}
 
 /**
  * Create a new "object" with a metatable of tname and allocate size
- * bytes for the object.  Also create an fenv associated with the
- * object.  This fenv is used to keep track of lua objects so that the
+ * bytes for the object.  Also create nslots slots associated with the
+ * object.  These are used to keep track of lua objects so that the
  * garbage collector doesn't prematurely collect lua objects that are
- * referenced by the C data structure.
+ * referenced by the C data structure.  With lua 5.4 the slots are
+ * user values of the userdata, before that they are stored in the
+ * fenv (or user value) table.
  *
  * [-0, +1, ?]
  */
-static void* obj_new(lua_State* L, size_t size, const char* tname) {
+static void* obj_new(lua_State* L, size_t size, const char* tname, int nslots) {
     void* obj;
 
+#if LUA_VERSION_NUM >= 504
+    obj = lua_newuserdatauv(L, size, nslots);
+#else
     obj = lua_newuserdata(L, size);
+    if ( nslots ) {
+        lua_createtable(L, nslots, 0);
+        lua_setuservalue(L, -2);
+    }
+#endif
     lua_ev_getmetatable(L, tname);
     lua_setmetatable(L, -2);
 
     return obj;
 }
 
+/**
+ * Push the value in slot of the object at idx.
+ *
+ * [-0, +1, -]
+ */
+static void obj_getslot(lua_State* L, int idx, int slot) {
+#if LUA_VERSION_NUM >= 504
+    lua_getiuservalue(L, idx, slot);
+#else
+    lua_getuservalue(L, idx);
+    lua_rawgeti(L, -1, slot);
+    lua_remove(L, -2);
+#endif
+}
+
+/**
+ * Pop a value and store it in slot of the object at idx.
+ *
+ * [-1, +0, m]
+ */
+static void obj_setslot(lua_State* L, int idx, int slot) {
+#if LUA_VERSION_NUM >= 504
+    lua_setiuservalue(L, idx, slot);
+#else
+    idx = abs_index(L, idx);
+    lua_getuservalue(L, idx);
+    lua_insert(L, -2);
+    lua_rawseti(L, -2, slot);
+    lua_pop(L, 1);
+#endif
+}
+
 /* vi:set expandtab ts=4: */
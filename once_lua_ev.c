@@ -0,0 +1,194 @@
+#include <stdlib.h>
+
+/* nodes are allocated this many at a time. */
+#define ONCE_BLOCK_SIZE 64
+
+/**
+ * loop:once() is built on ev_once(), which allocates (and frees) the
+ * io and timer watchers itself.  The argument passed to ev_once() is
+ * a node from a per loop pool which holds a registry reference to the
+ * callback.  While any node is pending the pool holds a reference to
+ * the loop object, like a started watcher does.  Nodes are allocated
+ * in blocks which are only freed with the loop.
+ */
+struct lua_ev_once {
+    lua_ev_once*  next; /* in the free list. */
+    lua_ev_loop*  loop;
+    int           fn_ref;
+};
+
+typedef struct once_block once_block;
+
+struct once_block {
+    once_block*   next;
+    lua_ev_once   nodes[ONCE_BLOCK_SIZE];
+};
+
+struct lua_ev_once_pool {
+    lua_ev_once*  free;
+    once_block*   blocks;
+    int           pending;
+    int           loop_ref;
+};
+
+/**
+ * Wait for fd to become ready for events, or for timeout seconds,
+ * whichever happens first, and then call the callback once.  Pass a
+ * negative (or nil) fd to only wait for the timeout, and a nil
+ * timeout to wait for the fd forever.
+ *
+ * Usage:
+ *     loop:once(fd, events, timeout, function(loop, revents) ... end)
+ *
+ * revents is ev.READ and/or ev.WRITE, or ev.TIMEOUT.
+ *
+ * [+0, -0, e]
+ */
+static int loop_once(lua_State *L) {
+    struct ev_loop*  loop    = *check_loop_and_init(L, 1);
+    lua_ev_loop*     lloop   = check_loop_data(L, 1);
+    int              fd      = luaL_optint(L, 2, -1);
+    int              events  = luaL_optint(L, 3, 0);
+    ev_tstamp        timeout = luaL_optnumber(L, 4, -1);
+    lua_ev_once_pool* pool;
+    lua_ev_once*     once;
+
+    luaL_checktype(L, 5, LUA_TFUNCTION);
+    if ( fd >= 0 && 0 == ( events & ( EV_READ | EV_WRITE ) ) )
+        luaL_argerror(L, 3, "events must contain ev.READ or ev.WRITE");
+    if ( fd < 0 && timeout < 0 )
+        luaL_argerror(L, 4, "need a timeout if there is no fd");
+
+    once = once_alloc(lloop);
+    if ( NULL == once ) return luaL_error(L, "out of memory");
+    pool = lloop->once;
+
+    lua_pushvalue(L, 5);
+    once->fn_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    if ( 0 == pool->pending++ ) {
+        lua_pushvalue(L, 1);
+        pool->loop_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+
+    ev_once(loop, fd, events & ( EV_READ | EV_WRITE ), timeout, &once_cb, once);
+    return 0;
+}
+
+/**
+ * Take a node from the pool of the loop, allocating the pool or a new
+ * block if needed.
+ *
+ * [-0, +0, -]
+ */
+static lua_ev_once* once_alloc(lua_ev_loop* loop) {
+    lua_ev_once_pool* pool = loop->once;
+    lua_ev_once*      once;
+
+    if ( NULL == pool ) {
+        pool = calloc(1, sizeof(lua_ev_once_pool));
+        if ( NULL == pool ) return NULL;
+        pool->loop_ref = LUA_NOREF;
+        loop->once = pool;
+    }
+    if ( NULL == pool->free ) {
+        once_block* block = malloc(sizeof(once_block));
+        int         i;
+
+        if ( NULL == block ) return NULL;
+        block->next  = pool->blocks;
+        pool->blocks = block;
+        for ( i = 0; i < ONCE_BLOCK_SIZE; i++ ) {
+            block->nodes[i].next = pool->free;
+            pool->free = &block->nodes[i];
+        }
+    }
+    once = pool->free;
+    pool->free = once->next;
+    once->loop = loop;
+    return once;
+}
+
+/**
+ * Called by libev when the fd is ready or the timeout expired: return
+ * the node to the pool and call the callback with the loop and
+ * revents.  The tracer, the watchdog and watcher_error() get a nil
+ * watcher.
+ *
+ * [+0, -0, m]
+ */
+static void once_cb(int revents, void* arg) {
+    lua_ev_once*      once  = arg;
+    lua_ev_loop*      lloop = once->loop;
+    lua_ev_once_pool* pool  = lloop->once;
+    lua_State*        L     = ev_userdata(lloop->loop);
+    lua_ev_tracer*    tracer = lloop->tracer;
+#ifndef _WIN32
+    lua_ev_watchdog*  watchdog = lloop->watchdog;
+#endif
+    double            started = 0;
+    int               result;
+    int               base;
+
+    result = lua_checkstack(L, 8);
+    assert(result != 0 /* able to allocate enough space on lua stack */);
+
+    push_traceback(L);
+    base = lua_gettop(L);
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, pool->loop_ref);
+    lua_pushnil(L); /* no watcher for watcher_error(). */
+    lua_rawgeti(L, LUA_REGISTRYINDEX, once->fn_ref);
+    /* STACK: <traceback>, <loop>, nil, <fn> */
+
+    luaL_unref(L, LUA_REGISTRYINDEX, once->fn_ref);
+    once->next = pool->free;
+    pool->free = once;
+    if ( 0 == --pool->pending ) {
+        /* the loop is still on the stack. */
+        luaL_unref(L, LUA_REGISTRYINDEX, pool->loop_ref);
+        pool->loop_ref = LUA_NOREF;
+    }
+
+    lua_pushvalue(L, base + 1);
+    lua_pushinteger(L, revents);
+
+    /* like watcher_cb_args(), with a nil watcher. */
+    if ( tracer ) started = probe_now();
+#ifndef _WIN32
+    if ( watchdog ) watchdog_enter(watchdog, L, NULL, base + 2);
+#endif
+
+    result = lua_pcall(L, 2, 0, base);
+
+#ifndef _WIN32
+    if ( watchdog && watchdog == lloop->watchdog ) watchdog_leave(watchdog);
+#endif
+    /* the callback may have used libev on some other loop. */
+    if ( lloop->mem ) mem_owner = lloop->mem;
+    if ( tracer && tracer == lloop->tracer ) {
+        trace_callback(L, tracer, NULL, base + 2, revents, started, result != 0);
+    }
+    if ( result ) watcher_error(L, NULL, base + 2, base + 1);
+    lua_settop(L, base - 1); /* pop traceback, loop and nil. */
+}
+
+/**
+ * Called by the loop __gc.  Pending nodes can only be left when the
+ * lua state is closed, their callbacks never run after this.
+ *
+ * [+0, -0, -]
+ */
+static void once_free(lua_ev_loop* loop) {
+    lua_ev_once_pool* pool = loop->once;
+
+    if ( NULL == pool ) return;
+    loop->once = NULL;
+    while ( NULL != pool->blocks ) {
+        once_block* block = pool->blocks;
+        pool->blocks = block->next;
+        free(block);
+    }
+    free(pool);
+}
+
+/* vi:set expandtab ts=4: */
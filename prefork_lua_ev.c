@@ -0,0 +1,565 @@
+#ifndef _WIN32
+#include <errno.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/**
+ * One worker process.  A worker whose pid is 0 is waiting for its
+ * respawn timer (or for fork() to succeed).  Workers are malloc()ed
+ * one by one, since libev keeps pointers to their watchers.
+ */
+struct lua_ev_prefork_worker {
+    ev_child               child;
+    ev_timer               respawn;
+    lua_ev_prefork*        prefork;
+    lua_ev_prefork_worker* next;
+    pid_t                  pid;
+    int                    id;
+    /* replaced by reload(), not respawned once it exited. */
+    int                    retiring;
+    /* consecutive exits within max_backoff seconds of the start. */
+    int                    crashes;
+    ev_tstamp              started;
+};
+
+/**
+ * The ev.Prefork object returned by ev.prefork().  It keeps a
+ * registry reference to itself until it was stopped and all workers
+ * exited, its raw libev watchers keep the default loop running until
+ * then.
+ */
+struct lua_ev_prefork {
+    ev_signal              reload;
+    ev_signal              stop;
+    /* NULL in the worker processes. */
+    struct ev_loop*        loop;
+    lua_ev_prefork_worker* workers;
+    int                    ref;
+    int                    stopping;
+    int                    stop_signum;
+    double                 backoff;
+    double                 max_backoff;
+};
+
+/**
+ * Fork <workers> processes which run init(loop, id) with the default
+ * loop re-initialized by loop:fork(), then run the default loop and
+ * exit once it returns.  Workers inherit all fds, so they share the
+ * listening sockets opened before.  Workers are watched with child
+ * watchers on the default loop and respawned when they exit, after
+ * backoff seconds, doubled for every exit within max_backoff seconds
+ * of the start of a worker.  Takes a single table argument with these
+ * fields:
+ *   workers       - number of worker processes.
+ *   init          - function called as init(loop, id) in each worker,
+ *                   id is 1 to workers.
+ *   on_exit       - optional function called as
+ *                   on_exit(loop, id, pid, exit_status, term_signal)
+ *                   after a worker exited.
+ *   backoff       - optional respawn delay, defaults to 0.1 seconds.
+ *   max_backoff   - optional maximum respawn delay, defaults to 10.
+ *   reload_signal - optional signal which calls prefork:reload(),
+ *                   defaults to SIGHUP, false for none.
+ *   stop_signal   - optional signal which calls prefork:stop() and
+ *                   which is sent to the workers, defaults to
+ *                   SIGTERM, false to only send SIGTERM.
+ *
+ * Returns the ev.Prefork object, in the master process only.
+ *
+ * Usage:
+ *     ev.prefork{ workers = 4, init = function(loop, id) ... end }
+ *     ev.Loop.default:loop()
+ *
+ * [+1, -0, e]
+ */
+static int prefork_new(lua_State *L) {
+    lua_ev_prefork* prefork;
+    struct ev_loop* loop;
+    int             workers, reload_signum, id;
+    int             loop_i, init_i, on_exit_i, prefork_i;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_settop(L, 1);
+
+    push_default_loop(L);
+    loop_i = lua_gettop(L);
+    loop   = *check_loop_and_init(L, loop_i);
+
+    lua_getfield(L, 1, "workers");
+    workers = lua_tointeger(L, -1);
+    luaL_argcheck(L, workers > 0, 1, "workers must be a positive number");
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "init");
+    init_i = lua_gettop(L);
+    luaL_argcheck(L, lua_isfunction(L, init_i), 1, "init must be a function");
+
+    lua_getfield(L, 1, "on_exit");
+    on_exit_i = lua_gettop(L);
+    luaL_argcheck(L, lua_isnil(L, on_exit_i) || lua_isfunction(L, on_exit_i),
+                  1, "on_exit must be a function");
+
+    prefork = (lua_ev_prefork*)obj_new(L, sizeof(lua_ev_prefork), PREFORK_MT, PREFORK_SLOTS);
+    prefork_i = lua_gettop(L);
+    memset(prefork, 0, sizeof(lua_ev_prefork));
+    prefork->ref = LUA_NOREF;
+    lua_pushvalue(L, init_i);
+    obj_setslot(L, prefork_i, PREFORK_INIT);
+    lua_pushvalue(L, on_exit_i);
+    obj_setslot(L, prefork_i, PREFORK_ON_EXIT);
+
+    lua_getfield(L, 1, "backoff");
+    prefork->backoff = luaL_optnumber(L, -1, 0.1);
+    lua_getfield(L, 1, "max_backoff");
+    prefork->max_backoff = luaL_optnumber(L, -1, 10);
+    luaL_argcheck(L, prefork->backoff >= 0 && prefork->max_backoff >= prefork->backoff,
+                  1, "backoff must be between 0 and max_backoff");
+    lua_pop(L, 2);
+    reload_signum        = prefork_opt_signal(L, "reload_signal", SIGHUP);
+    prefork->stop_signum = prefork_opt_signal(L, "stop_signal", SIGTERM);
+
+    prefork->loop = loop;
+    lua_pushvalue(L, prefork_i);
+    prefork->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    ev_signal_init(&prefork->reload, &prefork_reload_cb, reload_signum);
+    ev_signal_init(&prefork->stop, &prefork_stop_cb, prefork->stop_signum);
+    if ( reload_signum )        ev_signal_start(loop, &prefork->reload);
+    if ( prefork->stop_signum ) ev_signal_start(loop, &prefork->stop);
+
+    for ( id = 1; id <= workers; id++ ) {
+        prefork_spawn(L, prefork_worker_new(prefork, id));
+    }
+
+    lua_pushvalue(L, prefork_i);
+    return 1;
+}
+
+/**
+ * Get the signal number in the field name of the options table, def
+ * if it is nil and 0 if it is false.
+ *
+ * [-0, +0, v]
+ */
+static int prefork_opt_signal(lua_State *L, const char* name, int def) {
+    int signum = def;
+
+    lua_getfield(L, 1, name);
+    if ( lua_isnumber(L, -1) ) {
+        signum = lua_tointeger(L, -1);
+        luaL_argcheck(L, signum > 0, 1, lua_pushfstring(L, "invalid %s", name));
+    } else if ( lua_isboolean(L, -1) && ! lua_toboolean(L, -1) ) {
+        signum = 0;
+    } else {
+        luaL_argcheck(L, lua_isnil(L, -1), 1,
+                      lua_pushfstring(L, "%s must be a signal number or false", name));
+    }
+    lua_pop(L, 1);
+    return signum;
+}
+
+/**
+ * Allocate a worker and add it to the list of workers.
+ *
+ * [-0, +0, -]
+ */
+static lua_ev_prefork_worker* prefork_worker_new(lua_ev_prefork* prefork, int id) {
+    lua_ev_prefork_worker* worker = calloc(1, sizeof(lua_ev_prefork_worker));
+
+    if ( NULL == worker ) {
+        fprintf(stderr, "ev.prefork: out of memory\n");
+        abort();
+    }
+    ev_child_init(&worker->child, &prefork_child_cb, 0, 0);
+    ev_timer_init(&worker->respawn, &prefork_respawn_cb, 0, 0);
+    worker->prefork = prefork;
+    worker->id      = id;
+    worker->next    = prefork->workers;
+    prefork->workers = worker;
+    return worker;
+}
+
+/**
+ * Remove the worker from the list of workers and free it.  Its
+ * watchers must be stopped.
+ *
+ * [-0, +0, -]
+ */
+static void prefork_worker_free(lua_ev_prefork* prefork, lua_ev_prefork_worker* worker) {
+    lua_ev_prefork_worker** link = &prefork->workers;
+
+    while ( *link != worker ) link = &(*link)->next;
+    *link = worker->next;
+    free(worker);
+}
+
+/**
+ * Fork the worker process.  If fork() fails, it is retried like a
+ * worker which crashed.  Never returns in the worker process.
+ *
+ * [-0, +0, m]
+ */
+static void prefork_spawn(lua_State *L, lua_ev_prefork_worker* worker) {
+    lua_ev_prefork* prefork = worker->prefork;
+    sigset_t        all, mask;
+    pid_t           pid;
+
+    /* or stdio buffered by now would be written by each worker too. */
+    fflush(NULL);
+    /* signals sent to the worker before it reset the handlers of the
+     * master must not get lost in them. */
+    sigfillset(&all);
+    sigprocmask(SIG_SETMASK, &all, &mask);
+    pid = fork();
+    if ( 0 == pid ) prefork_worker(L, worker, &mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+
+    /* the loop may not have run yet, as in ev.prefork{}. */
+    ev_now_update(prefork->loop);
+    worker->started = ev_now(prefork->loop);
+    if ( pid < 0 ) {
+        fprintf(stderr, "ev.prefork: fork() failed: %s\n", strerror(errno));
+        prefork_schedule(worker);
+        return;
+    }
+    worker->pid = pid;
+    ev_child_set(&worker->child, pid, 0);
+    ev_child_start(prefork->loop, &worker->child);
+}
+
+/**
+ * Runs in the worker process: forget about the other workers, make
+ * the default loop usable after fork(), restore the signal mask, call
+ * init(loop, id) and run the default loop.  When called from a
+ * callback of the master the loop runs nested in that callback, which
+ * never returns.
+ *
+ * [-0, +0, -]
+ */
+static void prefork_worker(lua_State *L, lua_ev_prefork_worker* worker, const sigset_t* mask) {
+    lua_ev_prefork*        prefork = worker->prefork;
+    struct ev_loop*        loop    = prefork->loop;
+    lua_ev_prefork_worker* other;
+    int                    base;
+
+    for ( other = prefork->workers; other; other = other->next ) {
+        ev_child_stop(loop, &other->child);
+        ev_timer_stop(loop, &other->respawn);
+    }
+    /* back to the default actions of the signals. */
+    ev_signal_stop(loop, &prefork->reload);
+    ev_signal_stop(loop, &prefork->stop);
+    prefork->loop = NULL;
+    ev_default_fork();
+    sigprocmask(SIG_SETMASK, mask, NULL);
+
+    push_traceback(L);
+    base = lua_gettop(L);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, prefork->ref);
+    obj_getslot(L, base + 1, PREFORK_INIT);
+    push_default_loop(L);
+    lua_pushinteger(L, worker->id);
+    if ( 0 == lua_pcall(L, 2, 0, base) ) {
+        lua_pushcfunction(L, loop_run);
+        push_default_loop(L);
+        if ( 0 == lua_pcall(L, 1, 0, base) ) exit(0);
+    }
+    fprintf(stderr, "ev.prefork: worker %d failed: %s\n", worker->id, lua_tostring(L, -1));
+    exit(1);
+}
+
+/**
+ * Start the respawn timer of the worker, the delay doubles for every
+ * exit within max_backoff seconds of the start.
+ *
+ * [-0, +0, -]
+ */
+static void prefork_schedule(lua_ev_prefork_worker* worker) {
+    lua_ev_prefork* prefork = worker->prefork;
+    double          delay   = 0;
+
+    if ( ev_now(prefork->loop) - worker->started < prefork->max_backoff ) {
+        delay = prefork->backoff;
+        if ( worker->crashes < 30 ) delay *= (double)(1 << worker->crashes);
+        if ( delay > prefork->max_backoff ) delay = prefork->max_backoff;
+        worker->crashes++;
+    } else {
+        worker->crashes = 0;
+    }
+    ev_timer_set(&worker->respawn, delay, 0);
+    ev_timer_start(prefork->loop, &worker->respawn);
+}
+
+/**
+ * Child watcher callback of a worker: call on_exit and respawn the
+ * worker, unless it retired or the prefork object was stopped.
+ *
+ * [+0, -0, m]
+ */
+static void prefork_child_cb(struct ev_loop* loop, ev_child* child, int revents) {
+    lua_ev_prefork_worker* worker  = (lua_ev_prefork_worker*)child;
+    lua_ev_prefork*        prefork = worker->prefork;
+    lua_State*             L       = ev_userdata(loop);
+    lua_ev_loop*           lloop;
+    int                    id      = worker->id;
+    int                    rpid    = child->rpid;
+    int                    rstatus = child->rstatus;
+    int                    result;
+    int                    base;
+
+    ev_child_stop(loop, child);
+    worker->pid = 0;
+    if ( prefork->stopping || worker->retiring ) {
+        prefork_worker_free(prefork, worker);
+    } else {
+        prefork_schedule(worker);
+    }
+
+    push_traceback(L);
+    base = lua_gettop(L);
+    /* keeps the object alive even if on_exit stops it. */
+    lua_rawgeti(L, LUA_REGISTRYINDEX, prefork->ref);
+    push_default_loop(L);
+    lloop = lua_touserdata(L, base + 2);
+    obj_getslot(L, base + 1, PREFORK_ON_EXIT);
+    if ( lua_isfunction(L, -1) ) {
+        lua_pushvalue(L, base + 2);
+        lua_pushinteger(L, id);
+        lua_pushinteger(L, rpid);
+        spawn_push_rstatus(L, rstatus);
+        result = lua_pcall(L, 5, 0, base);
+
+        /* the callback may have used libev on some other loop. */
+        if ( lloop->mem ) mem_owner = lloop->mem;
+        if ( result ) watcher_error(L, NULL, base + 1, base + 2);
+    } else {
+        lua_pop(L, 1);
+    }
+    prefork_done(L, prefork);
+    lua_settop(L, base - 1);
+}
+
+/**
+ * Respawn timer callback of a worker.
+ *
+ * [+0, -0, m]
+ */
+static void prefork_respawn_cb(struct ev_loop* loop, ev_timer* timer, int revents) {
+    lua_ev_prefork_worker* worker = (lua_ev_prefork_worker*)
+        ((char*)timer - offsetof(lua_ev_prefork_worker, respawn));
+
+    prefork_spawn(ev_userdata(loop), worker);
+}
+
+/**
+ * Signal watcher callbacks, see prefork_reload() and prefork_stop().
+ *
+ * [+0, -0, m]
+ */
+static void prefork_reload_cb(struct ev_loop* loop, ev_signal* sig, int revents) {
+    lua_ev_prefork* prefork = (lua_ev_prefork*)
+        ((char*)sig - offsetof(lua_ev_prefork, reload));
+
+    prefork_reload(ev_userdata(loop), prefork);
+}
+
+static void prefork_stop_cb(struct ev_loop* loop, ev_signal* sig, int revents) {
+    lua_ev_prefork* prefork = (lua_ev_prefork*)
+        ((char*)sig - offsetof(lua_ev_prefork, stop));
+
+    prefork_signal_all(prefork, prefork->stop_signum);
+    prefork_done(ev_userdata(loop), prefork);
+}
+
+/**
+ * Fork a new process for every worker, and send the stop signal to
+ * the old ones, which are not respawned once they exited.  Workers
+ * waiting to be respawned are respawned right away.
+ *
+ * [-0, +0, m]
+ */
+static void prefork_reload(lua_State *L, lua_ev_prefork* prefork) {
+    lua_ev_prefork_worker* worker = prefork->workers;
+    lua_ev_prefork_worker* next;
+
+    if ( prefork->stopping ) return;
+    /* new workers are added in front of the ones replaced here. */
+    for ( ; worker; worker = next ) {
+        next = worker->next;
+        if ( worker->retiring ) continue;
+        worker->crashes = 0;
+        if ( 0 == worker->pid ) {
+            ev_timer_stop(prefork->loop, &worker->respawn);
+            prefork_spawn(L, worker);
+        } else {
+            /* the replacement first, so there is no gap in capacity. */
+            prefork_spawn(L, prefork_worker_new(prefork, worker->id));
+            worker->retiring = 1;
+            kill(worker->pid, prefork->stop_signum ? prefork->stop_signum : SIGTERM);
+        }
+    }
+}
+
+/**
+ * Stop respawning workers and send them signum.  Workers waiting to
+ * be respawned are gone right away.
+ *
+ * [-0, +0, -]
+ */
+static void prefork_signal_all(lua_ev_prefork* prefork, int signum) {
+    lua_ev_prefork_worker* worker = prefork->workers;
+    lua_ev_prefork_worker* next;
+
+    prefork->stopping = 1;
+    for ( ; worker; worker = next ) {
+        next = worker->next;
+        if ( worker->pid ) {
+            kill(worker->pid, signum ? signum : SIGTERM);
+        } else {
+            ev_timer_stop(prefork->loop, &worker->respawn);
+            prefork_worker_free(prefork, worker);
+        }
+    }
+}
+
+/**
+ * Once stopped and all workers exited, stop the signal watchers and
+ * drop the reference to the prefork object.
+ *
+ * [-0, +0, -]
+ */
+static void prefork_done(lua_State *L, lua_ev_prefork* prefork) {
+    if ( ! prefork->stopping || prefork->workers ) return;
+    ev_signal_stop(prefork->loop, &prefork->reload);
+    ev_signal_stop(prefork->loop, &prefork->stop);
+    luaL_unref(L, LUA_REGISTRYINDEX, prefork->ref);
+    prefork->ref = LUA_NOREF;
+}
+
+/**
+ * Check that the prefork object at narg is used by the master
+ * process.
+ *
+ * [-0, +0, v]
+ */
+static lua_ev_prefork* check_prefork_master(lua_State *L, int narg) {
+    lua_ev_prefork* prefork = check_prefork(L, narg);
+
+    if ( NULL == prefork->loop ) {
+        luaL_error(L, "ev.Prefork can only be used by the master process");
+    }
+    return prefork;
+}
+
+/**
+ * Create the prefork metatable in the registry.
+ *
+ * [-0, +1, ?]
+ */
+static int create_prefork_mt(lua_State *L) {
+
+    static luaL_reg methods[] = {
+        { "pids",   prefork_pids },
+        { "reload", prefork_reload_method },
+        { "stop",   prefork_stop },
+        { NULL, NULL }
+    };
+    lua_ev_newmetatable(L, PREFORK_MT);
+
+    lua_createtable(L, 0, 3);
+    lua_ev_setfuncs(L, methods);
+    lua_setfield(L, -2, "__index");
+
+    lua_pushcfunction(L, prefork_gc);
+    lua_setfield(L, -2, "__gc");
+
+    lua_pushboolean(L, 0);
+    lua_setfield(L, -2, "__metatable");
+    return 1;
+}
+
+/**
+ * Returns a table of worker id => pid of the running workers, not
+ * including workers replaced by reload() which did not exit yet.
+ *
+ * Usage:
+ *     pids = prefork:pids()
+ *
+ * [+1, -0, e]
+ */
+static int prefork_pids(lua_State *L) {
+    lua_ev_prefork*        prefork = check_prefork_master(L, 1);
+    lua_ev_prefork_worker* worker;
+
+    lua_newtable(L);
+    for ( worker = prefork->workers; worker; worker = worker->next ) {
+        if ( worker->retiring || 0 == worker->pid ) continue;
+        lua_pushinteger(L, worker->pid);
+        lua_rawseti(L, -2, worker->id);
+    }
+    return 1;
+}
+
+/**
+ * Replace all workers with new processes, the old ones get the stop
+ * signal and are not respawned.  Called on the reload signal.
+ *
+ * Usage:
+ *     prefork:reload()
+ *
+ * [+0, -0, e]
+ */
+static int prefork_reload_method(lua_State *L) {
+    prefork_reload(L, check_prefork_master(L, 1));
+    return 0;
+}
+
+/**
+ * Stop respawning workers and send them signum, which defaults to the
+ * stop signal.  Once all workers exited, the prefork object no longer
+ * keeps the default loop running.  Called on the stop signal.
+ *
+ * Usage:
+ *     prefork:stop([signum])
+ *
+ * [+0, -0, e]
+ */
+static int prefork_stop(lua_State *L) {
+    lua_ev_prefork* prefork = check_prefork_master(L, 1);
+
+    prefork_signal_all(prefork, luaL_optint(L, 2, prefork->stop_signum));
+    prefork_done(L, prefork);
+    return 0;
+}
+
+/**
+ * Only collected once stopped with all workers gone, or when the lua
+ * state is closed.
+ *
+ * [-0, +0, -]
+ */
+static int prefork_gc(lua_State *L) {
+    lua_ev_prefork* prefork = check_prefork(L, 1);
+
+    while ( prefork->workers ) {
+        if ( prefork->loop ) {
+            ev_child_stop(prefork->loop, &prefork->workers->child);
+            ev_timer_stop(prefork->loop, &prefork->workers->respawn);
+        }
+        prefork_worker_free(prefork, prefork->workers);
+    }
+    if ( prefork->loop ) {
+        ev_signal_stop(prefork->loop, &prefork->reload);
+        ev_signal_stop(prefork->loop, &prefork->stop);
+    }
+    return 0;
+}
+
+#endif /* _WIN32 */
+
+/* vi:set expandtab ts=4: */
@@ -0,0 +1,459 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define PROBE_DEFAULT_INTERVAL    0.001
+#define PROBE_DEFAULT_MAX_SAMPLES 100000
+
+/**
+ * Per tick lateness, split into time lost in the backend poll and
+ * time lost before/after it running other callbacks.
+ */
+typedef struct probe_sample {
+    double total;
+    double poll;
+    double queue;
+} probe_sample;
+
+/**
+ * The timer must be the first member, since that is what
+ * watcher_cb() and GET_WATCHER_DATA() operate on.  All times are
+ * taken from the monotonic clock.
+ */
+struct lua_ev_probe {
+    ev_timer      timer;
+    /* bracket the backend poll of every loop iteration. */
+    ev_prepare    prepare;
+    ev_check      check;
+    ev_tstamp     interval;
+    ev_tstamp     duration;
+    double        started;
+    double        expected;
+    double        before_poll;
+    double        after_poll;
+    double        last;
+    /* reservoir of samples, once full each tick replaces a random one. */
+    probe_sample* samples;
+    int           num_samples;
+    int           max_samples;
+    unsigned int  seed;
+    unsigned long ticks;
+    unsigned long missed;
+    probe_sample  sum;
+    probe_sample  max;
+};
+
+/**
+ * Create a table for ev.Probe that gives access to the constructor for
+ * probe objects.
+ *
+ * [-0, +1, ?]
+ */
+static int luaopen_ev_probe(lua_State *L) {
+    lua_pop(L, create_probe_mt(L));
+
+    lua_createtable(L, 0, 1);
+
+    lua_pushcfunction(L, probe_new);
+    lua_setfield(L, -2, "new");
+
+    return 1;
+}
+
+/**
+ * Create the probe metatable in the registry.
+ *
+ * [-0, +1, ?]
+ */
+static int create_probe_mt(lua_State *L) {
+
+    static luaL_reg methods[] = {
+        { "stop",          probe_stop },
+        { "start",         probe_start },
+        { "report",        probe_report },
+        { NULL, NULL }
+    };
+    add_watcher_mt(L, methods, PROBE_MT);
+
+    /* free the samples. */
+    lua_pushcfunction(L, probe_gc);
+    lua_setfield(L, -2, "__gc");
+    return 1;
+}
+
+/**
+ * Seconds on the monotonic clock, falls back to ev_time().
+ */
+static double probe_now(void) {
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    if ( 0 == clock_gettime(CLOCK_MONOTONIC, &ts) ) {
+        return ts.tv_sec + ts.tv_nsec * 1e-9;
+    }
+#endif
+    return ev_time();
+}
+
+/**
+ * Create a new probe object.  Arguments:
+ *   1 - callback function, called with the report once duration is over.
+ *   2 - interval (seconds between ticks, defaults to 1ms).
+ *   3 - duration (seconds to run, 0 means until stopped).
+ *   4 - max_samples (size of the sample reservoir).
+ *
+ * @see watcher_new()
+ *
+ * [+1, -0, ?]
+ */
+static int probe_new(lua_State* L) {
+    ev_tstamp     interval    = luaL_optnumber(L, 2, PROBE_DEFAULT_INTERVAL);
+    ev_tstamp     duration    = luaL_optnumber(L, 3, 0);
+    int           max_samples = luaL_optint(L, 4, PROBE_DEFAULT_MAX_SAMPLES);
+    lua_ev_probe* probe;
+
+    if ( interval <= 0.0 )
+        luaL_argerror(L, 2, "interval must be greater than 0");
+    if ( duration < 0.0 )
+        luaL_argerror(L, 3, "duration must be greater than or equal to 0");
+    if ( max_samples <= 0 )
+        luaL_argerror(L, 4, "max_samples must be greater than 0");
+
+    probe = (lua_ev_probe*)watcher_new(L, sizeof(lua_ev_probe), PROBE_MT);
+    memset(probe, 0, sizeof(lua_ev_probe));
+    ev_timer_init(&probe->timer, &probe_timer_cb, interval, 0.);
+    ev_prepare_init(&probe->prepare, &probe_prepare_cb);
+    ev_check_init(&probe->check, &probe_check_cb);
+    /* take the timestamps as close to the backend poll as possible. */
+    ev_set_priority(&probe->prepare, EV_MINPRI);
+    ev_set_priority(&probe->check, EV_MAXPRI);
+    probe->interval    = interval;
+    probe->duration    = duration;
+    probe->max_samples = max_samples;
+
+    probe->samples = malloc(max_samples * sizeof(probe_sample));
+    if ( NULL == probe->samples ) {
+        return luaL_error(L, "unable to allocate %d samples", max_samples);
+    }
+    return 1;
+}
+
+/**
+ * Start probing latency in this loop.  Takes a table with these
+ * optional fields:
+ *   interval    - seconds between ticks (default 0.001).
+ *   duration    - seconds to run, 0 means until stopped (default 1).
+ *   on_report   - called as on_report(loop, probe, ev.TIMEOUT, report)
+ *                 once duration is over.
+ *   daemon      - don't keep the loop running just for the probe.
+ *   max_samples - size of the sample reservoir (default 100000).
+ *
+ * Usage:
+ *     probe = loop:probe_latency{ interval = 0.005, duration = 10 }
+ *
+ * [+1, -0, e]
+ */
+static int probe_latency(lua_State *L) {
+    check_loop_and_init(L, 1);
+    if ( lua_isnoneornil(L, 2) ) {
+        lua_settop(L, 1);
+        lua_newtable(L);
+    }
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 2);
+
+    /* probe = ev.Probe.new(on_report, interval, duration, max_samples) */
+    lua_pushcfunction(L, probe_new);
+    lua_getfield(L, 2, "on_report");
+    if ( lua_isnil(L, -1) ) {
+        lua_pop(L, 1);
+        lua_pushcfunction(L, probe_on_report);
+    }
+    lua_getfield(L, 2, "interval");
+    lua_getfield(L, 2, "duration");
+    if ( lua_isnil(L, -1) ) {
+        lua_pop(L, 1);
+        lua_pushnumber(L, 1);
+    }
+    lua_getfield(L, 2, "max_samples");
+    lua_call(L, 4, 1);
+
+    /* probe:start(loop, daemon) */
+    lua_pushcfunction(L, probe_start);
+    lua_pushvalue(L, 3);
+    lua_pushvalue(L, 1);
+    lua_getfield(L, 2, "daemon");
+    lua_call(L, 3, 0);
+
+    return 1;
+}
+
+/**
+ * Default on_report callback, the report is still available through
+ * probe:report().
+ */
+static int probe_on_report(lua_State *L) {
+    return 0;
+}
+
+/**
+ * Record the time just before the backend poll.
+ *
+ * [+0, -0, -]
+ */
+static void probe_prepare_cb(struct ev_loop* loop, ev_prepare* prepare, int revents) {
+    lua_ev_probe* probe = (lua_ev_probe*)(((char*)prepare) - offsetof(lua_ev_probe, prepare));
+
+    probe->before_poll = probe_now();
+}
+
+/**
+ * Record the time just after the backend poll.
+ *
+ * [+0, -0, -]
+ */
+static void probe_check_cb(struct ev_loop* loop, ev_check* check, int revents) {
+    lua_ev_probe* probe = (lua_ev_probe*)(((char*)check) - offsetof(lua_ev_probe, check));
+
+    probe->after_poll = probe_now();
+}
+
+static void probe_add_sample(lua_ev_probe* probe, double total, double poll) {
+    probe_sample sample;
+    int          slot;
+
+    sample.total = total;
+    sample.poll  = poll;
+    sample.queue = total - poll;
+
+    probe->ticks++;
+    probe->sum.total += sample.total;
+    probe->sum.poll  += sample.poll;
+    probe->sum.queue += sample.queue;
+    if ( sample.total > probe->max.total ) probe->max.total = sample.total;
+    if ( sample.poll  > probe->max.poll  ) probe->max.poll  = sample.poll;
+    if ( sample.queue > probe->max.queue ) probe->max.queue = sample.queue;
+
+    if ( probe->num_samples < probe->max_samples ) {
+        probe->samples[probe->num_samples++] = sample;
+        return;
+    }
+    probe->seed = probe->seed * 1103515245u + 12345u;
+    slot = (int)(probe->seed % probe->ticks);
+    if ( slot < probe->max_samples ) probe->samples[slot] = sample;
+}
+
+/**
+ * Measure how late this tick is and re-arm the timer for the next
+ * one.  The poll part is how long the backend slept past the deadline
+ * (or past the point where the loop got to polling, if callbacks were
+ * still running at the deadline), the rest was spent running other
+ * callbacks.  Calls the lua callback once duration is over.
+ *
+ * [+0, -0, m]
+ */
+static void probe_timer_cb(struct ev_loop* loop, ev_timer* timer, int revents) {
+    lua_ev_probe* probe = (lua_ev_probe*)timer;
+    double        now   = probe_now();
+    double        total = now - probe->expected;
+    double        poll  = probe->after_poll -
+        ( probe->before_poll > probe->expected ? probe->before_poll : probe->expected );
+    double        skip;
+
+    /* libev may fire a hair early relative to our clock. */
+    if ( total < 0 ) total = 0;
+    if ( poll  < 0 ) poll  = 0;
+    if ( poll  > total ) poll = total;
+    probe_add_sample(probe, total, poll);
+    probe->last = now;
+
+    if ( probe->duration > 0 && now - probe->started >= probe->duration ) {
+        probe_stop_watchers(loop, probe);
+        watcher_cb_args(loop, timer, revents, &probe_push_report);
+        return;
+    }
+
+    /* skip ticks we are already too late for. */
+    probe->expected += probe->interval;
+    if ( probe->expected < now ) {
+        skip = (double)(long)((now - probe->expected) / probe->interval) + 1;
+        probe->missed   += (unsigned long)skip;
+        probe->expected += skip * probe->interval;
+    }
+    /* ev_timer_start() is relative to the time of the last poll. */
+    ev_timer_set(timer, probe->expected - probe->after_poll, 0.);
+    ev_timer_start(loop, timer);
+}
+
+/**
+ * Stop the timer and the prepare/check watchers (which never keep the
+ * loop alive on their own).
+ */
+static void probe_stop_watchers(struct ev_loop* loop, lua_ev_probe* probe) {
+    if ( ev_is_active(&probe->prepare) ) {
+        ev_ref(loop);
+        ev_prepare_stop(loop, &probe->prepare);
+        ev_ref(loop);
+        ev_check_stop(loop, &probe->check);
+    }
+    ev_timer_stop(loop, &probe->timer);
+}
+
+/**
+ * Push the report for watcher_cb_args().
+ *
+ * [-0, +1, m]
+ */
+static int probe_push_report(lua_State *L, void *watcher) {
+    probe_push_table(L, (lua_ev_probe*)watcher);
+    return 1;
+}
+
+static int probe_cmp(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Push { mean=, p50=, p90=, p99=, p999=, max= } for one component of
+ * the samples.
+ *
+ * [-0, +1, m]
+ */
+static void probe_push_stats(lua_State *L, lua_ev_probe* probe, double* values, size_t field, double sum, double max) {
+    static const struct { const char* name; double rank; } ranks[] = {
+        { "p50", 0.5 }, { "p90", 0.9 }, { "p99", 0.99 }, { "p999", 0.999 }
+    };
+    int n = probe->num_samples;
+    int i;
+
+    for ( i = 0; i < n; i++ ) {
+        values[i] = *(double*)((char*)&probe->samples[i] + field);
+    }
+    qsort(values, n, sizeof(double), probe_cmp);
+
+    lua_createtable(L, 0, 6);
+    lua_pushnumber(L, probe->ticks ? sum / probe->ticks : 0);
+    lua_setfield(L, -2, "mean");
+    for ( i = 0; i < (int)(sizeof(ranks) / sizeof(ranks[0])); i++ ) {
+        int idx = (int)(ranks[i].rank * n + 0.999999) - 1;
+        if ( idx < 0 ) idx = 0;
+        lua_pushnumber(L, n ? values[idx] : 0);
+        lua_setfield(L, -2, ranks[i].name);
+    }
+    lua_pushnumber(L, max);
+    lua_setfield(L, -2, "max");
+}
+
+/**
+ * Push the report table, all times are in seconds.
+ *
+ * [-0, +1, m]
+ */
+static void probe_push_table(lua_State *L, lua_ev_probe* probe) {
+    double* values = lua_newuserdata(L, (probe->num_samples + 1) * sizeof(double));
+
+    lua_createtable(L, 0, 9);
+    lua_pushnumber(L, probe->interval);
+    lua_setfield(L, -2, "interval");
+    lua_pushnumber(L, probe->ticks ? probe->last - probe->started : 0);
+    lua_setfield(L, -2, "elapsed");
+    lua_pushinteger(L, probe->ticks);
+    lua_setfield(L, -2, "ticks");
+    lua_pushinteger(L, probe->missed);
+    lua_setfield(L, -2, "missed");
+    lua_pushinteger(L, probe->num_samples);
+    lua_setfield(L, -2, "samples");
+
+    probe_push_stats(L, probe, values, offsetof(probe_sample, total), probe->sum.total, probe->max.total);
+    lua_setfield(L, -2, "total");
+    probe_push_stats(L, probe, values, offsetof(probe_sample, poll), probe->sum.poll, probe->max.poll);
+    lua_setfield(L, -2, "poll");
+    probe_push_stats(L, probe, values, offsetof(probe_sample, queue), probe->sum.queue, probe->max.queue);
+    lua_setfield(L, -2, "queue");
+
+    lua_remove(L, -2); /* values */
+}
+
+/**
+ * Stops the probe so it won't be called by the specified event loop.
+ *
+ * Usage:
+ *     probe:stop(loop)
+ *
+ * [+0, -0, e]
+ */
+static int probe_stop(lua_State *L) {
+    lua_ev_probe*   probe = check_probe(L, 1);
+    struct ev_loop* loop  = *check_loop_and_init(L, 2);
+
+    loop_stop_watcher(L, loop, GET_WATCHER_DATA(probe), 1);
+    probe_stop_watchers(loop, probe);
+
+    return 0;
+}
+
+/**
+ * Starts the probe, clearing any previous samples.
+ *
+ * Usage:
+ *     probe:start(loop [, is_daemon])
+ *
+ * [+0, -0, e]
+ */
+static int probe_start(lua_State *L) {
+    lua_ev_probe*   probe = check_probe(L, 1);
+    struct ev_loop* loop  = *check_loop_and_init(L, 2);
+    int is_daemon         = lua_toboolean(L, 3);
+
+    if ( ! ev_is_active(&probe->timer) ) {
+        probe->num_samples = 0;
+        probe->ticks       = 0;
+        probe->missed      = 0;
+        memset(&probe->sum, 0, sizeof(probe_sample));
+        memset(&probe->max, 0, sizeof(probe_sample));
+
+        ev_now_update(loop);
+        probe->started     = probe_now();
+        probe->expected    = probe->started + probe->interval;
+        probe->before_poll = probe->after_poll = probe->started;
+        ev_timer_set(&probe->timer, probe->interval, 0.);
+        ev_timer_start(loop, &probe->timer);
+
+        ev_prepare_start(loop, &probe->prepare);
+        ev_unref(loop);
+        ev_check_start(loop, &probe->check);
+        ev_unref(loop);
+    }
+    loop_start_watcher(L, loop, GET_WATCHER_DATA(probe), 2, 1, is_daemon);
+
+    return 0;
+}
+
+/**
+ * Returns the report of the samples taken so far.
+ *
+ * Usage:
+ *     report = probe:report()
+ *
+ * [+1, -0, e]
+ */
+static int probe_report(lua_State *L) {
+    probe_push_table(L, check_probe(L, 1));
+    return 1;
+}
+
+/**
+ * Free the samples.
+ *
+ * [+0, -0, -]
+ */
+static int probe_gc(lua_State *L) {
+    lua_ev_probe* probe = check_probe(L, 1);
+
+    free(probe->samples);
+    probe->samples = NULL;
+    return 0;
+}
+
+/* vi:set expandtab ts=4: */
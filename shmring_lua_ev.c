@@ -0,0 +1,476 @@
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SHMRING_MAGIC    0x474e4952u /* "RING" */
+#define SHMRING_MIN_SIZE 4096
+#define SHMRING_MAX_SIZE 0x40000000
+
+/* record header bits, the rest is the length of the record. */
+#define SHMRING_COMMIT   0x80000000u
+#define SHMRING_PAD      0x40000000u
+#define SHMRING_LEN      0x3fffffffu
+
+/* records are a 4 byte header plus the data, 8 byte aligned. */
+#define SHMRING_RECORD(len) ( ( (uint32_t)(len) + 4 + 7 ) & ~(uint32_t)7 )
+
+/**
+ * The start of the shared segment, followed by the data area.  head
+ * and tail are byte positions which only grow, their offset in the
+ * data area is position & (size - 1).  They live in separate cache
+ * lines since the consumer writes one and the producers the other.
+ *
+ * Producers reserve a record by moving tail with a compare and swap,
+ * copy the data and then commit the record by storing its header.
+ * The consumer reads committed records from head on, zeroes them and
+ * then moves head.  Since the data area starts zeroed, a header is
+ * always either zero or committed in the current lap.
+ */
+typedef struct shmring_shared {
+    uint32_t magic;
+    uint32_t size;
+    char     pad0[56];
+    uint64_t tail;
+    char     pad1[56];
+    uint64_t head;
+    char     pad2[56];
+} shmring_shared;
+
+/**
+ * The io watcher (on the eventfd) must be the first member, since that
+ * is what watcher_cb() and GET_WATCHER_DATA() operate on.
+ */
+struct lua_ev_shmring {
+    ev_io           io;
+    shmring_shared* shared;
+    char*           data;
+    uint32_t        size;
+    int             memfd;
+};
+
+/**
+ * Create a table for ev.ShmRing that gives access to the constructors
+ * for shmring objects.
+ *
+ * [-0, +1, ?]
+ */
+static int luaopen_ev_shmring(lua_State *L) {
+    lua_pop(L, create_shmring_mt(L));
+
+    lua_createtable(L, 0, 2);
+
+    lua_pushcfunction(L, shmring_new);
+    lua_setfield(L, -2, "new");
+
+    lua_pushcfunction(L, shmring_open);
+    lua_setfield(L, -2, "open");
+
+    return 1;
+}
+
+/**
+ * Create the shmring metatable in the registry.
+ *
+ * [-0, +1, ?]
+ */
+static int create_shmring_mt(lua_State *L) {
+
+    static luaL_reg methods[] = {
+        { "stop",          shmring_stop },
+        { "start",         shmring_start },
+        { "push",          shmring_push },
+        { "getfds",        shmring_getfds },
+        { "getsize",       shmring_getsize },
+        { NULL, NULL }
+    };
+    add_watcher_mt(L, methods, SHMRING_MT);
+
+    /* unmap the segment and close the fds. */
+    lua_pushcfunction(L, shmring_gc);
+    lua_setfield(L, -2, "__gc");
+    return 1;
+}
+
+/**
+ * Push a new shmring watcher without a segment.  Both fds are -1 so
+ * that shmring_gc() can clean up after any error that follows.
+ *
+ * [-0, +1, ?]
+ */
+static lua_ev_shmring* shmring_alloc(lua_State* L, int ctx_i) {
+    lua_ev_shmring* ring;
+
+    ring = (lua_ev_shmring*)watcher_new(L, sizeof(lua_ev_shmring), SHMRING_MT);
+    watcher_new_context(L, ctx_i);
+    memset(ring, 0, sizeof(lua_ev_shmring));
+    ev_io_init(&ring->io, &shmring_cb, -1, EV_READ);
+    ring->memfd = -1;
+    return ring;
+}
+
+/**
+ * Map the segment of ring->memfd, checking it if it was created by
+ * some other process.
+ *
+ * [-0, +0, e]
+ */
+static void shmring_map(lua_State* L, lua_ev_shmring* ring, uint32_t size) {
+    void* addr;
+
+    addr = mmap(NULL, sizeof(shmring_shared) + size, PROT_READ | PROT_WRITE,
+                MAP_SHARED, ring->memfd, 0);
+    if ( MAP_FAILED == addr ) {
+        luaL_error(L, "mmap: %s", strerror(errno));
+    }
+    ring->shared = (shmring_shared*)addr;
+    ring->data   = (char*)addr + sizeof(shmring_shared);
+    ring->size   = size;
+}
+
+/**
+ * Create a new shmring object with a new segment.  Arguments:
+ *   1 - callback function.
+ *   2 - size (number of bytes for records, rounded up to a power of
+ *       2 of at least 4096).
+ *   3 - optional context, see watcher:context()
+ *
+ * @see watcher_new()
+ *
+ * [+1, -0, ?]
+ */
+static int shmring_new(lua_State* L) {
+    lua_Number      want = luaL_checknumber(L, 2);
+    uint32_t        size = SHMRING_MIN_SIZE;
+    lua_ev_shmring* ring;
+    int             fd;
+
+    if ( want > SHMRING_MAX_SIZE )
+        luaL_argerror(L, 2, "size must be at most 1GB");
+    while ( size < want ) size <<= 1;
+
+    ring = shmring_alloc(L, 3);
+
+    ring->memfd = memfd_create("lua-ev-shmring", MFD_CLOEXEC);
+    if ( ring->memfd < 0 ) {
+        return luaL_error(L, "memfd_create: %s", strerror(errno));
+    }
+    /* the data area must start zeroed, which ftruncate() does. */
+    if ( ftruncate(ring->memfd, sizeof(shmring_shared) + size) != 0 ) {
+        return luaL_error(L, "ftruncate: %s", strerror(errno));
+    }
+    fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if ( fd < 0 ) {
+        return luaL_error(L, "eventfd: %s", strerror(errno));
+    }
+    ev_io_set(&ring->io, fd, EV_READ);
+
+    shmring_map(L, ring, size);
+    ring->shared->size  = size;
+    ring->shared->magic = SHMRING_MAGIC;
+    return 1;
+}
+
+/**
+ * Create a new shmring object for the segment of another shmring, as
+ * returned by its getfds().  The fds are duplicated.  Arguments:
+ *   1 - callback function.
+ *   2 - memfd of the segment.
+ *   3 - eventfd.
+ *   4 - optional context, see watcher:context()
+ *
+ * @see watcher_new()
+ *
+ * [+1, -0, ?]
+ */
+static int shmring_open(lua_State* L) {
+    int             memfd = luaL_checkint(L, 2);
+    int             efd   = luaL_checkint(L, 3);
+    lua_ev_shmring* ring;
+    struct stat     st;
+    uint32_t        size;
+    int             fd;
+
+    ring = shmring_alloc(L, 4);
+
+    ring->memfd = fcntl(memfd, F_DUPFD_CLOEXEC, 0);
+    if ( ring->memfd < 0 ) {
+        return luaL_error(L, "memfd: %s", strerror(errno));
+    }
+    fd = fcntl(efd, F_DUPFD_CLOEXEC, 0);
+    if ( fd < 0 ) {
+        return luaL_error(L, "eventfd: %s", strerror(errno));
+    }
+    ev_io_set(&ring->io, fd, EV_READ);
+
+    if ( fstat(ring->memfd, &st) != 0 ) {
+        return luaL_error(L, "fstat: %s", strerror(errno));
+    }
+    if ( st.st_size < (off_t)sizeof(shmring_shared) + SHMRING_MIN_SIZE ||
+         st.st_size > (off_t)sizeof(shmring_shared) + SHMRING_MAX_SIZE )
+    {
+        return luaL_error(L, "not a shmring segment");
+    }
+    size = st.st_size - sizeof(shmring_shared);
+    shmring_map(L, ring, size);
+    if ( ring->shared->magic != SHMRING_MAGIC || ring->shared->size != size ) {
+        return luaL_error(L, "not a shmring segment");
+    }
+    return 1;
+}
+
+/**
+ * Store the committed header of the record at pos, then wake the
+ * consumer if the record is the first one it has not consumed.  The
+ * fence pairs with the one in shmring_drain(): either the consumer
+ * sees the header, or we see that it moved head up to pos.
+ */
+static void shmring_commit(lua_ev_shmring* ring, uint64_t pos, uint32_t header) {
+    uint32_t* hdr = (uint32_t*)(ring->data + ( pos & ( ring->size - 1 ) ));
+
+    __atomic_store_n(hdr, header | SHMRING_COMMIT, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if ( __atomic_load_n(&ring->shared->head, __ATOMIC_RELAXED) == pos ) {
+        uint64_t one = 1;
+        ssize_t  result = write(ring->io.fd, &one, sizeof(one));
+        (void)result; /* EAGAIN: the counter is already non-zero. */
+    }
+}
+
+/**
+ * Add a record to the ring, returns 0 if it is full.  A record never
+ * wraps around the end of the data area: if it does not fit before
+ * the end, that space is filled with a padding record first.
+ */
+static int shmring_write(lua_ev_shmring* ring, const char* buf, size_t len) {
+    shmring_shared* shared = ring->shared;
+    uint32_t        need   = SHMRING_RECORD(len);
+
+    for (;;) {
+        uint64_t tail = __atomic_load_n(&shared->tail, __ATOMIC_RELAXED);
+        uint64_t head = __atomic_load_n(&shared->head, __ATOMIC_ACQUIRE);
+        uint32_t room = ring->size - ( tail & ( ring->size - 1 ) );
+
+        if ( need <= room ) {
+            if ( tail - head + need > ring->size ) return 0;
+            if ( ! __atomic_compare_exchange_n(&shared->tail, &tail, tail + need, 0,
+                                               __ATOMIC_ACQ_REL, __ATOMIC_RELAXED) )
+                continue;
+            memcpy(ring->data + ( tail & ( ring->size - 1 ) ) + 4, buf, len);
+            shmring_commit(ring, tail, len);
+            return 1;
+        }
+        if ( tail - head + room > ring->size ) return 0;
+        if ( __atomic_compare_exchange_n(&shared->tail, &tail, tail + room, 0,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_RELAXED) )
+            shmring_commit(ring, tail, SHMRING_PAD | room);
+    }
+}
+
+/**
+ * Returns true if the record at head is committed.
+ */
+static int shmring_ready(lua_ev_shmring* ring) {
+    uint64_t  head = __atomic_load_n(&ring->shared->head, __ATOMIC_RELAXED);
+    uint32_t* hdr  = (uint32_t*)(ring->data + ( head & ( ring->size - 1 ) ));
+
+    return ( __atomic_load_n(hdr, __ATOMIC_ACQUIRE) & SHMRING_COMMIT ) != 0;
+}
+
+/**
+ * The eventfd is readable: reset it and, unless the wakeup was
+ * spurious, call the lua callback with the records.  Records committed
+ * after the drain started are left for the next loop iteration, so a
+ * fast producer can not keep the loop in this callback.
+ *
+ * [+0, -0, m]
+ */
+static void shmring_cb(struct ev_loop* loop, ev_io* io, int revents) {
+    lua_ev_shmring* ring = (lua_ev_shmring*)io;
+    uint64_t        count;
+    ssize_t         result = read(io->fd, &count, sizeof(count));
+
+    (void)result;
+    if ( ! shmring_ready(ring) ) return;
+
+    watcher_cb_args(loop, io, revents, &shmring_drain);
+
+    if ( ev_is_active(io) && shmring_ready(ring) ) {
+        ev_feed_event(loop, io, EV_READ);
+    }
+}
+
+/**
+ * Consume the committed records, up to the tail as of now, and push
+ * them as an array of strings.  The records are only freed once all
+ * of them were pushed, so a memory error leaves them in the ring.
+ *
+ * @see watcher_cb_args()
+ *
+ * [-0, +1, m]
+ */
+static int shmring_drain(lua_State *L, void *watcher) {
+    lua_ev_shmring* ring   = (lua_ev_shmring*)watcher;
+    shmring_shared* shared = ring->shared;
+    uint64_t        first  = __atomic_load_n(&shared->head, __ATOMIC_RELAXED);
+    uint64_t        head   = first;
+    uint64_t        tail   = __atomic_load_n(&shared->tail, __ATOMIC_ACQUIRE);
+    int             n      = 0;
+
+    lua_newtable(L);
+    while ( head < tail ) {
+        char*    rec    = ring->data + ( head & ( ring->size - 1 ) );
+        uint32_t header = __atomic_load_n((uint32_t*)rec, __ATOMIC_ACQUIRE);
+        uint32_t used;
+
+        if ( ! ( header & SHMRING_COMMIT ) ) break;
+
+        if ( header & SHMRING_PAD ) {
+            used = header & SHMRING_LEN;
+        } else {
+            used = SHMRING_RECORD(header & SHMRING_LEN);
+            lua_pushlstring(L, rec + 4, header & SHMRING_LEN);
+            lua_rawseti(L, -2, ++n);
+        }
+        head += used;
+    }
+    while ( first < head ) {
+        char*    rec    = ring->data + ( first & ( ring->size - 1 ) );
+        uint32_t header = *(uint32_t*)rec;
+        uint32_t used   = ( header & SHMRING_PAD ) ?
+            header & SHMRING_LEN : SHMRING_RECORD(header & SHMRING_LEN);
+
+        memset(rec, 0, used);
+        first += used;
+    }
+    __atomic_store_n(&shared->head, head, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return 1;
+}
+
+/**
+ * Add a record to the ring.  Returns false if the ring is full.  Any
+ * process which has the ring may push, also while others do.
+ *
+ * Usage:
+ *     ok = shmring:push(record)
+ *
+ * [+1, -0, e]
+ */
+static int shmring_push(lua_State *L) {
+    lua_ev_shmring* ring = check_shmring(L, 1);
+    size_t          len;
+    const char*     str  = luaL_checklstring(L, 2, &len);
+
+    if ( NULL == ring->shared ) return luaL_error(L, "shmring is closed");
+    if ( len > ring->size - 8 )
+        luaL_argerror(L, 2, "record is larger than the ring");
+
+    lua_pushboolean(L, shmring_write(ring, str, len));
+    return 1;
+}
+
+/**
+ * Stops the shmring so it won't be called by the specified event
+ * loop.  Records pushed meanwhile stay in the ring.
+ *
+ * Usage:
+ *     shmring:stop(loop)
+ *
+ * [+0, -0, e]
+ */
+static int shmring_stop(lua_State *L) {
+    lua_ev_shmring* ring = check_shmring(L, 1);
+    struct ev_loop* loop = *check_loop_and_init(L, 2);
+
+    loop_stop_watcher(L, loop, GET_WATCHER_DATA(ring), 1);
+    ev_io_stop(loop, &ring->io);
+
+    return 0;
+}
+
+/**
+ * Starts consuming the records of the shmring in the specified event
+ * loop.  Only one process may consume a ring at a time.
+ *
+ * Usage:
+ *     shmring:start(loop [, is_daemon])
+ *
+ * [+0, -0, e]
+ */
+static int shmring_start(lua_State *L) {
+    lua_ev_shmring* ring = check_shmring(L, 1);
+    struct ev_loop* loop = *check_loop_and_init(L, 2);
+    int is_daemon        = lua_toboolean(L, 3);
+
+    if ( NULL == ring->shared ) return luaL_error(L, "shmring is closed");
+
+    ev_io_start(loop, &ring->io);
+    loop_start_watcher(L, loop, GET_WATCHER_DATA(ring), 2, 1, is_daemon);
+
+    /* records pushed while nobody consumed did not notify. */
+    if ( shmring_ready(ring) ) ev_feed_event(loop, &ring->io, EV_READ);
+
+    return 0;
+}
+
+/**
+ * Returns the memfd of the segment and the eventfd, to be passed to
+ * ev.ShmRing.open() in another process.
+ *
+ * Usage:
+ *     memfd, eventfd = shmring:getfds()
+ *
+ * [+2, -0, e]
+ */
+static int shmring_getfds(lua_State *L) {
+    lua_ev_shmring* ring = check_shmring(L, 1);
+
+    lua_pushinteger(L, ring->memfd);
+    lua_pushinteger(L, ring->io.fd);
+    return 2;
+}
+
+/**
+ * Returns the number of bytes available for records.
+ *
+ * Usage:
+ *     size = shmring:getsize()
+ *
+ * [+1, -0, e]
+ */
+static int shmring_getsize(lua_State *L) {
+    lua_ev_shmring* ring = check_shmring(L, 1);
+
+    lua_pushinteger(L, ring->size);
+    return 1;
+}
+
+/**
+ * Unmap the segment and close both fds.
+ *
+ * [+0, -0, -]
+ */
+static int shmring_gc(lua_State *L) {
+    lua_ev_shmring* ring = check_shmring(L, 1);
+
+    if ( NULL != ring->shared ) {
+        munmap(ring->shared, sizeof(shmring_shared) + ring->size);
+    }
+    if ( ring->memfd >= 0 ) close(ring->memfd);
+    if ( ring->io.fd >= 0 ) close(ring->io.fd);
+    ring->shared = NULL;
+    ring->data   = NULL;
+    ring->memfd  = -1;
+    ring->io.fd  = -1;
+    return 0;
+}
+
+#endif /* __linux__ */
+
+/* vi:set expandtab ts=4: */
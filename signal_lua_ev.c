@@ -25,6 +25,7 @@ static int create_signal_mt(lua_State *L) {
     static luaL_reg methods[] = {
         { "stop",          signal_stop },
         { "start",         signal_start },
+        { "set",           signal_set },
         { NULL, NULL }
     };
     return add_watcher_mt(L, methods, SIGNAL_MT);
@@ -34,6 +35,7 @@ static int create_signal_mt(lua_State *L) {
  * Create a new signal object.  Arguments:
  *   1 - callback function.
  *   2 - signal number
+ *   3 - optional context, see watcher:context()
  *
  * @see watcher_new()
  *
@@ -44,6 +46,7 @@ static int signal_new(lua_State* L) {
     ev_signal*  sig;
 
     sig = (ev_signal*)watcher_new(L, sizeof(ev_signal), SIGNAL_MT);
+    watcher_new_context(L, 3);
     ev_signal_init(sig, &signal_cb, signum);
     return 1;
 }
@@ -94,4 +97,24 @@ static int signal_start(lua_State *L) {
     return 0;
 }
 
+/**
+ * Changes the signal number, restarting the signal if it is active.
+ *
+ * Usage:
+ *     signal:set(signum)
+ *
+ * [+0, -0, e]
+ */
+static int signal_set(lua_State *L) {
+    ev_signal*      sig    = check_signal(L, 1);
+    int             signum = luaL_checkint(L, 2);
+    struct ev_loop* loop   = watcher_active_loop(sig);
+
+    if ( loop ) ev_signal_stop(loop, sig);
+    ev_signal_set(sig, signum);
+    if ( loop ) ev_signal_start(loop, sig);
+
+    return 0;
+}
+
 /* vi:set expandtab ts=4: */
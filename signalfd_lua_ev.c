@@ -0,0 +1,276 @@
+#ifdef __linux__
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
+
+#define SIGNALFD_BATCH 32
+
+/**
+ * The io watcher must be the first member, since that is what
+ * watcher_cb() and GET_WATCHER_DATA() operate on.
+ */
+struct lua_ev_signalfd {
+    ev_io                    io;
+    sigset_t                 mask;
+    /* first batch read by the io callback, handed to the lua callback. */
+    struct signalfd_siginfo* batch;
+    int                      batch_len;
+};
+
+/**
+ * Number of started ev.SignalFD watchers per signal, so a signal is
+ * only unblocked when the last watcher interested in it stops.
+ */
+static int signalfd_blocked[_NSIG];
+
+/**
+ * Create a table for ev.SignalFD that gives access to the constructor
+ * for signalfd objects.
+ *
+ * [-0, +1, ?]
+ */
+static int luaopen_ev_signalfd(lua_State *L) {
+    lua_pop(L, create_signalfd_mt(L));
+
+    lua_createtable(L, 0, 1);
+
+    lua_pushcfunction(L, signalfd_new);
+    lua_setfield(L, -2, "new");
+
+    return 1;
+}
+
+/**
+ * Create the signalfd metatable in the registry.
+ *
+ * [-0, +1, ?]
+ */
+static int create_signalfd_mt(lua_State *L) {
+
+    static luaL_reg methods[] = {
+        { "stop",          signalfd_stop },
+        { "start",         signalfd_start },
+        { "getfd",         signalfd_getfd },
+        { NULL, NULL }
+    };
+    add_watcher_mt(L, methods, SIGNALFD_MT);
+
+    /* close the signalfd. */
+    lua_pushcfunction(L, signalfd_gc);
+    lua_setfield(L, -2, "__gc");
+    return 1;
+}
+
+static int signalfd_checksignum(lua_State *L, int idx, int arg) {
+    int signum = luaL_checkint(L, idx);
+    if ( signum <= 0 || signum >= _NSIG )
+        luaL_argerror(L, arg, "invalid signal number");
+    return signum;
+}
+
+/**
+ * Create a new signalfd object.  Arguments:
+ *   1 - callback function.
+ *   2 - signal number, or an array of signal numbers.
+ *   3 - optional context, see watcher:context()
+ *
+ * @see watcher_new()
+ *
+ * [+1, -0, ?]
+ */
+static int signalfd_new(lua_State* L) {
+    lua_ev_signalfd* sfd;
+    sigset_t         mask;
+    int              fd;
+
+    sigemptyset(&mask);
+    if ( lua_istable(L, 2) ) {
+        int i, len = lua_objlen(L, 2);
+        if ( 0 == len ) luaL_argerror(L, 2, "no signal numbers given");
+        for ( i = 1; i <= len; i++ ) {
+            lua_rawgeti(L, 2, i);
+            sigaddset(&mask, signalfd_checksignum(L, -1, 2));
+            lua_pop(L, 1);
+        }
+    } else {
+        sigaddset(&mask, signalfd_checksignum(L, 2, 2));
+    }
+
+    sfd = (lua_ev_signalfd*)watcher_new(L, sizeof(lua_ev_signalfd), SIGNALFD_MT);
+    watcher_new_context(L, 3);
+    memset(sfd, 0, sizeof(lua_ev_signalfd));
+    ev_io_init(&sfd->io, &signalfd_cb, -1, EV_READ);
+    sfd->mask = mask;
+
+    fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if ( fd < 0 ) {
+        return luaL_error(L, "signalfd: %s", strerror(errno));
+    }
+    ev_io_set(&sfd->io, fd, EV_READ);
+    return 1;
+}
+
+/**
+ * Read the first batch of queued signals and call the lua callback,
+ * which reads the rest.
+ *
+ * [+0, -0, m]
+ */
+static void signalfd_cb(struct ev_loop* loop, ev_io* io, int revents) {
+    lua_ev_signalfd*        sfd = (lua_ev_signalfd*)io;
+    struct signalfd_siginfo batch[SIGNALFD_BATCH];
+    ssize_t                 len;
+
+    len = read(io->fd, batch, sizeof(batch));
+    if ( len < (ssize_t)sizeof(struct signalfd_siginfo) ) return;
+
+    sfd->batch     = batch;
+    sfd->batch_len = len / sizeof(struct signalfd_siginfo);
+    watcher_cb_args(loop, io, EV_SIGNAL, &signalfd_push_info);
+    sfd->batch     = NULL;
+    sfd->batch_len = 0;
+}
+
+/**
+ * Push the number of signals received and an array of
+ * { signum=, pid=, uid=, code= } records, reading everything that is
+ * still queued on the signalfd.
+ *
+ * @see watcher_cb_args()
+ *
+ * [-0, +2, m]
+ */
+static int signalfd_push_info(lua_State *L, void *watcher) {
+    lua_ev_signalfd*        sfd   = (lua_ev_signalfd*)watcher;
+    struct signalfd_siginfo batch[SIGNALFD_BATCH];
+    struct signalfd_siginfo *info = sfd->batch;
+    int                     len   = sfd->batch_len;
+    int                     count = 0;
+
+    lua_createtable(L, len, 0);
+    while ( len > 0 ) {
+        int i;
+        ssize_t bytes;
+
+        for ( i = 0; i < len; i++ ) {
+            lua_createtable(L, 0, 4);
+            lua_pushinteger(L, info[i].ssi_signo);
+            lua_setfield(L, -2, "signum");
+            lua_pushinteger(L, info[i].ssi_pid);
+            lua_setfield(L, -2, "pid");
+            lua_pushinteger(L, info[i].ssi_uid);
+            lua_setfield(L, -2, "uid");
+            lua_pushinteger(L, info[i].ssi_code);
+            lua_setfield(L, -2, "code");
+            lua_rawseti(L, -2, ++count);
+        }
+
+        bytes = read(sfd->io.fd, batch, sizeof(batch));
+        info  = batch;
+        len   = bytes > 0 ? bytes / sizeof(struct signalfd_siginfo) : 0;
+    }
+    lua_pushinteger(L, count);
+    lua_insert(L, -2);
+    return 2;
+}
+
+/**
+ * Stops the signalfd so it won't be called by the specified event
+ * loop.  Signals which no other ev.SignalFD watcher is interested in
+ * are unblocked again; any of those still queued are discarded.
+ *
+ * Usage:
+ *     signalfd:stop(loop)
+ *
+ * [+0, -0, e]
+ */
+static int signalfd_stop(lua_State *L) {
+    lua_ev_signalfd* sfd  = check_signalfd(L, 1);
+    struct ev_loop*  loop = *check_loop_and_init(L, 2);
+    struct timespec  zero = { 0, 0 };
+    sigset_t         unblock;
+    int              signum, any = 0;
+
+    if ( ev_is_active(&sfd->io) ) {
+        sigemptyset(&unblock);
+        for ( signum = 1; signum < _NSIG; signum++ ) {
+            if ( sigismember(&sfd->mask, signum) == 1 &&
+                 --signalfd_blocked[signum] == 0 )
+            {
+                sigaddset(&unblock, signum);
+                any = 1;
+            }
+        }
+        /* only discard what no other signalfd is waiting for. */
+        while ( any && sigtimedwait(&unblock, NULL, &zero) > 0 ) ;
+        sigprocmask(SIG_UNBLOCK, &unblock, NULL);
+    }
+
+    loop_stop_watcher(L, loop, GET_WATCHER_DATA(sfd), 1);
+    ev_io_stop(loop, &sfd->io);
+
+    return 0;
+}
+
+/**
+ * Starts the signalfd so it will be called by the specified event
+ * loop.  The signals are blocked so they are only delivered through
+ * the signalfd.
+ *
+ * Usage:
+ *     signalfd:start(loop [, is_daemon])
+ *
+ * [+0, -0, e]
+ */
+static int signalfd_start(lua_State *L) {
+    lua_ev_signalfd* sfd  = check_signalfd(L, 1);
+    struct ev_loop*  loop = *check_loop_and_init(L, 2);
+    int is_daemon         = lua_toboolean(L, 3);
+    int signum;
+
+    if ( ! ev_is_active(&sfd->io) ) {
+        for ( signum = 1; signum < _NSIG; signum++ ) {
+            if ( sigismember(&sfd->mask, signum) == 1 ) signalfd_blocked[signum]++;
+        }
+        sigprocmask(SIG_BLOCK, &sfd->mask, NULL);
+    }
+
+    ev_io_start(loop, &sfd->io);
+    loop_start_watcher(L, loop, GET_WATCHER_DATA(sfd), 2, 1, is_daemon);
+
+    return 0;
+}
+
+/**
+ * Returns the signalfd file descriptor.
+ *
+ * Usage:
+ *     fd = signalfd:getfd()
+ *
+ * [+1, -0, e]
+ */
+static int signalfd_getfd(lua_State *L) {
+    lua_ev_signalfd* sfd = check_signalfd(L, 1);
+
+    lua_pushinteger(L, sfd->io.fd);
+    return 1;
+}
+
+/**
+ * Close the signalfd.
+ *
+ * [+0, -0, -]
+ */
+static int signalfd_gc(lua_State *L) {
+    lua_ev_signalfd* sfd = check_signalfd(L, 1);
+
+    if ( sfd->io.fd >= 0 ) close(sfd->io.fd);
+    sfd->io.fd = -1;
+    return 0;
+}
+
+#endif /* __linux__ */
+
+/* vi:set expandtab ts=4: */
@@ -0,0 +1,409 @@
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <string.h>
+#include <unistd.h>
+
+extern char **environ;
+
+#define SPAWN_INHERIT 0
+#define SPAWN_PIPE    1
+#define SPAWN_NULL    2
+#define SPAWN_FD      3
+
+static const char* spawn_stdio_names[] = { "stdin", "stdout", "stderr" };
+
+/**
+ * Spawn a process with posix_spawn(), optionally connecting its
+ * stdin, stdout and stderr to non-blocking pipes, and start a child
+ * watcher for it: an ev.Child in the default loop, an ev.ChildFD in
+ * any other loop (Linux only).  Takes a single table argument with
+ * these fields:
+ *   argv    - array of strings, argv[1] is searched for in PATH.
+ *   env     - optional table of name => value, defaults to the
+ *             environment of this process.
+ *   cwd     - optional working directory of the new process.
+ *   setenv  - optional table of name => value added to env (or to
+ *             the environment of this process).
+ *   stdin, stdout, stderr
+ *           - "pipe", "null", a file descriptor number, or nil to
+ *             inherit the descriptor of this process.
+ *   fds     - optional table of fd number (above 2) in the new
+ *             process => file descriptor of this process to dup2().
+ *   on_exit - optional function called as
+ *             on_exit(loop, child, revents, exit_status, term_signal)
+ *             once the process exited.
+ *   loop    - optional loop, defaults to ev.Loop.default.
+ *
+ * Returns a table with pid, child (the started child watcher) and
+ * stdin, stdout, stderr set to the parent end of each pipe.
+ *
+ * Usage:
+ *     proc = ev.spawn_process{ argv = { "ls", "-l" }, stdout = "pipe" }
+ *
+ * [+1, -0, e]
+ */
+static int spawn_process(lua_State *L) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t          attr;
+    sigset_t                   sigs;
+    int                        mode[3], fd[3];
+    int                        pipes[3][2] = { { -1, -1 }, { -1, -1 }, { -1, -1 } };
+    const char**               argv;
+    char**                     envp = environ;
+    const char*                cwd;
+    int                        argc, i, err = 0;
+    int                        loop_i, fn_i, argv_i, env_i, setenv_i, fds_i, child_i;
+    pid_t                      pid;
+    struct ev_loop*            loop;
+    ev_child*                  child;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_settop(L, 1);
+
+    lua_getfield(L, 1, "loop");
+    if ( lua_isnil(L, -1) ) {
+        lua_pop(L, 1);
+        push_default_loop(L);
+    }
+    loop_i = lua_gettop(L);
+    loop   = *check_loop_and_init(L, loop_i);
+#ifndef __linux__
+    if ( ! ev_is_default_loop(loop) )
+        luaL_argerror(L, 1, "child processes can only be watched by the default loop");
+#endif
+
+    lua_getfield(L, 1, "on_exit");
+    if ( lua_isnil(L, -1) ) {
+        lua_pop(L, 1);
+        lua_pushcfunction(L, spawn_on_exit);
+    }
+    fn_i = lua_gettop(L);
+    luaL_argcheck(L, lua_isfunction(L, fn_i), 1, "on_exit must be a function");
+
+    lua_getfield(L, 1, "argv");
+    argv_i = lua_gettop(L);
+    luaL_argcheck(L, lua_istable(L, argv_i), 1, "argv must be a table");
+    argc = lua_objlen(L, argv_i);
+    luaL_argcheck(L, argc > 0, 1, "argv must not be empty");
+
+    /* userdata arrays are collected on error, so nothing can leak. */
+    argv = lua_newuserdata(L, (argc + 1) * sizeof(char*));
+    for ( i = 0; i < argc; i++ ) {
+        lua_rawgeti(L, argv_i, i + 1);
+        luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING, 1, "argv must only contain strings");
+        argv[i] = lua_tostring(L, -1); /* still referenced by the argv table. */
+        lua_pop(L, 1);
+    }
+    argv[argc] = NULL;
+
+    lua_getfield(L, 1, "env");
+    env_i = lua_gettop(L);
+    luaL_argcheck(L, lua_isnil(L, env_i) || lua_istable(L, env_i), 1, "env must be a table");
+    lua_getfield(L, 1, "setenv");
+    setenv_i = lua_gettop(L);
+    luaL_argcheck(L, lua_isnil(L, setenv_i) || lua_istable(L, setenv_i), 1, "setenv must be a table");
+    if ( lua_istable(L, env_i) || lua_istable(L, setenv_i) ) {
+        int envc  = 0;
+
+        lua_newtable(L); /* anchors the "name=value" strings. */
+        if ( lua_istable(L, env_i) ) {
+            lua_pushnil(L);
+            while ( lua_next(L, env_i) ) {
+                luaL_argcheck(L, lua_type(L, -2) == LUA_TSTRING, 1, "env names must be strings");
+                if ( ! spawn_is_setenv(L, setenv_i, lua_gettop(L) - 1) ) {
+                    lua_pushfstring(L, "%s=%s", lua_tostring(L, -2), lua_tostring(L, -1));
+                    lua_rawseti(L, setenv_i + 1, ++envc);
+                }
+                lua_pop(L, 1);
+            }
+        } else {
+            for ( i = 0; NULL != environ[i]; i++ ) {
+                const char* eq = strchr(environ[i], '=');
+                int         replaced;
+
+                if ( NULL == eq ) continue;
+                lua_pushlstring(L, environ[i], eq - environ[i]);
+                replaced = spawn_is_setenv(L, setenv_i, lua_gettop(L));
+                lua_pop(L, 1);
+                if ( replaced ) continue;
+                lua_pushstring(L, environ[i]);
+                lua_rawseti(L, setenv_i + 1, ++envc);
+            }
+        }
+        if ( lua_istable(L, setenv_i) ) {
+            lua_pushnil(L);
+            while ( lua_next(L, setenv_i) ) {
+                luaL_argcheck(L, lua_type(L, -2) == LUA_TSTRING, 1, "setenv names must be strings");
+                lua_pushfstring(L, "%s=%s", lua_tostring(L, -2), lua_tostring(L, -1));
+                lua_rawseti(L, setenv_i + 1, ++envc);
+                lua_pop(L, 1);
+            }
+        }
+        envp = lua_newuserdata(L, (envc + 1) * sizeof(char*));
+        for ( i = 0; i < envc; i++ ) {
+            lua_rawgeti(L, setenv_i + 1, i + 1);
+            envp[i] = (char*)lua_tostring(L, -1);
+            lua_pop(L, 1);
+        }
+        envp[envc] = NULL;
+    }
+
+    lua_getfield(L, 1, "fds");
+    fds_i = lua_gettop(L);
+    if ( lua_istable(L, fds_i) ) {
+        lua_pushnil(L);
+        while ( lua_next(L, fds_i) ) {
+            luaL_argcheck(L, lua_type(L, -2) == LUA_TNUMBER && lua_tointeger(L, -2) > 2,
+                          1, "fds must map fd numbers above 2 to file descriptors");
+            luaL_argcheck(L, lua_type(L, -1) == LUA_TNUMBER && lua_tointeger(L, -1) >= 0,
+                          1, "fds must map fd numbers above 2 to file descriptors");
+            lua_pop(L, 1);
+        }
+    } else if ( ! lua_isnil(L, fds_i) ) {
+        luaL_argerror(L, 1, "fds must be a table");
+    }
+
+    lua_getfield(L, 1, "cwd");
+    cwd = lua_tostring(L, -1);
+#if !defined(__GLIBC__) || __GLIBC__ < 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ < 29)
+    if ( cwd ) luaL_argerror(L, 1, "cwd is not supported on this platform");
+#endif
+
+    for ( i = 0; i < 3; i++ ) {
+        const char* how;
+
+        lua_getfield(L, 1, spawn_stdio_names[i]);
+        how = lua_type(L, -1) == LUA_TSTRING ? lua_tostring(L, -1) : NULL;
+        if ( lua_isnil(L, -1) || ( how && strcmp(how, "inherit") == 0 ) ) {
+            mode[i] = SPAWN_INHERIT;
+        } else if ( how && strcmp(how, "pipe") == 0 ) {
+            mode[i] = SPAWN_PIPE;
+        } else if ( how && strcmp(how, "null") == 0 ) {
+            mode[i] = SPAWN_NULL;
+        } else if ( lua_type(L, -1) == LUA_TNUMBER ) {
+            mode[i] = SPAWN_FD;
+            fd[i]   = lua_tointeger(L, -1);
+        } else {
+            return luaL_argerror(L, 1, lua_pushfstring(L,
+                "%s must be \"pipe\", \"null\", \"inherit\" or a file descriptor",
+                spawn_stdio_names[i]));
+        }
+        lua_pop(L, 1);
+    }
+
+    /* From here on errors are collected in err so we can clean up. */
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_init(&attr);
+
+    /* don't leak blocked signals (ev.SignalFD) or handlers into the child. */
+    sigemptyset(&sigs);
+    posix_spawnattr_setsigmask(&attr, &sigs);
+    sigfillset(&sigs);
+    sigdelset(&sigs, SIGKILL);
+    sigdelset(&sigs, SIGSTOP);
+    posix_spawnattr_setsigdefault(&attr, &sigs);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    for ( i = 0; i < 3 && 0 == err; i++ ) {
+        switch ( mode[i] ) {
+        case SPAWN_PIPE:
+#ifdef __linux__
+            /* atomically, so a concurrent fork can not inherit them. */
+            if ( pipe2(pipes[i], O_CLOEXEC) != 0 ) {
+                err = errno;
+                break;
+            }
+#else
+            if ( pipe(pipes[i]) != 0 ) {
+                err = errno;
+                break;
+            }
+            fcntl(pipes[i][0], F_SETFD, FD_CLOEXEC);
+            fcntl(pipes[i][1], F_SETFD, FD_CLOEXEC);
+#endif
+            /* stdin: child reads pipes[0][0], everything else writes [1]. */
+            err = posix_spawn_file_actions_adddup2(&actions, pipes[i][i == 0 ? 0 : 1], i);
+            break;
+        case SPAWN_NULL:
+            err = posix_spawn_file_actions_addopen(&actions, i, "/dev/null",
+                                                   i == 0 ? O_RDONLY : O_WRONLY, 0);
+            break;
+        case SPAWN_FD:
+            err = posix_spawn_file_actions_adddup2(&actions, fd[i], i);
+            break;
+        }
+    }
+    if ( lua_istable(L, fds_i) ) {
+        lua_pushnil(L);
+        while ( 0 == err && lua_next(L, fds_i) ) {
+            err = posix_spawn_file_actions_adddup2(&actions, lua_tointeger(L, -1),
+                                                   lua_tointeger(L, -2));
+            lua_pop(L, 1);
+        }
+    }
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))
+    if ( 0 == err && cwd ) err = posix_spawn_file_actions_addchdir_np(&actions, cwd);
+#endif
+
+    if ( 0 == err ) {
+        err = posix_spawnp(&pid, argv[0], &actions, &attr, (char* const*)argv, envp);
+    }
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    /* close the child ends, keep the parent ends non-blocking. */
+    for ( i = 0; i < 3; i++ ) {
+        int parent = i == 0 ? 1 : 0;
+        if ( pipes[i][0] < 0 ) continue;
+        close(pipes[i][1 - parent]);
+        if ( err ) {
+            close(pipes[i][parent]);
+        } else {
+            fcntl(pipes[i][parent], F_SETFL, fcntl(pipes[i][parent], F_GETFL) | O_NONBLOCK);
+        }
+    }
+    if ( err ) {
+        return luaL_error(L, "unable to spawn '%s': %s", argv[0], strerror(err));
+    }
+
+#ifdef __linux__
+    if ( ! ev_is_default_loop(loop) ) {
+        lua_ev_childfd* cfd;
+
+        /* child = ev.ChildFD.new(on_exit, pid) */
+        lua_pushcfunction(L, childfd_new);
+        lua_pushvalue(L, fn_i);
+        lua_pushinteger(L, pid);
+        if ( lua_pcall(L, 2, 1, 0) ) {
+            /* can't watch it, so don't leave it (or its pipes) behind. */
+            for ( i = 0; i < 3; i++ ) {
+                if ( pipes[i][0] >= 0 ) close(pipes[i][i == 0 ? 1 : 0]);
+            }
+            kill(pid, SIGKILL);
+            waitpid(pid, NULL, 0);
+            return lua_error(L);
+        }
+        child_i = lua_gettop(L);
+        cfd     = check_childfd(L, child_i);
+        cfd->push_args = &spawn_push_fd_status;
+
+        ev_io_start(loop, &cfd->io);
+        loop_start_watcher(L, loop, GET_WATCHER_DATA(cfd), loop_i, child_i, 0);
+    } else
+#endif
+    {
+        /* child = ev.Child.new(on_exit, pid, false) */
+        lua_pushcfunction(L, child_new);
+        lua_pushvalue(L, fn_i);
+        lua_pushinteger(L, pid);
+        lua_pushboolean(L, 0);
+        lua_call(L, 3, 1);
+        child_i = lua_gettop(L);
+        child   = check_child(L, child_i);
+        ev_set_cb(child, spawn_child_cb);
+
+        ev_child_start(loop, child);
+        loop_start_watcher(L, loop, GET_WATCHER_DATA(child), loop_i, child_i, 0);
+    }
+
+    lua_createtable(L, 0, 5);
+    lua_pushinteger(L, pid);
+    lua_setfield(L, -2, "pid");
+    lua_pushvalue(L, child_i);
+    lua_setfield(L, -2, "child");
+    for ( i = 0; i < 3; i++ ) {
+        if ( pipes[i][0] < 0 ) continue;
+        lua_pushinteger(L, pipes[i][i == 0 ? 1 : 0]);
+        lua_setfield(L, -2, spawn_stdio_names[i]);
+    }
+    return 1;
+}
+
+/**
+ * Returns true if the setenv table at setenv_i has the name at name_i,
+ * false if it doesn't or setenv_i is not a table.
+ *
+ * [-0, +0, -]
+ */
+static int spawn_is_setenv(lua_State *L, int setenv_i, int name_i) {
+    int found;
+
+    if ( ! lua_istable(L, setenv_i) ) return 0;
+    lua_pushvalue(L, name_i);
+    lua_rawget(L, setenv_i);
+    found = ! lua_isnil(L, -1);
+    lua_pop(L, 1);
+    return found;
+}
+
+/**
+ * Child watcher callback for spawned processes.  The watcher is
+ * stopped once the process is gone (not just stopped/continued), so
+ * the callback runs at most once per exit.
+ *
+ * [+0, -0, m]
+ */
+static void spawn_child_cb(struct ev_loop* loop, ev_child* child, int revents) {
+    if ( WIFEXITED(child->rstatus) || WIFSIGNALED(child->rstatus) ) {
+        ev_child_stop(loop, child);
+    }
+    watcher_cb_args(loop, child, revents, &spawn_push_status);
+}
+
+/**
+ * Push the decoded exit status and terminating signal (nil if the
+ * process did not exit or was not killed by a signal).
+ *
+ * @see watcher_cb_args()
+ *
+ * [-0, +2, -]
+ */
+static int spawn_push_status(lua_State *L, void *watcher) {
+    return spawn_push_rstatus(L, ((ev_child*)watcher)->rstatus);
+}
+
+#ifdef __linux__
+/**
+ * spawn_push_status() for ev.ChildFD watchers.
+ *
+ * [-0, +2, -]
+ */
+static int spawn_push_fd_status(lua_State *L, void *watcher) {
+    return spawn_push_rstatus(L, ((lua_ev_childfd*)watcher)->rstatus);
+}
+#endif
+
+/**
+ * Push exit status and terminating signal of the waitpid() status.
+ *
+ * [-0, +2, -]
+ */
+static int spawn_push_rstatus(lua_State *L, int rstatus) {
+    if ( WIFEXITED(rstatus) ) {
+        lua_pushinteger(L, WEXITSTATUS(rstatus));
+    } else {
+        lua_pushnil(L);
+    }
+    if ( WIFSIGNALED(rstatus) ) {
+        lua_pushinteger(L, WTERMSIG(rstatus));
+    } else {
+        lua_pushnil(L);
+    }
+    return 2;
+}
+
+/**
+ * Default on_exit callback, the process is reaped and the watcher is
+ * already stopped, so there is nothing left to do.
+ */
+static int spawn_on_exit(lua_State *L) {
+    return 0;
+}
+
+#endif /* _WIN32 */
+
+/* vi:set expandtab ts=4: */
@@ -1,3 +1,42 @@
+/**
+ * Nanosecond part of the a(ccess), m(odification) or c(hange) time.
+ */
+#if defined(__APPLE__)
+#  define STAT_NSEC(data, which) ((data).st_##which##timespec.tv_nsec)
+#elif defined(_WIN32)
+#  define STAT_NSEC(data, which) 0
+#else
+#  define STAT_NSEC(data, which) ((data).st_##which##tim.tv_nsec)
+#endif
+
+/**
+ * Bits passed to the stat callback (and returned by stat:changed()).
+ */
+#define STAT_CHANGED_DEV    0x0001
+#define STAT_CHANGED_INO    0x0002
+#define STAT_CHANGED_MODE   0x0004
+#define STAT_CHANGED_NLINK  0x0008
+#define STAT_CHANGED_UID    0x0010
+#define STAT_CHANGED_GID    0x0020
+#define STAT_CHANGED_RDEV   0x0040
+#define STAT_CHANGED_SIZE   0x0080
+#define STAT_CHANGED_ATIME  0x0100
+#define STAT_CHANGED_MTIME  0x0200
+#define STAT_CHANGED_CTIME  0x0400
+
+/**
+ * A stat watcher.  libev only compares whole seconds, so nsec checks
+ * the nanoseconds of the attributes libev read before the loop blocks
+ * (see stat_nsec_cb()), seen holds the attributes passed to the last
+ * callback.  The ev_stat must be the first member, check_stat()
+ * returns it.
+ */
+struct lua_ev_stat {
+    ev_stat     stat;
+    ev_prepare  nsec;
+    ev_statdata seen;
+};
+
 /**
  * Create a table for ev.STAT that gives access to the constructor for
  * stat objects.
@@ -7,11 +46,29 @@
 static int luaopen_ev_stat(lua_State *L) {
     lua_pop(L, create_stat_mt(L));
 
-    lua_createtable(L, 0, 1);
+    lua_createtable(L, 0, 12);
 
     lua_pushcfunction(L, stat_new);
     lua_setfield(L, -2, "new");
 
+#define CONSTANT(name) do { \
+    lua_pushinteger(L, STAT_CHANGED_ ## name); \
+    lua_setfield(L, -2, #name); \
+} while(0);
+
+    CONSTANT(DEV);
+    CONSTANT(INO);
+    CONSTANT(MODE);
+    CONSTANT(NLINK);
+    CONSTANT(UID);
+    CONSTANT(GID);
+    CONSTANT(RDEV);
+    CONSTANT(SIZE);
+    CONSTANT(ATIME);
+    CONSTANT(MTIME);
+    CONSTANT(CTIME);
+#undef CONSTANT
+
     return 1;
 }
 
@@ -25,7 +82,21 @@ static int create_stat_mt(lua_State *L) {
     static luaL_reg methods[] = {
         { "stop",          stat_stop },
         { "start",         stat_start },
+        { "set",           stat_set },
         { "getdata",       stat_getdata },
+        { "changed",       stat_changed },
+        { "dev",           stat_dev },
+        { "ino",           stat_ino },
+        { "mode",          stat_mode },
+        { "nlink",         stat_nlink },
+        { "uid",           stat_uid },
+        { "gid",           stat_gid },
+        { "rdev",          stat_rdev },
+        { "size",          stat_size },
+        { "atime",         stat_atime },
+        { "mtime",         stat_mtime },
+        { "ctime",         stat_ctime },
+        { "mtime_nsec",    stat_mtime_nsec },
         { NULL, NULL }
     };
     return add_watcher_mt(L, methods, STAT_MT);
@@ -36,6 +107,7 @@ static int create_stat_mt(lua_State *L) {
  *   1 - callback function.
  *   2 - path
  *   3 - interval
+ *   4 - optional context, see watcher:context()
  *
  * @see watcher_new()
  *
@@ -46,18 +118,109 @@ static int stat_new(lua_State* L) {
     ev_tstamp   interval = luaL_optint(L, 3, 0);
     ev_stat*    stat;
 
-    stat = (ev_stat*)watcher_new(L, sizeof(ev_stat), STAT_MT);
+    stat = (ev_stat*)watcher_new_slots(L, sizeof(lua_ev_stat), STAT_MT, STAT_SLOTS);
+    watcher_new_context(L, 4);
     ev_stat_init(stat, &stat_cb, path, interval);
+    ev_prepare_init(&((lua_ev_stat*)stat)->nsec, &stat_nsec_cb);
+    lua_pushvalue(L, 2);
+    obj_setslot(L, -2, STAT_PATH);
     return 1;
 }
 
 /**
- * @see watcher_cb()
+ * Calls the watcher callback with the bit set of changed attributes
+ * as an extra argument.
+ *
+ * @see watcher_cb_args()
  *
  * [+0, -0, m]
  */
 static void stat_cb(struct ev_loop* loop, ev_stat* stat, int revents) {
-    watcher_cb(loop, stat, revents);
+    ((lua_ev_stat*)stat)->seen = stat->attr;
+    watcher_cb_args(loop, stat, revents, &stat_push_changed);
+}
+
+/**
+ * libev reads the attributes on every inotify event and every
+ * interval, but only calls the callback if they changed by a whole
+ * second (or in another field).  Before the loop blocks, call it for
+ * a change of the nanoseconds of mtime or ctime too, with prev set to
+ * the attributes of the last callback.
+ *
+ * [+0, -0, -]
+ */
+static void stat_nsec_cb(struct ev_loop* loop, ev_prepare* prepare, int revents) {
+    lua_ev_stat* stat = (lua_ev_stat*)
+        (((char*)prepare) - offsetof(lua_ev_stat, nsec));
+
+    if ( ev_is_pending(&stat->stat) ) return;
+    if ( STAT_NSEC(stat->stat.attr, m) == STAT_NSEC(stat->seen, m) &&
+         STAT_NSEC(stat->stat.attr, c) == STAT_NSEC(stat->seen, c) ) return;
+
+    stat->stat.prev = stat->seen;
+    ev_feed_event(loop, &stat->stat, EV_STAT);
+}
+
+/**
+ * Start the nanosecond check of a stat watcher which was just
+ * started, it does not keep the loop running by itself.
+ *
+ * [-0, +0, -]
+ */
+static void stat_nsec_start(struct ev_loop* loop, lua_ev_stat* stat) {
+    if ( ev_is_active(&stat->nsec) ) return;
+    stat->seen = stat->stat.attr;
+    ev_prepare_start(loop, &stat->nsec);
+    ev_unref(loop);
+}
+
+/**
+ * [-0, +0, -]
+ */
+static void stat_nsec_stop(struct ev_loop* loop, lua_ev_stat* stat) {
+    if ( ! ev_is_active(&stat->nsec) ) return;
+    ev_ref(loop);
+    ev_prepare_stop(loop, &stat->nsec);
+}
+
+/**
+ * Compute the bit set of STAT_CHANGED_* for the attributes that differ
+ * between stat->prev and stat->attr.
+ */
+static int stat_changed_mask(ev_stat* stat) {
+    int changed = 0;
+
+#define CHANGED(field, bit) \
+    if ( stat->attr.st_##field != stat->prev.st_##field ) changed |= STAT_CHANGED_##bit
+
+    CHANGED(dev,   DEV);
+    CHANGED(ino,   INO);
+    CHANGED(mode,  MODE);
+    CHANGED(nlink, NLINK);
+    CHANGED(uid,   UID);
+    CHANGED(gid,   GID);
+    CHANGED(rdev,  RDEV);
+    CHANGED(size,  SIZE);
+    CHANGED(atime, ATIME);
+    CHANGED(mtime, MTIME);
+    CHANGED(ctime, CTIME);
+#undef CHANGED
+
+    if ( STAT_NSEC(stat->attr, a) != STAT_NSEC(stat->prev, a) ) changed |= STAT_CHANGED_ATIME;
+    if ( STAT_NSEC(stat->attr, m) != STAT_NSEC(stat->prev, m) ) changed |= STAT_CHANGED_MTIME;
+    if ( STAT_NSEC(stat->attr, c) != STAT_NSEC(stat->prev, c) ) changed |= STAT_CHANGED_CTIME;
+
+    return changed;
+}
+
+/**
+ * @see watcher_cb_args()
+ *
+ * [-0, +1, -]
+ */
+static int stat_push_changed(lua_State *L, void *watcher) {
+    lua_pushinteger(L, stat_changed_mask((ev_stat*)watcher));
+    return 1;
 }
 
 /**
@@ -73,6 +236,7 @@ static int stat_stop(lua_State *L) {
     struct ev_loop* loop = *check_loop_and_init(L, 2);
 
     loop_stop_watcher(L, loop, GET_WATCHER_DATA(stat), 1);
+    stat_nsec_stop(loop, (lua_ev_stat*)stat);
     ev_stat_stop(loop, stat);
 
     return 0;
@@ -92,20 +256,157 @@ static int stat_start(lua_State *L) {
     int is_daemon        = lua_toboolean(L, 3);
 
     ev_stat_start(loop, stat);
+    stat_nsec_start(loop, (lua_ev_stat*)stat);
     loop_start_watcher(L, loop, GET_WATCHER_DATA(stat), 2, 1, is_daemon);
 
     return 0;
 }
 
-#define set_attr(value)                         \
-    lua_pushliteral(L, #value);                 \
-    lua_pushinteger(L, stat->attr.st_##value);  \
-    lua_settable(L, -3)
+/**
+ * Changes the path and interval, restarting the stat if it is active.
+ *
+ * Usage:
+ *     stat:set(path [, interval])
+ *
+ * [+0, -0, e]
+ */
+static int stat_set(lua_State *L) {
+    ev_stat*        stat     = check_stat(L, 1);
+    const char*     path     = luaL_checkstring(L, 2);
+    ev_tstamp       interval = luaL_optnumber(L, 3, 0);
+    struct ev_loop* loop     = watcher_active_loop(stat);
+
+    if ( interval < 0.0 ) luaL_argerror(L, 3, "interval must be greater than or equal to 0");
+
+    if ( loop ) {
+        stat_nsec_stop(loop, (lua_ev_stat*)stat);
+        ev_stat_stop(loop, stat);
+    }
+    lua_pushvalue(L, 2);
+    obj_setslot(L, 1, STAT_PATH);
+    ev_stat_set(stat, path, interval);
+    if ( loop ) {
+        ev_stat_start(loop, stat);
+        stat_nsec_start(loop, (lua_ev_stat*)stat);
+    }
+
+    return 0;
+}
+
+/**
+ * Returns the bit set of ev.Stat.DEV, INO, MODE, NLINK, UID, GID,
+ * RDEV, SIZE, ATIME, MTIME and CTIME for the attributes that differ
+ * between the previous and the most recently detected attributes.
+ *
+ * Usage:
+ *     changed = stat:changed()
+ *
+ * [+1, -0, e]
+ */
+static int stat_changed(lua_State *L) {
+    lua_pushinteger(L, stat_changed_mask(check_stat(L, 1)));
+    return 1;
+}
+
+/**
+ * Define stat:<field>([prev]) accessors which return a single numeric
+ * attribute without building any tables.  If prev is true, the
+ * attribute from before the last change is returned.
+ *
+ * Usage:
+ *     size = stat:size()
+ *     old_size = stat:size(true)
+ *
+ * [+1, -0, e]
+ */
+#define STAT_ACCESSOR(field)                                    \
+static int stat_##field(lua_State *L) {                         \
+    ev_stat* stat = check_stat(L, 1);                           \
+    lua_pushinteger(L, lua_toboolean(L, 2) ?                    \
+                    stat->prev.st_##field :                     \
+                    stat->attr.st_##field);                     \
+    return 1;                                                   \
+}
+
+STAT_ACCESSOR(dev)
+STAT_ACCESSOR(ino)
+STAT_ACCESSOR(mode)
+STAT_ACCESSOR(nlink)
+STAT_ACCESSOR(uid)
+STAT_ACCESSOR(gid)
+STAT_ACCESSOR(rdev)
+STAT_ACCESSOR(size)
+STAT_ACCESSOR(atime)
+STAT_ACCESSOR(mtime)
+STAT_ACCESSOR(ctime)
+#undef STAT_ACCESSOR
+
+/**
+ * Returns the nanosecond part of the modification time so that edits
+ * within the same second can be told apart (0 if the platform doesn't
+ * provide it).
+ *
+ * Usage:
+ *     nsec = stat:mtime_nsec([prev])
+ *
+ * [+1, -0, e]
+ */
+static int stat_mtime_nsec(lua_State *L) {
+    ev_stat* stat = check_stat(L, 1);
+    lua_pushinteger(L, lua_toboolean(L, 2) ?
+                    STAT_NSEC(stat->prev, m) :
+                    STAT_NSEC(stat->attr, m));
+    return 1;
+}
+
+#define set_field(data, value)                   \
+    lua_pushinteger(L, (data).st_##value);       \
+    lua_setfield(L, -2, #value)
+
+#define set_nsec(data, value)                    \
+    lua_pushinteger(L, STAT_NSEC(data, value));  \
+    lua_setfield(L, -2, #value "time_nsec")
+
+/**
+ * Fill the table on the top of the stack with the attributes in data.
+ *
+ * [-0, +0, m]
+ */
+static void stat_fill_attr(lua_State *L, ev_statdata* data) {
+    set_field(*data, dev);
+    set_field(*data, ino);
+    set_field(*data, mode);
+    set_field(*data, nlink);
+    set_field(*data, uid);
+    set_field(*data, gid);
+    set_field(*data, rdev);
+    set_field(*data, size);
+    set_field(*data, atime);
+    set_field(*data, mtime);
+    set_field(*data, ctime);
+    set_nsec(*data, a);
+    set_nsec(*data, m);
+    set_nsec(*data, c);
+}
+
+#undef set_field
+#undef set_nsec
 
-#define set_prev(value)                         \
-    lua_pushliteral(L, #value);                 \
-    lua_pushinteger(L, stat->prev.st_##value);  \
-    lua_settable(L, -3)
+/**
+ * Reuse the table at t[name] if there is one, otherwise create it.
+ * Leaves the table on the top of the stack.
+ *
+ * [-0, +1, m]
+ */
+static void stat_subtable(lua_State *L, const char* name) {
+    lua_getfield(L, -1, name);
+    if ( ! lua_istable(L, -1) ) {
+        lua_pop(L, 1);
+        lua_createtable(L, 0, 14);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -3, name);
+    }
+}
 
 /**
  * Returns a table with the following fields:
@@ -114,63 +415,40 @@ static int stat_start(lua_State *L) {
  * - attr: the most-recently detected attributes of the file in a form
  *   of table with the following fields: dev, ino, mode, nlink, uid, gid,
  *   rdev, size, atime, mtime, ctime corresponding to struct stat members
- *   (st_dev, st_ino, etc.);
+ *   (st_dev, st_ino, etc.) plus atime_nsec, mtime_nsec and ctime_nsec;
  * - prev: the previous attributes of the file with the same fields as
  *   attr fields.
  *
+ * If a table is passed in, it is filled in (reusing its attr and prev
+ * tables) and returned instead of allocating new tables.
+ *
  * Usage:
- *     stat:getdata()
+ *     stat:getdata([table])
  *
  * [+1, -0, e]
  */
 static int stat_getdata(lua_State *L) {
     ev_stat* stat = check_stat(L, 1);
 
-    lua_newtable(L);
+    if ( lua_istable(L, 2) ) {
+        lua_settop(L, 2);
+    } else {
+        lua_createtable(L, 0, 4);
+    }
 
-    lua_pushliteral(L, "path");
     lua_pushstring(L, stat->path);
-    lua_settable(L, -3);
+    lua_setfield(L, -2, "path");
 
-    lua_pushliteral(L, "interval");
     lua_pushinteger(L, stat->interval);
-    lua_settable(L, -3);
-
-    /* attr table */
-    lua_pushliteral(L, "attr");
-    lua_newtable(L);
-
-    set_attr(dev);
-    set_attr(ino);
-    set_attr(mode);
-    set_attr(nlink);
-    set_attr(uid);
-    set_attr(gid);
-    set_attr(rdev);
-    set_attr(size);
-    set_attr(atime);
-    set_attr(mtime);
-    set_attr(ctime);
-
-    lua_settable(L, -3);
-
-    /* prev table */
-    lua_pushliteral(L, "prev");
-    lua_newtable(L);
-
-    set_prev(dev);
-    set_prev(ino);
-    set_prev(mode);
-    set_prev(nlink);
-    set_prev(uid);
-    set_prev(gid);
-    set_prev(rdev);
-    set_prev(size);
-    set_prev(atime);
-    set_prev(mtime);
-    set_prev(ctime);
-
-    lua_settable(L, -3);
+    lua_setfield(L, -2, "interval");
+
+    stat_subtable(L, "attr");
+    stat_fill_attr(L, &stat->attr);
+    lua_pop(L, 1);
+
+    stat_subtable(L, "prev");
+    stat_fill_attr(L, &stat->prev);
+    lua_pop(L, 1);
 
     return 1;
 }
@@ -0,0 +1,512 @@
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/* never wake up more often than this to poll a slice. */
+#define STATPOLL_MIN_TICK 0.01
+
+/* the backoff doubles the interval at most this many times. */
+#define STATPOLL_MAX_LEVEL 15
+
+/* entry flags. */
+#define STATPOLL_SEEN   1 /* attributes were recorded at least once. */
+#define STATPOLL_EXISTS 2 /* the last check found the path. */
+
+/**
+ * The attributes of a path, as of the last check.  Entries are kept
+ * in one array in the order they are checked, removal moves the last
+ * entry into the hole.
+ */
+typedef struct statpoll_entry {
+    char*          path;
+    unsigned int   hash;
+    /* checks left to skip, and the backoff level that set it. */
+    unsigned short skip;
+    unsigned char  level;
+    unsigned char  flags;
+    uint64_t       ino;
+    int64_t        size;
+    int64_t        mtime; /* nanoseconds */
+    int64_t        ctime; /* nanoseconds */
+} statpoll_entry;
+
+/**
+ * The timer must be the first member, since that is what watcher_cb()
+ * and GET_WATCHER_DATA() operate on.
+ */
+struct lua_ev_statpoll {
+    ev_timer        timer;
+    ev_tstamp       interval;
+    int             max_level;
+    statpoll_entry* entries;
+    int             num_entries;
+    int             max_entries;
+    /* where the next slice starts. */
+    int             cursor;
+    /* open addressed index into entries, keyed by path. */
+    int*            index;
+    int             index_size;
+    /* entries found changed by the current slice. */
+    int*            changed;
+    int             num_changed;
+    int             max_changed;
+};
+
+/**
+ * Create a table for ev.StatPoll that gives access to the constructor
+ * for statpoll objects.
+ *
+ * [-0, +1, ?]
+ */
+static int luaopen_ev_statpoll(lua_State *L) {
+    lua_pop(L, create_statpoll_mt(L));
+
+    lua_createtable(L, 0, 1);
+
+    lua_pushcfunction(L, statpoll_new);
+    lua_setfield(L, -2, "new");
+
+    return 1;
+}
+
+/**
+ * Create the statpoll metatable in the registry.
+ *
+ * [-0, +1, ?]
+ */
+static int create_statpoll_mt(lua_State *L) {
+
+    static luaL_reg methods[] = {
+        { "stop",          statpoll_stop },
+        { "start",         statpoll_start },
+        { "add",           statpoll_add },
+        { "remove",        statpoll_remove },
+        { "count",         statpoll_count },
+        { NULL, NULL }
+    };
+    add_watcher_mt(L, methods, STATPOLL_MT);
+
+    /* release the path array. */
+    lua_pushcfunction(L, statpoll_gc);
+    lua_setfield(L, -2, "__gc");
+    return 1;
+}
+
+/**
+ * Create a new statpoll object.  Arguments:
+ *   1 - callback function.
+ *   2 - interval (number of seconds within which every path is
+ *       checked, must be greater than 0).
+ *   3 - max_interval (paths that do not change are checked less and
+ *       less often, but at least every max_interval seconds.  Defaults
+ *       to interval, which disables the backoff).
+ *   4 - optional context, see watcher:context()
+ *
+ * @see watcher_new()
+ *
+ * [+1, -0, ?]
+ */
+static int statpoll_new(lua_State* L) {
+    ev_tstamp        interval     = luaL_checknumber(L, 2);
+    ev_tstamp        max_interval = luaL_optnumber(L, 3, interval);
+    lua_ev_statpoll* sp;
+    int              max_level    = 0;
+
+    if ( interval <= 0.0 )
+        luaL_argerror(L, 2, "interval must be greater than 0");
+    if ( max_interval < interval )
+        luaL_argerror(L, 3, "max_interval must not be less than interval");
+
+    while ( max_level < STATPOLL_MAX_LEVEL &&
+            interval * (2 << max_level) <= max_interval ) max_level++;
+
+    sp = (lua_ev_statpoll*)watcher_new(L, sizeof(lua_ev_statpoll), STATPOLL_MT);
+    watcher_new_context(L, 4);
+    memset(sp, 0, sizeof(lua_ev_statpoll));
+    ev_timer_init(&sp->timer, &statpoll_cb, interval, interval);
+    sp->interval  = interval;
+    sp->max_level = max_level;
+    return 1;
+}
+
+/**
+ * Find the index slot of path: returns the entry number, or -1 if the
+ * path is not in the list in which case *slot is where it would go.
+ */
+static int statpoll_find(lua_ev_statpoll* sp, const char* path, unsigned int hash, int* slot) {
+    unsigned int mask = sp->index_size - 1;
+    unsigned int i    = hash & mask;
+
+    while ( sp->index[i] != -1 ) {
+        statpoll_entry* entry = &sp->entries[sp->index[i]];
+        if ( entry->hash == hash && strcmp(entry->path, path) == 0 ) {
+            *slot = i;
+            return sp->index[i];
+        }
+        i = (i + 1) & mask;
+    }
+    *slot = i;
+    return -1;
+}
+
+/**
+ * Rebuild the path index so that it is at most half full.
+ */
+static int statpoll_reindex(lua_ev_statpoll* sp, int size) {
+    int* index = malloc(size * sizeof(int));
+    int  i;
+
+    if ( NULL == index ) return -1;
+    for ( i = 0; i < size; i++ ) index[i] = -1;
+    for ( i = 0; i < sp->num_entries; i++ ) {
+        unsigned int slot = sp->entries[i].hash & (size - 1);
+        while ( index[slot] != -1 ) slot = (slot + 1) & (size - 1);
+        index[slot] = i;
+    }
+    free(sp->index);
+    sp->index      = index;
+    sp->index_size = size;
+    return 0;
+}
+
+/**
+ * Empty an index slot, moving later entries of the same probe chain
+ * back so that lookups need no tombstones.
+ */
+static void statpoll_unindex(lua_ev_statpoll* sp, int slot) {
+    unsigned int mask = sp->index_size - 1;
+    unsigned int i    = slot;
+    unsigned int j    = slot;
+
+    for (;;) {
+        unsigned int home;
+
+        j = (j + 1) & mask;
+        if ( sp->index[j] == -1 ) break;
+        home = sp->entries[sp->index[j]].hash & mask;
+        /* leave it if its home is cyclically within (i, j]. */
+        if ( i <= j ? ( i < home && home <= j ) : ( i < home || home <= j ) )
+            continue;
+        sp->index[i] = sp->index[j];
+        i = j;
+    }
+    sp->index[i] = -1;
+}
+
+/**
+ * Read the attributes of entry, which are the current attributes if
+ * the path exists.  Returns true if they differ from the previous
+ * ones.  The first check of a path only records them.
+ *
+ * statx() is asked only for the attributes compared, which saves the
+ * server round trips for the others on some network filesystems.
+ */
+static int statpoll_check(statpoll_entry* entry) {
+    int      exists;
+    uint64_t ino   = 0;
+    int64_t  size  = 0;
+    int64_t  mtime = 0;
+    int64_t  ctime = 0;
+    int      changed;
+#ifdef STATX_BASIC_STATS
+    struct statx stx;
+
+    exists = statx(AT_FDCWD, entry->path, 0,
+                   STATX_INO | STATX_SIZE | STATX_MTIME | STATX_CTIME, &stx) == 0;
+    if ( exists ) {
+        ino   = stx.stx_ino;
+        size  = stx.stx_size;
+        mtime = stx.stx_mtime.tv_sec * (int64_t)1000000000 + stx.stx_mtime.tv_nsec;
+        ctime = stx.stx_ctime.tv_sec * (int64_t)1000000000 + stx.stx_ctime.tv_nsec;
+    }
+#else
+    struct stat st;
+
+    exists = stat(entry->path, &st) == 0;
+    if ( exists ) {
+        ino   = st.st_ino;
+        size  = st.st_size;
+        mtime = st.st_mtim.tv_sec * (int64_t)1000000000 + st.st_mtim.tv_nsec;
+        ctime = st.st_ctim.tv_sec * (int64_t)1000000000 + st.st_ctim.tv_nsec;
+    }
+#endif
+
+    changed = ( entry->flags & STATPOLL_SEEN ) &&
+        ( exists != ( ( entry->flags & STATPOLL_EXISTS ) != 0 ) ||
+          ino != entry->ino || size != entry->size ||
+          mtime != entry->mtime || ctime != entry->ctime );
+
+    entry->flags = STATPOLL_SEEN | ( exists ? STATPOLL_EXISTS : 0 );
+    entry->ino   = ino;
+    entry->size  = size;
+    entry->mtime = mtime;
+    entry->ctime = ctime;
+    return changed;
+}
+
+/**
+ * Compute how often the timer ticks and how many paths each tick
+ * visits so that every path is visited once per interval, with the
+ * visits spread evenly over it.
+ */
+static int statpoll_slice(lua_ev_statpoll* sp, ev_tstamp* tick) {
+    ev_tstamp t;
+
+    if ( 0 == sp->num_entries ) {
+        *tick = sp->interval;
+        return 0;
+    }
+    t = sp->interval / sp->num_entries;
+    if ( t < STATPOLL_MIN_TICK ) t = STATPOLL_MIN_TICK;
+    if ( t > sp->interval ) t = sp->interval;
+    *tick = t;
+    return (int)ceil(sp->num_entries * t / sp->interval - 1e-9);
+}
+
+/**
+ * Visit the next slice of paths.  A path which is backed off only has
+ * its skip count decremented, otherwise it is checked: a change resets
+ * the backoff and adds the path to the batch, no change doubles the
+ * number of intervals until the next check (up to max_interval).  The
+ * batch is delivered with one call to lua.
+ *
+ * [+0, -0, m]
+ */
+static void statpoll_cb(struct ev_loop* loop, ev_timer* timer, int revents) {
+    lua_ev_statpoll* sp = (lua_ev_statpoll*)timer;
+    ev_tstamp        tick;
+    int              slice = statpoll_slice(sp, &tick);
+
+    if ( slice > sp->num_entries ) slice = sp->num_entries;
+    sp->num_changed = 0;
+
+    while ( slice-- > 0 ) {
+        statpoll_entry* entry;
+
+        if ( sp->cursor >= sp->num_entries ) sp->cursor = 0;
+        entry = &sp->entries[sp->cursor];
+
+        if ( entry->skip ) {
+            entry->skip--;
+        } else if ( statpoll_check(entry) ) {
+            entry->level = 0;
+            if ( sp->num_changed == sp->max_changed ) {
+                int  max     = sp->max_changed ? sp->max_changed * 2 : 16;
+                int* changed = realloc(sp->changed, max * sizeof(int));
+                if ( NULL == changed ) break;
+                sp->changed     = changed;
+                sp->max_changed = max;
+            }
+            sp->changed[sp->num_changed++] = sp->cursor;
+        } else {
+            if ( entry->level < sp->max_level ) entry->level++;
+            entry->skip = ( 1 << entry->level ) - 1;
+        }
+        sp->cursor++;
+    }
+
+    /* the number of paths may have changed since the last tick. */
+    if ( tick != timer->repeat ) {
+        timer->repeat = tick;
+        ev_timer_again(loop, timer);
+    }
+
+    if ( 0 == sp->num_changed ) return;
+    watcher_cb_args(loop, timer, EV_STAT, &statpoll_push_changes);
+}
+
+/**
+ * Push the batch of changed paths as a table of path => exists.
+ *
+ * @see watcher_cb_args()
+ *
+ * [-0, +1, m]
+ */
+static int statpoll_push_changes(lua_State *L, void *watcher) {
+    lua_ev_statpoll* sp = (lua_ev_statpoll*)watcher;
+    int              i;
+
+    lua_createtable(L, 0, sp->num_changed);
+    for ( i = 0; i < sp->num_changed; i++ ) {
+        statpoll_entry* entry = &sp->entries[sp->changed[i]];
+        lua_pushboolean(L, ( entry->flags & STATPOLL_EXISTS ) != 0);
+        lua_setfield(L, -2, entry->path);
+    }
+    sp->num_changed = 0;
+    return 1;
+}
+
+/**
+ * Add a path to the list.  Its attributes are recorded by its first
+ * check, changes are reported from then on.  Returns false if the path
+ * is already in the list.
+ *
+ * Usage:
+ *     added = statpoll:add(path)
+ *
+ * [+1, -0, e]
+ */
+static int statpoll_add(lua_State *L) {
+    lua_ev_statpoll* sp   = check_statpoll(L, 1);
+    const char*      path = luaL_checkstring(L, 2);
+    unsigned int     hash = fswatch_hash(path);
+    statpoll_entry*  entry;
+    int              slot;
+
+    if ( sp->num_entries * 2 >= sp->index_size &&
+         statpoll_reindex(sp, sp->index_size ? sp->index_size * 2 : 64) != 0 )
+    {
+        return luaL_error(L, "out of memory");
+    }
+    if ( statpoll_find(sp, path, hash, &slot) >= 0 ) {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+
+    if ( sp->num_entries == sp->max_entries ) {
+        int             max     = sp->max_entries ? sp->max_entries * 2 : 16;
+        statpoll_entry* entries = realloc(sp->entries, max * sizeof(statpoll_entry));
+        if ( NULL == entries ) return luaL_error(L, "out of memory");
+        sp->entries     = entries;
+        sp->max_entries = max;
+    }
+    entry = &sp->entries[sp->num_entries];
+    memset(entry, 0, sizeof(statpoll_entry));
+    entry->path = strdup(path);
+    if ( NULL == entry->path ) return luaL_error(L, "out of memory");
+    entry->hash = hash;
+    sp->index[slot] = sp->num_entries++;
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/**
+ * Remove a path from the list.  Returns false if the path is not in
+ * the list.
+ *
+ * Usage:
+ *     removed = statpoll:remove(path)
+ *
+ * [+1, -0, e]
+ */
+static int statpoll_remove(lua_State *L) {
+    lua_ev_statpoll* sp   = check_statpoll(L, 1);
+    const char*      path = luaL_checkstring(L, 2);
+    int              slot;
+    int              i;
+    int              last;
+
+    i = sp->index_size ? statpoll_find(sp, path, fswatch_hash(path), &slot) : -1;
+    if ( i < 0 ) {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+
+    statpoll_unindex(sp, slot);
+    free(sp->entries[i].path);
+
+    /* move the last entry into the hole. */
+    last = --sp->num_entries;
+    if ( i != last ) {
+        sp->entries[i] = sp->entries[last];
+        statpoll_find(sp, sp->entries[i].path, sp->entries[i].hash, &slot);
+        sp->index[slot] = i;
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/**
+ * Returns the number of paths in the list.
+ *
+ * Usage:
+ *     num = statpoll:count()
+ *
+ * [+1, -0, e]
+ */
+static int statpoll_count(lua_State *L) {
+    lua_ev_statpoll* sp = check_statpoll(L, 1);
+
+    lua_pushinteger(L, sp->num_entries);
+    return 1;
+}
+
+/**
+ * Stops the statpoll so it won't be called by the specified event
+ * loop.  The recorded attributes and backoff are kept.
+ *
+ * Usage:
+ *     statpoll:stop(loop)
+ *
+ * [+0, -0, e]
+ */
+static int statpoll_stop(lua_State *L) {
+    lua_ev_statpoll* sp   = check_statpoll(L, 1);
+    struct ev_loop*  loop = *check_loop_and_init(L, 2);
+
+    loop_stop_watcher(L, loop, GET_WATCHER_DATA(sp), 1);
+    ev_timer_stop(loop, &sp->timer);
+
+    return 0;
+}
+
+/**
+ * Starts the statpoll so it will be called by the specified event
+ * loop.
+ *
+ * Usage:
+ *     statpoll:start(loop [, is_daemon])
+ *
+ * [+0, -0, e]
+ */
+static int statpoll_start(lua_State *L) {
+    lua_ev_statpoll* sp   = check_statpoll(L, 1);
+    struct ev_loop*  loop = *check_loop_and_init(L, 2);
+    int is_daemon         = lua_toboolean(L, 3);
+    ev_tstamp        tick;
+
+    if ( ! ev_is_active(&sp->timer) ) {
+        statpoll_slice(sp, &tick);
+        ev_timer_set(&sp->timer, tick, tick);
+        ev_timer_start(loop, &sp->timer);
+    }
+    loop_start_watcher(L, loop, GET_WATCHER_DATA(sp), 2, 1, is_daemon);
+
+    return 0;
+}
+
+/**
+ * Free the path array and index.
+ *
+ * [+0, -0, -]
+ */
+static int statpoll_gc(lua_State *L) {
+    lua_ev_statpoll* sp = check_statpoll(L, 1);
+    int              i;
+
+    for ( i = 0; i < sp->num_entries; i++ ) free(sp->entries[i].path);
+    free(sp->entries);
+    free(sp->index);
+    free(sp->changed);
+    sp->entries     = NULL;
+    sp->index       = NULL;
+    sp->changed     = NULL;
+    sp->num_entries = 0;
+    sp->max_entries = 0;
+    sp->index_size  = 0;
+    sp->num_changed = 0;
+    sp->max_changed = 0;
+    return 0;
+}
+
+#endif /* __linux__ */
+
+/* vi:set expandtab ts=4: */
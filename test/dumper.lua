@@ -1,4 +1,4 @@
-module(..., package.seeall)
+local dumper = {}
 
 local function dump_impl(input, output, path, indent, done)
    if nil == input then
@@ -29,13 +29,15 @@ local function dump_impl(input, output, path, indent, done)
    else
       table.insert(output, "[")
       table.insert(output, tostring(input))
-      table.insert(output, "\]");
+      table.insert(output, "]");
    end
 end
 
-function dump(name, input)
+function dumper.dump(name, input)
    local output = { tostring(name) }
    table.insert(output, " = ")
    dump_impl(input, output, name, 0, {})
    return table.concat(output)
 end
+
+return dumper
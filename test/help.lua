@@ -1,10 +1,10 @@
-module(..., package.seeall);
+local help = {}
 
 local tap   = require("tap")
 local ev    = require("ev")
 local ok    = tap.ok
 
-function collect_and_assert_no_watchers(test, test_name)
+function help.collect_and_assert_no_watchers(test, test_name)
    collectgarbage("collect")
    local base = ev.object_count()
 
@@ -16,3 +16,5 @@ function collect_and_assert_no_watchers(test, test_name)
    local count =  ev.object_count()
    ok(count == base, 'no active watchers after ' .. test_name .. ' got: ' .. count .. ' expected: ' .. base)
 end
+
+return help
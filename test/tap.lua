@@ -1,12 +1,14 @@
-module(..., package.seeall)
+local tap = {}
 
 local counter = 1
 
-function ok(assert_true, desc)
+function tap.ok(assert_true, desc)
    local msg = ( assert_true and "ok " or "not ok " ) .. counter
    if ( desc ) then
       msg = msg .. " - " .. desc
    end
    print(msg)
    counter = counter + 1
-end
\ No newline at end of file
+end
+
+return tap
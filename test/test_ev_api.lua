@@ -0,0 +1,50 @@
+print '1..8'
+
+local src_dir, build_dir = ...
+package.path  = src_dir .. "?.lua;" .. package.path
+package.cpath = build_dir .. "?.so;" .. package.cpath
+
+local tap    = require("tap")
+local ev     = require("ev")
+local native = require("test_ev_native")
+local help   = require("help")
+local ok     = tap.ok
+
+local noleaks = help.collect_and_assert_no_watchers
+local loop    = ev.Loop.default
+
+-- Native watchers keep the loop running unless they are daemons:
+function test_native_timer()
+   ok(native.version() >= 1, 'api version ' .. native.version())
+
+   local timer = native.timer(loop, 0.01)
+   loop:loop()
+   ok(native.count(timer) == 1, 'loop ran until the native timer fired')
+
+   local daemon = native.timer(loop, 10, true)
+   local idle = ev.Idle.new(function(loop, idle) idle:stop(loop) end)
+   idle:start(loop)
+   loop:loop()
+   ok(native.count(daemon) == 0, 'daemon native timer does not keep the loop running')
+   native.stop(daemon)
+end
+
+-- A started native watcher keeps its loop alive:
+function test_loop_kept()
+   local weak  = setmetatable({}, { __mode = "v" })
+   local other = ev.Loop.new()
+   local timer = native.timer(other, 10)
+   weak.loop = other
+   other = nil
+   collectgarbage("collect")
+   ok(weak.loop, 'loop kept while the native timer runs')
+
+   native.stop(timer)
+   collectgarbage("collect")
+   ok(not weak.loop, 'loop collected once it is stopped')
+
+   ok(not pcall(native.timer, {}, 1), 'check_loop() rejects other values')
+end
+
+noleaks(test_native_timer, "test_native_timer")
+noleaks(test_loop_kept, "test_loop_kept")
@@ -0,0 +1,67 @@
+print '1..10'
+
+local src_dir, build_dir = ...
+package.path  = src_dir .. "?.lua;" .. package.path
+package.cpath = build_dir .. "?.so;" .. package.cpath
+
+local tap   = require("tap")
+local ev    = require("ev")
+local help  = require("help")
+local ok    = tap.ok
+
+local noleaks = help.collect_and_assert_no_watchers
+
+-- The default loop is never used here: its SIGCHLD handler would
+-- reap the children before the pidfds can.
+
+function test_basic()
+   local loop = ev.Loop.new()
+   local proc = ev.spawn_process{ argv = { "sleep", "0.1" }, loop = loop }
+   local pid  = proc.pid
+   -- replace the watcher ev.spawn_process() started:
+   proc.child:stop(loop)
+   local child = ev.ChildFD.new(
+      function(loop, child, revents)
+         ok(revents == ev.CHILD, 'revents is ev.CHILD')
+         ok(child:getrpid() == pid, 'got proper pid')
+         local status = child:getstatus()
+         ok(status.exited and status.exit_status == 0, 'exit status')
+         ok(not child:is_active(), 'stopped after the exit')
+      end, pid)
+   ok(child:getpid() == pid and child:getfd() >= 0, 'getpid() and getfd()')
+   child:start(loop)
+   loop:loop()
+end
+
+-- ev.spawn_process() uses ev.ChildFD on other loops than the default:
+function test_spawn()
+   local loop = ev.Loop.new()
+   local proc
+   proc = ev.spawn_process{
+      argv = { "sleep", "10" },
+      loop = loop,
+      on_exit = function(loop, child, revents, exit_status, term_signal)
+         ok(term_signal == 9 and exit_status == nil, 'killed')
+      end,
+   }
+   os.execute("kill -9 " .. proc.pid)
+   loop:loop()
+
+   local exited = 0
+   for i = 1, 50 do
+      ev.spawn_process{
+         argv = { "true" },
+         loop = loop,
+         on_exit = function(loop, child, revents, exit_status)
+            if exit_status == 0 then exited = exited + 1 end
+         end,
+      }
+   end
+   loop:loop()
+   ok(exited == 50, 'many children on one loop')
+
+   ok(not pcall(ev.ChildFD.new, function() end, 0), 'pid must be > 0')
+end
+
+noleaks(test_basic, "test_basic")
+noleaks(test_spawn, "test_spawn")
@@ -0,0 +1,77 @@
+print '1..14'
+
+local src_dir, build_dir = ...
+package.path  = src_dir .. "?.lua;" .. package.path
+package.cpath = build_dir .. "?.so;" .. package.cpath
+
+local tap   = require("tap")
+local ev    = require("ev")
+local help  = require("help")
+local ok    = tap.ok
+
+local noleaks = help.collect_and_assert_no_watchers
+local loop    = ev.Loop.default
+
+function test_batch()
+    local calls = 0
+    local got
+    local fd1, fd2 = ev.FdChannel.socketpair()
+    local a = ev.FdChannel.new(function() end, fd1)
+    local b = ev.FdChannel.new(function(loop, b, revents, messages)
+        calls = calls + 1
+        got   = messages
+        b:stop(loop)
+    end, fd2)
+    ok(a:getfd() == fd1, 'getfd() works')
+
+    -- pass one end of another pair and keep the other:
+    local fd3, fd4 = ev.FdChannel.socketpair()
+    ok(a:send('hello', { fd3 }, true), 'send with an fd')
+    ok(a:send(), 'send without payload or fds')
+    b:start(loop)
+    loop:loop()
+
+    ok(calls == 1, 'one callback for the batch')
+    ok(got and #got == 2, 'both messages received')
+    ok(got[1].payload == 'hello' and #got[1].fds == 1, 'payload and fd received')
+    ok(got[2].payload == '' and #got[2].fds == 0, 'empty message received')
+
+    local fh = io.open('/proc/self/fdinfo/' .. got[1].fds[1])
+    local flags = tonumber(fh:read('*a'):match('flags:%s*(%d+)'), 8)
+    fh:close()
+    ok(math.floor(flags / 2048) % 2 == 1, 'received fd is non-blocking')
+
+    -- the received fd is a working socket:
+    local pong
+    local x = ev.FdChannel.new(function(loop, x, revents, messages)
+        pong = messages[1].payload
+        x:stop(loop)
+    end, got[1].fds[1])
+    local y = ev.FdChannel.new(function() end, fd4)
+    y:send('ping')
+    x:start(loop)
+    loop:loop()
+    ok(pong == 'ping', 'passed fd works')
+
+    ok(not pcall(a.send, a, string.rep('x', 65536)), 'payload too large')
+    local fds = {}
+    for i = 1, 254 do fds[i] = fd1 end
+    ok(not pcall(a.send, a, '', fds), 'too many fds')
+end
+
+function test_closed()
+    local closed
+    local fd1, fd2 = ev.FdChannel.socketpair()
+    local a = ev.FdChannel.new(function() end, fd1)
+    local b = ev.FdChannel.new(function(loop, b, revents, messages)
+        closed = messages.closed
+    end, fd2)
+    b:start(loop)
+    a = nil
+    collectgarbage("collect")
+    loop:loop()
+    ok(closed == true, 'peer closed, the watcher stopped itself')
+end
+
+noleaks(test_batch, "test_batch")
+noleaks(test_closed, "test_closed")
@@ -0,0 +1,116 @@
+print '1..20'
+
+local src_dir, build_dir = ...
+package.path  = src_dir .. "../?.lua;" .. src_dir .. "?.lua;" .. package.path
+package.cpath = build_dir .. "?.so;" .. package.cpath
+
+local tap    = require("tap")
+local ev     = require("ev")
+local ev_ffi = require("ev_ffi")
+local help   = require("help")
+local ok     = tap.ok
+
+local noleaks = help.collect_and_assert_no_watchers
+local loop    = ev.Loop.default
+
+-- Start, stop and again behave like the methods:
+function test_start_stop()
+   local n = 0
+   local timer = ev.Timer.new(function(loop, timer) n = n + 1 end, 0.001, 0.001)
+   ev_ffi.start(timer, loop)
+   ok(ev_ffi.is_active(timer) and timer:is_active(), 'first start')
+   ev_ffi.stop(timer, loop)
+   ok(not ev_ffi.is_active(timer) and not timer:is_active(), 'stopped')
+   ev_ffi.start(timer, loop)
+   ok(ev_ffi.is_active(timer), 'restarted')
+
+   local idle = ev.Idle.new(function(loop, idle)
+      if n >= 3 then
+         ev_ffi.stop(timer, loop)
+         ev_ffi.stop(idle, loop)
+      end
+   end)
+   ev_ffi.start(idle, loop)
+   loop:loop()
+   ok(n >= 3 and not ev_ffi.is_active(timer), 'loop ends once all are stopped: ' .. n)
+
+   ev_ffi.again(timer, loop)
+   ok(timer:is_active(), 'again starts a repeating timer')
+   timer:stop(loop)
+   ok(ev_ffi.now(loop) == loop:now(), 'now')
+end
+
+-- Set changes active watchers in place:
+function test_set()
+   local fired = 0
+   local timer = ev.Timer.new(function(loop, timer) fired = loop:now() end, 10)
+   local started = loop:now()
+   timer:start(loop)
+   ev_ffi.timer_set(timer, 0.01)
+   loop:loop()
+   ok(fired > 0 and fired - started < 5, 'timer_set restarted the timer')
+
+   local io = ev.IO.new(function(loop, io) io:stop(loop) end, 1, ev.READ)
+   io:start(loop)
+   ev_ffi.io_set(io, 1, ev.WRITE)
+   ok(io:getfd() == 1 and io:is_active(), 'io_set keeps the watcher started')
+   loop:loop()
+   ok(not io:is_active(), 'io fired with the new events')
+   ok(not pcall(ev_ffi.io_set, timer, 1, ev.READ), 'io_set on a timer fails')
+end
+
+-- Daemon watchers take the regular methods, parked watchers are
+-- released again:
+function test_daemon_and_release()
+   local idle = ev.Idle.new(function() end)
+   ev_ffi.start(idle, loop, true)
+   ev_ffi.stop(idle, loop)
+   ok(not idle:is_active(), 'daemon stopped')
+
+   local timer = ev.Timer.new(function() end, 1, 1)
+   timer:start(loop)
+   local count = loop:memory().count
+   ev_ffi.stop(timer, loop)
+   ok(loop:memory().count == count, 'stopped timer is parked')
+   -- an iteration after the sweep interval releases the parked timer:
+   local wait = ev.Timer.new(function() end, 1.1)
+   wait:start(loop)
+   loop:loop()
+   loop:loop(ev.NOWAIT)
+   ok(loop:memory().count == 0, 'parked watchers released')
+end
+
+-- A parked watcher restarted in another loop belongs to that loop:
+function test_other_loop()
+   local other = ev.Loop.new()
+   local got
+   local timer = ev.Timer.new(function(loop, timer) got = loop end, 0.01)
+   timer:start(loop)
+   ev_ffi.stop(timer, loop)
+   timer:start(other)
+   other:loop()
+   ok(got == other, 'callback gets the loop it was restarted in')
+   ok(loop:memory().count == 0, 'released from the first loop')
+
+   -- a daemon in the other loop does not keep either loop running:
+   local idle = ev.Idle.new(function() end)
+   idle:start(loop)
+   ev_ffi.stop(idle, loop)
+   idle:start(other, true)
+   local done
+   ev.Timer.new(function() done = true end, 0.01):start(other)
+   other:loop()
+   loop:loop()
+   ok(done, 'daemon restarted in the other loop')
+   idle:stop(other)
+end
+
+if not ev_ffi.enabled then
+   for i = 1, 20 do ok(true, '# SKIP no LuaJIT FFI') end
+   return
+end
+
+noleaks(test_start_stop, "test_start_stop")
+noleaks(test_set, "test_set")
+noleaks(test_daemon_and_release, "test_daemon_and_release")
+noleaks(test_other_loop, "test_other_loop")
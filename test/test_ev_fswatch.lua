@@ -0,0 +1,84 @@
+print '1..10'
+
+local src_dir, build_dir = ...
+package.path  = src_dir .. "?.lua;" .. package.path
+package.cpath = build_dir .. "?.so;" .. package.cpath
+
+local tap   = require("tap")
+local ev    = require("ev")
+local help  = require("help")
+local dump  = require("dumper").dump
+local ok    = tap.ok
+
+local noleaks = help.collect_and_assert_no_watchers
+local loop    = ev.Loop.default
+
+function make_tree()
+    local root = os.tmpname()
+    os.execute('rm -f ' .. root .. ' && mkdir -p ' .. root .. '/a/b')
+    return root
+end
+
+function later(cmd)
+    ev.Timer.new(function(loop, timer, revents)
+        os.execute(cmd)
+    end, 0.1):start(loop)
+end
+
+function test_nested()
+    local root = make_tree()
+    local path = root .. '/a/b/file'
+    local fswatch = ev.FSWatch.new(function(loop, fswatch, revents, events)
+        ok(events[path] ~= nil, 'got event for file in nested directory')
+        ok(events[path] % (2*ev.FSWatch.CREATE) >= ev.FSWatch.CREATE, 'got CREATE')
+        fswatch:stop(loop)
+    end, root)
+    ok(fswatch:getpath() == root, 'getpath() works')
+    fswatch:start(loop)
+    later('touch ' .. path)
+    loop:loop()
+    os.execute('rm -rf ' .. root)
+end
+
+function test_debounce()
+    local root = make_tree()
+    local path = root .. '/a/file'
+    local calls = 0
+    local fswatch = ev.FSWatch.new(function(loop, fswatch, revents, events)
+        calls = calls + 1
+        ok(events[path] ~= nil, 'got coalesced event for file')
+        fswatch:stop(loop)
+    end, root, 0.2)
+    fswatch:start(loop)
+    later('echo 1 > ' .. path .. '; echo 2 >> ' .. path .. '; echo 3 >> ' .. path)
+    loop:loop()
+    ok(calls == 1, 'one callback for the whole batch')
+    os.execute('rm -rf ' .. root)
+end
+
+function test_stop_keeps_events()
+    local root = make_tree()
+    local path = root .. '/a/file'
+    local got
+    local fswatch = ev.FSWatch.new(function(loop, fswatch, revents, events)
+        got = events
+        fswatch:stop(loop)
+    end, root, 0.2)
+    fswatch:start(loop)
+    later('touch ' .. path)
+    -- read by now, but still waiting for the debounce delay:
+    ev.Timer.new(function(loop)
+        fswatch:stop(loop)
+    end, 0.2):start(loop)
+    loop:loop()
+    ok(got == nil, 'no events delivered while stopped')
+
+    fswatch:start(loop)
+    loop:loop()
+    ok(got and got[path] ~= nil, 'kept events delivered after start()')
+    os.execute('rm -rf ' .. root)
+end
+
+noleaks(test_nested, "test_nested")
+noleaks(test_debounce, "test_debounce")
+noleaks(test_stop_keeps_events, "test_stop_keeps_events")
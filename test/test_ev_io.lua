@@ -31,6 +31,20 @@ local function test_stdin()
    loop:loop()
 end
 
+local function test_modify()
+   local io1 = ev.IO.new(
+      function(loop, io, revents)
+         ok(revents == ev.WRITE, 'modify() changed the events')
+         io:stop(loop)
+      end, 1, ev.READ)
+   io1:start(loop)
+   io1:modify(ev.WRITE)
+   loop:loop()
+
+   io1:set(2, ev.WRITE)
+   ok(io1:getfd() == 2, 'set() changed the fd')
+end
+
 local function newtry()
    local try = {}
    setmetatable(try, try)
@@ -107,5 +121,6 @@ local function test_echo()
 end
 
 noleaks(test_stdin, "test_stdin")
+noleaks(test_modify, "test_modify")
 noleaks(test_echo,  "test_echo")
 
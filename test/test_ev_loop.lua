@@ -61,3 +61,23 @@ ok(ev.Loop.new(1):backend() == 1,
 
 ok(ev.Loop.new(2):backend() == 2,
    "Able to choose backend 2 (poll), fails on windows or if LIBEV_FLAGS environment variable excludes this backend")
+
+-- Errors are routed to loop:on_error() and repeat offenders are stopped:
+do
+  local loop    = ev.Loop.new()
+  local errors  = 0
+  local calls   = 0
+  ok(loop:on_error(function(loop, watcher, err)
+    errors = errors + 1
+    ok(string.find(err, "boom", 1, true), "error handler got the error message")
+  end, 2) == nil, "on_error() returns the old handler")
+  local idle = ev.Idle.new(function()
+    calls = calls + 1
+    error("boom")
+  end)
+  idle:start(loop)
+  loop:loop()
+  ok(calls == 2 and errors == 2, "idle watcher stopped after 2 consecutive failures")
+  ok(not idle:is_active(), "idle watcher no longer active")
+  ok(loop:error_counts().idle == 2, "error counts per watcher type")
+end
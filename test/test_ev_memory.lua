@@ -0,0 +1,57 @@
+print '1..12'
+
+local src_dir, build_dir = ...
+package.path  = src_dir .. "?.lua;" .. package.path
+package.cpath = build_dir .. "?.so;" .. package.cpath
+
+local tap   = require("tap")
+local ev    = require("ev")
+local help  = require("help")
+local ok    = tap.ok
+
+-- Must come before any loop is used:
+ok(pcall(ev.set_allocator, true), 'ev.set_allocator(true)')
+
+local noleaks = help.collect_and_assert_no_watchers
+local loop    = ev.Loop.default
+
+-- libev memory is charged to the loop which asked for it:
+function test_libev()
+   local base = loop:memory()
+   ok(base.libev > 0 and base.libev_peak >= base.libev, 'default loop libev=' .. base.libev)
+
+   local other = ev.Loop.new()
+   ok(other:memory().libev > 0, 'new loop has its own libev memory')
+   ok(loop:memory().libev == base.libev, 'default loop not charged for the new loop')
+   other = nil
+   collectgarbage("collect")
+
+   -- the fd table grows with the highest fd:
+   local io = ev.IO.new(function() end, 900, ev.READ)
+   io:start(loop)
+   io:stop(loop)
+   local grown = loop:memory()
+   ok(grown.libev - base.libev > 900 * 4, 'fd table growth shows up: ' .. (grown.libev - base.libev))
+   loop:loop(ev.NOWAIT)
+end
+
+-- Started watchers and their tables are counted:
+function test_watchers()
+   local timers = {}
+   for i = 1, 3 do
+      timers[i] = ev.Timer.new(function() end, 10)
+      timers[i]:start(loop)
+   end
+   timers[1].data = { 1, 2, 3 }
+   local mem = loop:memory()
+   ok(mem.count == 3, 'count=' .. mem.count)
+   ok(mem.watchers > 0 and mem.fenv > 0, 'watchers=' .. mem.watchers .. ' fenv=' .. mem.fenv)
+   ok(mem.shadow > 0, 'shadow=' .. mem.shadow)
+   for i = 1, 3 do timers[i]:stop(loop) end
+   ok(loop:memory().count == 0, 'stopped watchers are not counted')
+end
+
+noleaks(test_libev, "test_libev")
+noleaks(test_watchers, "test_watchers")
+
+ok(not pcall(ev.set_allocator, false), 'cannot switch back while libev holds memory')
@@ -0,0 +1,117 @@
+print '1..17'
+
+local src_dir, build_dir = ...
+package.path  = src_dir .. "?.lua;" .. package.path
+package.cpath = build_dir .. "?.so;" .. package.cpath
+
+local tap   = require("tap")
+local ev    = require("ev")
+local help  = require("help")
+local ok    = tap.ok
+
+local noleaks = help.collect_and_assert_no_watchers
+
+-- a pipe with data in it, so watchers for reading fire on every iteration:
+local function readable()
+    local rfd, wfd = ev.FdChannel.socketpair()
+    ev.FdChannel.new(function() end, wfd):send("x")
+    return rfd, ev.FdChannel.new(function() end, wfd)
+end
+
+function test_pending()
+    local a, b = ev.Loop.new(), ev.Loop.new()
+    local fd, keep = readable()
+    local called
+    local io = ev.IO.new(function(loop, io, revents)
+        called = { loop = loop, revents = revents }
+        io:stop(loop)
+    end, fd, ev.READ)
+    io:priority(-1)
+    -- runs first, while io is pending:
+    local first = ev.IO.new(function(loop, first)
+        ok(io:is_pending(), 'io is pending in the first loop')
+        io:migrate(a, b)
+        first:stop(loop)
+    end, fd, ev.READ)
+    first:priority(1)
+    first:start(a)
+    io:start(a)
+
+    a:loop()
+    ok(not called, 'not called in the first loop')
+    ok(io:is_active() and io:is_pending(), 'still active and pending')
+    ok(io:priority() == -1, 'priority kept')
+    b:loop()
+    ok(called and called.loop == b and called.revents == ev.READ, 'called in the second loop')
+end
+
+function test_timer()
+    local a, b = ev.Loop.new(), ev.Loop.new()
+    local fired
+    local timer = ev.Timer.new(function(loop, timer)
+        fired = loop:now()
+    end, 0.1)
+    timer:start(a)
+    ok(not pcall(timer.migrate, timer, b, a), 'only from the loop it is started in')
+
+    -- half of the time passes in the first loop:
+    local started = a:now()
+    ev.Timer.new(function(loop)
+        timer:migrate(a, b)
+    end, 0.05):start(a)
+    a:loop()
+    b:loop()
+    ok(fired and fired - started > 0.09 and fired - started < 0.13,
+       string.format('remaining time kept (fired after %.3f)', fired - started))
+
+    -- a daemon does not keep the loop running:
+    local daemon = ev.Timer.new(function() fired = nil end, 0.01)
+    daemon:start(a, true)
+    daemon:migrate(a, b)
+    b:loop()
+    ok(fired, 'still a daemon')
+    daemon:stop(b)
+
+    local sig = ev.Signal.new(function() end, 1)
+    sig:start(a)
+    ok(not pcall(sig.migrate, sig, a, b), 'signal watchers can not move')
+    sig:stop(a)
+end
+
+function test_pick_hot()
+    local a, b = ev.Loop.new(), ev.Loop.new()
+    local fd, keep = readable()
+    local watchers = {}
+    for i = 1, 4 do
+        watchers[i] = ev.IO.new(function() end, fd, ev.READ)
+    end
+    -- 6, 3 and 1 callbacks, the last one is not in this loop:
+    watchers[1]:start(a)
+    for i = 1, 6 do
+        if i == 4 then watchers[2]:start(a) end
+        if i == 6 then watchers[3]:start(a) end
+        a:loop(ev.ONCE)
+    end
+    watchers[4]:start(b)
+    b:loop(ev.ONCE)
+
+    local hot, rate = a:pick_hot(watchers)
+    ok(#hot == 2 and hot[1] == watchers[2] and hot[2] == watchers[3],
+       'picked the busiest watchers with half of the callbacks')
+    ok(rate > 0, 'callback rate ' .. rate)
+    hot, rate = a:pick_hot(watchers)
+    ok(#hot == 0 and rate == 0, 'counts were reset')
+
+    a:loop(ev.ONCE)
+    hot = a:pick_hot(watchers, 1)
+    ok(#hot == 3, 'share 1 picks all busy watchers')
+    for _, io in ipairs(hot) do io:migrate(a, b) end
+    hot = b:pick_hot(watchers, 1)
+    ok(#hot == 1 and hot[1] == watchers[4], 'moved watchers start counting again')
+
+    for i = 1, 4 do watchers[i]:stop(b) end
+end
+
+noleaks(test_pending, "test_pending")
+noleaks(test_timer, "test_timer")
+noleaks(test_pick_hot, "test_pick_hot")
@@ -0,0 +1,93 @@
+/**
+ * A native module for test_ev_api.lua: timers which count in C and
+ * only use lua_ev_api.h.
+ */
+#include <ev.h>
+#include <lauxlib.h>
+#include <lua.h>
+
+#include "lua_ev_api.h"
+
+typedef struct native_timer {
+    ev_timer        timer;
+    lua_ev_native   native;
+    struct ev_loop* loop;
+    int             count;
+} native_timer;
+
+static const lua_ev_api* api;
+
+static void native_timer_cb(struct ev_loop* loop, ev_timer* timer, int revents) {
+    native_timer* t = (native_timer*)timer;
+
+    t->count++;
+    if ( ! ev_is_active(timer) ) {
+        /* loop:run() set the userdata to its lua_State. */
+        api->native_stopped(ev_userdata(loop), &t->native);
+    }
+}
+
+/* timer = native.timer(loop, after, is_daemon) */
+static int native_timer_new(lua_State *L) {
+    struct ev_loop* loop   = api->check_loop(L, 1);
+    double          after  = luaL_checknumber(L, 2);
+    int             daemon = lua_toboolean(L, 3);
+    native_timer*   t;
+
+    lua_settop(L, 2);
+    t = lua_newuserdata(L, sizeof(native_timer));
+
+    luaL_getmetatable(L, "test_ev_native.timer");
+    lua_setmetatable(L, -2);
+    lua_ev_native_init(&t->native);
+    t->loop  = loop;
+    t->count = 0;
+    ev_timer_init(&t->timer, native_timer_cb, after, 0);
+    ev_timer_start(loop, &t->timer);
+    api->native_started(L, 1, &t->native, daemon);
+    return 1;
+}
+
+/* count = native.count(timer) */
+static int native_timer_count(lua_State *L) {
+    native_timer* t = luaL_checkudata(L, 1, "test_ev_native.timer");
+
+    lua_pushinteger(L, t->count);
+    return 1;
+}
+
+/* native.stop(timer), also the __gc */
+static int native_timer_stop(lua_State *L) {
+    native_timer* t = luaL_checkudata(L, 1, "test_ev_native.timer");
+
+    ev_timer_stop(t->loop, &t->timer);
+    api->native_stopped(L, &t->native);
+    return 0;
+}
+
+/* version = native.version() */
+static int native_version(lua_State *L) {
+    lua_pushinteger(L, api->version);
+    return 1;
+}
+
+int luaopen_test_ev_native(lua_State *L) {
+    api = lua_ev_api_get(L, LUA_EV_API_VERSION);
+    if ( NULL == api ) return luaL_error(L, "require 'ev' first");
+
+    luaL_newmetatable(L, "test_ev_native.timer");
+    lua_pushcfunction(L, native_timer_stop);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    lua_newtable(L);
+    lua_pushcfunction(L, native_timer_new);
+    lua_setfield(L, -2, "timer");
+    lua_pushcfunction(L, native_timer_count);
+    lua_setfield(L, -2, "count");
+    lua_pushcfunction(L, native_timer_stop);
+    lua_setfield(L, -2, "stop");
+    lua_pushcfunction(L, native_version);
+    lua_setfield(L, -2, "version");
+    return 1;
+}
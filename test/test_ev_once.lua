@@ -0,0 +1,94 @@
+print '1..15'
+
+local src_dir, build_dir = ...
+package.path  = src_dir .. "?.lua;" .. package.path
+package.cpath = build_dir .. "?.so;" .. package.cpath
+
+local tap   = require("tap")
+local ev    = require("ev")
+local help  = require("help")
+local ok    = tap.ok
+
+local noleaks = help.collect_and_assert_no_watchers
+local loop    = ev.Loop.default
+
+-- Either the fd or the timeout triggers the callback:
+function test_basic()
+   local got
+   loop:once(nil, nil, 0.01, function(loop, revents) got = revents end)
+   loop:loop()
+   ok(got == ev.TIMEOUT, 'timeout only')
+
+   got = nil
+   loop:once(1, ev.WRITE, 10, function(loop, revents) got = revents end)
+   loop:loop()
+   ok(got == ev.WRITE, 'STDOUT is writable before the timeout')
+
+   local count = 0
+   for i = 1, 100 do
+      loop:once(-1, 0, 0.001 * (i % 3), function() count = count + 1 end)
+   end
+   loop:loop()
+   ok(count == 100, 'each callback called once')
+
+   ok(not pcall(loop.once, loop, nil, nil, nil, function() end), 'needs a fd or a timeout')
+end
+
+-- Errors go to the loop error handler:
+function test_error()
+   local other = ev.Loop.new()
+   local got_watcher, got_err
+   other:on_error(function(loop, watcher, err)
+      got_watcher, got_err = watcher, err
+   end)
+   other:once(nil, nil, 0.01, function() error("boom") end)
+   other:loop()
+   ok(got_watcher == nil and got_err:find("boom"), 'handler gets nil and the error')
+   ok(other:error_counts().once == 1, 'counted as once')
+end
+
+-- A pending once keeps its loop alive:
+function test_loop_kept()
+   local weak  = setmetatable({}, { __mode = "v" })
+   local other = ev.Loop.new()
+   local called
+   other:once(nil, nil, 0.01, function(loop) called = loop end)
+   weak.loop = other
+   other = nil
+   collectgarbage("collect")
+   ok(weak.loop, 'loop kept while once is pending')
+   weak.loop:loop()
+   ok(called == weak.loop, 'callback gets the loop')
+   called = nil
+   collectgarbage("collect")
+   ok(not weak.loop, 'loop collected after the callback')
+end
+
+-- The tracer and the watchdog see once callbacks too:
+function test_hooks()
+   loop:trace_start()
+   loop:once(nil, nil, 0.01, function() end)
+   loop:loop()
+   local json = loop:trace_dump()
+   loop:trace_stop()
+   ok(json:match('"name":"once","cat":"callback"'), 'once callback traced')
+
+   if not loop.watchdog_start then
+      ok(true, '# skip: no watchdog')
+      return
+   end
+   local report
+   loop:watchdog_start{ threshold = 0.05, on_slow = function(info) report = info end }
+   loop:once(nil, nil, 0.01, function()
+      local start = os.clock()
+      while os.clock() - start < 0.3 do end
+   end)
+   loop:loop()
+   loop:watchdog_stop()
+   ok(report and report.type == 'once', 'slow once callback reported')
+end
+
+noleaks(test_basic, "test_basic")
+noleaks(test_error, "test_error")
+noleaks(test_loop_kept, "test_loop_kept")
+noleaks(test_hooks, "test_hooks")
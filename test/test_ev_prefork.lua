@@ -0,0 +1,79 @@
+print '1..11'
+
+local src_dir, build_dir = ...
+package.path  = src_dir .. "?.lua;" .. package.path
+package.cpath = build_dir .. "?.so;" .. package.cpath
+
+local tap   = require("tap")
+local ev    = require("ev")
+local help  = require("help")
+local ok    = tap.ok
+
+local noleaks = help.collect_and_assert_no_watchers
+local loop    = ev.Loop.default
+
+local SIGHUP  = 1
+local SIGTERM = 15
+
+-- workers serve until they get the stop signal:
+local function serve(loop, id)
+    ev.Timer.new(function() end, 60):start(loop)
+end
+
+function test_respawn()
+    local exits = {}
+    local prefork = ev.prefork{
+        workers     = 2,
+        backoff     = 0.02,
+        max_backoff = 1,
+        init        = function(loop, id)
+            if id == 1 then os.exit(3) end
+            serve(loop, id)
+        end,
+        on_exit     = function(loop, id, pid, exit_status, term_signal)
+            exits[#exits + 1] = { id = id, pid = pid, status = exit_status,
+                                  signal = term_signal, at = loop:now() }
+            -- as if the master got SIGTERM:
+            if #exits == 3 then loop:feed_signal_event(SIGTERM) end
+        end,
+    }
+    local pids = prefork:pids()
+    ok(pids[1] and pids[2] and pids[1] ~= pids[2], 'forked two workers')
+    loop:loop()
+
+    ok(#exits == 4, 'three crashes and one stop (' .. #exits .. ')')
+    ok(exits[1].id == 1 and exits[2].id == 1 and exits[3].id == 1 and
+       exits[3].status == 3 and exits[3].pid ~= exits[1].pid,
+       'crashed worker respawned')
+    ok(exits[3].at - exits[2].at > exits[2].at - exits[1].at,
+       string.format('respawn delay doubled (%.3f, %.3f)',
+                     exits[2].at - exits[1].at, exits[3].at - exits[2].at))
+    ok(exits[4].id == 2 and exits[4].pid == pids[2] and exits[4].signal == SIGTERM,
+       'stop signal passed on to the workers')
+    ok(not next(prefork:pids()), 'no workers left')
+end
+
+function test_reload()
+    local exits = {}
+    local prefork
+    prefork = ev.prefork{
+        workers = 1,
+        init    = serve,
+        on_exit = function(loop, id, pid, exit_status, term_signal)
+            exits[#exits + 1] = { id = id, pid = pid, signal = term_signal }
+            prefork:stop()
+        end,
+    }
+    local old = prefork:pids()[1]
+    prefork:reload()
+    local new = prefork:pids()[1]
+    ok(new and new ~= old, 'reload() forked a new worker')
+    loop:loop()
+
+    ok(#exits == 2 and exits[1].pid == old and exits[1].signal == SIGTERM,
+       'old worker got the stop signal')
+    ok(exits[2].pid == new and exits[2].id == 1, 'stop() ended the new worker')
+end
+
+noleaks(test_respawn, "test_respawn")
+noleaks(test_reload, "test_reload")
@@ -0,0 +1,69 @@
+print '1..14'
+
+local src_dir, build_dir = ...
+package.path  = src_dir .. "?.lua;" .. package.path
+package.cpath = build_dir .. "?.so;" .. package.cpath
+
+local tap   = require("tap")
+local ev    = require("ev")
+local help  = require("help")
+local ok    = tap.ok
+
+local noleaks = help.collect_and_assert_no_watchers
+local loop    = ev.Loop.default
+
+-- Run a probe to completion and check the report:
+function test_basic()
+   local got_report
+   local probe = loop:probe_latency{
+      interval  = 0.005,
+      duration  = 0.2,
+      on_report = function(loop, probe, revents, report)
+         got_report = report
+         ok(ev.TIMEOUT == revents, 'ev.TIMEOUT == revents')
+         ok(not probe:is_active(), 'probe is stopped once duration is over')
+      end,
+   }
+   ok(probe:is_active(), 'probe_latency() starts the probe')
+   loop:loop()
+   local report = got_report
+   ok(report ~= nil, 'got a report')
+   ok(report.ticks > 10 and report.samples == report.ticks, 'ticks=' .. report.ticks)
+   ok(report.interval == 0.005, 'report has interval')
+   local total = report.total
+   ok(total.p50 <= total.p90 and total.p90 <= total.p99 and
+      total.p99 <= total.p999 and total.p999 <= total.max,
+      'percentiles are ordered')
+   ok(math.abs(report.poll.mean + report.queue.mean - total.mean) < 1e-6,
+      'poll + queue time adds up to the total')
+end
+
+-- Time spent in other callbacks shows up as queue time:
+function test_queue()
+   local busy = ev.Timer.new(function()
+      local start = os.clock()
+      while os.clock() - start < 0.01 do end
+   end, 0.001, 0.02)
+   busy:start(loop)
+   local probe = loop:probe_latency{ interval = 0.002, duration = 0.3 }
+   loop:loop(ev.ONCE)
+   while probe:is_active() do loop:loop(ev.ONCE) end
+   busy:stop(loop)
+   local report = probe:report()
+   ok(report.queue.max >= 0.005, 'busy callbacks delay the probe: ' .. report.queue.max)
+end
+
+-- A daemon probe doesn't keep the loop running:
+function test_daemon()
+   local probe = loop:probe_latency{ interval = 0.001, duration = 0, daemon = true }
+   local timer = ev.Timer.new(function() end, 0.05)
+   timer:start(loop)
+   loop:loop()
+   ok(probe:is_active(), 'probe still running after loop returned')
+   ok(probe:report().ticks > 0, 'live report has ticks')
+   probe:stop(loop)
+end
+
+noleaks(test_basic, "test_basic")
+noleaks(test_queue, "test_queue")
+noleaks(test_daemon, "test_daemon")
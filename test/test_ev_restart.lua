@@ -0,0 +1,94 @@
+local src_dir, build_dir, role = ...
+package.path  = src_dir .. "../?.lua;" .. src_dir .. "?.lua;" .. package.path
+package.cpath = build_dir .. "?.so;" .. package.cpath
+
+local ev      = require("ev")
+local restart = require("ev_restart")
+
+-- The new process: answer over the inherited "echo" socket, tell the
+-- old process we are ready, and exit once it let go of the channel.
+if role == "child" then
+    local handoff = restart.inherit()
+    local loop    = ev.Loop.new()
+    local echo    = ev.FdChannel.new(function() end, handoff.listeners.echo)
+    echo:send(string.format("%d %d %s", #handoff.state, #handoff.conns,
+                            tostring(handoff.listeners[1] ~= nil)))
+    handoff:ready()
+    handoff.channel:callback(function(loop, chan) chan:stop(loop) end)
+    handoff.channel:start(loop)
+    loop:loop()
+    os.exit(0)
+end
+
+print '1..9'
+
+local tap   = require("tap")
+local help  = require("help")
+local ok    = tap.ok
+
+local noleaks = help.collect_and_assert_no_watchers
+local loop    = ev.Loop.default
+
+function test_not_restarted()
+    ok(restart.inherit() == nil, 'inherit() is nil without a handoff')
+end
+
+function test_restart()
+    local lua = arg and arg[-1]
+    if not lua then
+        for i = 1, 6 do ok(true, '# skip: no lua interpreter to run') end
+        return
+    end
+
+    -- socket pairs stand in for listening sockets and connections:
+    local e1, e2 = ev.FdChannel.socketpair()
+    local l1, l2 = ev.FdChannel.socketpair()
+    local c1, c2 = ev.FdChannel.socketpair()
+    local listener = ev.IO.new(function() end, e1, ev.READ)
+    listener:start(loop)
+
+    local reply
+    local peer = ev.FdChannel.new(function(loop, peer, revents, messages)
+        reply = messages[1].payload
+        peer:stop(loop)
+    end, e2)
+    peer:start(loop)
+
+    local started = loop:now()
+    local ready_after, failed, drained
+    -- stands in for connections that are still draining:
+    local draining = ev.Timer.new(function() end, 1)
+    draining:start(loop)
+    restart.exec{
+        argv      = { lua, src_dir .. "test_ev_restart.lua", src_dir, build_dir, "child" },
+        listeners = { echo = listener, l1 },
+        conns     = { c1 },
+        state     = string.rep("state", 30000),
+        deadline  = 0.05,
+        loop      = loop,
+        on_ready  = function(loop, proc)
+            ready_after = loop:now() - started
+        end,
+        on_deadline = function(loop)
+            drained = true
+            draining:stop(loop)
+        end,
+        on_fail   = function(loop, err)
+            failed = err
+        end,
+    }
+    loop:loop()
+
+    ok(not failed, 'handoff did not fail ' .. tostring(failed))
+    ok(ready_after, string.format('new process ready after %.1fms', (ready_after or 0) * 1000))
+    ok(not listener:is_active(), 'old listener stopped once the new process was ready')
+    ok(reply == "150000 1 true", 'state, listeners and conns handed over: ' .. tostring(reply))
+    ok(drained, 'on_deadline called')
+
+    -- conns are passed on, not closed:
+    local unused = ev.FdChannel.new(function() end, c2)
+    ok(unused:send("x"), 'connections stay open here')
+end
+
+noleaks(test_not_restarted, "test_not_restarted")
+noleaks(test_restart, "test_restart")
@@ -0,0 +1,91 @@
+print '1..15'
+
+local src_dir, build_dir = ...
+package.path  = src_dir .. "?.lua;" .. package.path
+package.cpath = build_dir .. "?.so;" .. package.cpath
+
+local tap   = require("tap")
+local ev    = require("ev")
+local help  = require("help")
+local ok    = tap.ok
+
+local noleaks = help.collect_and_assert_no_watchers
+local loop    = ev.Loop.default
+
+function test_batch()
+    local calls = 0
+    local got
+    local ring = ev.ShmRing.new(function(loop, ring, revents, records)
+        calls = calls + 1
+        got   = records
+        ring:stop(loop)
+    end, 1000)
+    ok(ring:getsize() == 4096, 'size is rounded up to 4096')
+
+    -- pushed before the consumer starts:
+    ok(ring:push('one'), 'push')
+    ok(ring:push(''), 'push empty record')
+    ring:start(loop)
+    ring:push('three')
+    loop:loop()
+    ok(calls == 1, 'one callback for all records')
+    ok(got and #got == 3 and got[1] == 'one' and got[2] == '' and got[3] == 'three',
+       'records in order')
+    ok(not pcall(ring.push, ring, string.rep('x', 4096)), 'record larger than the ring')
+end
+
+-- A second mapping of the segment, as another process would have:
+function test_open()
+    local got = {}
+    local ring = ev.ShmRing.new(function(loop, ring, revents, records)
+        for _, rec in ipairs(records) do got[#got + 1] = rec end
+        if #got == 2000 then ring:stop(loop) end
+    end, 4096)
+    local memfd, eventfd = ring:getfds()
+    local producer = ev.ShmRing.open(function() end, memfd, eventfd)
+    ok(producer:getsize() == 4096, 'open() maps the same size')
+
+    -- fill it up:
+    local n = 0
+    while producer:push(string.format('%04d', n)) do n = n + 1 end
+    ok(n == 4096 / 8, 'push() returns false once the ring is full (' .. n .. ')')
+
+    -- keep pushing from a timer, the records wrap around many times:
+    ring:start(loop)
+    local timer = ev.Timer.new(function(loop, timer)
+        while n < 2000 and producer:push(string.format('%04d' .. string.rep('.', n % 37), n)) do
+            n = n + 1
+        end
+        if n == 2000 then timer:stop(loop) end
+    end, 0.001, 0.001)
+    timer:start(loop)
+    loop:loop()
+
+    local in_order = #got == 2000
+    for i = 1, #got do
+        if tonumber(got[i]:sub(1, 4)) ~= i - 1 then in_order = false break end
+    end
+    ok(in_order, 'all records received in order across wrap-arounds')
+
+    ok(not pcall(ev.ShmRing.open, function() end, eventfd, memfd), 'open() checks the segment')
+end
+
+-- Nothing is lost while the consumer is stopped:
+function test_stopped()
+    local calls = 0
+    local ring = ev.ShmRing.new(function(loop, ring, revents, records)
+        calls = calls + 1
+        ok(#records == 1 and records[1] == 'later', 'record pushed while stopped')
+        ring:stop(loop)
+    end, 4096)
+    ring:start(loop)
+    ring:stop(loop)
+    ring:push('later')
+    ring:start(loop)
+    loop:loop()
+    ok(calls == 1, 'delivered after start()')
+end
+
+noleaks(test_batch, "test_batch")
+noleaks(test_open, "test_open")
+noleaks(test_stopped, "test_stopped")
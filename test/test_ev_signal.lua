@@ -1,4 +1,4 @@
-print '1..17'
+print '1..20'
 
 local src_dir, build_dir = ...
 package.path  = src_dir .. "?.lua;" .. package.path
@@ -161,6 +161,19 @@ function test_clear_pending()
    ok(num_called  == 1, 'just one signal handler got called')
 end
 
+-- Test set() on an active signal
+function test_set()
+   local sig = ev.Signal.new(
+      function(loop, sig, revents)
+         ok(true, 'got SIGALRM after set()')
+         sig:stop(loop)
+      end,
+      15)
+   sig:start(loop)
+   sig:set(14)
+   os.execute('kill -14 $PPID')
+   loop:loop()
+end
 
 noleaks(test_basic, "test_basic")
 noleaks(test_daemon_true, "test_daemon_true")
@@ -168,3 +181,4 @@ noleaks(test_start_stop_active, "test_start_stop_active")
 noleaks(test_callback, "test_callback")
 noleaks(test_is_pending, "test_is_pending")
 noleaks(test_clear_pending, "test_clear_pending")
+noleaks(test_set, "test_set")
@@ -0,0 +1,68 @@
+print '1..10'
+
+local src_dir, build_dir = ...
+package.path  = src_dir .. "?.lua;" .. package.path
+package.cpath = build_dir .. "?.so;" .. package.cpath
+
+local tap   = require("tap")
+local ev    = require("ev")
+local help  = require("help")
+local dump  = require("dumper").dump
+local ok    = tap.ok
+
+local noleaks = help.collect_and_assert_no_watchers
+local loop    = ev.Loop.default
+
+-- SIGUSR1 through a signalfd:
+function test_basic()
+   local sig = ev.SignalFD.new(
+      function(loop, sig, revents, count, info)
+         ok(ev.SIGNAL == revents, 'ev.SIGNAL(' .. ev.SIGNAL .. ') == revents (' .. revents .. ')')
+         ok(count == 1, 'got one SIGUSR1')
+         ok(info[1].signum == 10, 'siginfo has signal number')
+         ok(info[1].pid > 0, 'siginfo has sender pid')
+         sig:stop(loop)
+      end,
+      10) -- SIGUSR1
+   ok(sig:getfd() >= 0, 'getfd() works')
+   sig:start(loop)
+   os.execute('kill -10 $PPID')
+   loop:loop()
+end
+
+-- Several signals on one watcher:
+function test_many()
+   local seen = {}
+   local sig = ev.SignalFD.new(
+      function(loop, sig, revents, count, info)
+         for i=1,count do seen[info[i].signum] = true end
+         if seen[10] and seen[12] then sig:stop(loop) end
+      end,
+      { 10, 12 }) -- SIGUSR1, SIGUSR2
+   sig:start(loop)
+   os.execute('kill -10 $PPID; kill -12 $PPID')
+   loop:loop()
+   ok(seen[10] and seen[12], 'got SIGUSR1 and SIGUSR2')
+end
+
+-- Stopping one watcher keeps the signals another one still waits for:
+function test_stop_shared()
+   local got
+   local first  = ev.SignalFD.new(function() end, 10)
+   local second = ev.SignalFD.new(
+      function(loop, sig, revents, count, info)
+         got = info[1].signum
+         sig:stop(loop)
+      end,
+      10)
+   first:start(loop)
+   second:start(loop)
+   os.execute('kill -10 $PPID')
+   first:stop(loop)
+   loop:loop()
+   ok(got == 10, 'SIGUSR1 still delivered to the other watcher')
+end
+
+noleaks(test_basic, "test_basic")
+noleaks(test_many, "test_many")
+noleaks(test_stop_shared, "test_stop_shared")
@@ -0,0 +1,68 @@
+print '1..12'
+
+local src_dir, build_dir = ...
+package.path  = src_dir .. "?.lua;" .. package.path
+package.cpath = build_dir .. "?.so;" .. package.cpath
+
+local tap   = require("tap")
+local ev    = require("ev")
+local help  = require("help")
+local dump  = require("dumper").dump
+local ok    = tap.ok
+
+local noleaks = help.collect_and_assert_no_watchers
+local loop    = ev.Loop.default
+
+function test_exit_status()
+    local proc
+    proc = ev.spawn_process{
+        argv = { "sh", "-c", "exit $CODE" },
+        env  = { CODE = 3 },
+        on_exit = function(loop, child, revents, exit_status, term_signal)
+            ok(child:getrpid() == proc.pid, 'got proper pid')
+            ok(exit_status == 3, 'exit status decoded')
+            ok(term_signal == nil, 'not signaled')
+            ok(not child:is_active(), 'child watcher stopped after exit')
+        end,
+    }
+    ok(proc.pid > 0, 'spawned process')
+    loop:loop()
+end
+
+function test_pipe()
+    local proc = ev.spawn_process{
+        argv   = { "echo", "hello" },
+        stdout = "pipe",
+        stderr = "null",
+    }
+    ok(proc.stdout ~= nil and proc.stdin == nil, 'got a pipe for stdout only')
+    ev.IO.new(function(loop, io, revents)
+        ok(true, 'stdout pipe is readable')
+        io:stop(loop)
+    end, proc.stdout, ev.READ):start(loop)
+    loop:loop()
+end
+
+function test_setenv_fds()
+    local fd1, fd2 = ev.FdChannel.socketpair()
+    local status
+    ev.spawn_process{
+        -- fails unless PATH is kept, A is added and fd 4 is open:
+        argv   = { "sh", "-c", '[ "$A" = a ] && [ -n "$PATH" ] && { true >&4; } 2>/dev/null' },
+        setenv = { A = "a" },
+        fds    = { [4] = fd2 },
+        on_exit = function(loop, child, revents, exit_status)
+            status = exit_status
+        end,
+    }
+    loop:loop()
+    ok(status == 0, 'setenv added to the environment and fd passed')
+    ev.FdChannel.new(function() end, fd1):close()
+    ev.FdChannel.new(function() end, fd2):close()
+    ok(not pcall(ev.spawn_process, { argv = { "true" }, fds = { [1] = fd1 } }),
+       'fds only takes fds above 2')
+end
+
+noleaks(test_exit_status, "test_exit_status")
+noleaks(test_pipe, "test_pipe")
+noleaks(test_setenv_fds, "test_setenv_fds")
@@ -54,6 +54,71 @@ function test_remove()
     loop:loop()
 end
 
+function test_changed()
+    local path = os.tmpname()
+    local data = {}
+    local stat = ev.Stat.new(function(loop, stat, revents, changed)
+        ok(changed == stat:changed(), 'callback gets the changed mask')
+        ok(changed % (2*ev.Stat.NLINK) >= ev.Stat.NLINK, 'nlink changed')
+        ok(stat:nlink() == 0 and stat:nlink(true) > 0, 'nlink accessor')
+        ok(stat:getdata(data) == data, 'getdata(t) fills in t')
+        ok(data.attr.nlink == 0 and data.prev.nlink > 0, 'getdata(t) fills in attr and prev')
+        ok(type(stat:mtime_nsec(true)) == 'number', 'mtime_nsec accessor')
+        stat:stop(loop)
+    end, path)
+    stat:start(loop)
+    ok(stat:size() == 0, 'size accessor')
+    remove_file(path)
+    loop:loop()
+end
+
+function test_set()
+    local old_path = os.tmpname()
+    local path = os.tmpname()
+    local stat = ev.Stat.new(function(loop, stat, revents)
+        ok(stat:getdata().path == path, 'watches the new path')
+        stat:stop(loop)
+    end, old_path)
+    stat:start(loop)
+    stat:set(path)
+    ok(stat:is_active(), 'still active after set()')
+    os.remove(old_path)
+    remove_file(path)
+    loop:loop()
+end
+
+-- Edits within the same second are not missed:
+function test_same_second()
+    local path = os.tmpname()
+    local calls = 0
+    local changed
+    local stat = ev.Stat.new(function(loop, stat, revents, mask)
+        calls = calls + 1
+        if calls == 1 then
+            -- only the nanoseconds of mtime change:
+            ev.Timer.new(function()
+                os.execute("touch -d '2020-01-01 00:00:00.2' " .. path)
+            end, 0.1):start(loop)
+        else
+            changed = mask
+            stat:stop(loop)
+        end
+    end, path)
+    stat:start(loop)
+    ev.Timer.new(function()
+        os.execute("touch -d '2020-01-01 00:00:00.1' " .. path)
+    end, 0.1):start(loop)
+    loop:loop()
+    ok(calls == 2 and changed % (2*ev.Stat.MTIME) >= ev.Stat.MTIME,
+       'same second edit sets MTIME')
+    ok(stat:mtime() == stat:mtime(true) and stat:mtime_nsec() == 200000000 and
+       stat:mtime_nsec(true) == 100000000, 'mtime_nsec of both edits')
+    os.remove(path)
+end
+
 noleaks(test_basic, "test_basic")
 noleaks(test_remove, "test_remove")
+noleaks(test_changed, "test_changed")
+noleaks(test_set, "test_set")
+noleaks(test_same_second, "test_same_second")
 
@@ -0,0 +1,94 @@
+print '1..18'
+
+local src_dir, build_dir = ...
+package.path  = src_dir .. "?.lua;" .. package.path
+package.cpath = build_dir .. "?.so;" .. package.cpath
+
+local tap   = require("tap")
+local ev    = require("ev")
+local help  = require("help")
+local ok    = tap.ok
+
+local noleaks = help.collect_and_assert_no_watchers
+local loop    = ev.Loop.default
+
+function later(after, cmd)
+    ev.Timer.new(function(loop, timer, revents)
+        os.execute(cmd)
+    end, after):start(loop)
+end
+
+function test_list()
+    local poll = ev.StatPoll.new(function() end, 1)
+    ok(poll:count() == 0, 'empty list')
+    for i = 1, 1000 do
+        poll:add('/nonexistent/' .. i)
+    end
+    ok(poll:add('/nonexistent/1') == false, 'paths are only added once')
+    ok(poll:count() == 1000, 'count() after add()')
+    for i = 1, 1000, 2 do
+        poll:remove('/nonexistent/' .. i)
+    end
+    ok(poll:remove('/nonexistent/1') == false, 'remove() of a missing path')
+    ok(poll:count() == 500, 'count() after remove()')
+    local found = 0
+    for i = 2, 1000, 2 do
+        if poll:add('/nonexistent/' .. i) == false then found = found + 1 end
+    end
+    ok(found == 500, 'remaining paths are still found')
+    ok(not pcall(ev.StatPoll.new, function() end, 0), 'interval must be positive')
+    ok(not pcall(ev.StatPoll.new, function() end, 1, 0.5), 'max_interval must not be less than interval')
+end
+
+function test_batch()
+    local dir   = os.tmpname()
+    local calls = 0
+    local changes
+    os.execute('rm -f ' .. dir .. ' && mkdir -p ' .. dir .. ' && touch ' .. dir .. '/a ' .. dir .. '/b')
+
+    local poll = ev.StatPoll.new(function(loop, poll, revents, changed)
+        calls   = calls + 1
+        changes = changed
+        ok(revents == ev.STAT, 'revents is ev.STAT')
+        poll:stop(loop)
+    end, 0.01)
+    for _, name in ipairs({ 'a', 'b', 'c', 'd' }) do
+        poll:add(dir .. '/' .. name)
+    end
+    poll:start(loop)
+    -- with the shortest tick all four paths are checked in one slice:
+    later(0.15, 'echo 1 > ' .. dir .. '/a; rm ' .. dir .. '/b; touch ' .. dir .. '/c')
+    loop:loop()
+
+    ok(calls == 1, 'one callback for the whole batch')
+    ok(changes[dir .. '/a'] == true, 'modified path reported')
+    ok(changes[dir .. '/b'] == false, 'removed path reported as missing')
+    ok(changes[dir .. '/c'] == true, 'created path reported')
+    ok(changes[dir .. '/d'] == nil, 'unchanged path not reported')
+    os.execute('rm -rf ' .. dir)
+end
+
+function test_backoff()
+    local dir   = os.tmpname()
+    local start = loop:now()
+    local delay
+    os.execute('rm -f ' .. dir .. ' && mkdir -p ' .. dir .. ' && touch ' .. dir .. '/a')
+
+    -- checked at 0.05, 0.15, 0.35, 0.55, the change at 0.42 is only
+    -- seen by the last one:
+    local poll = ev.StatPoll.new(function(loop, poll, revents, changed)
+        delay = loop:now() - start
+        poll:stop(loop)
+    end, 0.05, 0.2)
+    poll:add(dir .. '/a')
+    poll:start(loop)
+    later(0.42, 'echo 1 > ' .. dir .. '/a')
+    loop:loop()
+
+    ok(delay and delay > 0.5, 'unchanged path is checked less often (' .. tostring(delay) .. ')')
+    os.execute('rm -rf ' .. dir)
+end
+
+noleaks(test_list, "test_list")
+noleaks(test_batch, "test_batch")
+noleaks(test_backoff, "test_backoff")
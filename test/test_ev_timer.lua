@@ -1,4 +1,4 @@
-print '1..20'
+print '1..39'
 
 local src_dir, build_dir = ...
 package.path  = src_dir .. "?.lua;" .. package.path
@@ -188,6 +188,99 @@ function test_clear_pending()
    ok(num_called == 1, 'exactly one timer was called')
 end
 
+-- Test set() on active timers
+function test_set()
+   local num_called = 0
+   local timer1 = ev.Timer.new(
+      function(loop, timer)
+         num_called = num_called + 1
+      end, 10)
+   timer1:start(loop)
+   timer1:set(0.01)
+   ok(timer1:is_active(), 'still active after set()')
+   loop:loop()
+   ok(num_called == 1, 'called after the new timeout')
+
+   local timer2 = ev.Timer.new(
+      function(loop, timer)
+         ok(false, 'Should never be called!')
+      end, 0.01)
+   timer2:start(loop, true)
+   timer2:set(10)
+   loop:loop()
+   ok(timer2:is_active(), 'set() keeps the daemon flag')
+   timer2:stop(loop)
+end
+-- Test the context argument
+function test_context()
+   local Counter = {}
+   function Counter:on_timeout(loop, timer, revents)
+      self.count = self.count + 1
+      self.got_timer = timer
+   end
+   local c1, c2 = { count = 0 }, { count = 0 }
+   local timer1 = ev.Timer.new(Counter.on_timeout, 0.01, 0, c1)
+   local timer2 = ev.Timer.new(Counter.on_timeout, 0.01, 0, c2)
+   timer1:start(loop)
+   timer2:start(loop)
+   loop:loop()
+   ok(c1.count == 1 and c1.got_timer == timer1, 'context passed first')
+   ok(c2.count == 1 and c2.got_timer == timer2, 'one function, two contexts')
+
+   ok(timer1:context() == c1, 'context() returns the context')
+   ok(timer1:context(c2) == c1 and timer1:context() == c2, 'context(new) returns the old one')
+
+   timer1:callback(Counter.on_timeout, c1)
+   ok(timer1:context() == c1, 'callback(fn, context) sets the context')
+
+   local args
+   timer1:context(nil)
+   timer1:callback(function(...) args = select('#', ...) end)
+   timer1:start(loop)
+   loop:loop()
+   ok(args == 3, 'no context after context(nil)')
+end
+
+function test_slack()
+   local loop  = ev.Loop.new()
+   local timer = ev.Timer.new(function() end, 1)
+   ok(timer:slack() == 0, 'no slack by default')
+   ok(timer:slack(0.05) == 0 and timer:slack() == 0.05, 'slack(new) returns the old one')
+   ok(not pcall(timer.slack, timer, -1), 'slack must not be negative')
+
+   -- three wakeups without slack are one with it, as a new loop has no
+   -- pending slack expiry the first timer expires at the end of its
+   -- window, which is in the windows of the other two:
+   local started = loop:now()
+   local fired   = {}
+   for i = 1, 3 do
+      local t = ev.Timer.new(function(loop)
+         fired[i] = { at = loop:now(), iteration = loop:iteration() }
+      end, 0.01 * i)
+      t:slack(0.05)
+      t:start(loop)
+   end
+   loop:loop()
+   ok(fired[1].iteration == fired[2].iteration and fired[2].iteration == fired[3].iteration,
+      'timers fired in the same wakeup')
+   ok(fired[1].at - started >= 0.03 - 0.001 and fired[1].at - started < 0.2,
+      string.format('not before the last one was due (%.3f)', fired[1].at - started))
+   local stats = loop:slack_stats()
+   ok(stats.fired == 3 and stats.coalesced == 2, 'slack_stats() counts saved wakeups')
+
+   -- repeating timers stay within their slack:
+   local count = 0
+   local rep = ev.Timer.new(function(loop, rep)
+      count = count + 1
+      if count == 3 then rep:stop(loop) end
+   end, 0.01, 0.01)
+   rep:slack(0.01)
+   started = loop:now()
+   rep:start(loop)
+   loop:loop()
+   ok(count == 3 and loop:now() - started < 0.2,
+      string.format('repeating timer with slack (%.3f)', loop:now() - started))
+end
 
 noleaks(test_basic, "test_basic")
 noleaks(test_daemon_true, "test_daemon_true")
@@ -196,6 +289,9 @@ noleaks(test_start_stop_active, "test_start_stop_active")
 noleaks(test_callback, "test_callback")
 noleaks(test_is_pending, "test_is_pending")
 noleaks(test_clear_pending, "test_clear_pending")
+noleaks(test_set, "test_set")
+noleaks(test_context, "test_context")
+noleaks(test_slack, "test_slack")
 --print(dump("registry", debug.getregistry()[1]));
 
 -- test_is_pending()
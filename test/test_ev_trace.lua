@@ -0,0 +1,107 @@
+print '1..18'
+
+local src_dir, build_dir = ...
+package.path  = src_dir .. "?.lua;" .. package.path
+package.cpath = build_dir .. "?.so;" .. package.cpath
+
+local tap   = require("tap")
+local ev    = require("ev")
+local help  = require("help")
+local ok    = tap.ok
+
+local noleaks = help.collect_and_assert_no_watchers
+local loop    = ev.Loop.default
+
+local function busy(seconds)
+   local start = os.clock()
+   while os.clock() - start < seconds do end
+end
+
+local function count(str, pattern)
+   local n = 0
+   for _ in str:gmatch(pattern) do n = n + 1 end
+   return n
+end
+
+-- Every callback, poll and iteration ends up in the dump:
+function test_basic()
+   loop:trace_start()
+   local timer = ev.Timer.new(function() end, 0.01)
+   timer:start(loop)
+   local idle = ev.Idle.new(function(loop, idle) idle:stop(loop) end)
+   idle:start(loop)
+   loop:loop()
+   local json = loop:trace_dump()
+   loop:trace_stop()
+   ok(json:match('^{"displayTimeUnit":"ms"') and json:match('%]}\n$'), 'dump is a chrome trace')
+   ok(count(json, '"name":"timer","cat":"callback","ph":"X"') == 1, 'timer callback traced')
+   ok(count(json, '"name":"idle","cat":"callback"') == 1, 'idle callback traced')
+   ok(json:match('"name":"poll","cat":"loop"'), 'backend poll traced')
+   ok(json:match('"name":"iteration","cat":"loop".-"iteration":%d+'), 'loop iterations traced')
+end
+
+-- fd and errors are recorded in the args:
+function test_args()
+   local old = loop:on_error(function() end)
+   loop:trace_start()
+   local idle = ev.Idle.new(function(loop, idle)
+      idle:stop(loop)
+      error("oops")
+   end)
+   idle:start(loop)
+   local io = ev.IO.new(function(loop, io) io:stop(loop) end, 1, ev.WRITE)
+   io:start(loop)
+   loop:loop()
+   local json = loop:trace_dump()
+   loop:trace_stop()
+   loop:on_error(old)
+   ok(json:match('"name":"idle"[^\n]*"error":true'), 'failed callback marked')
+   ok(json:match('"name":"io"[^\n]*"revents":2,"fd":1'), 'io callback has fd')
+end
+
+-- Unsampled iterations only record slow callbacks:
+function test_sampling()
+   loop:trace_start{ sample = 0, slow = 0.02 }
+   local fast = ev.Idle.new(function(loop, idle) idle:stop(loop) end)
+   fast:start(loop)
+   local slow = ev.Timer.new(function() busy(0.03) end, 0.001)
+   slow:start(loop)
+   loop:loop()
+   local json = loop:trace_dump()
+   loop:trace_stop()
+   ok(not json:match('"name":"idle"'), 'fast callback not recorded')
+   ok(not json:match('"name":"poll"'), 'unsampled poll not recorded')
+   ok(count(json, '"name":"timer"') == 1, 'slow callback recorded')
+end
+
+-- The ring keeps the newest events, dumps go to a file or on a signal:
+function test_ring_and_files()
+   local path = os.tmpname()
+   loop:trace_start{ size = 4, signal = 14, path = path }
+   local n = 0
+   local idle = ev.Idle.new(function(loop, idle)
+      n = n + 1
+      if n == 10 then idle:stop(loop) end
+   end)
+   idle:start(loop)
+   loop:loop()
+   ok(loop:trace_dump(path), 'trace_dump(path)')
+   local json = io.open(path):read("*a")
+   ok(count(json, '"ph":"X"') == 4 and json:match('"dropped":%d+'), 'ring wrapped: ' .. json:match('"dropped":%d+'))
+
+   os.remove(path)
+   loop:feed_signal_event(14)
+   loop:loop(ev.NOWAIT)
+   local file = io.open(path)
+   ok(file and file:read("*a"):match('"traceEvents"'), 'dumped on signal')
+   if file then file:close() end
+   os.remove(path)
+
+   loop:trace_stop()
+   ok(not pcall(loop.trace_dump, loop), 'no dump once stopped')
+end
+
+noleaks(test_basic, "test_basic")
+noleaks(test_args, "test_args")
+noleaks(test_sampling, "test_sampling")
+noleaks(test_ring_and_files, "test_ring_and_files")
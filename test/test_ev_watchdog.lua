@@ -0,0 +1,119 @@
+print '1..16'
+
+local src_dir, build_dir = ...
+package.path  = src_dir .. "?.lua;" .. package.path
+package.cpath = build_dir .. "?.so;" .. package.cpath
+
+local tap   = require("tap")
+local ev    = require("ev")
+local help  = require("help")
+local ok    = tap.ok
+
+local noleaks = help.collect_and_assert_no_watchers
+local loop    = ev.Loop.default
+
+local function busy(seconds)
+   local start = os.clock()
+   while os.clock() - start < seconds do end
+end
+
+local reports
+local function on_slow(info)
+   reports[#reports + 1] = info
+end
+
+-- A slow one-shot timer is reported once, with its stack:
+function test_slow_timer()
+   reports = {}
+   loop:watchdog_start{ threshold = 0.05, on_slow = on_slow }
+   ev.Timer.new(function() busy(0.3) end, 0.01):start(loop)
+   loop:loop()
+   loop:watchdog_stop()
+   local info = reports[1] or {}
+   ok(#reports == 1, 'reported once, got ' .. #reports)
+   ok(info.type == "timer", 'type=' .. tostring(info.type))
+   ok(type(info.elapsed) == "number" and info.elapsed >= 0.05, 'elapsed=' .. tostring(info.elapsed))
+   ok(tostring(info.traceback):match("in function 'busy'"), 'stack of the callback captured')
+end
+
+-- Fast callbacks are left alone:
+function test_fast()
+   reports = {}
+   loop:watchdog_start{ threshold = 0.05, on_slow = on_slow }
+   local n = 0
+   ev.Idle.new(function(loop, idle)
+      n = n + 1
+      busy(0.002)
+      if n == 100 then idle:stop(loop) end
+   end):start(loop)
+   loop:loop()
+   loop:watchdog_stop()
+   ok(#reports == 0, 'no reports for fast callbacks')
+end
+
+-- The fd of io watchers is reported:
+function test_io()
+   reports = {}
+   loop:watchdog_start{ threshold = 0.05, on_slow = on_slow }
+   ev.IO.new(function(loop, io)
+      io:stop(loop)
+      busy(0.2)
+   end, 1, ev.WRITE):start(loop)
+   loop:loop()
+   loop:watchdog_stop()
+   local info = reports[1] or {}
+   ok(info.type == "io", 'type=' .. tostring(info.type))
+   ok(info.fd == 1, 'fd=' .. tostring(info.fd))
+end
+
+-- Nothing is reported once stopped:
+function test_stop()
+   reports = {}
+   loop:watchdog_start{ threshold = 0.05, on_slow = on_slow }
+   loop:watchdog_stop()
+   ev.Timer.new(function() busy(0.2) end, 0.01):start(loop)
+   loop:loop()
+   ok(#reports == 0, 'no reports after watchdog_stop()')
+end
+
+-- A debug hook set by the user is put back:
+function test_user_hook()
+   reports = {}
+   local function user_hook() end
+   loop:watchdog_start{ threshold = 0.05, on_slow = on_slow }
+   ev.Timer.new(function()
+      debug.sethook(user_hook, "", 1000000)
+      busy(0.2)
+   end, 0.01):start(loop)
+   loop:loop()
+   loop:watchdog_stop()
+   ok(#reports == 1 and debug.gethook() == user_hook, 'user hook restored')
+   debug.sethook()
+end
+
+-- Signals blocked for an ev.SignalFD are not delivered to the
+-- watchdog thread instead:
+function test_signalfd()
+   if not ev.SignalFD then
+      ok(true, '# skip: no ev.SignalFD')
+      return
+   end
+   local got
+   loop:watchdog_start{ threshold = 0.05 }
+   local sig = ev.SignalFD.new(function(loop, sig, revents, count, info)
+      got = info[1].signum
+      sig:stop(loop)
+   end, 10) -- SIGUSR1
+   sig:start(loop)
+   os.execute('kill -10 $PPID')
+   loop:loop()
+   loop:watchdog_stop()
+   ok(got == 10, 'SIGUSR1 read from the signalfd')
+end
+
+noleaks(test_slow_timer, "test_slow_timer")
+noleaks(test_fast, "test_fast")
+noleaks(test_io, "test_io")
+noleaks(test_stop, "test_stop")
+noleaks(test_user_hook, "test_user_hook")
+noleaks(test_signalfd, "test_signalfd")
@@ -1,3 +1,14 @@
+#include <math.h>
+
+/**
+ * A timer with the slack set by timer:slack().  The ev_timer must be
+ * the first member, check_timer() returns it.
+ */
+struct lua_ev_timer {
+    ev_timer  timer;
+    ev_tstamp slack;
+};
+
 /**
  * Create a table for ev.Timer that gives access to the constructor for
  * timer objects.
@@ -27,6 +38,8 @@ static int create_timer_mt(lua_State *L) {
         { "stop",          timer_stop },
         { "start",         timer_start },
         { "clear_pending", timer_clear_pending },
+        { "set",           timer_set },
+        { "slack",         timer_slack },
         { NULL, NULL }
     };
     return add_watcher_mt(L, methods, TIMER_MT);
@@ -37,6 +50,7 @@ static int create_timer_mt(lua_State *L) {
  *   1 - callback function.
  *   2 - after (number of seconds until timer should trigger).
  *   3 - repeat (number of seconds to wait for consecutive timeouts).
+ *   4 - optional context, see watcher:context()
  *
  * @see watcher_new()
  *
@@ -52,8 +66,10 @@ static int timer_new(lua_State* L) {
     if ( repeat < 0.0 )
         luaL_argerror(L, 3, "repeat must be greater than or equal to 0");
 
-    timer = (ev_timer*)watcher_new(L, sizeof(ev_timer), TIMER_MT);
+    timer = (ev_timer*)watcher_new(L, sizeof(lua_ev_timer), TIMER_MT);
+    watcher_new_context(L, 4);
     ev_timer_init(timer, &timer_cb, after, repeat);
+    ((lua_ev_timer*)timer)->slack = 0;
     return 1;
 }
 
@@ -66,6 +82,69 @@ static void timer_cb(struct ev_loop* loop, ev_timer* timer, int revents) {
     watcher_cb(loop, timer, revents);
 }
 
+/**
+ * Callback of timers with slack: counts the callbacks which ran in
+ * the same loop iteration (so the same wakeup) as another timer with
+ * slack, and moves the next expiry of a repeating timer into its
+ * slack window like timer_slack_after() does.
+ *
+ * @see watcher_cb()
+ *
+ * [+0, -0, m]
+ */
+static void timer_slack_cb(struct ev_loop* loop, ev_timer* timer, int revents) {
+    lua_ev_loop* lloop = (GET_WATCHER_DATA(timer))->loop;
+
+    if ( lloop ) {
+        if ( lloop->slack_fired && lloop->slack_iteration == ev_iteration(loop) ) {
+            lloop->slack_coalesced++;
+        }
+        lloop->slack_iteration = ev_iteration(loop);
+        lloop->slack_fired++;
+    }
+    if ( timer->repeat && ev_is_active(timer) ) {
+        ev_timer_stop(loop, timer);
+        ev_timer_set(timer, timer_slack_after(loop, lloop, timer->repeat,
+                                              ((lua_ev_timer*)timer)->slack),
+                     timer->repeat);
+        ev_timer_start(loop, timer);
+    }
+    watcher_cb(loop, timer, revents);
+}
+
+/**
+ * Returns when a timer with slack which should expire after seconds
+ * from now expires: the last expiry picked in this loop if it is in
+ * the window of after to after + slack seconds, so timers with
+ * overlapping windows expire together.  If that expiry has passed it
+ * is the end of the window, so that as many timers started later as
+ * possible can expire with this one.  Otherwise (the pending expiry
+ * does not fit) it is the last multiple in the window of the largest
+ * power of 2 seconds not above slack, which lines up with timers
+ * started at other times.
+ *
+ * [-0, +0, -]
+ */
+static ev_tstamp timer_slack_after(struct ev_loop* loop, lua_ev_loop* lloop, ev_tstamp after, ev_tstamp slack) {
+    ev_tstamp now = ev_now(loop);
+    ev_tstamp at  = now + after;
+    ev_tstamp quantum;
+    int       exp;
+
+    if ( lloop && lloop->slack_at >= at && lloop->slack_at <= at + slack ) {
+        return lloop->slack_at - now;
+    }
+    if ( ! lloop || lloop->slack_at <= now ) {
+        at += slack;
+    } else {
+        frexp(slack, &exp);
+        quantum = ldexp(1.0, exp - 1);
+        at = floor((at + slack) / quantum) * quantum;
+    }
+    if ( lloop ) lloop->slack_at = at;
+    return at - now;
+}
+
 /**
  * Restart a timer with the specified repeat number of seconds.  If no
  * repeat was specified, the timer is simply stopped.  May optionally
@@ -90,7 +169,14 @@ static int timer_again(lua_State *L) {
 
     if ( repeat ) timer->repeat = repeat;
 
-    if ( timer->repeat ) {
+    if ( timer->repeat && ((lua_ev_timer*)timer)->slack > 0 ) {
+        ev_timer_stop(loop, timer);
+        ev_timer_set(timer, timer_slack_after(loop, check_loop_data(L, 2), timer->repeat,
+                                              ((lua_ev_timer*)timer)->slack),
+                     timer->repeat);
+        ev_timer_start(loop, timer);
+        loop_start_watcher(L, loop, GET_WATCHER_DATA(timer), 2, 1, -1);
+    } else if ( timer->repeat ) {
         ev_timer_again(loop, timer);
         loop_start_watcher(L, loop, GET_WATCHER_DATA(timer), 2, 1, -1);
     } else {
@@ -134,6 +220,12 @@ static int timer_start(lua_State *L) {
     struct ev_loop* loop   = *check_loop_and_init(L, 2);
     int is_daemon          = lua_toboolean(L, 3);
 
+    if ( ((lua_ev_timer*)timer)->slack > 0 && ! ev_is_active(timer) ) {
+        /* a stopped timer keeps the time left in at. */
+        ev_timer_set(timer, timer_slack_after(loop, check_loop_data(L, 2), timer->at,
+                                              ((lua_ev_timer*)timer)->slack),
+                     timer->repeat);
+    }
     ev_timer_start(loop, timer);
     loop_start_watcher(L, loop, GET_WATCHER_DATA(timer), 2, 1, is_daemon);
 
@@ -160,7 +252,88 @@ static int timer_clear_pending(lua_State *L) {
         loop_stop_watcher(L, loop, GET_WATCHER_DATA(timer), 1);
     }
 
-    lua_pushnumber(L, revents);
+    lua_pushinteger(L, revents);
+    return 1;
+}
+
+/**
+ * Changes after and repeat, restarting the timer if it is active (so
+ * it expires after seconds from now).
+ *
+ * Usage:
+ *     timer:set(after [, repeat])
+ *
+ * [+0, -0, e]
+ */
+static int timer_set(lua_State *L) {
+    ev_timer*       timer  = check_timer(L, 1);
+    ev_tstamp       after  = luaL_checknumber(L, 2);
+    ev_tstamp       repeat = luaL_optnumber(L, 3, 0);
+    struct ev_loop* loop   = watcher_active_loop(timer);
+
+    if ( after <= 0.0 )
+        luaL_argerror(L, 2, "after must be greater than 0");
+    if ( repeat < 0.0 )
+        luaL_argerror(L, 3, "repeat must be greater than or equal to 0");
+
+    if ( loop ) {
+        ev_timer_stop(loop, timer);
+        if ( ((lua_ev_timer*)timer)->slack > 0 ) {
+            after = timer_slack_after(loop, (GET_WATCHER_DATA(timer))->loop, after,
+                                      ((lua_ev_timer*)timer)->slack);
+        }
+    }
+    ev_timer_set(timer, after, repeat);
+    if ( loop ) ev_timer_start(loop, timer);
+
+    return 0;
+}
+
+/**
+ * Get/set the slack of the timer: it may expire up to this many
+ * seconds late, so that it can expire together with other timers with
+ * slack in the same loop, saving wakeups.  The default is 0, the
+ * timer expires as early as possible.  Takes effect when the timer is
+ * started next (or repeats).  If passed a new_slack, then the
+ * old_slack will be returned.
+ *
+ * Usage:
+ *     old_slack = timer:slack([new_slack])
+ *
+ * [+1, -0, e]
+ */
+static int timer_slack(lua_State *L) {
+    lua_ev_timer* timer = (lua_ev_timer*)check_timer(L, 1);
+
+    lua_pushnumber(L, timer->slack);
+    if ( lua_gettop(L) > 2 ) {
+        ev_tstamp slack = luaL_checknumber(L, 2);
+
+        if ( slack < 0.0 ) luaL_argerror(L, 2, "slack must be greater than or equal to 0");
+        timer->slack = slack;
+        ev_set_cb(&timer->timer, slack > 0 ? &timer_slack_cb : &timer_cb);
+    }
+    return 1;
+}
+
+/**
+ * Returns a table with the number of callbacks of timers with slack
+ * in this loop (fired), and how many of these ran in the same wakeup
+ * as another one (coalesced), which is the number of wakeups saved.
+ *
+ * Usage:
+ *     stats = loop:slack_stats()
+ *
+ * [+1, -0, e]
+ */
+static int loop_slack_stats(lua_State *L) {
+    lua_ev_loop* loop = check_loop_data(L, 1);
+
+    lua_createtable(L, 0, 2);
+    lua_pushnumber(L, loop->slack_fired);
+    lua_setfield(L, -2, "fired");
+    lua_pushnumber(L, loop->slack_coalesced);
+    lua_setfield(L, -2, "coalesced");
     return 1;
 }
 
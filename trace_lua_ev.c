@@ -0,0 +1,422 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#define TRACE_DEFAULT_SIZE 65536
+
+#define TRACE_ITERATION 1
+#define TRACE_POLL      2
+#define TRACE_CALLBACK  3
+
+/**
+ * One complete ("ph":"X") event of the chrome trace.  Times are
+ * seconds on the same monotonic clock as ev.Probe.
+ */
+typedef struct trace_event {
+    double      ts;
+    double      dur;
+    /* metatable name of the watcher ("ev{io}", ...) for callbacks. */
+    const char* name;
+    /* fd, signal number or pid of the watcher, loop iteration for
+     * iterations, -1 if there is nothing to show. */
+    int         arg;
+    short       revents;
+    char        kind;
+    char        failed;
+} trace_event;
+
+/**
+ * Per loop tracer state, only ever touched from the thread running the
+ * loop, so recording is a plain store into the ring and an increment
+ * of <head>, without any locking.  Once the ring is full the oldest
+ * events are overwritten.
+ */
+struct lua_ev_tracer {
+    /* bracket the backend poll of every loop iteration. */
+    ev_prepare    prepare;
+    ev_check      check;
+    /* dump to <path> when this signal arrives. */
+    ev_signal     signal;
+    char*         path;
+    trace_event*  events;
+    unsigned long mask;
+    unsigned long head;
+    /* fraction of iterations recorded in full. */
+    double        sample;
+    /* callbacks taking at least this long are always recorded (0 = off). */
+    double        slow;
+    /* start of the current iteration (just before its poll). */
+    double        iteration_start;
+    int           sampled;
+    int           tid;
+    unsigned int  seed;
+};
+
+/**
+ * Start tracing this loop, replacing any previous trace.  Takes a
+ * table with these optional fields:
+ *   size   - number of events kept in the ring buffer (default 65536).
+ *   sample - fraction of loop iterations recorded with their poll and
+ *            all callbacks (default 1, every iteration).
+ *   slow   - callbacks running for at least this many seconds are
+ *            recorded even in iterations which are not sampled.
+ *   signal - signal number which dumps the trace to <path>.
+ *   path   - file written on <signal> (default "ev-trace-<pid>.json").
+ *
+ * Usage:
+ *     loop:trace_start{ sample = 0.01, slow = 0.005, signal = 12 }
+ *
+ * [+0, -0, e]
+ */
+static int loop_trace_start(lua_State *L) {
+    static int      next_tid = 0;
+    lua_ev_loop*    lloop    = check_loop_data(L, 1);
+    struct ev_loop* loop     = *check_loop_and_init(L, 1);
+    lua_ev_tracer*  tracer;
+    unsigned long   size;
+    double          sample   = 1;
+    double          slow     = 0;
+    int             signum   = 0;
+    long            req_size = TRACE_DEFAULT_SIZE;
+    const char*     path     = NULL;
+
+    if ( ! lua_isnoneornil(L, 2) ) {
+        luaL_checktype(L, 2, LUA_TTABLE);
+        lua_getfield(L, 2, "size");
+        req_size = luaL_optlong(L, -1, TRACE_DEFAULT_SIZE);
+        lua_getfield(L, 2, "sample");
+        sample   = luaL_optnumber(L, -1, 1);
+        lua_getfield(L, 2, "slow");
+        slow     = luaL_optnumber(L, -1, 0);
+        lua_getfield(L, 2, "signal");
+        signum   = luaL_optint(L, -1, 0);
+        lua_getfield(L, 2, "path");
+        path     = luaL_optstring(L, -1, NULL);
+    }
+    if ( req_size <= 0 )
+        return luaL_error(L, "size must be greater than 0");
+    if ( sample < 0 || sample > 1 )
+        return luaL_error(L, "sample must be between 0 and 1");
+
+    /* round up to a power of two so the ring index is a mask. */
+    for ( size = 1; size < (unsigned long)req_size; size <<= 1 );
+
+    trace_free(loop, lloop);
+
+    tracer = calloc(1, sizeof(lua_ev_tracer));
+    if ( NULL != tracer ) {
+        tracer->events = malloc(size * sizeof(trace_event));
+        if ( NULL != path ) tracer->path = strdup(path);
+    }
+    if ( NULL == tracer || NULL == tracer->events || ( NULL != path && NULL == tracer->path ) ) {
+        if ( NULL != tracer ) {
+            free(tracer->events);
+            free(tracer);
+        }
+        return luaL_error(L, "unable to allocate %lu trace events", size);
+    }
+    tracer->mask   = size - 1;
+    tracer->sample = sample;
+    tracer->slow   = slow;
+    tracer->seed   = (unsigned int)(size_t)tracer ^ (unsigned int)(probe_now() * 1e6);
+    tracer->tid    = ev_is_default_loop(loop) ? 0 : ++next_tid;
+    tracer->iteration_start = probe_now();
+    tracer->sampled         = trace_roll(tracer);
+
+    ev_prepare_init(&tracer->prepare, &trace_prepare_cb);
+    ev_check_init(&tracer->check, &trace_check_cb);
+    /* take the timestamps as close to the backend poll as possible. */
+    ev_set_priority(&tracer->prepare, EV_MINPRI);
+    ev_set_priority(&tracer->check, EV_MAXPRI);
+    ev_prepare_start(loop, &tracer->prepare);
+    ev_unref(loop);
+    ev_check_start(loop, &tracer->check);
+    ev_unref(loop);
+
+    if ( signum > 0 ) {
+        ev_signal_init(&tracer->signal, &trace_signal_cb, signum);
+        ev_signal_start(loop, &tracer->signal);
+        ev_unref(loop);
+    }
+
+    lloop->tracer = tracer;
+    return 0;
+}
+
+/**
+ * Stop tracing this loop and throw away the recorded events.
+ *
+ * Usage:
+ *     loop:trace_stop()
+ *
+ * [+0, -0, e]
+ */
+static int loop_trace_stop(lua_State *L) {
+    lua_ev_loop* lloop = check_loop_data(L, 1);
+
+    trace_free(lloop->loop, lloop);
+    return 0;
+}
+
+/**
+ * Write the recorded events as chrome trace JSON, which can be loaded
+ * into chrome://tracing or https://ui.perfetto.dev.  Tracing goes on.
+ * Returns the JSON if no path is given.
+ *
+ * Usage:
+ *     json = loop:trace_dump()
+ *     ok, err = loop:trace_dump(path)
+ *
+ * [+1|2, -0, e]
+ */
+static int loop_trace_dump(lua_State *L) {
+    lua_ev_loop*   lloop  = check_loop_data(L, 1);
+    lua_ev_tracer* tracer = lloop->tracer;
+    const char*    path   = luaL_optstring(L, 2, NULL);
+    luaL_Buffer    b;
+
+    if ( NULL == tracer ) return luaL_error(L, "loop is not being traced");
+
+    if ( NULL != path ) {
+        if ( trace_write_file(tracer, path) ) {
+            lua_pushnil(L);
+            lua_pushfstring(L, "%s: %s", path, strerror(errno));
+            return 2;
+        }
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+    luaL_buffinit(L, &b);
+    trace_write(tracer, &trace_add_buffer, &b);
+    luaL_pushresult(&b);
+    return 1;
+}
+
+/**
+ * Stop the tracer watchers and free the tracer of a loop, if any.
+ *
+ * [+0, -0, -]
+ */
+static void trace_free(struct ev_loop* loop, lua_ev_loop* lloop) {
+    lua_ev_tracer* tracer = lloop->tracer;
+
+    if ( NULL == tracer ) return;
+    lloop->tracer = NULL;
+
+    ev_ref(loop);
+    ev_prepare_stop(loop, &tracer->prepare);
+    ev_ref(loop);
+    ev_check_stop(loop, &tracer->check);
+    if ( ev_is_active(&tracer->signal) ) {
+        ev_ref(loop);
+        ev_signal_stop(loop, &tracer->signal);
+    }
+    free(tracer->path);
+    free(tracer->events);
+    free(tracer);
+}
+
+/**
+ * Decide if the next iteration is recorded in full.
+ */
+static int trace_roll(lua_ev_tracer* tracer) {
+    if ( tracer->sample >= 1 ) return 1;
+    tracer->seed = tracer->seed * 1103515245u + 12345u;
+    return (tracer->seed >> 8) < tracer->sample * (double)(1u << 24);
+}
+
+static trace_event* trace_push(lua_ev_tracer* tracer, int kind, double ts, double dur) {
+    trace_event* event = &tracer->events[tracer->head++ & tracer->mask];
+
+    event->kind    = kind;
+    event->ts      = ts;
+    event->dur     = dur;
+    event->name    = NULL;
+    event->arg     = -1;
+    event->revents = 0;
+    event->failed  = 0;
+    return event;
+}
+
+/**
+ * Close the current iteration just before the backend poll and start
+ * the next one.
+ *
+ * [+0, -0, -]
+ */
+static void trace_prepare_cb(struct ev_loop* loop, ev_prepare* prepare, int revents) {
+    lua_ev_tracer* tracer = (lua_ev_tracer*)(((char*)prepare) - offsetof(lua_ev_tracer, prepare));
+    double         now    = probe_now();
+
+    if ( tracer->sampled ) {
+        trace_push(tracer, TRACE_ITERATION, tracer->iteration_start,
+                   now - tracer->iteration_start)->arg = (int)ev_loop_count(loop);
+    }
+    tracer->iteration_start = now;
+    tracer->sampled         = trace_roll(tracer);
+}
+
+/**
+ * Record the backend poll just after it returned.
+ *
+ * [+0, -0, -]
+ */
+static void trace_check_cb(struct ev_loop* loop, ev_check* check, int revents) {
+    lua_ev_tracer* tracer = (lua_ev_tracer*)(((char*)check) - offsetof(lua_ev_tracer, check));
+
+    if ( tracer->sampled ) {
+        trace_push(tracer, TRACE_POLL, tracer->iteration_start,
+                   probe_now() - tracer->iteration_start);
+    }
+}
+
+/**
+ * Dump the trace when the configured signal arrives.
+ *
+ * [+0, -0, -]
+ */
+static void trace_signal_cb(struct ev_loop* loop, ev_signal* sig, int revents) {
+    lua_ev_tracer* tracer = (lua_ev_tracer*)(((char*)sig) - offsetof(lua_ev_tracer, signal));
+    char           path[64];
+
+    if ( NULL == tracer->path ) {
+#ifndef _WIN32
+        snprintf(path, sizeof(path), "ev-trace-%d.json", (int)getpid());
+#else
+        snprintf(path, sizeof(path), "ev-trace.json");
+#endif
+    }
+    if ( trace_write_file(tracer, tracer->path ? tracer->path : path) ) {
+        fprintf(stderr, "TRACE DUMP FAILED: %s: %s\n",
+                tracer->path ? tracer->path : path, strerror(errno));
+    }
+}
+
+/**
+ * Called by watcher_cb_args() (and once_cb(), with a nil watcher) after
+ * the lua callback of the watcher at watcher_i returned, started is
+ * when it was called.  Records the callback if this iteration is
+ * sampled or the callback was slow.
+ *
+ * [-0, +0, -]
+ */
+static void trace_callback(lua_State *L, lua_ev_tracer* tracer, void *watcher, int watcher_i, int revents, double started, int failed) {
+    double       dur = probe_now() - started;
+    const char*  name = NULL;
+    trace_event* event;
+
+    if ( ! tracer->sampled && ! ( tracer->slow > 0 && dur >= tracer->slow ) ) return;
+
+    if ( lua_isnil(L, watcher_i) ) {
+        name = lua_ev_once_name;
+    } else if ( lua_getmetatable(L, watcher_i) ) {
+        lua_rawgeti(L, -1, OBJ_TYPE_MAGIC_IDX);
+        name = lua_touserdata(L, -1);
+        lua_pop(L, 2);
+    }
+    event = trace_push(tracer, TRACE_CALLBACK, started, dur);
+    event->name    = name;
+    event->revents = revents;
+    event->failed  = failed;
+    watcher_target(name, watcher, &event->arg);
+}
+
+static void trace_add_buffer(void* ctx, const char* s, size_t len) {
+    luaL_addlstring((luaL_Buffer*)ctx, s, len);
+}
+
+static void trace_add_file(void* ctx, const char* s, size_t len) {
+    fwrite(s, 1, len, (FILE*)ctx);
+}
+
+/**
+ * Write the trace to path, returns non-zero with errno set on
+ * failure.
+ */
+static int trace_write_file(lua_ev_tracer* tracer, const char* path) {
+    FILE* file = fopen(path, "w");
+    int   err;
+
+    if ( NULL == file ) return -1;
+    trace_write(tracer, &trace_add_file, file);
+    err = ferror(file);
+    if ( fclose(file) || err ) {
+        if ( err ) errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Format the ring buffer as chrome trace JSON, oldest event first.
+ * Timestamps are microseconds.
+ */
+static void trace_write(lua_ev_tracer* tracer, trace_add_fn add, void* ctx) {
+    char          buf[256];
+    unsigned long size    = tracer->mask + 1;
+    unsigned long first   = tracer->head > size ? tracer->head - size : 0;
+    unsigned long i;
+    int           pid     = 0;
+    int           len;
+
+#ifndef _WIN32
+    pid = (int)getpid();
+#endif
+    len = snprintf(buf, sizeof(buf),
+                   "{\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped\":%lu,\"sample\":%g},\n"
+                   "\"traceEvents\":[\n"
+                   "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                   "\"args\":{\"name\":\"ev loop %d\"}}",
+                   first, tracer->sample, pid, tracer->tid, tracer->tid);
+    add(ctx, buf, len);
+
+    for ( i = first; i < tracer->head; i++ ) {
+        trace_event* event = &tracer->events[i & tracer->mask];
+        const char*  name;
+        const char*  cat  = "loop";
+        size_t       name_len;
+
+        switch ( event->kind ) {
+        case TRACE_ITERATION:
+            name = "iteration";
+            name_len = 9;
+            break;
+        case TRACE_POLL:
+            name = "poll";
+            name_len = 4;
+            break;
+        default:
+            cat = "callback";
+            /* "ev{io}" => "io" */
+            name = event->name ? event->name + 3 : "watcher";
+            name_len = event->name ? strlen(name) - 1 : 7;
+            break;
+        }
+        len = snprintf(buf, sizeof(buf),
+                       ",\n{\"name\":\"%.*s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                       "\"pid\":%d,\"tid\":%d,\"args\":{",
+                       (int)name_len, name, cat, event->ts * 1e6, event->dur * 1e6,
+                       pid, tracer->tid);
+        if ( event->kind == TRACE_ITERATION ) {
+            len += snprintf(buf + len, sizeof(buf) - len, "\"iteration\":%d", event->arg);
+        } else if ( event->kind == TRACE_CALLBACK ) {
+            len += snprintf(buf + len, sizeof(buf) - len, "\"revents\":%d", event->revents);
+            if ( event->arg != -1 ) {
+                len += snprintf(buf + len, sizeof(buf) - len, ",\"%s\":%d",
+                                watcher_target(event->name, NULL, NULL), event->arg);
+            }
+            if ( event->failed ) {
+                len += snprintf(buf + len, sizeof(buf) - len, ",\"error\":true");
+            }
+        }
+        len += snprintf(buf + len, sizeof(buf) - len, "}}");
+        add(ctx, buf, len);
+    }
+    add(ctx, "\n]}\n", 4);
+}
+
+/* vi:set expandtab ts=4: */
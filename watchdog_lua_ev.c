@@ -0,0 +1,370 @@
+#ifndef _WIN32
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * Per loop watchdog.  Around every callback watcher_cb_args() only
+ * records which watcher runs, bumps <seq> and sets <running>.  The
+ * watchdog thread wakes up four times per threshold and fires if it
+ * sees the same callback running for at least the threshold.  These
+ * fields are written by the loop thread without any locking, a stale
+ * read only delays detection by one wakeup.
+ */
+struct lua_ev_watchdog {
+    volatile unsigned long seq;
+    volatile int           running;
+    void* volatile         watcher;
+    /* metatable name of the watcher ("ev{io}", ...). */
+    const char* volatile   name;
+    lua_State* volatile    L;
+
+    /* everything below is protected by watchdog_lock. */
+    double                 threshold;
+    int                    on_slow_ref;
+    int                    stopping;
+    /* set by the watchdog thread, cleared by watchdog_hook(). */
+    int                    firing;
+    unsigned long          fired_seq;
+    double                 elapsed;
+    /* debug hook that was set before ours. */
+    lua_Hook               old_hook;
+    int                    old_mask;
+    int                    old_count;
+    pthread_t              thread;
+    pthread_cond_t         wake;
+    lua_ev_watchdog*       next;
+};
+
+static pthread_mutex_t  watchdog_lock = PTHREAD_MUTEX_INITIALIZER;
+/* all running watchdogs, so watchdog_hook() can find its own. */
+static lua_ev_watchdog* watchdog_list = NULL;
+
+/**
+ * Start a thread which reports any callback of this loop running for
+ * longer than threshold seconds, replacing a previous watchdog.  Takes
+ * a table with these fields:
+ *   threshold - seconds a single callback may run (default 0.1).
+ *   on_slow   - called as on_slow(info) from inside the slow callback,
+ *               info has the fields type, fd/signal/pid (if any),
+ *               elapsed (lower bound in seconds) and traceback.
+ *               Defaults to printing the info to stderr.
+ *
+ * Usage:
+ *     loop:watchdog_start{ threshold = 0.05 }
+ *
+ * [+0, -0, e]
+ */
+static int loop_watchdog_start(lua_State *L) {
+    lua_ev_loop*     lloop     = check_loop_data(L, 1);
+    double           threshold = 0.1;
+    int              on_slow_ref = LUA_NOREF;
+    lua_ev_watchdog* wd;
+    sigset_t         all, mask;
+    int              err;
+
+    check_loop_and_init(L, 1);
+    if ( ! lua_isnoneornil(L, 2) ) {
+        luaL_checktype(L, 2, LUA_TTABLE);
+        lua_getfield(L, 2, "threshold");
+        threshold = luaL_optnumber(L, -1, 0.1);
+        lua_getfield(L, 2, "on_slow");
+        if ( ! lua_isnil(L, -1) ) luaL_checktype(L, -1, LUA_TFUNCTION);
+    }
+    if ( threshold <= 0 )
+        return luaL_error(L, "threshold must be greater than 0");
+
+    wd = calloc(1, sizeof(lua_ev_watchdog));
+    if ( NULL == wd ) return luaL_error(L, "unable to allocate watchdog");
+
+    watchdog_free(L, lloop);
+
+    if ( lua_isfunction(L, -1) ) on_slow_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    wd->threshold   = threshold;
+    wd->on_slow_ref = on_slow_ref;
+    wd->L           = L;
+    pthread_cond_init(&wd->wake, NULL);
+
+    pthread_mutex_lock(&watchdog_lock);
+    /* the thread inherits the mask: block everything so that signals
+     * blocked in the loop thread (ev.SignalFD) are not delivered to
+     * it instead. */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &mask);
+    err = pthread_create(&wd->thread, NULL, &watchdog_thread, wd);
+    pthread_sigmask(SIG_SETMASK, &mask, NULL);
+    if ( err ) {
+        pthread_mutex_unlock(&watchdog_lock);
+        pthread_cond_destroy(&wd->wake);
+        luaL_unref(L, LUA_REGISTRYINDEX, on_slow_ref);
+        free(wd);
+        return luaL_error(L, "unable to start watchdog thread");
+    }
+    wd->next      = watchdog_list;
+    watchdog_list = wd;
+    pthread_mutex_unlock(&watchdog_lock);
+
+    lloop->watchdog = wd;
+    return 0;
+}
+
+/**
+ * Stop the watchdog thread of this loop.
+ *
+ * Usage:
+ *     loop:watchdog_stop()
+ *
+ * [+0, -0, e]
+ */
+static int loop_watchdog_stop(lua_State *L) {
+    watchdog_free(L, check_loop_data(L, 1));
+    return 0;
+}
+
+/**
+ * Stop and join the watchdog thread of a loop, if any.  Must be
+ * called from the thread running the loop.
+ *
+ * [+0, -0, -]
+ */
+static void watchdog_free(lua_State *L, lua_ev_loop* lloop) {
+    lua_ev_watchdog*  wd = lloop->watchdog;
+    lua_ev_watchdog** p;
+
+    if ( NULL == wd ) return;
+    lloop->watchdog = NULL;
+
+    pthread_mutex_lock(&watchdog_lock);
+    wd->stopping = 1;
+    pthread_cond_signal(&wd->wake);
+    for ( p = &watchdog_list; *p; p = &(*p)->next ) {
+        if ( *p == wd ) {
+            *p = wd->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&watchdog_lock);
+    pthread_join(wd->thread, NULL);
+
+    /* the hook did not get a chance to run, put back the old one. */
+    if ( wd->firing ) lua_sethook(wd->L, wd->old_hook, wd->old_mask, wd->old_count);
+
+    luaL_unref(L, LUA_REGISTRYINDEX, wd->on_slow_ref);
+    pthread_cond_destroy(&wd->wake);
+    free(wd);
+}
+
+/**
+ * Called by watcher_cb_args() (and once_cb(), with a nil watcher)
+ * right before the lua callback runs.
+ *
+ * [-0, +0, -]
+ */
+static void watchdog_enter(lua_ev_watchdog* wd, lua_State *L, void *watcher, int watcher_i) {
+    const char* name = NULL;
+
+    /* the watcher may be unreferenced by the time the hook runs. */
+    if ( lua_isnil(L, watcher_i) ) {
+        name = lua_ev_once_name;
+    } else if ( lua_getmetatable(L, watcher_i) ) {
+        lua_rawgeti(L, -1, OBJ_TYPE_MAGIC_IDX);
+        name = lua_touserdata(L, -1);
+        lua_pop(L, 2);
+    }
+    wd->L       = L;
+    wd->watcher = watcher;
+    wd->name    = name;
+    wd->seq++;
+    wd->running = 1;
+}
+
+/**
+ * Called by watcher_cb_args() and once_cb() once the lua callback returned.
+ *
+ * [-0, +0, -]
+ */
+static void watchdog_leave(lua_ev_watchdog* wd) {
+    wd->running = 0;
+}
+
+/**
+ * Body of the watchdog thread.  Once a callback ran for too long it
+ * sets watchdog_hook() as the debug hook of the lua_State running the
+ * loop (lua_sethook() is the one API function which may be called
+ * asynchronously) so the stack is captured by the loop thread itself.
+ */
+static void* watchdog_thread(void* arg) {
+    lua_ev_watchdog* wd   = arg;
+    unsigned long    last = wd->seq;
+    double           seen = probe_now();
+
+    pthread_mutex_lock(&watchdog_lock);
+    while ( ! wd->stopping ) {
+        struct timespec ts;
+        double          deadline;
+        unsigned long   seq;
+        double          now;
+
+        /* pthread_cond_timedwait() uses the realtime clock. */
+        clock_gettime(CLOCK_REALTIME, &ts);
+        deadline   = ts.tv_sec + ts.tv_nsec * 1e-9 + wd->threshold / 4;
+        ts.tv_sec  = (time_t)deadline;
+        ts.tv_nsec = (long)((deadline - ts.tv_sec) * 1e9);
+        pthread_cond_timedwait(&wd->wake, &watchdog_lock, &ts);
+        if ( wd->stopping ) break;
+
+        seq = wd->seq;
+        now = probe_now();
+        if ( seq != last || ! wd->running ) {
+            last = seq;
+            seen = now;
+            continue;
+        }
+        if ( wd->fired_seq == seq || wd->firing || now - seen < wd->threshold ) continue;
+
+        wd->fired_seq = seq;
+        wd->firing    = 1;
+        wd->elapsed   = now - seen;
+        wd->old_hook  = lua_gethook(wd->L);
+        wd->old_mask  = lua_gethookmask(wd->L);
+        wd->old_count = lua_gethookcount(wd->L);
+        /* return events catch callbacks stuck in C right as they return. */
+        lua_sethook(wd->L, &watchdog_hook, LUA_MASKCALL | LUA_MASKRET | LUA_MASKCOUNT, 1);
+    }
+    pthread_mutex_unlock(&watchdog_lock);
+    return NULL;
+}
+
+/**
+ * Runs in the loop thread inside the slow callback: restores the old
+ * hook and reports the watcher and the lua stack.
+ *
+ * [-0, +0, -]
+ */
+static void watchdog_hook(lua_State *L, lua_Debug *ar) {
+    lua_ev_watchdog* wd;
+    int              on_slow_ref;
+    void*            watcher;
+    const char*      name;
+    double           elapsed;
+    int              current;
+    int              top;
+    const char*      target;
+    int              arg  = -1;
+    char             desc[64];
+
+    pthread_mutex_lock(&watchdog_lock);
+    for ( wd = watchdog_list; wd; wd = wd->next ) {
+        if ( wd->firing && wd->L == L ) break;
+    }
+    if ( NULL == wd ) {
+        /* our watchdog is gone, don't leave a hook on every instruction. */
+        if ( lua_gethook(L) == &watchdog_hook ) lua_sethook(L, NULL, 0, 0);
+        pthread_mutex_unlock(&watchdog_lock);
+        return;
+    }
+    wd->firing = 0;
+    lua_sethook(L, wd->old_hook, wd->old_mask, wd->old_count);
+    current     = wd->running && wd->seq == wd->fired_seq;
+    on_slow_ref = wd->on_slow_ref;
+    watcher     = wd->watcher;
+    name        = wd->name;
+    elapsed     = wd->elapsed;
+    pthread_mutex_unlock(&watchdog_lock);
+
+    /* the callback returned in the meantime. */
+    if ( ! current ) return;
+
+    if ( ! lua_checkstack(L, 8) ) return;
+    top = lua_gettop(L);
+
+    lua_createtable(L, 0, 5);
+    lua_pushnumber(L, elapsed);
+    lua_setfield(L, -2, "elapsed");
+
+    /* "ev{io}" => "io" */
+    if ( NULL != name && strncmp(name, "ev{", 3) == 0 ) {
+        lua_pushlstring(L, name + 3, strlen(name) - 4);
+    } else {
+        lua_pushliteral(L, "watcher");
+    }
+    lua_setfield(L, -2, "type");
+    target = watcher_target(name, watcher, &arg);
+    if ( NULL != target ) {
+        lua_pushinteger(L, arg);
+        lua_setfield(L, -2, target);
+    }
+
+    watchdog_push_traceback(L);
+    lua_setfield(L, -2, "traceback");
+
+    if ( on_slow_ref != LUA_NOREF ) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, on_slow_ref);
+        lua_insert(L, -2);
+        if ( lua_pcall(L, 1, 0, 0) ) {
+            fprintf(stderr, "WATCHDOG HANDLER FAILED: %s\n", lua_tostring(L, -1));
+        }
+    } else {
+        lua_getfield(L, -1, "type");
+        if ( NULL != target ) {
+            snprintf(desc, sizeof(desc), "%s watcher (%s %d)", lua_tostring(L, -1), target, arg);
+        } else {
+            snprintf(desc, sizeof(desc), "%s watcher", lua_tostring(L, -1));
+        }
+        lua_getfield(L, -2, "traceback");
+        fprintf(stderr, "SLOW CALLBACK: %s running for at least %.3fs\n%s\n",
+                desc, elapsed, lua_tostring(L, -1));
+    }
+    lua_settop(L, top);
+}
+
+/**
+ * Push the stack of the running lua code like debug.traceback() does,
+ * without calling into lua.
+ *
+ * [-0, +1, m]
+ */
+static void watchdog_push_traceback(lua_State *L) {
+    lua_Debug   ar;
+    luaL_Buffer b;
+    char        line[32];
+    int         level;
+
+    luaL_buffinit(L, &b);
+    luaL_addstring(&b, "stack traceback:");
+    for ( level = 0; lua_getstack(L, level, &ar); level++ ) {
+        if ( level >= 20 ) {
+            luaL_addstring(&b, "\n\t...");
+            break;
+        }
+        lua_getinfo(L, "Snl", &ar);
+        luaL_addstring(&b, "\n\t");
+        luaL_addstring(&b, ar.short_src);
+        if ( ar.currentline > 0 ) {
+            snprintf(line, sizeof(line), ":%d", ar.currentline);
+            luaL_addstring(&b, line);
+        }
+        if ( *ar.namewhat != '\0' ) {
+            luaL_addstring(&b, ": in function '");
+            luaL_addstring(&b, ar.name);
+            luaL_addchar(&b, '\'');
+        } else if ( *ar.what == 'm' ) {
+            luaL_addstring(&b, ": in main chunk");
+        } else if ( *ar.what == 'C' ) {
+            luaL_addstring(&b, ": ?");
+        } else {
+            snprintf(line, sizeof(line), ":%d>", ar.linedefined);
+            luaL_addstring(&b, ": in function <");
+            luaL_addstring(&b, ar.short_src);
+            luaL_addstring(&b, line);
+        }
+    }
+    luaL_pushresult(&b);
+}
+
+#endif /* _WIN32 */
+
+/* vi:set expandtab ts=4: */
@@ -1,6 +1,5 @@
 #include <stdint.h>
-
-static char watcher_magic[] = "ev{watcher}";
+#include <string.h>
 
 /**
  * Add watcher specific methods to the table on the top of the lua
@@ -15,7 +14,9 @@ static int add_watcher_mt(lua_State *L, luaL_reg* methods, const char* tname) {
         { "is_pending",    watcher_is_pending },
         { "clear_pending", watcher_clear_pending },
         { "callback",      watcher_callback },
+        { "context",       watcher_context },
         { "priority",      watcher_priority },
+        { "migrate",       watcher_migrate },
         { "shadow",        watcher_shadow },
         { NULL, NULL }
     };
@@ -28,8 +29,8 @@ static int add_watcher_mt(lua_State *L, luaL_reg* methods, const char* tname) {
     /* create methods table. */
     lua_createtable(L, 0, 10);
         /* add methods to table. */
-    luaL_register(L, NULL, common_methods);
-    luaL_register(L, NULL, methods);
+    lua_ev_setfuncs(L, common_methods);
+    lua_ev_setfuncs(L, methods);
 
     /* create __index/__newindex closures in metatable. */
     lua_pushcclosure(L, watcher_index, 1); /* use methods table in upval 1. */
@@ -68,7 +69,7 @@ static ev_watcher* check_watcher(lua_State *L, int watcher_i) {
             }
         }
     }
-    luaL_typerror(L, watcher_i, "ev{io,timer,signal,idle}");
+    obj_typerror(L, watcher_i, "ev{io,timer,signal,idle}");
     return NULL;
 }
 
@@ -108,10 +109,28 @@ static int watcher_is_pending(lua_State *L) {
  * [+1, -0, e]
  */
 static int watcher_clear_pending(lua_State *L) {
-    lua_pushnumber(L, ev_clear_pending(*check_loop_and_init(L, 2), check_watcher(L, 1)));
+    lua_pushinteger(L, ev_clear_pending(*check_loop_and_init(L, 2), check_watcher(L, 1)));
     return 1;
 }
 
+/**
+ * Used by the set() methods which change a watcher in place: returns
+ * the loop an active watcher must be stopped in before ev_TYPE_set()
+ * and started again afterwards, or NULL if the watcher is not active.
+ * The watcher stays started in the lua sense (same loop reference and
+ * daemon flag) since loop_start_watcher() and loop_stop_watcher() are
+ * not involved.
+ *
+ * [-0, +0, -]
+ */
+static struct ev_loop* watcher_active_loop(void* watcher) {
+    lua_ev_watcher_data* wdata = GET_WATCHER_DATA(watcher);
+
+    if ( ! ev_is_active((ev_watcher*)watcher) || NULL == wdata->loop ) return NULL;
+    if ( NULL != wdata->loop->mem ) mem_owner = wdata->loop->mem;
+    return wdata->loop->loop;
+}
+
 /**
  * Implement the new function on all the watcher objects.  The first
  * element on the stack must be the callback function.  The new
@@ -120,111 +139,381 @@ static int watcher_clear_pending(lua_State *L) {
  * [+1, -0, ?]
  */
 static ev_watcher* watcher_new(lua_State* L, size_t size, const char* lua_type) {
+    return watcher_new_slots(L, size, lua_type, WATCHER_SLOTS);
+}
+
+/**
+ * watcher_new() for watcher types with slots after WATCHER_SLOTS.
+ *
+ * [+1, -0, ?]
+ */
+static ev_watcher* watcher_new_slots(lua_State* L, size_t size, const char* lua_type, int nslots) {
     char*  obj;
     ev_watcher* watcher;
     lua_ev_watcher_data *wdata;
 
     luaL_checktype(L, 1, LUA_TFUNCTION);
 
-    obj = obj_new(L, WATCHER_DATA_SIZE + size, lua_type);
-
-    /* create fenv table for watcher. */
-    lua_createtable(L, 2, 0);
+    obj = obj_new(L, WATCHER_DATA_SIZE + size, lua_type, nslots);
 
-    /* save reference to callback in fenv table. */
+    /* save reference to callback in the watcher. */
     lua_pushvalue(L, 1); /* dup watcher callback function. */
-    lua_rawseti(L, -2, WATCHER_FN);
-
-    /* set watcher's fenv table. */
-    lua_setfenv(L, -2);
+    obj_setslot(L, -2, WATCHER_FN);
 
     wdata = (lua_ev_watcher_data*)obj;
     wdata->watcher_ref = LUA_NOREF;
     wdata->flags = 0;
+    wdata->loop = NULL;
 
     watcher = (ev_watcher*)(obj + WATCHER_DATA_SIZE);
 
     return watcher;
 }
 
+/**
+ * Sets the context of the new watcher on the top of the stack to the
+ * optional constructor argument at ctx_i.
+ *
+ * [-0, +0, -]
+ */
+static void watcher_new_context(lua_State* L, int ctx_i) {
+    lua_ev_watcher_data* wdata = lua_touserdata(L, -1);
+
+    if ( ctx_i >= lua_gettop(L) || lua_isnil(L, ctx_i) ) return;
+    lua_pushvalue(L, ctx_i);
+    obj_setslot(L, -2, WATCHER_CONTEXT);
+    wdata->flags |= WATCHER_FLAG_HAS_CONTEXT;
+}
+
 /**
  * Implements the callback function on all the watcher objects.  This
  * will be indirectly called by the libev event loop implementation.
  *
- * TODO: Custom error handlers?  Currently, any error in a callback
- * will print the error to stderr and things will "go on".
+ * Errors raised by the callback are passed to watcher_error().
  *
  * [+0, -0, m]
  */
 static void watcher_cb(struct ev_loop *loop, void *watcher, int revents) {
+    watcher_cb_args(loop, watcher, revents, NULL);
+}
+
+/**
+ * What watcher_cb_push_call() needs to push the extra arguments.
+ */
+typedef struct watcher_cb_push {
+    lua_ev_push_args push_args;
+    void*            watcher;
+} watcher_cb_push;
+
+/**
+ * Called in the protected call of watcher_cb_args() with the callback,
+ * its arguments and a light userdata of the watcher_cb_push on the
+ * stack: pushes the extra arguments and calls the callback, so errors
+ * raised by push_args go to watcher_error() too.
+ *
+ * [-(n+2), +0, e]
+ */
+static int watcher_cb_push_call(lua_State *L) {
+    watcher_cb_push* push = lua_touserdata(L, -1);
+
+    lua_pop(L, 1);
+    push->push_args(L, push->watcher);
+    lua_call(L, lua_gettop(L) - 1, 0);
+    return 0;
+}
+
+/**
+ * Same as watcher_cb(), but if push_args is non-NULL it is called
+ * just before the callback is invoked so that watcher types which
+ * collect data in C (like ev.FSWatch) can append extra arguments
+ * after <revents>.  push_args must return the number of values it
+ * pushed.  It runs in the protected call of the callback, if it
+ * raises an error the callback is not called.
+ *
+ * [+0, -0, m]
+ */
+static void watcher_cb_args(struct ev_loop *loop, void *watcher, int revents, lua_ev_push_args push_args) {
     lua_State* L       = ev_userdata(loop);
     lua_ev_watcher_data* wdata = GET_WATCHER_DATA(watcher);
+    lua_ev_loop*   lloop;
+    lua_ev_tracer* tracer;
+#ifndef _WIN32
+    lua_ev_watchdog* watchdog;
+#endif
+    double     started = 0;
+    watcher_cb_push push;
     int        result;
+    int        nargs   = 3;
+    int        base;
 
-    result = lua_checkstack(L, 5);
+    result = lua_checkstack(L, 8);
     assert(result != 0 /* able to allocate enough space on lua stack */);
 
-    /* push 'debug.traceback' function. */
+    /* push the traceback message handler. */
     push_traceback(L);
+    base = lua_gettop(L);
 
     lua_rawgeti(L, LUA_REGISTRYINDEX, wdata->watcher_ref);
-    lua_getfenv(L, -1);
-    /* STACK: <traceback>, <watcher>, <watcher fenv> */
-    /* insert <callback>, <loop> before <watcher> */
-    lua_rawgeti(L, -1, WATCHER_FN);
-    lua_insert(L, -3);
-    lua_rawgeti(L, -1, WATCHER_LOOP);
-    lua_insert(L, -3);
-    lua_pop(L, 1); /* pop <watcher fenv> */
+    obj_getslot(L, base + 1, WATCHER_LOOP);
+    /* STACK: <traceback>, <watcher>, <loop> */
+    obj_getslot(L, base + 1, WATCHER_FN);
+    if ( wdata->flags & WATCHER_FLAG_HAS_CONTEXT ) {
+        obj_getslot(L, base + 1, WATCHER_CONTEXT);
+        nargs++;
+    }
+    lua_pushvalue(L, base + 2);
+    lua_pushvalue(L, base + 1);
 
-    /* STACK: <traceback>, <watcher fn>, <loop>, <watcher> */
+    /* STACK: <traceback>, <watcher>, <loop>, <watcher fn>, [<context>,] <loop>, <watcher> */
 
     if ( !ev_is_active(watcher) ) {
         /* Must remove "stop"ed watcher from loop: */
-        loop_stop_watcher(L, loop, wdata, 1);
+        loop_stop_watcher(L, loop, wdata, base + 1);
     }
 
     /* push revents */
     lua_pushinteger(L, revents);
 
-    /* STACK: <traceback>, <watcher fn>, <loop>, <watcher>, <revents> */
-    if ( lua_pcall(L, 3, 0, -5) ) {
-        /* TODO: Enable user-specified error handler! */
-        fprintf(stderr, "CALLBACK FAILED: %s\n",
-                lua_tostring(L, -1));
-        lua_pop(L, 2); /* pop error string & traceback function. */
+    /* STACK: ..., <watcher fn>, [<context>,] <loop>, <watcher>, <revents> [, <push>] */
+    if ( push_args ) {
+        push.push_args = push_args;
+        push.watcher   = watcher;
+        lua_pushcfunction(L, &watcher_cb_push_call);
+        lua_insert(L, base + 3);
+        lua_pushlightuserdata(L, &push);
+        nargs += 2;
+    }
+
+    if ( (wdata->flags & WATCHER_EVENTS_MASK) != WATCHER_EVENTS_MASK ) {
+        wdata->flags += 1 << WATCHER_EVENTS_SHIFT;
+    }
+
+    lloop  = lua_touserdata(L, base + 2);
+    tracer = lloop ? lloop->tracer : NULL;
+    if ( tracer ) started = probe_now();
+#ifndef _WIN32
+    watchdog = lloop ? lloop->watchdog : NULL;
+    if ( watchdog ) watchdog_enter(watchdog, L, watcher, base + 1);
+#endif
+
+    result = lua_pcall(L, nargs, 0, base);
+
+#ifndef _WIN32
+    if ( watchdog && watchdog == lloop->watchdog ) watchdog_leave(watchdog);
+#endif
+    /* the callback may have stopped (and freed) the tracer. */
+    /* the callback may have used libev on some other loop. */
+    if ( lloop && lloop->mem ) mem_owner = lloop->mem;
+    if ( tracer && tracer == lloop->tracer ) {
+        trace_callback(L, tracer, watcher, base + 1, revents, started, result != 0);
+    }
+    if ( result ) {
+        watcher_error(L, wdata, base + 1, base + 2);
     } else {
-        lua_pop(L, 1); /* pop traceback function. */
+        wdata->flags &= ~WATCHER_FAILURES_MASK;
     }
+    lua_settop(L, base - 1); /* pop traceback, watcher and loop. */
+}
+
+/**
+ * Handle an error raised by a watcher callback.  The error message
+ * (with traceback) is on the top of the stack.  Counts the error for
+ * the watcher type in the loop, passes it to the loop:on_error()
+ * handler (or prints it to stderr if there is none), and stops the
+ * watcher if it failed too often in a row.  wdata is NULL for other
+ * callbacks: the watcher is nil for loop:once() callbacks, which are
+ * counted as "once", and the ev.Prefork object for its on_exit.
+ *
+ * [-1, +0, m]
+ */
+static void watcher_error(lua_State *L, lua_ev_watcher_data* wdata, int watcher_i, int loop_i) {
+    lua_ev_loop* loop   = lua_touserdata(L, loop_i);
+    const char*  type   = lua_isnil(L, watcher_i) ? "once" : watcher_type(L, watcher_i);
+    int          failures = 0;
+
+    if ( wdata ) {
+        failures = ((wdata->flags & WATCHER_FAILURES_MASK) >> WATCHER_FAILURES_SHIFT);
+        if ( failures < 0xff ) failures++;
+        wdata->flags = (wdata->flags & ~WATCHER_FAILURES_MASK) | (failures << WATCHER_FAILURES_SHIFT);
+    }
+
+    if ( NULL == loop ) {
+        fprintf(stderr, "CALLBACK FAILED: %s\n", lua_tostring(L, -1));
+        lua_pop(L, 1);
+        return;
+    }
+
+    /* loop[LOOP_ERRORS][type] += 1 */
+    obj_getslot(L, loop_i, LOOP_ERRORS);
+    if ( ! lua_istable(L, -1) ) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        obj_setslot(L, loop_i, LOOP_ERRORS);
+    }
+    lua_pushstring(L, type);
+    lua_pushvalue(L, -1);
+    lua_rawget(L, -3);
+    lua_pushinteger(L, lua_tointeger(L, -1) + 1);
+    lua_replace(L, -2);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+
+    /* STACK: <err> */
+    obj_getslot(L, loop_i, LOOP_ERROR_FN);
+    if ( lua_isfunction(L, -1) ) {
+        lua_pushvalue(L, loop_i);
+        lua_pushvalue(L, watcher_i);
+        lua_pushvalue(L, -4);
+        if ( lua_pcall(L, 3, 0, 0) ) {
+            fprintf(stderr, "ERROR HANDLER FAILED: %s\n", lua_tostring(L, -1));
+            lua_pop(L, 1);
+        }
+    } else {
+        lua_pop(L, 1);
+        fprintf(stderr, "CALLBACK FAILED: %s\n", lua_tostring(L, -1));
+    }
+    lua_pop(L, 1); /* pop <err> */
+
+    if ( loop->max_failures && failures >= loop->max_failures &&
+         wdata && wdata->watcher_ref != LUA_NOREF )
+    {
+        /* watcher:stop(loop) */
+        lua_getfield(L, watcher_i, "stop");
+        lua_pushvalue(L, watcher_i);
+        lua_pushvalue(L, loop_i);
+        if ( lua_pcall(L, 2, 0, 0) ) {
+            fprintf(stderr, "STOPPING %s WATCHER FAILED: %s\n", type, lua_tostring(L, -1));
+            lua_pop(L, 1);
+        }
+        wdata->flags &= ~WATCHER_FAILURES_MASK;
+    }
+}
+
+/**
+ * Returns the short type name of the watcher at watcher_i ("io",
+ * "timer", ...), the metatable name without the "ev{" "}" decoration.
+ * The returned string is only valid until the next call.
+ *
+ * [-0, +0, -]
+ */
+static const char* watcher_type(lua_State *L, int watcher_i) {
+    static char type[32];
+    const char* name = NULL;
+    size_t      len;
+
+    if ( lua_getmetatable(L, watcher_i) ) {
+        lua_rawgeti(L, -1, OBJ_TYPE_MAGIC_IDX);
+        name = lua_touserdata(L, -1);
+        lua_pop(L, 2);
+    }
+    if ( NULL == name || strncmp(name, "ev{", 3) != 0 ) return "watcher";
+
+    len = strlen(name + 3);
+    if ( len == 0 || len > sizeof(type) ) return "watcher";
+    memcpy(type, name + 3, len - 1);
+    type[len - 1] = '\0';
+    return type;
+}
+
+/**
+ * Returns what the watcher with the metatable name <name> (the
+ * OBJ_TYPE_MAGIC_IDX value) is watching: "fd", "signal", "pid" or NULL
+ * if there is nothing to show.  If watcher is non-NULL the value is
+ * stored in *arg.
+ *
+ * [-0, +0, -]
+ */
+static const char* watcher_target(const char* name, void* watcher, int* arg) {
+    if ( name == lua_ev_io_mt || name == lua_ev_signalfd_mt || name == lua_ev_fswatch_mt ||
+         name == lua_ev_childfd_mt || name == lua_ev_shmring_mt ||
+         name == lua_ev_fdchannel_mt ) {
+        if ( watcher ) *arg = ((ev_io*)watcher)->fd;
+        return "fd";
+    } else if ( name == lua_ev_signal_mt ) {
+        if ( watcher ) *arg = ((ev_signal*)watcher)->signum;
+        return "signal";
+    } else if ( name == lua_ev_child_mt ) {
+        if ( watcher ) *arg = ((ev_child*)watcher)->pid;
+        return "pid";
+    }
+    return NULL;
 }
 
 /**
  * Get/set the watcher callback.  If passed a new_callback, then the
  * old_callback will be returned.  Otherwise, just returns the current
- * callback function.
+ * callback function.  If a new_context is passed too, it replaces the
+ * context (see watcher:context()).
  *
  * Usage:
- *   old_callback = watcher:callback([new_callback])
+ *   old_callback = watcher:callback([new_callback [, new_context]])
  *
  * [+1, -0, e]
  */
 static int watcher_callback(lua_State *L) {
-    ev_watcher *watcher = check_watcher(L, 1);
-    lua_ev_watcher_data* wdata = GET_WATCHER_DATA(watcher);
-    int has_fn = lua_gettop(L) > 1;
+    int has_fn  = lua_gettop(L) > 1;
+    int has_ctx = lua_gettop(L) > 2;
 
-    lua_getfenv(L, 1);
-    lua_rawgeti(L, -1, WATCHER_FN); /* get current callback. */
+    check_watcher(L, 1);
+    obj_getslot(L, 1, WATCHER_FN); /* get current callback. */
 
     if ( has_fn ) {
         luaL_checktype(L, 2, LUA_TFUNCTION);
         lua_pushvalue(L, 2);
-        lua_rawseti(L, -3, WATCHER_FN); /* set new callback. */
+        obj_setslot(L, 1, WATCHER_FN); /* set new callback. */
+    }
+    if ( has_ctx ) {
+        lua_pushvalue(L, 3);
+        watcher_set_context(L, 1);
     }
     /* return current/old callback. */
     return 1;
 }
 
+/**
+ * Get/set the watcher context.  If the context is not nil, it is
+ * passed as the first argument of the callback (before the loop), so
+ * one function can serve many watchers:
+ *
+ *     function Conn:on_read(loop, io, revents) ... end
+ *     ev.IO.new(Conn.on_read, fd, ev.READ, conn)
+ *
+ * Usage:
+ *   old_context = watcher:context([new_context])
+ *
+ * [+1, -0, e]
+ */
+static int watcher_context(lua_State *L) {
+    int has_ctx = lua_gettop(L) > 1;
+
+    check_watcher(L, 1);
+    obj_getslot(L, 1, WATCHER_CONTEXT);
+
+    if ( has_ctx ) {
+        lua_pushvalue(L, 2);
+        watcher_set_context(L, 1);
+    }
+    return 1;
+}
+
+/**
+ * Pops the value on the top of the stack into the context of the
+ * watcher at watcher_i, nil removes the context.
+ *
+ * [-1, +0, -]
+ */
+static void watcher_set_context(lua_State *L, int watcher_i) {
+    lua_ev_watcher_data* wdata = GET_WATCHER_DATA(check_watcher(L, watcher_i));
+
+    if ( lua_isnil(L, -1) ) {
+        wdata->flags &= ~WATCHER_FLAG_HAS_CONTEXT;
+    } else {
+        wdata->flags |= WATCHER_FLAG_HAS_CONTEXT;
+    }
+    obj_setslot(L, watcher_i, WATCHER_CONTEXT);
+}
+
 /**
  * Get/set the watcher priority.  If passed a new_priority, then the
  * old_priority will be returned.  Otherwise, just returns the current
@@ -245,6 +534,69 @@ static int watcher_priority(lua_State *L) {
     return 1;
 }
 
+/**
+ * Move a watcher started in from_loop to to_loop: the same as
+ * watcher:stop(from_loop) followed by watcher:start(to_loop) with the
+ * daemon flag the watcher was started with, except that a pending
+ * event moves along instead of being dropped.  The priority is kept,
+ * and so is the remaining time of a timer.  Child and signal watchers
+ * can't be moved, libev ties them to a loop.  If the start fails, the
+ * watcher is started in from_loop again and the error raised.
+ *
+ * Usage:
+ *   watcher:migrate(from_loop, to_loop)
+ *
+ * [+0, -0, e]
+ */
+static int watcher_migrate(lua_State *L) {
+    ev_watcher*          watcher = check_watcher(L, 1);
+    lua_ev_watcher_data* wdata   = GET_WATCHER_DATA(watcher);
+    lua_ev_loop*         from    = check_loop_data(L, 2);
+    struct ev_loop*      to      = *check_loop_and_init(L, 3);
+    const char*          type    = watcher_type(L, 1);
+    int                  is_daemon, revents;
+
+    lua_settop(L, 3);
+    luaL_argcheck(L, wdata->loop == from && ev_is_active(watcher), 2,
+                  "the watcher is not active in this loop");
+    if ( strcmp(type, "child") == 0 || strcmp(type, "signal") == 0 ) {
+        return luaL_error(L, "%s watchers can not be moved to another loop", type);
+    }
+    if ( from->loop == to ) return 0;
+
+    is_daemon = (wdata->flags & WATCHER_FLAG_IS_DAEMON) != 0;
+    revents   = ev_clear_pending(from->loop, watcher);
+
+    /* watcher:stop(from_loop) */
+    lua_getfield(L, 1, "stop");
+    lua_pushvalue(L, 1);
+    lua_pushvalue(L, 2);
+    lua_call(L, 2, 0);
+    /* it has yet to be seen how busy it is in to_loop. */
+    wdata->flags &= ~WATCHER_EVENTS_MASK;
+
+    /* timers are started relative to the time of the loop. */
+    ev_now_update(to);
+
+    /* watcher:start(to_loop, is_daemon) */
+    lua_getfield(L, 1, "start");
+    lua_pushvalue(L, 1);
+    lua_pushvalue(L, 3);
+    lua_pushboolean(L, is_daemon);
+    if ( lua_pcall(L, 3, 0, 0) ) {
+        lua_getfield(L, 1, "start");
+        lua_pushvalue(L, 1);
+        lua_pushvalue(L, 2);
+        lua_pushboolean(L, is_daemon);
+        lua_call(L, 3, 0);
+        if ( from->mem ) mem_owner = from->mem;
+        if ( revents ) ev_feed_event(from->loop, watcher, revents);
+        return lua_error(L);
+    }
+    if ( revents ) ev_feed_event(to, watcher, revents);
+    return 0;
+}
+
 /**
  * Get/set the watcher shadow.  If passed a new_shadow, then the
  * old_shadow will be returned.  Otherwise, just returns the current
@@ -260,8 +612,7 @@ static int watcher_shadow(lua_State *L) {
     lua_ev_watcher_data* wdata = GET_WATCHER_DATA(watcher);
     int has_param = lua_gettop(L) > 1;
 
-    lua_getfenv(L, 1);
-    lua_rawgeti(L, -1, WATCHER_SHADOW); /* get current shadow. */
+    obj_getslot(L, 1, WATCHER_SHADOW); /* get current shadow. */
 
     if ( has_param ) {
         /* update has_shadow flag. */
@@ -272,7 +623,7 @@ static int watcher_shadow(lua_State *L) {
         }
         /* set new shadow. */
         lua_pushvalue(L, 2);
-        lua_rawseti(L, -3, WATCHER_SHADOW); /* set new shadow. */
+        obj_setslot(L, 1, WATCHER_SHADOW); /* set new shadow. */
     }
     /* return current/old shadow. */
     return 1;
@@ -293,15 +644,12 @@ static int watcher_newindex(lua_State *L) {
 
     if ( (wdata->flags & WATCHER_FLAG_HAS_SHADOW) ) {
         /* get existing shadow table. */
-        lua_getfenv(L, 1);
-        lua_rawgeti(L, -1, WATCHER_SHADOW);
-        lua_remove(L, -2); /* remove fenv table. */
+        obj_getslot(L, 1, WATCHER_SHADOW);
     } else {
         /* Lazily create the shadow table. */
-        lua_getfenv(L, 1);
         lua_newtable(L);
         lua_pushvalue(L, -1);
-        lua_rawseti(L, -3, WATCHER_SHADOW);
+        obj_setslot(L, 1, WATCHER_SHADOW);
         wdata->flags |= WATCHER_FLAG_HAS_SHADOW;
     }
     /* STACK: <watcher>, <key>, <value>, <shadow> */
@@ -338,10 +686,8 @@ static int watcher_index(lua_State *L) {
 
     /* next check shadow table if the watcher has one. */
     if ( (wdata->flags & WATCHER_FLAG_HAS_SHADOW) ) {
-        /* get shadow table from fenv. */
-        lua_getfenv(L, 1);
-        lua_rawgeti(L, -1, WATCHER_SHADOW);
-        lua_remove(L, -2); /* remove fenv table. */
+        /* get shadow table. */
+        obj_getslot(L, 1, WATCHER_SHADOW);
 
         lua_pushvalue(L, 2);
         /* STACK: <watcher>, <key>, <shadow>, <key> */